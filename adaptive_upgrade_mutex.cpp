@@ -0,0 +1,204 @@
+//------------------------- adaptive_upgrade_mutex.cpp -------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "adaptive_upgrade_mutex.h"
+
+namespace acme
+{
+
+namespace detail
+{
+
+std::atomic<const void*> visible_readers[visible_reader_slots];
+
+}  // detail
+
+adaptive_upgrade_mutex::adaptive_upgrade_mutex(unsigned min_reads,
+                                               unsigned inhibit_factor)
+    : distributed_(false),
+      reads_(0),
+      draining_(false),
+      revocations_(0),
+      min_reads_(min_reads),
+      inhibit_factor_(inhibit_factor)
+{
+}
+
+// Readers
+
+// Called holding m_ shared.  Writers reset reads_ and set inhibit_until_
+// holding m_ exclusively.
+
+void
+adaptive_upgrade_mutex::note_centralized_read() noexcept
+{
+    if (distributed_.load(std::memory_order_relaxed))
+        return;
+    if (reads_.fetch_add(1, std::memory_order_relaxed) + 1 < min_reads_)
+        return;
+    if (Clock::now() >= inhibit_until_)
+        distributed_.store(true);
+}
+
+bool
+adaptive_upgrade_mutex::try_lock_shared()
+{
+    if (enter_distributed())
+        return true;
+    if (!m_.try_lock_shared())
+        return false;
+    note_centralized_read();
+    return true;
+}
+
+// Writers
+
+// Sequentially consistent, as are the reader's compare-exchange and its
+// check of distributed_, so that a reader that saw distributed_ set is seen
+// here.
+
+bool
+adaptive_upgrade_mutex::drained(unsigned skip) const noexcept
+{
+    for (unsigned i = 0; i < detail::visible_reader_slots; ++i)
+        if (i != skip && detail::visible_readers[i].load() == this)
+            return false;
+    return true;
+}
+
+// Exclusive ownership
+
+void
+adaptive_upgrade_mutex::lock()
+{
+    m_.lock();
+    centralize(detail::untimed_wait());
+}
+
+bool
+adaptive_upgrade_mutex::try_lock()
+{
+    if (!m_.try_lock())
+        return false;
+    if (centralize(detail::no_wait()))
+        return true;
+    m_.unlock();
+    return false;
+}
+
+void
+adaptive_upgrade_mutex::unlock()
+{
+    m_.unlock();
+}
+
+// Shared <-> Exclusive
+
+bool
+adaptive_upgrade_mutex::try_unlock_shared_and_lock()
+{
+    return shared_to_exclusive([this] {return m_.try_lock();},
+                               [this] {return m_.try_unlock_shared_and_lock();},
+                               detail::no_wait());
+}
+
+void
+adaptive_upgrade_mutex::unlock_and_lock_shared()
+{
+    m_.unlock_and_lock_shared();
+}
+
+// Shared <-> Upgrade
+
+bool
+adaptive_upgrade_mutex::try_unlock_shared_and_lock_upgrade()
+{
+    if (visible_slot() == ~0u)
+        return m_.try_unlock_shared_and_lock_upgrade();
+    if (!m_.try_lock_upgrade())
+        return false;
+    unlock_shared();
+    return true;
+}
+
+void
+adaptive_upgrade_mutex::unlock_upgrade_and_lock_shared()
+{
+    m_.unlock_upgrade_and_lock_shared();
+}
+
+// Upgrade <-> Exclusive
+
+void
+adaptive_upgrade_mutex::unlock_upgrade_and_lock()
+{
+    m_.unlock_upgrade_and_lock();
+    centralize(detail::untimed_wait());
+}
+
+bool
+adaptive_upgrade_mutex::try_unlock_upgrade_and_lock()
+{
+    if (!m_.try_unlock_upgrade_and_lock())
+        return false;
+    if (centralize(detail::no_wait()))
+        return true;
+    m_.unlock_and_lock_upgrade();
+    return false;
+}
+
+void
+adaptive_upgrade_mutex::unlock_and_lock_upgrade()
+{
+    m_.unlock_and_lock_upgrade();
+}
+
+// Ownership transfer
+
+adaptive_upgrade_mutex::detached_ownership
+adaptive_upgrade_mutex::detach(lock_mode m) noexcept
+{
+    detached_ownership d = {~0u};
+    if (m == lock_mode::shared)
+        d.slot = detail::this_thread_visible_reads.remove(this);
+    return d;
+}
+
+void
+adaptive_upgrade_mutex::attach(lock_mode m, const detached_ownership& d)
+{
+    if (m == lock_mode::shared && d.slot != ~0u)
+        detail::this_thread_visible_reads.add(this, d.slot);
+}
+
+void
+adaptive_upgrade_mutex::unlock_detached(lock_mode m,
+                                        const detached_ownership& d)
+{
+    switch (m)
+    {
+    case lock_mode::shared:
+        if (d.slot != ~0u)
+            detail::visible_readers[d.slot].store(nullptr,
+                                                  std::memory_order_release);
+        else
+            m_.unlock_shared();
+        break;
+    case lock_mode::upgrade:
+        m_.unlock_upgrade();
+        break;
+    case lock_mode::exclusive:
+        m_.unlock();
+        break;
+    }
+}
+
+}  // acme
@@ -0,0 +1,542 @@
+//------------------------- adaptive_upgrade_mutex.h ---------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_ADAPTIVE
+#define UPGRADE_MUTEX_ADAPTIVE
+
+/*
+    <adaptive_upgrade_mutex.h> synopsis
+
+namespace acme
+{
+
+class adaptive_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_min_reads = 64;
+    static constexpr unsigned default_inhibit_factor = 9;
+
+    explicit adaptive_upgrade_mutex(
+                          unsigned min_reads = default_min_reads,
+                          unsigned inhibit_factor = default_inhibit_factor);
+    ~adaptive_upgrade_mutex() = default;
+
+    adaptive_upgrade_mutex(const adaptive_upgrade_mutex&) = delete;
+    adaptive_upgrade_mutex& operator=(const adaptive_upgrade_mutex&) = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions:  as
+    // basic_upgrade_mutex, except there are no cancellable overloads, and
+    // shared ownership must be given up by the thread that took it, unless
+    // moved with an ownership_token.
+
+    // Ownership transfer (see ownership_token.h)
+
+    struct detached_ownership {unsigned slot;};
+
+    detached_ownership detach(lock_mode m) noexcept;
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    bool distributed() const noexcept;     // readers currently bypass m_
+    unsigned long revocations() const noexcept;
+};
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <thread>
+#include <vector>
+
+namespace acme
+{
+
+namespace detail
+{
+
+// Visible readers, shared by every adaptive_upgrade_mutex.  A reader in
+// distributed mode claims the slot its thread and mutex hash to by storing
+// the mutex's address there.
+
+const unsigned visible_reader_slots = 4096;
+
+extern std::atomic<const void*> visible_readers[visible_reader_slots];
+
+inline thread_local int visible_reader_tag;
+
+inline
+unsigned
+visible_reader_slot(const void* m) noexcept
+{
+    std::uint64_t h = reinterpret_cast<std::uintptr_t>(m) ^
+                      (reinterpret_cast<std::uintptr_t>(&visible_reader_tag)
+                       << 7);
+    h *= 0x9E3779B97F4A7C15ull;
+    return static_cast<unsigned>(h >> 52) % visible_reader_slots;
+}
+
+// The mutexes the calling thread holds through a visible reader slot, and
+// the slots, which tells unlock_shared which way to release.  A thread whose
+// record is full reads the centralized way.  A read attached from another
+// thread keeps that thread's slot, and goes to spill if the record is full.
+
+struct visible_reads
+{
+    static constexpr unsigned capacity = 8;
+
+    struct entry
+    {
+        const void* m;
+        unsigned    slot;
+    };
+
+    entry              held[capacity];
+    unsigned           n = 0;
+    std::vector<entry> spill;
+
+    void
+    add(const void* m, unsigned slot)
+    {
+        if (n == capacity)
+            spill.push_back(entry{m, slot});
+        else
+            held[n++] = entry{m, slot};
+    }
+
+    // The slot of a read of m, or ~0u if there is none.
+    unsigned
+    find(const void* m) const noexcept
+    {
+        for (unsigned i = n; i-- > 0;)
+            if (held[i].m == m)
+                return held[i].slot;
+        for (const entry& e : spill)
+            if (e.m == m)
+                return e.slot;
+        return ~0u;
+    }
+
+    unsigned
+    remove(const void* m) noexcept
+    {
+        for (unsigned i = n; i-- > 0;)
+            if (held[i].m == m)
+            {
+                unsigned slot = held[i].slot;
+                held[i] = held[--n];
+                return slot;
+            }
+        for (std::size_t i = spill.size(); i-- > 0;)
+            if (spill[i].m == m)
+            {
+                unsigned slot = spill[i].slot;
+                spill.erase(spill.begin() + i);
+                return slot;
+            }
+        return ~0u;
+    }
+
+    bool
+    full() const noexcept
+    {
+        return n == capacity;
+    }
+};
+
+inline thread_local visible_reads this_thread_visible_reads;
+
+// What a writer waits on for distributed readers to leave.  They do not
+// notify:  it spins, then yields.  The lock is not used.
+
+struct visible_reader_scan
+{
+    template <class Lock, class Predicate>
+        void
+        wait(Lock&, Predicate pred)
+        {
+            for (unsigned i = 0; !pred(); ++i)
+                pause(i);
+        }
+
+    template <class Lock, class Clock, class Duration, class Predicate>
+        bool
+        wait_until(Lock&,
+                   const std::chrono::time_point<Clock, Duration>& abs_time,
+                   Predicate pred)
+        {
+            for (unsigned i = 0; !pred(); ++i)
+            {
+                if (Clock::now() >= abs_time)
+                    return pred();
+                pause(i);
+            }
+            return true;
+        }
+
+    static
+    void
+    pause(unsigned i) noexcept
+    {
+        if (i < 64)
+            cpu_relax();
+        else
+            std::this_thread::yield();
+    }
+};
+
+}  // detail
+
+// An upgrade mutex that switches between two ways of counting readers as
+// its load changes.
+//
+// Centralized:  every acquisition goes through m_, an upgrade_mutex.  Writers
+// pay nothing extra; readers contend on m_'s internal mutex.
+//
+// Distributed:  a reader publishes itself in a slot of a table shared by all
+// adaptive mutexes, with one compare-exchange on a line other readers seldom
+// touch, and then checks that the mode has not changed.  A writer first
+// takes m_ exclusively, so that no reader can enter the centralized way, then
+// switches the mutex to centralized and waits for every slot naming the mutex
+// to clear.  Upgrade ownership does not exclude readers and needs no switch.
+//
+// The mutex starts centralized.  A reader that takes the centralized path
+// switches it to distributed once at least min_reads readers have done so
+// since the last writer and the inhibit period has passed.  Each switch back
+// measures what it cost the writer and inhibits the distributed mode for
+// inhibit_factor times as long, which bounds the writers' slowdown to about
+// 1 / (inhibit_factor + 1) however the traffic shifts.  (This is BRAVO's
+// policy, plus the read-ratio threshold.)
+
+class adaptive_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_min_reads = 64;
+    static constexpr unsigned default_inhibit_factor = 9;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    alignas(64) std::atomic<bool>  distributed_;
+    upgrade_mutex                  m_;
+    std::atomic<unsigned>          reads_;     // centralized, since a writer
+    Clock::time_point              inhibit_until_;         // guarded by m_
+    bool                           draining_;              // guarded by m_
+    std::atomic<unsigned long>     revocations_;
+    const unsigned                 min_reads_;
+    const unsigned                 inhibit_factor_;
+
+public:
+    explicit adaptive_upgrade_mutex(
+                          unsigned min_reads = default_min_reads,
+                          unsigned inhibit_factor = default_inhibit_factor);
+    ~adaptive_upgrade_mutex() = default;
+
+    adaptive_upgrade_mutex(const adaptive_upgrade_mutex&) = delete;
+    adaptive_upgrade_mutex& operator=(const adaptive_upgrade_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (!m_.try_lock_until(abs_time))
+                return false;
+            if (centralize(detail::wait_until(abs_time)))
+                return true;
+            m_.unlock();
+            return false;
+        }
+    void unlock();
+
+    // Shared ownership
+
+    void
+    lock_shared()
+    {
+        if (!enter_distributed())
+        {
+            m_.lock_shared();
+            note_centralized_read();
+        }
+    }
+
+    bool try_lock_shared();
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (enter_distributed())
+                return true;
+            if (!m_.try_lock_shared_until(abs_time))
+                return false;
+            note_centralized_read();
+            return true;
+        }
+
+    void
+    unlock_shared()
+    {
+        unsigned slot = detail::this_thread_visible_reads.remove(this);
+        if (slot != ~0u)
+            detail::visible_readers[slot].store(nullptr,
+                                                std::memory_order_release);
+        else
+            m_.unlock_shared();
+    }
+
+    // Upgrade ownership
+
+    void lock_upgrade() {m_.lock_upgrade();}
+    bool try_lock_upgrade() {return m_.try_lock_upgrade();}
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return m_.try_lock_upgrade_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return m_.try_lock_upgrade_until(abs_time);
+        }
+    void unlock_upgrade() {m_.unlock_upgrade();}
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return shared_to_exclusive(
+                [&] {return m_.try_lock_until(abs_time);},
+                [&] {return m_.try_unlock_shared_and_lock_until(abs_time);},
+                detail::wait_until(abs_time));
+        }
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (visible_slot() == ~0u)
+                return m_.try_unlock_shared_and_lock_upgrade_until(abs_time);
+            if (!m_.try_lock_upgrade_until(abs_time))
+                return false;
+            unlock_shared();
+            return true;
+        }
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (!m_.try_unlock_upgrade_and_lock_until(abs_time))
+                return false;
+            if (centralize(detail::wait_until(abs_time)))
+                return true;
+            m_.unlock_and_lock_upgrade();
+            return false;
+        }
+    void unlock_and_lock_upgrade();
+
+    // Ownership transfer
+
+    // A distributed read moves with its slot, which is then not the one the
+    // new owner's thread hashes to; a centralized one is m_'s, which any
+    // thread may release.
+
+    struct detached_ownership
+    {
+        unsigned slot;       // ~0u:  centralized
+    };
+
+    detached_ownership detach(lock_mode m) noexcept;
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    // Observers
+
+    bool
+    distributed() const noexcept
+    {
+        return distributed_.load(std::memory_order_relaxed);
+    }
+
+    unsigned long
+    revocations() const noexcept
+    {
+        return revocations_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // Distributed readers
+
+    // false:  the caller must read the centralized way.  The slot is claimed
+    // before distributed_ is checked, and a writer clears distributed_ before
+    // scanning, so one of the two sees the other.
+    bool
+    enter_distributed() noexcept
+    {
+        if (!distributed_.load(std::memory_order_relaxed) ||
+            detail::this_thread_visible_reads.full())
+            return false;
+        unsigned i = detail::visible_reader_slot(this);
+        std::atomic<const void*>& slot = detail::visible_readers[i];
+        const void* expected = nullptr;
+        if (!slot.compare_exchange_strong(expected, this))
+            return false;
+        if (distributed_.load())
+        {
+            detail::this_thread_visible_reads.add(this, i);
+            return true;
+        }
+        slot.store(nullptr, std::memory_order_relaxed);
+        return false;
+    }
+
+    // The slot through which the caller reads, or ~0u.
+    unsigned
+    visible_slot() const noexcept
+    {
+        return detail::this_thread_visible_reads.find(this);
+    }
+
+    void note_centralized_read() noexcept;
+
+    // Writers
+
+    template <class Waiter>
+        bool centralize(const Waiter& w, unsigned skip = ~0u);
+    bool drained(unsigned skip) const noexcept;
+
+    template <class LockExclusive, class Convert, class Waiter>
+        bool shared_to_exclusive(LockExclusive lock_exclusive,
+                                 Convert convert, const Waiter& w);
+};
+
+// Writers
+
+// Called holding m_ exclusively.  Switches to centralized, waits for the
+// distributed readers to leave -- all but the caller's own slot, skip -- and
+// inhibits the distributed mode in proportion to the wait.  On false the
+// mode stays centralized, and the next writer waits out the readers left.
+
+template <class Waiter>
+bool
+adaptive_upgrade_mutex::centralize(const Waiter& w, unsigned skip)
+{
+    reads_.store(0, std::memory_order_relaxed);
+    if (distributed_.load(std::memory_order_relaxed))
+    {
+        distributed_.store(false);
+        revocations_.fetch_add(1, std::memory_order_relaxed);
+        draining_ = true;
+    }
+    if (!draining_)
+        return true;
+    Clock::time_point t0 = Clock::now();
+    detail::visible_reader_scan scan;
+    int unlocked = 0;
+    bool r = w(scan, unlocked, [this, skip] {return drained(skip);});
+    Clock::time_point t1 = Clock::now();
+    inhibit_until_ = t1 + (t1 - t0) * inhibit_factor_;
+    draining_ = !r;
+    return r;
+}
+
+// A shared owner converts by taking m_ exclusively beside its own read -- it
+// holds no read in m_ -- and then giving up its slot.
+
+template <class LockExclusive, class Convert, class Waiter>
+bool
+adaptive_upgrade_mutex::shared_to_exclusive(LockExclusive lock_exclusive,
+                                            Convert convert, const Waiter& w)
+{
+    unsigned mine = visible_slot();
+    if (mine == ~0u)
+    {
+        if (!convert())
+            return false;
+        if (centralize(w))
+            return true;
+        m_.unlock_and_lock_shared();
+        return false;
+    }
+    if (!lock_exclusive())
+        return false;
+    if (!centralize(w, mine))
+    {
+        m_.unlock();
+        return false;
+    }
+    unlock_shared();
+    return true;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_ADAPTIVE
@@ -0,0 +1,234 @@
+//------------------------------- assignment.h ---------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_ASSIGNMENT
+#define UPGRADE_MUTEX_ASSIGNMENT
+
+/*
+    <assignment.h> synopsis
+
+namespace Assignment
+{
+
+// A vector of doubles guarded by an upgrade_mutex:  the example of locking
+// two objects in different modes.
+
+class A
+{
+public:
+    explicit A(std::vector<double> data = {});
+    A(const A& a);
+    A& operator=(const A& a);
+
+    void swap(A& a);
+
+    // Both objects take the elementwise average of the two.  The sizes must
+    // match.
+    void average(A& a);
+    void average_parallel(A& a, unsigned threads = 0);  // 0:  one per core
+
+    double at(std::size_t i) const;
+    std::size_t size() const;
+};
+
+}  // Assignment
+*/
+
+#include "upgrade_mutex.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace Assignment
+{
+
+namespace detail
+{
+
+// r1[i] = r2[i] = (x[i] + y[i]) / 2.  With GCC's vector extensions four
+// lanes at a time, as wide as the target allows.
+
+inline
+void
+average_range(const double* x, const double* y, double* r1, double* r2,
+              std::size_t n) noexcept
+{
+    std::size_t i = 0;
+#if defined(__GNUC__)
+    typedef double v4d __attribute__((vector_size(32)));
+    for (; i + 4 <= n; i += 4)
+    {
+        v4d a;
+        v4d b;
+        std::memcpy(&a, x + i, sizeof(a));
+        std::memcpy(&b, y + i, sizeof(b));
+        v4d r = (a + b) * 0.5;
+        std::memcpy(r1 + i, &r, sizeof(r));
+        std::memcpy(r2 + i, &r, sizeof(r));
+    }
+#endif
+    for (; i < n; ++i)
+        r1[i] = r2[i] = (x[i] + y[i]) / 2;
+}
+
+// Splits the range among up to threads threads, the caller among them.
+// Below min_chunk elements a thread costs more than it saves.  The threads
+// are started for each call; if one cannot be, the caller averages its
+// chunk too.
+
+inline
+void
+average_parallel(const double* x, const double* y, double* r1, double* r2,
+                 std::size_t n, unsigned threads)
+{
+    const std::size_t min_chunk = std::size_t(1) << 16;
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t t = std::min<std::size_t>(threads, n / min_chunk);
+    if (t <= 1)
+    {
+        average_range(x, y, r1, r2, n);
+        return;
+    }
+    // Chunks are multiples of eight elements:  whole cache lines when the
+    // buffers are aligned.
+    std::size_t chunk = ((n + t - 1) / t + 7) & ~std::size_t(7);
+    std::vector<std::thread> workers;
+    workers.reserve(t - 1);
+    std::size_t b = chunk;
+    try
+    {
+        for (; b < n; b += chunk)
+        {
+            std::size_t k = std::min(chunk, n - b);
+            workers.emplace_back([=] {average_range(x + b, y + b, r1 + b,
+                                                    r2 + b, k);});
+        }
+    }
+    catch (const std::system_error&)
+    {
+    }
+    for (; b < n; b += chunk)
+        average_range(x + b, y + b, r1 + b, r2 + b, std::min(chunk, n - b));
+    average_range(x, y, r1, r2, std::min(chunk, n));
+    for (auto& w : workers)
+        w.join();
+}
+
+}  // detail
+
+class A
+{
+    typedef acme::upgrade_mutex            mutex_type;
+    typedef acme::shared_lock<mutex_type>  SharedLock;
+    typedef acme::upgrade_lock<mutex_type> UpgradeLock;
+    typedef acme::unique_lock<mutex_type>  Lock;
+
+    mutable mutex_type  mut_;
+    std::vector<double> data_;
+    std::vector<double> spare_;     // average_parallel's, under upgrade
+
+public:
+
+    explicit A(std::vector<double> data = {})
+        : data_(std::move(data)) {}
+
+    A(const A& a)
+    {
+        SharedLock _(a.mut_);
+        data_ = a.data_;
+    }
+
+    A& operator=(const A& a)
+    {
+        if (this != &a)
+        {
+            Lock       this_lock(mut_, std::defer_lock);
+            SharedLock that_lock(a.mut_, std::defer_lock);
+            std::lock(this_lock, that_lock);
+            data_ = a.data_;
+        }
+        return *this;
+    }
+
+    void swap(A& a)
+    {
+        Lock this_lock(mut_, std::defer_lock);
+        Lock that_lock(a.mut_, std::defer_lock);
+        std::lock(this_lock, that_lock);
+        data_.swap(a.data_);
+    }
+
+    void average(A& a)
+    {
+        assert(data_.size() == a.data_.size());
+        assert(this != &a);
+
+        Lock        this_lock(mut_, std::defer_lock);
+        UpgradeLock share_that_lock(a.mut_, std::defer_lock);
+        std::lock(this_lock, share_that_lock);
+
+        for (unsigned i = 0; i < data_.size(); ++i)
+            data_[i] = (data_[i] + a.data_[i]) / 2;
+
+        SharedLock share_this_lock(std::move(this_lock));
+        Lock that_lock(std::move(share_that_lock));
+        a.data_ = data_;
+    }
+
+    // Upgrade ownership of both keeps writers out while readers go on
+    // reading the old values.  The averages go to each object's spare
+    // buffer, and each object is owned exclusively only to swap it in; the
+    // old values become the spare for next time, so that after the first
+    // call the buffers are not reallocated.  From 2 * 64K elements the
+    // threads that share the work are started, and their handles allocated,
+    // on every call, while both objects are owned upgrade.
+
+    void average_parallel(A& a, unsigned threads = 0)
+    {
+        assert(this != &a);
+
+        UpgradeLock this_lock(mut_, std::defer_lock);
+        UpgradeLock that_lock(a.mut_, std::defer_lock);
+        std::lock(this_lock, that_lock);
+        assert(data_.size() == a.data_.size());
+
+        spare_.resize(data_.size());
+        a.spare_.resize(data_.size());
+        detail::average_parallel(data_.data(), a.data_.data(), spare_.data(),
+                                 a.spare_.data(), data_.size(), threads);
+
+        Lock this_unique(std::move(this_lock));
+        data_.swap(spare_);
+        this_unique.unlock();
+        Lock that_unique(std::move(that_lock));
+        a.data_.swap(a.spare_);
+    }
+
+    double at(std::size_t i) const
+    {
+        SharedLock _(mut_);
+        return data_.at(i);
+    }
+
+    std::size_t size() const
+    {
+        SharedLock _(mut_);
+        return data_.size();
+    }
+};
+
+}  // Assignment
+
+#endif  // UPGRADE_MUTEX_ASSIGNMENT
@@ -0,0 +1,108 @@
+//---------------------------- asymmetric_fence.h ------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_ASYMMETRIC_FENCE
+#define UPGRADE_MUTEX_ASYMMETRIC_FENCE
+
+/*
+    <asymmetric_fence.h> synopsis
+
+namespace acme
+{
+
+bool asymmetric_fence_expedited() noexcept;
+void asymmetric_light_fence() noexcept;
+void asymmetric_heavy_fence() noexcept;
+
+}  // acme
+*/
+
+#include <atomic>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace acme
+{
+
+// A pair of fences for Dekker-style handshakes where one side runs far more
+// often than the other.  An asymmetric_light_fence in one thread and an
+// asymmetric_heavy_fence in another order memory as two seq_cst fences
+// would.
+//
+// Where the kernel offers membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED), the
+// light fence only stops the compiler from reordering, and the heavy fence
+// is the system call, which runs a full barrier on every cpu running a
+// thread of this process.  Elsewhere both are seq_cst fences.
+//
+// The choice is made once per process, on first use, so that the two sides
+// always agree.
+
+namespace detail
+{
+
+inline
+bool
+register_membarrier() noexcept
+{
+#if defined(__linux__) && defined(__NR_membarrier)
+    long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+    if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+        return false;
+    return syscall(__NR_membarrier,
+                   MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+}  // detail
+
+inline
+bool
+asymmetric_fence_expedited() noexcept
+{
+    static const bool expedited = detail::register_membarrier();
+    return expedited;
+}
+
+inline
+void
+asymmetric_light_fence() noexcept
+{
+    if (asymmetric_fence_expedited())
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+    else
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+// Once registered, the expedited command cannot fail.
+
+inline
+void
+asymmetric_heavy_fence() noexcept
+{
+#if defined(__linux__) && defined(__NR_membarrier)
+    if (asymmetric_fence_expedited())
+    {
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        return;
+    }
+#endif
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_ASYMMETRIC_FENCE
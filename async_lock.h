@@ -0,0 +1,268 @@
+//-------------------------------- async_lock.h --------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_ASYNC_LOCK
+#define UPGRADE_MUTEX_ASYNC_LOCK
+
+/*
+    <async_lock.h> synopsis  (Linux only)
+
+namespace acme
+{
+
+// A request for ownership of m in mode that no thread blocks on, for event
+// loops.  Mutex is a basic_upgrade_mutex with a queued_admission policy.
+
+template <class Mutex>
+class async_lock_request
+{
+public:
+    typedef Mutex mutex_type;
+
+    // Queues the request.  With efd == -1 the request makes its own eventfd.
+    async_lock_request(mutex_type& m, lock_mode mode, int efd = -1);
+    ~async_lock_request();           // cancels, or unlocks if never taken
+
+    async_lock_request(const async_lock_request&) = delete;
+    async_lock_request& operator=(const async_lock_request&) = delete;
+
+    int fd() const noexcept;         // readable once ready
+    lock_mode mode() const noexcept;
+    bool ready() const noexcept;     // the request owns the mutex
+
+    // Withdraws a pending request.  Returns false if it is ready (or taken)
+    // and so cannot be withdrawn.
+    bool cancel();
+
+    // Transfer ownership of a ready request to the caller; throw
+    // system_error(EPERM) if not ready or not of this mode.
+    std::unique_lock<mutex_type> take_unique();
+    std::shared_lock<mutex_type> take_shared();
+    upgrade_lock<mutex_type> take_upgrade();
+};
+
+}  // acme
+*/
+
+#ifdef __linux__
+
+#include "upgrade_mutex.h"
+#include <cerrno>
+#include <sys/eventfd.h>
+
+namespace acme
+{
+
+namespace detail
+{
+
+struct async_access
+{
+    template <class Mutex>
+        static
+        typename Mutex::wait_strategy::mutex_type&
+        mut(Mutex& m) noexcept
+        {
+            return m.mut_;
+        }
+
+    template <class Mutex>
+        static
+        typename Mutex::admission_policy&
+        admission(Mutex& m) noexcept
+        {
+            return m;
+        }
+};
+
+}  // detail
+
+// The request queues at gate1 with the threads, in the admission policy's
+// order, and is granted by whichever thread releases the mutex:  that thread
+// passes gate1 for it, or for a writer, the last reader out completes it.
+// Completion makes ready() true and then adds 1 to the eventfd, from the
+// releasing thread, holding the mutex's internal mutex.
+//
+// Several requests may share one eventfd:  on each readable edge the event
+// loop reads the counter and checks ready() on each of them.  Ownership is
+// held by the request, not by a thread, until taken; afterwards the lock
+// releases it as usual.
+
+template <class Mutex>
+class async_lock_request
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    typedef typename Mutex::admission_policy::async_waiter node_type;
+    typedef typename Mutex::wait_strategy::mutex_type      internal_mutex;
+
+    struct node
+        : node_type
+    {
+        async_lock_request* self;
+    };
+
+    enum : unsigned char {pending, owned, taken, cancelled};
+
+    mutex_type&                m_;
+    const lock_mode            mode_;
+    int                        fd_;
+    bool                       own_fd_;
+    std::atomic<unsigned char> state_;
+    node                       node_;
+
+public:
+    async_lock_request(mutex_type& m, lock_mode mode, int efd = -1);
+    ~async_lock_request();
+
+    async_lock_request(const async_lock_request&) = delete;
+    async_lock_request& operator=(const async_lock_request&) = delete;
+
+    int fd() const noexcept {return fd_;}
+    lock_mode mode() const noexcept {return mode_;}
+
+    bool
+    ready() const noexcept
+    {
+        return state_.load(std::memory_order_acquire) == owned;
+    }
+
+    bool cancel();
+
+    std::unique_lock<mutex_type> take_unique();
+    std::shared_lock<mutex_type> take_shared();
+    upgrade_lock<mutex_type> take_upgrade();
+
+private:
+    static void done(node_type& n) noexcept;
+    void take(lock_mode mode);
+};
+
+template <class Mutex>
+async_lock_request<Mutex>::async_lock_request(mutex_type& m, lock_mode mode,
+                                              int efd)
+    : m_(m),
+      mode_(mode),
+      fd_(efd),
+      own_fd_(efd == -1),
+      state_(pending)
+{
+    if (own_fd_)
+    {
+        fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (fd_ == -1)
+            throw std::system_error(std::error_code(errno,
+                                                    std::system_category()),
+                                    "async_lock_request: eventfd");
+    }
+    node_.self = this;
+    node_.done = &done;
+    std::lock_guard<internal_mutex> _(detail::async_access::mut(m_));
+    detail::async_access::admission(m_).admit_async(m_, node_, mode_);
+}
+
+// A completed request's eventfd may still be being written:  the internal
+// mutex is taken to wait for done to return before closing it.
+
+template <class Mutex>
+async_lock_request<Mutex>::~async_lock_request()
+{
+    if (!cancel())
+    {
+        {
+            std::lock_guard<internal_mutex> _(detail::async_access::mut(m_));
+        }
+        if (state_.load(std::memory_order_relaxed) == owned)
+        {
+            switch (mode_)
+            {
+            case lock_mode::shared:
+                m_.unlock_shared();
+                break;
+            case lock_mode::upgrade:
+                m_.unlock_upgrade();
+                break;
+            case lock_mode::exclusive:
+                m_.unlock();
+                break;
+            }
+        }
+    }
+    if (own_fd_)
+        close(fd_);
+}
+
+template <class Mutex>
+void
+async_lock_request<Mutex>::done(node_type& n) noexcept
+{
+    async_lock_request* self = static_cast<node&>(n).self;
+    self->state_.store(owned, std::memory_order_release);
+    std::uint64_t one = 1;
+    ssize_t r = write(self->fd_, &one, sizeof(one));
+    (void)r;
+}
+
+template <class Mutex>
+bool
+async_lock_request<Mutex>::cancel()
+{
+    if (state_.load(std::memory_order_acquire) != pending)
+        return false;
+    std::lock_guard<internal_mutex> _(detail::async_access::mut(m_));
+    if (state_.load(std::memory_order_relaxed) != pending ||
+        !detail::async_access::admission(m_).cancel_async(m_, node_))
+        return false;
+    state_.store(cancelled, std::memory_order_relaxed);
+    return true;
+}
+
+template <class Mutex>
+void
+async_lock_request<Mutex>::take(lock_mode mode)
+{
+    unsigned char expected = owned;
+    if (mode != mode_ || !state_.compare_exchange_strong(expected, taken))
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "async_lock_request: not ready in this mode");
+}
+
+template <class Mutex>
+std::unique_lock<Mutex>
+async_lock_request<Mutex>::take_unique()
+{
+    take(lock_mode::exclusive);
+    return std::unique_lock<Mutex>(m_, std::adopt_lock);
+}
+
+template <class Mutex>
+std::shared_lock<Mutex>
+async_lock_request<Mutex>::take_shared()
+{
+    take(lock_mode::shared);
+    return std::shared_lock<Mutex>(m_, std::adopt_lock);
+}
+
+template <class Mutex>
+upgrade_lock<Mutex>
+async_lock_request<Mutex>::take_upgrade()
+{
+    take(lock_mode::upgrade);
+    return upgrade_lock<Mutex>(m_, std::adopt_lock);
+}
+
+}  // acme
+
+#endif  // __linux__
+
+#endif  // UPGRADE_MUTEX_ASYNC_LOCK
@@ -0,0 +1,1600 @@
+//-------------------------------- bench.cpp -----------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+//  bench [--perf] [name ...]
+//
+//  Runs the named benchmarks (all of them when none are named) and prints,
+//  for each mutex compared, the throughput and the distribution of time spent
+//  acquiring each lock mode.  With --perf, the benchmarks of mixed loads
+//  also print, per operation in each mode, the cycles, instructions, cache
+//  misses, context switches and preemptions its calls to the mutex cost
+//  (perf_counters.h); counters the host does not permit print as n/a.
+//
+//  handoff:  barging (the default admission) against handoff_admission under
+//            a mixed shared / upgrade / exclusive load.
+//  cohort:   upgrade_mutex against cohort_upgrade_mutex under a read-mostly
+//            and a write-heavy load.  Differences show on multi-node hosts.
+//  read_mostly:  upgrade_mutex against read_mostly_upgrade_mutex as the
+//            share of writes grows from 1%.
+//  affine:   upgrade_mutex against biased_upgrade_mutex when each thread
+//            locks its own mutexes and rarely another thread's.
+//  deadline: the share of timed acquisitions missing their deadlines under
+//            barging, handoff and deadline_admission.
+//  adaptive: upgrade_mutex, read_mostly_upgrade_mutex and
+//            adaptive_upgrade_mutex under steady loads and under one that
+//            swings between read-heavy and write-heavy phases.
+//  conversions:  the rate, failure rate and latency of each of
+//            upgrade_mutex's conversions, as two threads cycle through them
+//            beside a growing number of plain readers.
+//  average:  Assignment::A's average against average_parallel for growing
+//            vectors, and what each costs the objects' readers.
+//  lru:      lru_cache against an LRU cache behind one std::mutex, its hit
+//            rate and the latency of its lookups, as the threads look up
+//            skewed keys and put each one they miss.
+//  intention:  a table of pages of rows behind one upgrade_mutex against
+//            intention_mutexes on the table, each page and each row, as
+//            threads mix scans of the table or of a page with updates of
+//            single rows.
+//  help:     a pool of workers whose updates wait for readers to drain,
+//            sleeping meanwhile against running the pool's other tasks.
+//  freeze:   the cost of short reads of a group of upgrade_mutexes against
+//            the same group in a lock_domain, thawed and frozen.
+
+#include "adaptive_upgrade_mutex.h"
+#include "assignment.h"
+#include "biased_upgrade_mutex.h"
+#include "cohort_upgrade_mutex.h"
+#include "intention_mutex.h"
+#include "lock_domain.h"
+#include "lru_cache.h"
+#include "perf_counters.h"
+#include "read_mostly_upgrade_mutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+
+typedef std::chrono::steady_clock Clock;
+
+const std::chrono::seconds run_time(2);
+
+unsigned
+bench_threads()
+{
+    return std::max(4u, std::thread::hardware_concurrency());
+}
+
+// Harness
+
+struct xorshift
+{
+    std::uint32_t s;
+
+    explicit xorshift(std::uint32_t seed) : s(seed ? seed : 1) {}
+
+    std::uint32_t
+    operator()()
+    {
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        return s;
+    }
+};
+
+volatile unsigned spin_sink;
+
+void
+spin(unsigned n)
+{
+    for (unsigned i = 0; i < n; ++i)
+        spin_sink = i;
+}
+
+class sample_set
+{
+    std::vector<std::uint32_t> v_;
+
+public:
+    void
+    add(Clock::duration d)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d);
+        v_.push_back(static_cast<std::uint32_t>(
+                         std::min<long long>(ns.count(), 0xFFFFFFFF)));
+    }
+
+    void
+    merge(const sample_set& x)
+    {
+        v_.insert(v_.end(), x.v_.begin(), x.v_.end());
+    }
+
+    std::size_t size() const {return v_.size();}
+
+    // Sorts the samples; q in [0, 1].
+    std::uint32_t
+    percentile(double q)
+    {
+        if (v_.empty())
+            return 0;
+        std::sort(v_.begin(), v_.end());
+        std::size_t i = static_cast<std::size_t>(q * (v_.size() - 1) + 0.5);
+        return v_[i];
+    }
+};
+
+// Event counts (--perf), summed over the operations sampled.
+
+bool perf_enabled = false;
+const unsigned perf_every = 64;       // operations per sample
+
+acme::perf_counters&
+this_thread_counters()
+{
+    thread_local acme::perf_counters c;
+    return c;
+}
+
+// What was counted from before to after, less what the reads themselves
+// counted, added to sum.
+
+void
+add_counted(double (&sum)[acme::perf_events], const acme::perf_values& before,
+            const acme::perf_values& after)
+{
+    const acme::perf_values& o = this_thread_counters().overhead();
+    for (unsigned i = 0; i < acme::perf_events; ++i)
+    {
+        std::uint64_t d = after.v[i] - before.v[i];
+        sum[i] += d > o.v[i] ? d - o.v[i] : 0;
+    }
+}
+
+// The counts of one sampled operation, taken only while it is inside the
+// mutex's calls:  open() just before each, close() just after.
+
+struct perf_window
+{
+    double            sum[acme::perf_events] = {};
+    acme::perf_values before;
+
+    void open() {before = this_thread_counters().read();}
+    void close() {add_counted(sum, before, this_thread_counters().read());}
+};
+
+struct perf_sample
+{
+    double      sum[acme::perf_events] = {};
+    std::size_t n = 0;
+
+    void
+    add(const acme::perf_values& before, const acme::perf_values& after)
+    {
+        add_counted(sum, before, after);
+        ++n;
+    }
+
+    void
+    add(const perf_window& w)
+    {
+        for (unsigned i = 0; i < acme::perf_events; ++i)
+            sum[i] += w.sum[i];
+        ++n;
+    }
+
+    void
+    merge(const perf_sample& x)
+    {
+        for (unsigned i = 0; i < acme::perf_events; ++i)
+            sum[i] += x.sum[i];
+        n += x.n;
+    }
+};
+
+const char* const mode_names[] = {"shared", "upgrade", "exclusive"};
+
+struct result
+{
+    sample_set    wait[3];
+    perf_sample   perf[3];
+    std::size_t   ops = 0;
+    std::size_t   timed = 0;       // timed acquisitions attempted
+    std::size_t   missed = 0;      // ... that timed out
+    double        seconds = 0;
+
+    void
+    merge(const result& x)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            wait[i].merge(x.wait[i]);
+            perf[i].merge(x.perf[i]);
+        }
+        ops += x.ops;
+        timed += x.timed;
+        missed += x.missed;
+    }
+};
+
+void
+print_header(const char* title)
+{
+    std::cout << title << '\n'
+              << std::left << std::setw(24) << "" << std::right
+              << std::setw(12) << "ops/s" << std::setw(11) << "mode"
+              << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "p99.9" << std::setw(12) << "max (ns)"
+              << '\n';
+}
+
+void
+print_perf(const result& r)
+{
+    const acme::perf_counters& c = this_thread_counters();
+    for (int i = 0; i < 3; ++i)
+    {
+        const perf_sample& p = r.perf[i];
+        if (p.n == 0)
+            continue;
+        std::cout << std::setw(36) << "" << std::setw(11) << mode_names[i]
+                  << "  per op:";
+        for (unsigned e = 0; e < acme::perf_events; ++e)
+        {
+            acme::perf_event ev = acme::perf_event(e);
+            std::cout << "  " << c.name(ev) << ' ';
+            if (!c.available(ev))
+                std::cout << "n/a";
+            else
+                std::cout << std::setprecision(e < acme::perf_context_switches ?
+                                               0 : 3)
+                          << p.sum[e] / p.n;
+        }
+        std::cout << std::setprecision(0) << '\n';
+    }
+}
+
+void
+print(const char* name, result& r)
+{
+    std::cout << std::fixed << std::setprecision(0);
+    bool first = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (r.wait[i].size() == 0)
+            continue;
+        if (first)
+            std::cout << std::left << std::setw(24) << name << std::right
+                      << std::setw(12) << r.ops / r.seconds;
+        else
+            std::cout << std::setw(36) << "";
+        first = false;
+        std::cout << std::setw(11) << mode_names[i]
+                  << std::setw(10) << r.wait[i].percentile(.5)
+                  << std::setw(10) << r.wait[i].percentile(.99)
+                  << std::setw(10) << r.wait[i].percentile(.999)
+                  << std::setw(12) << r.wait[i].percentile(1) << '\n';
+    }
+    print_perf(r);
+}
+
+// Runs body(thread_index, Result&) on n threads until run_time elapses.
+// body returns after one operation; the loop checks the clock.
+
+template <class Result = result, class Body>
+Result
+run(unsigned n, Body body)
+{
+    std::atomic<bool> go{false};
+    std::atomic<bool> stop{false};
+    std::vector<Result> results(n);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < n; ++i)
+        threads.emplace_back([&, i]
+        {
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                body(i, results[i]);
+                ++results[i].ops;
+            }
+        });
+    auto t0 = Clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(run_time);
+    stop.store(true);
+    for (auto& t : threads)
+        t.join();
+    Result r;
+    r.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+    for (auto& x : results)
+        r.merge(x);
+    return r;
+}
+
+// Mixed load
+
+// Percentages of operations taking shared and upgrade ownership; the rest
+// take exclusive.  Half of the upgrades convert to exclusive.
+
+struct mix
+{
+    unsigned shared;
+    unsigned upgrade;
+};
+
+// Times the acquisition lock(), or, in a sampled operation (w not null),
+// counts its events instead, so that neither includes the other's reads.
+
+template <class Lock>
+void
+acquire(perf_window* w, sample_set& wait, Lock lock)
+{
+    if (w != nullptr)
+    {
+        w->open();
+        lock();
+        w->close();
+        return;
+    }
+    auto t0 = Clock::now();
+    lock();
+    wait.add(Clock::now() - t0);
+}
+
+// Counts the events of a release or conversion in a sampled operation.
+
+template <class Unlock>
+void
+release(perf_window* w, Unlock unlock)
+{
+    if (w != nullptr)
+        w->open();
+    unlock();
+    if (w != nullptr)
+        w->close();
+}
+
+// Short critical sections and short think times keep the mutex saturated so
+// that arrivals race with woken waiters.  With --perf one operation in
+// perf_every is counted, over its calls to the mutex only, and not timed.
+
+template <class Mutex>
+void
+mixed_op(Mutex& m, mix p, std::uint32_t x, result& r)
+{
+    unsigned pick = x % 100;
+    perf_window window;
+    perf_window* w = nullptr;
+    if (perf_enabled && (x >> 8) % perf_every == 0)
+        w = &window;
+    int mode = 2;
+    if (pick < p.shared)
+    {
+        mode = 0;
+        acquire(w, r.wait[0], [&] {m.lock_shared();});
+        spin(100);
+        release(w, [&] {m.unlock_shared();});
+    }
+    else if (pick < p.shared + p.upgrade)
+    {
+        mode = 1;
+        acquire(w, r.wait[1], [&] {m.lock_upgrade();});
+        spin(100);
+        if (x & 0x10000)
+        {
+            release(w, [&] {m.unlock_upgrade_and_lock();});
+            spin(100);
+            release(w, [&] {m.unlock();});
+        }
+        else
+            release(w, [&] {m.unlock_upgrade();});
+    }
+    else
+    {
+        acquire(w, r.wait[2], [&] {m.lock();});
+        spin(200);
+        release(w, [&] {m.unlock();});
+    }
+    if (w != nullptr)
+        r.perf[mode].add(*w);
+    spin(x >> 24);
+}
+
+template <class Mutex>
+result
+mixed_load(unsigned n, mix p)
+{
+    Mutex m;
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        mixed_op(m, p, rng[i](), r);
+    });
+}
+
+// handoff
+
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::handoff_admission> handoff_mutex;
+
+void
+bench_handoff()
+{
+    unsigned n = bench_threads();
+    const mix p = {70, 10};
+    std::cout << "70% shared, 10% upgrade, " << n << " threads\n";
+    print_header("acquisition latency");
+    result barging = mixed_load<acme::upgrade_mutex>(n, p);
+    print("barging", barging);
+    result handoff = mixed_load<handoff_mutex>(n, p);
+    print("handoff", handoff);
+}
+
+// cohort
+
+void
+bench_cohort()
+{
+    unsigned n = bench_threads();
+    std::cout << acme::numa_topology::get().nodes() << " NUMA nodes, " << n
+              << " threads\n";
+    const mix loads[] = {{95, 3}, {50, 10}};
+    for (const mix& p : loads)
+    {
+        std::cout << '\n';
+        std::string title = std::to_string(p.shared) + "% shared, " +
+                            std::to_string(p.upgrade) + "% upgrade";
+        print_header(title.c_str());
+        result flat = mixed_load<acme::upgrade_mutex>(n, p);
+        print("upgrade_mutex", flat);
+        result cohort = mixed_load<acme::cohort_upgrade_mutex>(n, p);
+        print("cohort_upgrade_mutex", cohort);
+    }
+}
+
+// read_mostly
+
+void
+bench_read_mostly()
+{
+    unsigned n = bench_threads();
+    std::cout << n << " threads, membarrier "
+              << (acme::asymmetric_fence_expedited() ? "used" : "unavailable")
+              << '\n';
+    const mix loads[] = {{99, 0}, {90, 5}};
+    for (const mix& p : loads)
+    {
+        std::cout << '\n';
+        std::string title = std::to_string(p.shared) + "% shared, " +
+                            std::to_string(p.upgrade) + "% upgrade";
+        print_header(title.c_str());
+        result flat = mixed_load<acme::upgrade_mutex>(n, p);
+        print("upgrade_mutex", flat);
+        result rm = mixed_load<acme::read_mostly_upgrade_mutex>(n, p);
+        print("read_mostly", rm);
+    }
+}
+
+// affine
+
+// Each thread has its own mutexes and mostly locks those, in every mode;
+// one operation in foreign_every takes another thread's mutex.  Critical
+// sections are short so that the cost of the lock itself shows.
+
+template <class Mutex>
+result
+affine_load(unsigned n, unsigned foreign_every)
+{
+    const unsigned per_thread = 8;
+    std::vector<Mutex> m(n * per_thread);
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        std::uint32_t x = rng[i]();
+        unsigned owner = i;
+        if (foreign_every != 0 && (x >> 8) % foreign_every == 0)
+            owner = (i + 1 + x % (n - 1)) % n;
+        Mutex& mx = m[owner * per_thread + (x >> 4) % per_thread];
+        unsigned pick = x % 16;
+        auto t0 = Clock::now();
+        if (pick < 10)
+        {
+            mx.lock_shared();
+            r.wait[0].add(Clock::now() - t0);
+            spin(10);
+            mx.unlock_shared();
+        }
+        else if (pick < 13)
+        {
+            mx.lock_upgrade();
+            r.wait[1].add(Clock::now() - t0);
+            spin(10);
+            mx.unlock_upgrade_and_lock();
+            spin(10);
+            mx.unlock();
+        }
+        else
+        {
+            mx.lock();
+            r.wait[2].add(Clock::now() - t0);
+            spin(10);
+            mx.unlock();
+        }
+    });
+}
+
+void
+bench_affine()
+{
+    unsigned n = bench_threads();
+    std::cout << n << " threads, 8 mutexes each\n";
+    const unsigned foreign[] = {0, 10000, 100};
+    for (unsigned f : foreign)
+    {
+        std::cout << '\n';
+        std::string title = f == 0 ? std::string("no foreign locking")
+                                   : "1 in " + std::to_string(f) +
+                                     " operations on a foreign mutex";
+        print_header(title.c_str());
+        result flat = affine_load<acme::upgrade_mutex>(n, f);
+        print("upgrade_mutex", flat);
+        result biased = affine_load<acme::biased_upgrade_mutex>(n, f);
+        print("biased", biased);
+    }
+}
+
+// deadline
+
+// Every thread makes timed acquisitions with deadlines spread over
+// 20 .. 500 us, except one in eight, which waits untimed.  The mutex is
+// oversubscribed, so some deadlines must be missed; the question is how many.
+
+template <class Mutex>
+result
+deadline_load(unsigned n)
+{
+    Mutex m;
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        std::uint32_t x = rng[i]();
+        unsigned pick = x % 16;
+        bool timed = (x >> 4) % 8 != 0;
+        auto t0 = Clock::now();
+        auto deadline = t0 + std::chrono::microseconds(20 + (x >> 8) % 480);
+        bool got = true;
+        int mode = pick < 10 ? 0 : pick < 13 ? 1 : 2;
+        switch (mode)
+        {
+        case 0:
+            if (timed)
+                got = m.try_lock_shared_until(deadline);
+            else
+                m.lock_shared();
+            break;
+        case 1:
+            if (timed)
+                got = m.try_lock_upgrade_until(deadline);
+            else
+                m.lock_upgrade();
+            break;
+        default:
+            if (timed)
+                got = m.try_lock_until(deadline);
+            else
+                m.lock();
+            break;
+        }
+        if (timed)
+        {
+            ++r.timed;
+            if (!got)
+            {
+                ++r.missed;
+                return;
+            }
+        }
+        r.wait[mode].add(Clock::now() - t0);
+        spin(mode == 0 ? 5000 : 20000);
+        switch (mode)
+        {
+        case 0:
+            m.unlock_shared();
+            break;
+        case 1:
+            m.unlock_upgrade();
+            break;
+        default:
+            m.unlock();
+            break;
+        }
+    });
+}
+
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::deadline_admission> deadline_mutex;
+
+void
+print_misses(const char* name, const result& r)
+{
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(12) << r.ops / r.seconds
+              << std::setw(12) << r.timed
+              << std::setw(10) << std::setprecision(2)
+              << (r.timed != 0 ? 100. * r.missed / r.timed : 0.) << '\n'
+              << std::setprecision(0);
+}
+
+void
+bench_deadline()
+{
+    unsigned n = 2 * bench_threads();
+    std::cout << n << " threads, 7 in 8 acquisitions timed\n"
+              << std::left << std::setw(24) << "" << std::right
+              << std::setw(12) << "ops/s" << std::setw(12) << "timed"
+              << std::setw(10) << "missed %" << '\n'
+              << std::fixed << std::setprecision(0);
+    result barging = deadline_load<acme::upgrade_mutex>(n);
+    print_misses("barging", barging);
+    result handoff = deadline_load<handoff_mutex>(n);
+    print_misses("handoff", handoff);
+    result edf = deadline_load<deadline_mutex>(n);
+    print_misses("deadline", edf);
+    std::cout << '\n';
+    print_header("acquisition latency");
+    print("barging", barging);
+    print("handoff", handoff);
+    print("deadline", edf);
+}
+
+// adaptive
+
+// Alternates between the two mixes every period.
+
+template <class Mutex>
+result
+phased_load(unsigned n, mix a, mix b, Clock::duration period)
+{
+    Mutex m;
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    const Clock::time_point t0 = Clock::now();
+    return run(n, [&](unsigned i, result& r)
+    {
+        bool second = (Clock::now() - t0) / period % 2 != 0;
+        mixed_op(m, second ? b : a, rng[i](), r);
+    });
+}
+
+void
+bench_adaptive()
+{
+    unsigned n = bench_threads();
+    std::cout << n << " threads\n";
+    const mix loads[] = {{99, 0}, {50, 10}};
+    for (const mix& p : loads)
+    {
+        std::cout << '\n';
+        std::string title = std::to_string(p.shared) + "% shared, " +
+                            std::to_string(p.upgrade) + "% upgrade";
+        print_header(title.c_str());
+        result flat = mixed_load<acme::upgrade_mutex>(n, p);
+        print("upgrade_mutex", flat);
+        result rm = mixed_load<acme::read_mostly_upgrade_mutex>(n, p);
+        print("read_mostly", rm);
+        result ad = mixed_load<acme::adaptive_upgrade_mutex>(n, p);
+        print("adaptive", ad);
+    }
+    const mix day = {99, 0};
+    const mix batch = {50, 10};
+    const auto period = std::chrono::milliseconds(100);
+    std::cout << '\n';
+    print_header("99% / 50% shared, alternating every 100ms");
+    result flat = phased_load<acme::upgrade_mutex>(n, day, batch, period);
+    print("upgrade_mutex", flat);
+    result rm = phased_load<acme::read_mostly_upgrade_mutex>(n, day, batch,
+                                                              period);
+    print("read_mostly", rm);
+    result ad = phased_load<acme::adaptive_upgrade_mutex>(n, day, batch,
+                                                          period);
+    print("adaptive", ad);
+}
+
+// conversions
+
+enum conversion
+{
+    try_shared_to_exclusive,
+    try_shared_to_exclusive_for,
+    try_shared_to_upgrade,
+    try_shared_to_upgrade_for,
+    upgrade_to_exclusive,
+    try_upgrade_to_exclusive,
+    try_upgrade_to_exclusive_for,
+    exclusive_to_upgrade,
+    exclusive_to_shared,
+    upgrade_to_shared,
+    conversions
+};
+
+const char* const conversion_names[conversions] =
+{
+    "try_unlock_shared_and_lock",
+    "try_unlock_shared_and_lock_for",
+    "try_unlock_shared_and_lock_upgrade",
+    "try_unlock_shared_and_lock_upgrade_for",
+    "unlock_upgrade_and_lock",
+    "try_unlock_upgrade_and_lock",
+    "try_unlock_upgrade_and_lock_for",
+    "unlock_and_lock_upgrade",
+    "unlock_and_lock_shared",
+    "unlock_upgrade_and_lock_shared",
+};
+
+struct conversion_result
+{
+    sample_set    time[conversions];    // successful or not
+    std::size_t   failed[conversions] = {};
+    std::size_t   ops = 0;
+    double        seconds = 0;
+
+    void
+    merge(const conversion_result& x)
+    {
+        for (int i = 0; i < conversions; ++i)
+        {
+            time[i].merge(x.time[i]);
+            failed[i] += x.failed[i];
+        }
+        ops += x.ops;
+    }
+};
+
+template <class F>
+bool
+timed(conversion_result& r, conversion c, F f)
+{
+    auto t0 = Clock::now();
+    bool ok = f();
+    r.time[c].add(Clock::now() - t0);
+    if (!ok)
+        ++r.failed[c];
+    return ok;
+}
+
+// The cycles of main.cpp's clockwise, try_for_clockwise and
+// counter_clockwise tests, and one trying upgrade to exclusive, chosen at
+// random.  Each state is held for a short critical section.
+
+template <class Mutex>
+void
+conversion_cycle(Mutex& m, std::uint32_t x, conversion_result& r)
+{
+    const auto patience = std::chrono::microseconds(5);
+    const unsigned work = 20;
+    switch (x % 4)
+    {
+    case 0:
+        m.lock_shared();
+        spin(work);
+        if (!timed(r, try_shared_to_exclusive,
+                   [&] {return m.try_unlock_shared_and_lock();}))
+        {
+            if (!timed(r, try_shared_to_upgrade,
+                       [&] {return m.try_unlock_shared_and_lock_upgrade();}))
+            {
+                m.unlock_shared();
+                return;
+            }
+            spin(work);
+            timed(r, upgrade_to_exclusive,
+                  [&] {m.unlock_upgrade_and_lock(); return true;});
+        }
+        break;
+    case 1:
+        m.lock_shared();
+        spin(work);
+        if (!timed(r, try_shared_to_exclusive_for,
+                   [&] {return m.try_unlock_shared_and_lock_for(patience);}))
+        {
+            if (!timed(r, try_shared_to_upgrade_for, [&]
+                       {
+                           return m.try_unlock_shared_and_lock_upgrade_for(
+                                                                    patience);
+                       }))
+            {
+                m.unlock_shared();
+                return;
+            }
+            spin(work);
+            if (!timed(r, try_upgrade_to_exclusive_for, [&]
+                       {
+                           return m.try_unlock_upgrade_and_lock_for(patience);
+                       }))
+            {
+                m.unlock_upgrade();
+                return;
+            }
+        }
+        break;
+    case 2:
+        m.lock_upgrade();
+        spin(work);
+        timed(r, upgrade_to_exclusive,
+              [&] {m.unlock_upgrade_and_lock(); return true;});
+        spin(work);
+        timed(r, exclusive_to_shared,
+              [&] {m.unlock_and_lock_shared(); return true;});
+        spin(work);
+        m.unlock_shared();
+        return;
+    default:
+        m.lock_upgrade();
+        spin(work);
+        if (!timed(r, try_upgrade_to_exclusive,
+                   [&] {return m.try_unlock_upgrade_and_lock();}))
+        {
+            timed(r, upgrade_to_shared,
+                  [&] {m.unlock_upgrade_and_lock_shared(); return true;});
+            spin(work);
+            m.unlock_shared();
+            return;
+        }
+        break;
+    }
+    // Exclusive, back round to shared.
+    spin(work);
+    timed(r, exclusive_to_upgrade,
+          [&] {m.unlock_and_lock_upgrade(); return true;});
+    spin(work);
+    timed(r, upgrade_to_shared,
+          [&] {m.unlock_upgrade_and_lock_shared(); return true;});
+    spin(work);
+    m.unlock_shared();
+}
+
+// Threads 0 .. converters-1 cycle through conversions; the rest are plain
+// readers like mixed_op's.
+
+template <class Mutex>
+conversion_result
+conversion_load(unsigned converters, unsigned readers)
+{
+    Mutex m;
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < converters + readers; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run<conversion_result>(converters + readers,
+                                  [&](unsigned i, conversion_result& r)
+    {
+        std::uint32_t x = rng[i]();
+        if (i < converters)
+        {
+            conversion_cycle(m, x, r);
+            return;
+        }
+        m.lock_shared();
+        spin(100);
+        m.unlock_shared();
+        spin(x >> 24);
+    });
+}
+
+void
+print(conversion_result& r)
+{
+    std::cout << std::left << std::setw(40) << "" << std::right
+              << std::setw(12) << "ops/s" << std::setw(9) << "failed %"
+              << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "p99.9" << std::setw(12) << "max (ns)"
+              << '\n';
+    for (int i = 0; i < conversions; ++i)
+    {
+        std::size_t n = r.time[i].size();
+        if (n == 0)
+            continue;
+        std::cout << std::left << std::setw(40) << conversion_names[i]
+                  << std::right << std::setprecision(0)
+                  << std::setw(12) << n / r.seconds
+                  << std::setw(9) << std::setprecision(1)
+                  << 100. * r.failed[i] / n << std::setprecision(0)
+                  << std::setw(10) << r.time[i].percentile(.5)
+                  << std::setw(10) << r.time[i].percentile(.99)
+                  << std::setw(10) << r.time[i].percentile(.999)
+                  << std::setw(12) << r.time[i].percentile(1) << '\n';
+    }
+}
+
+void
+bench_conversions()
+{
+    const unsigned converters = 2;
+    unsigned n = bench_threads();
+    const unsigned readers[] = {0, n / 4, n - converters};
+    std::cout << std::fixed;
+    for (unsigned k : readers)
+    {
+        std::cout << '\n' << "upgrade_mutex, " << converters
+                  << " converting threads, " << k << " readers\n";
+        conversion_result r = conversion_load<acme::upgrade_mutex>(converters,
+                                                                   k);
+        print(r);
+    }
+}
+
+// average
+
+// Thread 0 averages two objects over and over; the others read single
+// elements of either.  wait[2] holds the averages' durations and wait[0] the
+// reads'.
+
+template <class Average>
+result
+average_load(unsigned n, std::size_t size, Average average)
+{
+    Assignment::A a(std::vector<double>(size, 1.0));
+    Assignment::A b(std::vector<double>(size, 3.0));
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        std::uint32_t x = rng[i]();
+        auto t0 = Clock::now();
+        if (i == 0)
+        {
+            average(a, b);
+            r.wait[2].add(Clock::now() - t0);
+            return;
+        }
+        spin_sink = static_cast<unsigned>((x & 1 ? a : b).at(x % size));
+        r.wait[0].add(Clock::now() - t0);
+        spin(x >> 24);
+    });
+}
+
+void
+print_average(const char* name, result& r)
+{
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(12) << r.wait[2].size() / r.seconds
+              << std::setw(12) << r.wait[2].percentile(.5) / 1000
+              << std::setw(12) << r.wait[0].size() / r.seconds
+              << std::setw(10) << r.wait[0].percentile(.5)
+              << std::setw(10) << r.wait[0].percentile(.99)
+              << std::setw(12) << r.wait[0].percentile(1) << '\n';
+}
+
+void
+bench_average()
+{
+    unsigned n = bench_threads();
+    std::cout << n - 1 << " reading threads, "
+              << std::thread::hardware_concurrency()
+              << " threads averaging in parallel\n"
+              << std::fixed << std::setprecision(0);
+    const std::size_t sizes[] = {std::size_t(1) << 12, std::size_t(1) << 18,
+                                 std::size_t(1) << 21};
+    for (std::size_t size : sizes)
+    {
+        std::cout << '\n' << size << " doubles\n"
+                  << std::left << std::setw(24) << "" << std::right
+                  << std::setw(12) << "averages/s" << std::setw(12)
+                  << "p50 (us)" << std::setw(12) << "reads/s"
+                  << std::setw(10) << "p50" << std::setw(10) << "p99"
+                  << std::setw(12) << "max (ns)" << '\n';
+        result serial = average_load(n, size,
+                              [](Assignment::A& x, Assignment::A& y)
+                              {
+                                  x.average(y);
+                              });
+        print_average("average", serial);
+        result parallel = average_load(n, size,
+                              [](Assignment::A& x, Assignment::A& y)
+                              {
+                                  x.average_parallel(y);
+                              });
+        print_average("average_parallel", parallel);
+    }
+}
+
+// lru
+
+// The textbook LRU cache:  every lookup owns the mutex to move its entry to
+// the front.
+
+template <class Key, class T>
+class mutex_lru_cache
+{
+    typedef std::list<std::pair<Key, T>> list_type;
+
+    std::mutex                                            mut_;
+    list_type                                             list_;
+    std::unordered_map<Key, typename list_type::iterator> index_;
+    const std::size_t                                     capacity_;
+
+public:
+    explicit mutex_lru_cache(std::size_t capacity) : capacity_(capacity) {}
+
+    std::optional<T>
+    get(const Key& k)
+    {
+        std::lock_guard<std::mutex> _(mut_);
+        auto i = index_.find(k);
+        if (i == index_.end())
+            return std::nullopt;
+        list_.splice(list_.begin(), list_, i->second);
+        return i->second->second;
+    }
+
+    void
+    put(const Key& k, const T& v)
+    {
+        std::lock_guard<std::mutex> _(mut_);
+        auto i = index_.find(k);
+        if (i != index_.end())
+        {
+            i->second->second = v;
+            list_.splice(list_.begin(), list_, i->second);
+            return;
+        }
+        if (index_.size() == capacity_)
+        {
+            index_.erase(list_.back().first);
+            list_.pop_back();
+        }
+        list_.emplace_front(k, v);
+        index_.emplace(k, list_.begin());
+    }
+};
+
+struct lru_result
+{
+    sample_set    get;
+    std::size_t   hits = 0;
+    std::size_t   ops = 0;
+    double        seconds = 0;
+
+    void
+    merge(const lru_result& x)
+    {
+        get.merge(x.get);
+        hits += x.hits;
+        ops += x.ops;
+    }
+};
+
+// Keys are keys * u^3 for u uniform in [0, 1):  a few keys are hot and most
+// are cold.  A miss puts the key.
+
+template <class Cache>
+lru_result
+lru_load(unsigned n, std::size_t capacity, std::uint32_t keys)
+{
+    Cache c(capacity);
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run<lru_result>(n, [&](unsigned i, lru_result& r)
+    {
+        double u = rng[i]() / 4294967296.;
+        std::uint32_t k = static_cast<std::uint32_t>(keys * u * u * u);
+        auto t0 = Clock::now();
+        std::optional<std::uint64_t> v = c.get(k);
+        r.get.add(Clock::now() - t0);
+        if (v)
+            ++r.hits;
+        else
+            c.put(k, k);
+        spin(50);
+    });
+}
+
+void
+print(const char* name, lru_result& r)
+{
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setw(12) << std::setprecision(0) << r.ops / r.seconds
+              << std::setw(8) << std::setprecision(1) << 100. * r.hits / r.ops
+              << std::setprecision(0)
+              << std::setw(10) << r.get.percentile(.5)
+              << std::setw(10) << r.get.percentile(.99)
+              << std::setw(10) << r.get.percentile(.999)
+              << std::setw(12) << r.get.percentile(1) << '\n';
+}
+
+void
+bench_lru()
+{
+    unsigned n = bench_threads();
+    const std::size_t capacities[] = {1024, 65536};
+    std::cout << std::fixed;
+    for (std::size_t capacity : capacities)
+    {
+        std::uint32_t keys = static_cast<std::uint32_t>(4 * capacity);
+        std::cout << '\n' << n << " threads, capacity " << capacity << ", "
+                  << keys << " keys\n"
+                  << std::left << std::setw(24) << "" << std::right
+                  << std::setw(12) << "ops/s" << std::setw(8) << "hit %"
+                  << std::setw(10) << "p50" << std::setw(10) << "p99"
+                  << std::setw(10) << "p99.9" << std::setw(12) << "max (ns)"
+                  << '\n';
+        lru_result m = lru_load<mutex_lru_cache<std::uint32_t,
+                                                std::uint64_t>>(n, capacity,
+                                                                keys);
+        print("std::mutex", m);
+        lru_result u = lru_load<acme::lru_cache<std::uint32_t,
+                                                std::uint64_t>>(n, capacity,
+                                                                keys);
+        print("lru_cache", u);
+    }
+}
+
+// intention
+
+// Per thousand operations, the scans of the whole table and of one page;
+// the rest update one row.  wait[0] holds the table scans' acquisition
+// times, wait[1] the page scans' and wait[2] the updates'.  A thread locks
+// a row having locked its table and page, in parent_mode.
+
+struct scan_mix
+{
+    unsigned table;
+    unsigned page;
+};
+
+const unsigned table_pages = 16;
+const unsigned page_rows = 64;
+
+template <class Table>
+result
+table_load(unsigned n, scan_mix p)
+{
+    Table t;
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        std::uint32_t x = rng[i]();
+        unsigned pick = x % 1000;
+        unsigned page = (x >> 10) % table_pages;
+        auto t0 = Clock::now();
+        if (pick < p.table)
+            t.scan(r.wait[0], t0);
+        else if (pick < p.table + p.page)
+            t.scan_page(page, r.wait[1], t0);
+        else
+            t.update(page, (x >> 14) % page_rows, r.wait[2], t0);
+        spin(x >> 24);
+    });
+}
+
+class coarse_table
+{
+    acme::upgrade_mutex mut_;
+    long                rows_[table_pages][page_rows] = {};
+
+public:
+    void
+    scan(sample_set& s, Clock::time_point t0)
+    {
+        acme::shared_lock<acme::upgrade_mutex> _(mut_);
+        s.add(Clock::now() - t0);
+        long sum = 0;
+        for (auto& page : rows_)
+            for (long v : page)
+                sum += v;
+        spin_sink = static_cast<unsigned>(sum);
+    }
+
+    void
+    scan_page(unsigned page, sample_set& s, Clock::time_point t0)
+    {
+        acme::shared_lock<acme::upgrade_mutex> _(mut_);
+        s.add(Clock::now() - t0);
+        long sum = 0;
+        for (long v : rows_[page])
+            sum += v;
+        spin_sink = static_cast<unsigned>(sum);
+    }
+
+    void
+    update(unsigned page, unsigned row, sample_set& s, Clock::time_point t0)
+    {
+        acme::unique_lock<acme::upgrade_mutex> _(mut_);
+        s.add(Clock::now() - t0);
+        ++rows_[page][row];
+        spin(50);
+    }
+};
+
+class intention_table
+{
+    typedef acme::intention_mode mode;
+
+    acme::intention_mutex table_;
+    acme::intention_mutex pages_[table_pages];
+    acme::intention_mutex locks_[table_pages][page_rows];
+    long                  rows_[table_pages][page_rows] = {};
+
+public:
+    void
+    scan(sample_set& s, Clock::time_point t0)
+    {
+        acme::intention_lock _(table_, mode::s);
+        s.add(Clock::now() - t0);
+        long sum = 0;
+        for (auto& page : rows_)
+            for (long v : page)
+                sum += v;
+        spin_sink = static_cast<unsigned>(sum);
+    }
+
+    void
+    scan_page(unsigned page, sample_set& s, Clock::time_point t0)
+    {
+        acme::intention_lock t(table_, acme::parent_mode(mode::s));
+        acme::intention_lock _(pages_[page], mode::s);
+        s.add(Clock::now() - t0);
+        long sum = 0;
+        for (long v : rows_[page])
+            sum += v;
+        spin_sink = static_cast<unsigned>(sum);
+    }
+
+    void
+    update(unsigned page, unsigned row, sample_set& s, Clock::time_point t0)
+    {
+        acme::intention_lock t(table_, acme::parent_mode(mode::x));
+        acme::intention_lock p(pages_[page], acme::parent_mode(mode::x));
+        acme::intention_lock _(locks_[page][row], mode::x);
+        s.add(Clock::now() - t0);
+        ++rows_[page][row];
+        spin(50);
+    }
+};
+
+void
+print_table(const char* name, result& r)
+{
+    const char* const ops[] = {"table scan", "page scan", "update"};
+    std::cout << std::setprecision(0);
+    bool first = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        if (r.wait[i].size() == 0)
+            continue;
+        if (first)
+            std::cout << std::left << std::setw(24) << name << std::right
+                      << std::setw(12) << r.ops / r.seconds;
+        else
+            std::cout << std::setw(36) << "";
+        first = false;
+        std::cout << std::setw(11) << ops[i]
+                  << std::setw(10) << r.wait[i].percentile(.5)
+                  << std::setw(10) << r.wait[i].percentile(.99)
+                  << std::setw(10) << r.wait[i].percentile(.999)
+                  << std::setw(12) << r.wait[i].percentile(1) << '\n';
+    }
+}
+
+void
+bench_intention()
+{
+    unsigned n = bench_threads();
+    const scan_mix mixes[] = {{1, 0}, {1, 100}, {20, 200}};
+    std::cout << std::fixed;
+    for (scan_mix p : mixes)
+    {
+        std::cout << '\n' << std::setprecision(1) << p.table / 10.
+                  << "% table scans, " << p.page / 10. << "% page scans, "
+                  << table_pages << " pages of " << page_rows << " rows, "
+                  << n << " threads\n";
+        print_header("acquisition latency");
+        result coarse = table_load<coarse_table>(n, p);
+        print_table("upgrade_mutex", coarse);
+        result fine = table_load<intention_table>(n, p);
+        print_table("intention_mutex", fine);
+    }
+}
+
+// help
+
+// A closed queue of independent tasks, each a computation of random length
+// that, run, is queued again.
+
+class task_queue
+{
+    std::mutex           mut_;
+    std::deque<unsigned> q_;
+
+public:
+    explicit task_queue(std::size_t n)
+    {
+        xorshift x(n);
+        for (std::size_t i = 0; i < n; ++i)
+            q_.push_back(1000 + (x() >> 22));
+    }
+
+    // Runs one task, adding the time to busy.  false if none is queued.
+    bool
+    run_one(double& busy, std::size_t& tasks)
+    {
+        unsigned n;
+        {
+            std::lock_guard<std::mutex> _(mut_);
+            if (q_.empty())
+                return false;
+            n = q_.front();
+            q_.pop_front();
+        }
+        auto t0 = Clock::now();
+        spin(n);
+        busy += std::chrono::duration<double>(Clock::now() - t0).count();
+        ++tasks;
+        std::lock_guard<std::mutex> _(mut_);
+        q_.push_back(n);
+        return true;
+    }
+};
+
+struct pool_result
+{
+    sample_set    update;         // waits for exclusive ownership
+    std::size_t   tasks = 0;
+    std::size_t   ops = 0;
+    double        busy = 0;       // seconds running tasks and updates
+    double        seconds = 0;
+
+    void
+    merge(const pool_result& x)
+    {
+        update.merge(x.update);
+        tasks += x.tasks;
+        ops += x.ops;
+        busy += x.busy;
+    }
+};
+
+// Threads 0 .. readers-1 scan a table under shared ownership; the others
+// are the pool's workers.  One operation in four of a worker updates the
+// table; the rest run a task.
+
+template <bool Help>
+pool_result
+pool_load(unsigned readers, unsigned workers)
+{
+    acme::upgrade_mutex m;
+    task_queue q(4 * workers);
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < readers + workers; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run<pool_result>(readers + workers, [&](unsigned i, pool_result& r)
+    {
+        std::uint32_t x = rng[i]();
+        if (i < readers)
+        {
+            m.lock_shared();
+            spin(5000);
+            m.unlock_shared();
+            spin(x >> 22);
+            return;
+        }
+        if (x % 4 != 0)
+        {
+            if (!q.run_one(r.busy, r.tasks))
+                std::this_thread::yield();
+            return;
+        }
+        auto t0 = Clock::now();
+        if (Help)
+            m.lock([&] {return q.run_one(r.busy, r.tasks);});
+        else
+            m.lock();
+        auto t1 = Clock::now();
+        r.update.add(t1 - t0);
+        spin(200);
+        m.unlock();
+        r.busy += std::chrono::duration<double>(Clock::now() - t1).count();
+    });
+}
+
+void
+print(const char* name, pool_result& r, unsigned workers)
+{
+    std::cout << std::left << std::setw(24) << name << std::right
+              << std::setprecision(0)
+              << std::setw(12) << r.tasks / r.seconds
+              << std::setw(12) << r.update.size() / r.seconds
+              << std::setw(8) << std::setprecision(1)
+              << 100 * r.busy / (workers * r.seconds) << std::setprecision(0)
+              << std::setw(10) << r.update.percentile(.5)
+              << std::setw(10) << r.update.percentile(.99)
+              << std::setw(12) << r.update.percentile(1) << '\n';
+}
+
+void
+bench_help()
+{
+    unsigned n = bench_threads();
+    const unsigned readers[] = {1, n / 2};
+    std::cout << std::fixed;
+    for (unsigned k : readers)
+    {
+        unsigned workers = n;
+        std::cout << '\n' << workers << " workers, " << k << " readers\n"
+                  << std::left << std::setw(24) << "" << std::right
+                  << std::setw(12) << "tasks/s" << std::setw(12) << "updates/s"
+                  << std::setw(8) << "busy %" << std::setw(10) << "p50"
+                  << std::setw(10) << "p99" << std::setw(12) << "max (ns)"
+                  << '\n';
+        pool_result sleeping = pool_load<false>(k, workers);
+        print("lock()", sleeping, workers);
+        pool_result helping = pool_load<true>(k, workers);
+        print("lock(help)", helping, workers);
+    }
+}
+
+// freeze
+
+// Every thread takes shared ownership of one of a group of mutexes, chosen
+// at random, for a short read.  Only one read in perf_every is timed, and
+// counted with --perf, so that the clock does not swamp the read path.
+
+template <class Mutex>
+result
+read_load(unsigned n, std::deque<Mutex>& m)
+{
+    std::vector<xorshift> rng;
+    for (unsigned i = 0; i < n; ++i)
+        rng.emplace_back(0x9E3779B9u * (i + 1));
+    return run(n, [&](unsigned i, result& r)
+    {
+        std::uint32_t x = rng[i]();
+        Mutex& mx = m[x % m.size()];
+        if ((x >> 8) % perf_every != 0)
+        {
+            mx.lock_shared();
+            spin(10);
+            mx.unlock_shared();
+            return;
+        }
+        acme::perf_values before;
+        if (perf_enabled)
+            before = this_thread_counters().read();
+        auto t0 = Clock::now();
+        mx.lock_shared();
+        r.wait[0].add(Clock::now() - t0);
+        spin(10);
+        mx.unlock_shared();
+        if (perf_enabled)
+            r.perf[0].add(before, this_thread_counters().read());
+    });
+}
+
+void
+bench_freeze()
+{
+    unsigned n = bench_threads();
+    const unsigned group = 16;
+    std::cout << n << " threads, " << group << " mutexes, membarrier "
+              << (acme::asymmetric_fence_expedited() ? "used" : "unavailable")
+              << '\n';
+    print_header("shared acquisition latency");
+    std::deque<acme::upgrade_mutex> plain(group);
+    result flat = read_load(n, plain);
+    print("upgrade_mutex", flat);
+    acme::lock_domain d;
+    std::deque<acme::domain_upgrade_mutex> members;
+    for (unsigned i = 0; i < group; ++i)
+        members.emplace_back(d);
+    result thawed = read_load(n, members);
+    print("domain, thawed", thawed);
+    d.freeze();
+    result frozen = read_load(n, members);
+    print("domain, frozen", frozen);
+    auto t0 = Clock::now();
+    d.unfreeze();
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                  Clock::now() - t0);
+    std::cout << std::setprecision(2) << "frozen reads "
+              << (frozen.ops / frozen.seconds) / (flat.ops / flat.seconds)
+              << "x upgrade_mutex's, "
+              << (frozen.ops / frozen.seconds) / (thawed.ops / thawed.seconds)
+              << "x thawed; unfreeze took " << us.count() << " us\n"
+              << std::setprecision(0);
+}
+
+struct benchmark
+{
+    const char* name;
+    void      (*run)();
+};
+
+const benchmark benchmarks[] =
+{
+    {"handoff",     bench_handoff},
+    {"cohort",      bench_cohort},
+    {"read_mostly", bench_read_mostly},
+    {"affine",      bench_affine},
+    {"deadline",    bench_deadline},
+    {"adaptive",    bench_adaptive},
+    {"conversions", bench_conversions},
+    {"average",     bench_average},
+    {"lru",         bench_lru},
+    {"intention",   bench_intention},
+    {"help",        bench_help},
+    {"freeze",      bench_freeze},
+};
+
+}  // unnamed
+
+int main(int argc, char* argv[])
+{
+    int first = 1;
+    if (argc > 1 && std::strcmp(argv[1], "--perf") == 0)
+    {
+        perf_enabled = true;
+        first = 2;
+        const acme::perf_counters& c = this_thread_counters();
+        std::cout << "perf counters" << (c.kernel() ? " (user and kernel):"
+                                                    : " (user only):");
+        for (unsigned e = 0; e < acme::perf_events; ++e)
+            if (c.available(acme::perf_event(e)))
+                std::cout << ' ' << c.name(acme::perf_event(e));
+        std::cout << '\n';
+    }
+    bool ran = false;
+    for (const benchmark& b : benchmarks)
+    {
+        bool wanted = argc <= first;
+        for (int i = first; i < argc; ++i)
+            if (std::strcmp(argv[i], b.name) == 0)
+                wanted = true;
+        if (!wanted)
+            continue;
+        if (ran)
+            std::cout << '\n';
+        std::cout << "== " << b.name << " ==\n";
+        b.run();
+        ran = true;
+    }
+    if (!ran)
+    {
+        std::cerr << "usage: " << argv[0] << " [--perf] [name ...]\nname:";
+        for (const benchmark& b : benchmarks)
+            std::cerr << ' ' << b.name;
+        std::cerr << '\n';
+        return 2;
+    }
+}
@@ -0,0 +1,231 @@
+//------------------------- biased_upgrade_mutex.cpp ---------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "biased_upgrade_mutex.h"
+#include <cerrno>
+
+namespace acme
+{
+
+biased_upgrade_mutex::biased_upgrade_mutex()
+    : owner_(unowned),
+      state_(0),
+      revokers_(0),
+      revocations_(0),
+      first_owner_(unowned),
+      streak_(0)
+{
+    // Settle the choice of fences before any thread relies on it.
+    asymmetric_fence_expedited();
+}
+
+// The bias
+
+bool
+biased_upgrade_mutex::claim_bias() noexcept
+{
+    const std::uintptr_t me = detail::this_thread_bias_tag();
+    std::uintptr_t o = unowned;
+    if (!owner_.compare_exchange_strong(o, me, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        return false;
+    first_owner_.store(me, std::memory_order_relaxed);
+    return true;
+}
+
+// The revoker checks state_ holding rev_mut_, so notifying under it cannot be
+// missed.
+
+void
+biased_upgrade_mutex::wake_revoker()
+{
+    std::lock_guard<mutex_type> _(rev_mut_);
+    drained_.notify_all();
+}
+
+void
+biased_upgrade_mutex::release(unsigned x)
+{
+    switch (x)
+    {
+    case exclusive_entered:
+        m_.unlock();
+        break;
+    case upgradable_entered:
+        m_.unlock_upgrade();
+        break;
+    default:
+        m_.unlock_shared();
+        break;
+    }
+}
+
+// Called holding m_ exclusively, with the bias revoked.  No one else holds
+// m_, so the first owner's ownership can move into the bias; those waiting
+// for m_ will find the bias and revoke it again.  Not while a revoker waits
+// in revoke():  the rebias would erase its mark.
+
+void
+biased_upgrade_mutex::note_writer()
+{
+    const std::uintptr_t me = detail::this_thread_bias_tag();
+    if (first_owner_.load(std::memory_order_relaxed) != me)
+    {
+        streak_ = 0;
+        return;
+    }
+    if (++streak_ < rebias_after)
+        return;
+    {
+        std::lock_guard<mutex_type> _(rev_mut_);
+        if (revokers_ != 0)
+            return;
+        state_.store(exclusive_entered, std::memory_order_relaxed);
+        owner_.store(me, std::memory_order_release);
+    }
+    streak_ = 0;
+    m_.unlock();
+}
+
+// Shared <-> Exclusive
+
+bool
+biased_upgrade_mutex::try_unlock_shared_and_lock()
+{
+    if (!holds_bias())
+        return m_.try_unlock_shared_and_lock();
+    if (state_.load(std::memory_order_relaxed) != one_reader)
+        return false;
+    convert_biased(one_reader, exclusive_entered);
+    return true;
+}
+
+void
+biased_upgrade_mutex::unlock_and_lock_shared()
+{
+    if (holds_bias())
+        convert_biased(exclusive_entered, one_reader);
+    else
+        m_.unlock_and_lock_shared();
+}
+
+// Shared <-> Upgrade
+
+bool
+biased_upgrade_mutex::try_unlock_shared_and_lock_upgrade()
+{
+    if (!holds_bias())
+        return m_.try_unlock_shared_and_lock_upgrade();
+    if (state_.load(std::memory_order_relaxed) & upgradable_entered)
+        return false;
+    convert_biased(one_reader, upgradable_entered);
+    return true;
+}
+
+void
+biased_upgrade_mutex::unlock_upgrade_and_lock_shared()
+{
+    if (holds_bias())
+        convert_biased(upgradable_entered, one_reader);
+    else
+        m_.unlock_upgrade_and_lock_shared();
+}
+
+// Upgrade <-> Exclusive
+
+void
+biased_upgrade_mutex::unlock_upgrade_and_lock()
+{
+    if (holds_bias())
+        convert_biased(upgradable_entered, exclusive_entered);
+    else
+        m_.unlock_upgrade_and_lock();
+}
+
+void
+biased_upgrade_mutex::unlock_and_lock_upgrade()
+{
+    if (holds_bias())
+        convert_biased(exclusive_entered, upgradable_entered);
+    else
+        m_.unlock_and_lock_upgrade();
+}
+
+bool
+biased_upgrade_mutex::try_unlock_upgrade_and_lock()
+{
+    if (!holds_bias())
+        return m_.try_unlock_upgrade_and_lock();
+    if (state_.load(std::memory_order_relaxed) != upgradable_entered)
+        return false;
+    convert_biased(upgradable_entered, exclusive_entered);
+    return true;
+}
+
+// Ownership transfer
+
+unsigned
+biased_upgrade_mutex::mode_bits(lock_mode m) noexcept
+{
+    switch (m)
+    {
+    case lock_mode::shared:
+        return one_reader;
+    case lock_mode::upgrade:
+        return upgradable_entered;
+    case lock_mode::exclusive:
+        break;
+    }
+    return exclusive_entered;
+}
+
+// The caller takes m_ in the same mode beside its biased hold:  only
+// threads on their way through acquire_slow can hold m_ while the bias is
+// held, and they give it back.  Then it drops the biased hold and revokes
+// the bias itself, completing any revocation pending.
+
+biased_upgrade_mutex::detached_ownership
+biased_upgrade_mutex::detach(lock_mode m)
+{
+    if (!holds_bias())
+        return detached_ownership();
+    const unsigned x = mode_bits(m);
+    if (state_.load(std::memory_order_relaxed) != x)
+        throw std::system_error(std::error_code(EBUSY, std::system_category()),
+                                "biased_upgrade_mutex: other biased holds");
+    switch (m)
+    {
+    case lock_mode::shared:
+        m_.lock_shared();
+        break;
+    case lock_mode::upgrade:
+        m_.lock_upgrade();
+        break;
+    case lock_mode::exclusive:
+        m_.lock();
+        break;
+    }
+    std::lock_guard<mutex_type> _(rev_mut_);
+    state_.store(0, std::memory_order_release);
+    owner_.store(revoked, std::memory_order_release);
+    revocations_.store(revocations_.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+    drained_.notify_all();
+    return detached_ownership();
+}
+
+void
+biased_upgrade_mutex::unlock_detached(lock_mode m, const detached_ownership&)
+{
+    release(mode_bits(m));
+}
+
+}  // acme
@@ -0,0 +1,536 @@
+//-------------------------- biased_upgrade_mutex.h ----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_BIASED
+#define UPGRADE_MUTEX_BIASED
+
+/*
+    <biased_upgrade_mutex.h> synopsis
+
+namespace acme
+{
+
+class biased_upgrade_mutex
+{
+public:
+    static constexpr unsigned rebias_after = 256;
+
+    biased_upgrade_mutex();
+    ~biased_upgrade_mutex() = default;
+
+    biased_upgrade_mutex(const biased_upgrade_mutex&) = delete;
+    biased_upgrade_mutex& operator=(const biased_upgrade_mutex&) = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions:  as
+    // basic_upgrade_mutex, except there are no cancellable overloads.
+
+    // Ownership transfer (see ownership_token.h).  A bias owner can detach
+    // only when the hold is all it has through the bias; otherwise
+    // system_error(EBUSY).
+
+    struct detached_ownership {};
+
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode m, const detached_ownership&) noexcept;
+    void unlock_detached(lock_mode m, const detached_ownership&);
+
+    bool biased() const noexcept;              // a thread holds the bias
+    unsigned long revocations() const noexcept;
+};
+
+}  // acme
+*/
+
+#include "asymmetric_fence.h"
+#include "upgrade_mutex.h"
+
+namespace acme
+{
+
+namespace detail
+{
+
+// Identifies the calling thread to a biased_upgrade_mutex.  Its address is
+// even, leaving the low bit of owner_ free.
+
+inline thread_local int bias_tag;
+
+inline
+std::uintptr_t
+this_thread_bias_tag() noexcept
+{
+    return reinterpret_cast<std::uintptr_t>(&bias_tag);
+}
+
+}  // detail
+
+// An upgrade mutex biased towards one thread.
+//
+// The first thread to lock it takes the bias.  While it holds the bias its
+// acquisitions, releases and conversions in every mode are plain loads and
+// stores of the mutex's state_ word, ordered by a light asymmetric fence; no
+// locked instruction is needed.
+//
+// Any other thread revokes the bias before it locks:  it marks owner_,
+// issues the heavy asymmetric fence, which makes the bias owner either see
+// the mark or have its state_ seen, and waits until the owner holds nothing
+// biased.  From then on every thread, the former owner included, goes
+// through an ordinary upgrade_mutex.  Once the first owner takes exclusive
+// ownership rebias_after times running, with no other thread doing so in
+// between, it takes the bias back.
+//
+// Only the first owner ever holds the bias, so state_ has one writer even
+// when that thread is slow to notice a revocation.  A thread that exits
+// holding the bias hands it to whichever thread next reuses its
+// thread-local storage.
+//
+// A revocation costs a membarrier system call and a wait for the owner's
+// critical section, so the bias only pays when other threads are rare.
+
+class biased_upgrade_mutex
+{
+public:
+    static constexpr unsigned rebias_after = 256;
+
+private:
+    typedef std::mutex                   mutex_type;
+    typedef condvar_wait::gate_type      gate_type;
+    typedef std::unique_lock<mutex_type> lock_type;
+
+    // owner_:  0 before the first lock, the owner's tag while biased, the tag
+    // with the low bit set while a revocation is pending, then revoked.
+    static constexpr std::uintptr_t unowned = 0;
+    static constexpr std::uintptr_t revoked = 1;
+
+    // state_:  what the bias owner holds through the bias.
+    static constexpr unsigned exclusive_entered = 1U << 31;
+    static constexpr unsigned upgradable_entered = 1U << 30;
+    static constexpr unsigned one_reader = 1;
+
+    alignas(64) std::atomic<std::uintptr_t> owner_;
+    std::atomic<unsigned>                   state_;
+
+    alignas(64) mutex_type                  rev_mut_;
+    gate_type                               drained_;    // revoker waits
+    unsigned                                revokers_;   // in revoke()
+    std::atomic<unsigned long>              revocations_;
+
+    upgrade_mutex                           m_;
+    std::atomic<std::uintptr_t>             first_owner_;
+    unsigned                                streak_;      // guarded by m_
+
+public:
+    biased_upgrade_mutex();
+    ~biased_upgrade_mutex() = default;
+
+    biased_upgrade_mutex(const biased_upgrade_mutex&) = delete;
+    biased_upgrade_mutex& operator=(const biased_upgrade_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void
+    lock()
+    {
+        if (!enter_biased(exclusive_entered))
+            acquire_slow(exclusive_entered,
+                         [this] {m_.lock(); return true;},
+                         [this] {return revoke(detail::untimed_wait());});
+    }
+
+    bool
+    try_lock()
+    {
+        return enter_biased(exclusive_entered) ||
+               acquire_slow(exclusive_entered,
+                            [this] {return m_.try_lock();},
+                            [this] {return revoke(detail::no_wait());});
+    }
+
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return enter_biased(exclusive_entered) ||
+                   acquire_slow(exclusive_entered,
+                       [&] {return m_.try_lock_until(abs_time);},
+                       [&] {return revoke(detail::wait_until(abs_time));});
+        }
+
+    void
+    unlock()
+    {
+        if (!leave_biased(exclusive_entered))
+            m_.unlock();
+    }
+
+    // Shared ownership
+
+    void
+    lock_shared()
+    {
+        if (!enter_biased(one_reader))
+            acquire_slow(one_reader,
+                         [this] {m_.lock_shared(); return true;},
+                         [this] {return revoke(detail::untimed_wait());});
+    }
+
+    bool
+    try_lock_shared()
+    {
+        return enter_biased(one_reader) ||
+               acquire_slow(one_reader,
+                            [this] {return m_.try_lock_shared();},
+                            [this] {return revoke(detail::no_wait());});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return enter_biased(one_reader) ||
+                   acquire_slow(one_reader,
+                       [&] {return m_.try_lock_shared_until(abs_time);},
+                       [&] {return revoke(detail::wait_until(abs_time));});
+        }
+
+    void
+    unlock_shared()
+    {
+        if (!leave_biased(one_reader))
+            m_.unlock_shared();
+    }
+
+    // Upgrade ownership
+
+    void
+    lock_upgrade()
+    {
+        if (!enter_biased(upgradable_entered))
+            acquire_slow(upgradable_entered,
+                         [this] {m_.lock_upgrade(); return true;},
+                         [this] {return revoke(detail::untimed_wait());});
+    }
+
+    bool
+    try_lock_upgrade()
+    {
+        return enter_biased(upgradable_entered) ||
+               acquire_slow(upgradable_entered,
+                            [this] {return m_.try_lock_upgrade();},
+                            [this] {return revoke(detail::no_wait());});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(std::chrono::steady_clock::now() +
+                                          rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return enter_biased(upgradable_entered) ||
+                   acquire_slow(upgradable_entered,
+                       [&] {return m_.try_lock_upgrade_until(abs_time);},
+                       [&] {return revoke(detail::wait_until(abs_time));});
+        }
+
+    void
+    unlock_upgrade()
+    {
+        if (!leave_biased(upgradable_entered))
+            m_.unlock_upgrade();
+    }
+
+    // Shared <-> Exclusive
+
+    // Within the bias only the owner's own holds can stand in the way, and
+    // waiting for them would never end, so the timed conversions of a
+    // biased hold answer at once.
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (holds_bias())
+                return try_unlock_shared_and_lock();
+            return m_.try_unlock_shared_and_lock_until(abs_time);
+        }
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (holds_bias())
+                return try_unlock_shared_and_lock_upgrade();
+            return m_.try_unlock_shared_and_lock_upgrade_until(abs_time);
+        }
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    void unlock_and_lock_upgrade();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (holds_bias())
+                return try_unlock_upgrade_and_lock();
+            return m_.try_unlock_upgrade_and_lock_until(abs_time);
+        }
+
+    // Ownership transfer
+
+    // A biased hold cannot leave the owner's thread, so detaching one moves
+    // it into m_ and revokes the bias.  Ownership of m_ moves freely.
+
+    struct detached_ownership {};
+
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode, const detached_ownership&) noexcept {}
+    void unlock_detached(lock_mode m, const detached_ownership&);
+
+    // Observers
+
+    bool
+    biased() const noexcept
+    {
+        std::uintptr_t o = owner_.load(std::memory_order_relaxed);
+        return o != unowned && o != revoked;
+    }
+
+    unsigned long
+    revocations() const noexcept
+    {
+        return revocations_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // The bias
+
+    // Records x in state_ if the calling thread holds the bias and its own
+    // biased holds allow it.  false:  the caller must take the slow path.  A
+    // pending revocation turns the owner away unless it already holds
+    // something biased, since the revoker must wait for that anyway.
+    bool
+    enter_biased(unsigned x) noexcept
+    {
+        const std::uintptr_t me = detail::this_thread_bias_tag();
+        if ((owner_.load(std::memory_order_relaxed) & ~revoked) != me)
+            return false;
+        unsigned s = state_.load(std::memory_order_relaxed);
+        if (!compatible(s, x))
+            return false;
+        state_.store(s + x, std::memory_order_relaxed);
+        asymmetric_light_fence();
+        if (owner_.load(std::memory_order_acquire) == me || s != 0)
+            return true;
+        state_.store(s, std::memory_order_release);
+        wake_revoker();
+        return false;
+    }
+
+    // Releases x if the calling thread holds it through the bias.  While the
+    // owner holds anything biased, owner_ stays its tag, perhaps marked.
+    bool
+    leave_biased(unsigned x) noexcept
+    {
+        const std::uintptr_t me = detail::this_thread_bias_tag();
+        if ((owner_.load(std::memory_order_relaxed) & ~revoked) != me)
+            return false;
+        state_.store(state_.load(std::memory_order_relaxed) - x,
+                     std::memory_order_release);
+        asymmetric_light_fence();
+        if (owner_.load(std::memory_order_relaxed) != me)
+            wake_revoker();
+        return true;
+    }
+
+    static
+    bool
+    compatible(unsigned s, unsigned x) noexcept
+    {
+        if (s & exclusive_entered)
+            return false;
+        if (x == exclusive_entered)
+            return s == 0;
+        if (x == upgradable_entered)
+            return !(s & upgradable_entered);
+        return true;
+    }
+
+    bool
+    holds_bias() const noexcept
+    {
+        return (owner_.load(std::memory_order_relaxed) & ~revoked) ==
+               detail::this_thread_bias_tag();
+    }
+
+    void
+    convert_biased(unsigned from, unsigned to) noexcept
+    {
+        state_.store(state_.load(std::memory_order_relaxed) - from + to,
+                     std::memory_order_relaxed);
+    }
+
+    template <class Acquire, class Revoke>
+        bool acquire_slow(unsigned x, Acquire acquire, Revoke revoke_bias);
+    template <class Waiter>
+        bool revoke(const Waiter& w);
+    bool claim_bias() noexcept;
+    void wake_revoker();
+    void release(unsigned x);
+    void note_writer();
+    static unsigned mode_bits(lock_mode m) noexcept;
+};
+
+// The bias
+
+// Takes x through the bias if the mutex is still unowned; otherwise revokes
+// the bias and takes x from m_.  A rebias can slip in while the caller waits
+// for m_, so ownership of m_ only counts once the bias is seen revoked.  A
+// bias owner whose own biased holds refuse x would wait for itself, and
+// fails instead.
+
+template <class Acquire, class Revoke>
+bool
+biased_upgrade_mutex::acquire_slow(unsigned x, Acquire acquire,
+                                   Revoke revoke_bias)
+{
+    if (holds_bias() && state_.load(std::memory_order_relaxed) != 0)
+        return false;
+    for (;;)
+    {
+        std::uintptr_t o = owner_.load(std::memory_order_acquire);
+        if (o == unowned)
+        {
+            if (claim_bias() && enter_biased(x))
+                return true;
+            continue;
+        }
+        if (o == detail::this_thread_bias_tag() && enter_biased(x))
+            return true;
+        if (o != revoked)
+        {
+            if (!revoke_bias())
+                return false;
+            continue;
+        }
+        if (!acquire())
+            return false;
+        if (owner_.load(std::memory_order_acquire) == revoked)
+        {
+            if (x == exclusive_entered)
+                note_writer();
+            return true;
+        }
+        release(x);
+    }
+}
+
+// Marks owner_, fences, and waits for the owner's biased holds to drain.
+// Giving up leaves the mark, which keeps the owner off the bias until the
+// next revoker finishes the job.  While any revoker is here note_writer
+// does not rebias; should owner_ nonetheless be found unmarked after a
+// wait, the mark and the fence are made again.
+
+template <class Waiter>
+bool
+biased_upgrade_mutex::revoke(const Waiter& w)
+{
+    lock_type lk(rev_mut_);
+    ++revokers_;
+    for (;;)
+    {
+        std::uintptr_t o = owner_.load(std::memory_order_relaxed);
+        if (o == unowned || o == revoked)
+            break;                          // or the owner detached its hold
+        const std::uintptr_t marked = o | revoked;
+        if (o != marked)
+        {
+            owner_.store(marked, std::memory_order_relaxed);
+            asymmetric_heavy_fence();
+        }
+        if (!w(drained_, lk, [this, marked]
+               {
+                   return state_.load(std::memory_order_acquire) == 0 ||
+                          owner_.load(std::memory_order_relaxed) != marked;
+               }))
+        {
+            --revokers_;
+            return false;
+        }
+        if (owner_.load(std::memory_order_relaxed) != marked)
+            continue;
+        owner_.store(revoked, std::memory_order_release);
+        revocations_.store(revocations_.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+        break;
+    }
+    --revokers_;
+    return true;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_BIASED
@@ -0,0 +1,481 @@
+//------------------------ cohort_upgrade_mutex.cpp ----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "cohort_upgrade_mutex.h"
+#include <cerrno>
+#include <fstream>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace acme
+{
+
+namespace
+{
+
+// Parses a sysfs list such as "0-3,8-11" into its members.
+
+std::vector<unsigned>
+parse_list(const std::string& s)
+{
+    std::vector<unsigned> v;
+    std::size_t i = 0;
+    while (i < s.size())
+    {
+        std::size_t end;
+        unsigned first;
+        try
+        {
+            first = std::stoul(s.substr(i), &end);
+        }
+        catch (const std::exception&)
+        {
+            break;
+        }
+        i += end;
+        unsigned last = first;
+        if (i < s.size() && s[i] == '-')
+        {
+            ++i;
+            try
+            {
+                last = std::stoul(s.substr(i), &end);
+            }
+            catch (const std::exception&)
+            {
+                break;
+            }
+            i += end;
+        }
+        for (unsigned x = first; x <= last; ++x)
+            v.push_back(x);
+        if (i < s.size() && s[i] == ',')
+            ++i;
+        else
+            break;
+    }
+    return v;
+}
+
+std::string
+read_line(const std::string& path)
+{
+    std::ifstream f(path);
+    std::string s;
+    std::getline(f, s);
+    return s;
+}
+
+}  // unnamed
+
+// numa_topology
+
+numa_topology::numa_topology()
+    : nodes_(1),
+      current_(nullptr)
+{
+#ifdef __linux__
+    const std::string dir = "/sys/devices/system/node/";
+    std::vector<unsigned> online = parse_list(read_line(dir + "online"));
+    for (unsigned node : online)
+    {
+        // Node ids are small; a larger one means a parse of garbage.
+        if (node >= 1024)
+            break;
+        for (unsigned cpu : parse_list(read_line(dir + "node" +
+                                                 std::to_string(node) +
+                                                 "/cpulist")))
+        {
+            if (cpu >= 65536)
+                break;
+            if (cpu >= node_of_cpu_.size())
+                node_of_cpu_.resize(cpu + 1, 0);
+            node_of_cpu_[cpu] = static_cast<unsigned short>(node);
+            if (node >= nodes_)
+                nodes_ = node + 1;
+        }
+    }
+#endif
+}
+
+const numa_topology&
+numa_topology::get()
+{
+    static const numa_topology topology;
+    return topology;
+}
+
+unsigned
+numa_topology::current_node() const noexcept
+{
+    if (current_ != nullptr)
+        return current_();
+    if (nodes_ == 1)
+        return 0;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && static_cast<unsigned>(cpu) < node_of_cpu_.size())
+        return node_of_cpu_[cpu];
+#endif
+    return 0;
+}
+
+// cohort_upgrade_mutex
+
+cohort_upgrade_mutex::cohort_upgrade_mutex(unsigned max_batch)
+    : cohort_upgrade_mutex(numa_topology::get(), max_batch)
+{
+}
+
+cohort_upgrade_mutex::cohort_upgrade_mutex(const numa_topology& topo,
+                                           unsigned max_batch)
+    : topo_(topo),
+      max_batch_(max_batch),
+      readers_(new reader_count[topo_.nodes()]),
+      cohorts_(new cohort[topo_.nodes()]),
+      owner_node_(0),
+      gowner_(-1),
+      gwanting_(0),
+      gwant_(new bool[topo_.nodes()]()),
+      write_entered_(false)
+{
+}
+
+// Cohort lock
+
+bool
+cohort_upgrade_mutex::try_lock_cohort()
+{
+    unsigned n = topo_.current_node();
+    cohort& c = cohorts_[n];
+    {
+        std::lock_guard<mutex_type> _(c.mut);
+        if (c.locked)
+            return false;
+        c.locked = true;
+        if (c.owns_global)
+        {
+            owner_node_ = n;
+            return true;
+        }
+    }
+    bool global;
+    {
+        std::lock_guard<mutex_type> _(gmut_);
+        global = gowner_ < 0;
+        if (global)
+            gowner_ = static_cast<int>(n);
+    }
+    if (!global)
+    {
+        release_local(c);
+        return false;
+    }
+    c.owns_global = true;
+    owner_node_ = n;
+    return true;
+}
+
+// Keep the global lock within the node while it has waiters, up to
+// max_batch_ times in a row.
+
+void
+cohort_upgrade_mutex::unlock_cohort() noexcept
+{
+    unsigned n = owner_node_;
+    cohort& c = cohorts_[n];
+    std::lock_guard<mutex_type> _(c.mut);
+    if (c.waiting != 0 && c.batch < max_batch_)
+        ++c.batch;
+    else
+    {
+        c.batch = 0;
+        c.owns_global = false;
+        unlock_global(n);
+    }
+    c.locked = false;
+    if (c.waiting != 0)
+        c.gate.notify_one();
+}
+
+// Give up the local lock without having taken the global one.
+
+void
+cohort_upgrade_mutex::release_local(cohort& c) noexcept
+{
+    std::lock_guard<mutex_type> _(c.mut);
+    c.batch = 0;
+    c.locked = false;
+    if (c.waiting != 0)
+        c.gate.notify_one();
+}
+
+// The global lock goes to the next node, round robin, that wants it.
+
+void
+cohort_upgrade_mutex::unlock_global(unsigned node) noexcept
+{
+    std::lock_guard<mutex_type> _(gmut_);
+    gowner_ = -1;
+    if (gwanting_ == 0)
+        return;
+    unsigned n = topo_.nodes();
+    for (unsigned i = 1; i <= n; ++i)
+    {
+        unsigned next = (node + i) % n;
+        if (gwant_[next])
+        {
+            gwant_[next] = false;
+            --gwanting_;
+            gowner_ = static_cast<int>(next);
+            ggate_.notify_all();
+            return;
+        }
+    }
+}
+
+// Readers
+
+void
+cohort_upgrade_mutex::add_reader() noexcept
+{
+    detail::cohort_reader& r = detail::this_cohort_reader;
+    if (r.held++ == 0)
+        r.node = topo_.current_node();
+    readers_[r.node].n.fetch_add(1);
+}
+
+void
+cohort_upgrade_mutex::remove_reader() noexcept
+{
+    detail::cohort_reader& r = detail::this_cohort_reader;
+    readers_[r.node].n.fetch_sub(1);
+    --r.held;
+}
+
+// Each node's count only ever covers readers that took it there, so a count
+// seen as zero is one no reader present before write_entered_ was set holds.
+
+bool
+cohort_upgrade_mutex::readers_drained() const noexcept
+{
+    for (unsigned i = 0; i < topo_.nodes(); ++i)
+        if (readers_[i].n.load() != 0)
+            return false;
+    return true;
+}
+
+void
+cohort_upgrade_mutex::wake_writer() noexcept
+{
+    std::lock_guard<mutex_type> _(wmut_);
+    drained_.notify_one();
+}
+
+void
+cohort_upgrade_mutex::reopen() noexcept
+{
+    write_entered_.store(false);
+    std::lock_guard<mutex_type> _(wmut_);
+    reopened_.notify_all();
+}
+
+// Exclusive ownership
+
+void
+cohort_upgrade_mutex::lock()
+{
+    exclusive(detail::untimed_wait());
+}
+
+bool
+cohort_upgrade_mutex::try_lock()
+{
+    if (!try_lock_cohort())
+        return false;
+    if (try_unlock_upgrade_and_lock())
+        return true;
+    unlock_cohort();
+    return false;
+}
+
+void
+cohort_upgrade_mutex::unlock()
+{
+    reopen();
+    unlock_cohort();
+}
+
+// Shared ownership
+
+void
+cohort_upgrade_mutex::lock_shared()
+{
+    shared(detail::untimed_wait());
+}
+
+bool
+cohort_upgrade_mutex::try_lock_shared()
+{
+    add_reader();
+    if (!write_entered_.load())
+        return true;
+    remove_reader();
+    wake_writer();
+    return false;
+}
+
+void
+cohort_upgrade_mutex::unlock_shared()
+{
+    remove_reader();
+    if (write_entered_.load())
+        wake_writer();
+}
+
+// Upgrade ownership
+
+void
+cohort_upgrade_mutex::lock_upgrade()
+{
+    lock_cohort(detail::untimed_wait());
+}
+
+bool
+cohort_upgrade_mutex::try_lock_upgrade()
+{
+    return try_lock_cohort();
+}
+
+void
+cohort_upgrade_mutex::unlock_upgrade()
+{
+    unlock_cohort();
+}
+
+// Shared <-> Exclusive
+
+bool
+cohort_upgrade_mutex::try_unlock_shared_and_lock()
+{
+    if (!try_lock_cohort())
+        return false;
+    remove_reader();
+    if (try_unlock_upgrade_and_lock())
+        return true;
+    unlock_upgrade_and_lock_shared();
+    return false;
+}
+
+void
+cohort_upgrade_mutex::unlock_and_lock_shared()
+{
+    add_reader();
+    reopen();
+    unlock_cohort();
+}
+
+// Shared <-> Upgrade
+
+bool
+cohort_upgrade_mutex::try_unlock_shared_and_lock_upgrade()
+{
+    if (!try_lock_cohort())
+        return false;
+    remove_reader();
+    return true;
+}
+
+void
+cohort_upgrade_mutex::unlock_upgrade_and_lock_shared()
+{
+    add_reader();
+    unlock_cohort();
+}
+
+// Upgrade <-> Exclusive
+
+void
+cohort_upgrade_mutex::unlock_upgrade_and_lock()
+{
+    upgrade_to_exclusive(detail::untimed_wait());
+}
+
+bool
+cohort_upgrade_mutex::try_unlock_upgrade_and_lock()
+{
+    write_entered_.store(true);
+    if (readers_drained())
+        return true;
+    reopen();
+    return false;
+}
+
+void
+cohort_upgrade_mutex::unlock_and_lock_upgrade()
+{
+    reopen();
+}
+
+// Ownership transfer
+
+cohort_upgrade_mutex::detached_ownership
+cohort_upgrade_mutex::detach(lock_mode m) noexcept
+{
+    detached_ownership d = {0};
+    if (m == lock_mode::shared)
+    {
+        detail::cohort_reader& r = detail::this_cohort_reader;
+        d.node = r.node;
+        --r.held;
+    }
+    return d;
+}
+
+// The thread's reads all give back their count on r.node.
+
+void
+cohort_upgrade_mutex::attach(lock_mode m, const detached_ownership& d)
+{
+    if (m != lock_mode::shared)
+        return;
+    detail::cohort_reader& r = detail::this_cohort_reader;
+    if (r.held != 0 && r.node != d.node)
+        throw std::system_error(std::error_code(EXDEV, std::system_category()),
+                                "cohort_upgrade_mutex: reads on another node");
+    r.node = d.node;
+    ++r.held;
+}
+
+void
+cohort_upgrade_mutex::unlock_detached(lock_mode m,
+                                      const detached_ownership& d)
+{
+    switch (m)
+    {
+    case lock_mode::shared:
+        readers_[d.node].n.fetch_sub(1);
+        if (write_entered_.load())
+            wake_writer();
+        break;
+    case lock_mode::upgrade:
+        unlock_upgrade();
+        break;
+    case lock_mode::exclusive:
+        unlock();
+        break;
+    }
+}
+
+}  // acme
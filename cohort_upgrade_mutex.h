@@ -0,0 +1,471 @@
+//------------------------- cohort_upgrade_mutex.h -----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_COHORT
+#define UPGRADE_MUTEX_COHORT
+
+/*
+    <cohort_upgrade_mutex.h> synopsis
+
+namespace acme
+{
+
+// The NUMA nodes of this host, read once from /sys/devices/system/node.  A
+// host without that information is one node.
+
+class numa_topology
+{
+public:
+    static const numa_topology& get();
+
+    // nodes nodes, the calling thread being on node current(), which must
+    // be less than nodes:  to run the paths between nodes on any host.
+    numa_topology(unsigned nodes, unsigned (*current)() noexcept);
+
+    unsigned nodes() const noexcept;
+    unsigned current_node() const noexcept;   // of the calling thread's cpu
+};
+
+class cohort_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_max_batch = 64;
+
+    explicit cohort_upgrade_mutex(unsigned max_batch = default_max_batch);
+    explicit cohort_upgrade_mutex(const numa_topology& topo,   // outlives it
+                                  unsigned max_batch = default_max_batch);
+    ~cohort_upgrade_mutex();
+
+    cohort_upgrade_mutex(const cohort_upgrade_mutex&) = delete;
+    cohort_upgrade_mutex& operator=(const cohort_upgrade_mutex&) = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions:  as
+    // basic_upgrade_mutex, except there are no cancellable overloads.
+
+    // Ownership transfer (see ownership_token.h).  A thread already reading
+    // some cohort_upgrade_mutex on another node cannot attach shared
+    // ownership taken on this node:  system_error(EXDEV).
+
+    struct detached_ownership {unsigned node;};
+
+    detached_ownership detach(lock_mode m) noexcept;
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    unsigned nodes() const noexcept;
+    unsigned max_batch() const noexcept;
+};
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <memory>
+#include <vector>
+
+namespace acme
+{
+
+class numa_topology
+{
+    std::vector<unsigned short> node_of_cpu_;
+    unsigned                    nodes_;
+    unsigned                    (*current_)() noexcept;
+
+    numa_topology();
+
+public:
+    static const numa_topology& get();
+
+    numa_topology(unsigned nodes, unsigned (*current)() noexcept)
+        : nodes_(nodes != 0 ? nodes : 1), current_(current) {}
+
+    unsigned nodes() const noexcept {return nodes_;}
+    unsigned current_node() const noexcept;
+};
+
+namespace detail
+{
+
+// The node whose reader count the calling thread uses.  It is chosen afresh
+// only when the thread holds no shared ownership of any cohort_upgrade_mutex,
+// so that a thread which migrates across nodes still gives back its count on
+// the node it took it on.
+
+struct cohort_reader
+{
+    unsigned node;
+    unsigned held;
+};
+
+inline thread_local cohort_reader this_cohort_reader = {0, 0};
+
+}  // detail
+
+// A cohort lock (Dice, Marathe, Shavit) for upgrade and exclusive ownership,
+// with readers counted per NUMA node.
+//
+// Upgrade and exclusive owners hold the cohort lock:  a lock per node, plus a
+// global lock owned by one node at a time.  An owner releasing with waiters
+// on its own node passes them the local lock and keeps the global one, up to
+// max_batch times in a row; then the global lock goes to the next node with a
+// waiter, round robin.  Ownership thus stays within a node's caches for a
+// while instead of crossing the interconnect on every handoff.
+//
+// Readers increment a counter on their own node's cache line and enter unless
+// write_entered_ is set.  An exclusive owner sets write_entered_ and waits for
+// every node's count to reach zero.  Readers that find write_entered_ set give
+// back their count and wait for it to clear, so a writer is never overtaken
+// by new readers.  The upgrade owner holds no reader count.
+//
+// On a single node host this degenerates to one local lock, one reader count
+// and an uncontended global lock.
+
+class cohort_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_max_batch = 64;
+
+private:
+    typedef std::mutex                   mutex_type;
+    typedef condvar_wait::gate_type      gate_type;
+    typedef std::unique_lock<mutex_type> lock_type;
+
+    struct alignas(64) reader_count
+    {
+        std::atomic<unsigned> n{0};
+    };
+
+    struct alignas(64) cohort
+    {
+        mutex_type mut;
+        gate_type  gate;
+        unsigned   waiting = 0;
+        unsigned   batch = 0;         // local handoffs since taking global
+        bool       locked = false;
+        bool       owns_global = false;
+    };
+
+    const numa_topology&            topo_;
+    const unsigned                  max_batch_;
+    std::unique_ptr<reader_count[]> readers_;
+    std::unique_ptr<cohort[]>       cohorts_;
+    unsigned                        owner_node_;  // of the cohort lock owner
+
+    // The global lock
+    alignas(64) mutex_type          gmut_;
+    gate_type                       ggate_;
+    int                             gowner_;      // node, or -1
+    unsigned                        gwanting_;
+    std::unique_ptr<bool[]>         gwant_;
+
+    // Writer vs readers
+    alignas(64) std::atomic<bool>   write_entered_;
+    mutex_type                      wmut_;
+    gate_type                       drained_;     // a writer waits for readers
+    gate_type                       reopened_;    // readers wait for the writer
+
+public:
+    explicit cohort_upgrade_mutex(unsigned max_batch = default_max_batch);
+    explicit cohort_upgrade_mutex(const numa_topology& topo,
+                                  unsigned max_batch = default_max_batch);
+    ~cohort_upgrade_mutex() = default;
+
+    cohort_upgrade_mutex(const cohort_upgrade_mutex&) = delete;
+    cohort_upgrade_mutex& operator=(const cohort_upgrade_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return exclusive(detail::wait_until(abs_time));
+        }
+    void unlock();
+
+    // Shared ownership
+
+    void lock_shared();
+    bool try_lock_shared();
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return shared(detail::wait_until(abs_time));
+        }
+    void unlock_shared();
+
+    // Upgrade ownership
+
+    void lock_upgrade();
+    bool try_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return lock_cohort(detail::wait_until(abs_time));
+        }
+    void unlock_upgrade();
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (!lock_cohort(detail::wait_until(abs_time)))
+                return false;
+            remove_reader();
+            if (upgrade_to_exclusive(detail::wait_until(abs_time)))
+                return true;
+            unlock_upgrade_and_lock_shared();
+            return false;
+        }
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (!lock_cohort(detail::wait_until(abs_time)))
+                return false;
+            remove_reader();
+            return true;
+        }
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return upgrade_to_exclusive(detail::wait_until(abs_time));
+        }
+    void unlock_and_lock_upgrade();
+
+    // Ownership transfer
+
+    // A read moves with the node whose count it holds.  The cohort lock is
+    // not tied to a thread.
+
+    struct detached_ownership
+    {
+        unsigned node;
+    };
+
+    detached_ownership detach(lock_mode m) noexcept;
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    // Observers
+
+    unsigned nodes() const noexcept {return topo_.nodes();}
+    unsigned max_batch() const noexcept {return max_batch_;}
+
+private:
+    // Cohort lock
+
+    template <class Waiter>
+        bool lock_cohort(const Waiter& w);
+    bool try_lock_cohort();
+    void unlock_cohort() noexcept;
+    void release_local(cohort& c) noexcept;
+
+    template <class Waiter>
+        bool lock_global(unsigned node, const Waiter& w);
+    void unlock_global(unsigned node) noexcept;
+
+    // Readers
+
+    template <class Waiter>
+        bool shared(const Waiter& w);
+    void add_reader() noexcept;
+    void remove_reader() noexcept;
+    bool readers_drained() const noexcept;
+    void wake_writer() noexcept;
+    void reopen() noexcept;
+
+    template <class Waiter>
+        bool exclusive(const Waiter& w);
+    template <class Waiter>
+        bool upgrade_to_exclusive(const Waiter& w);
+};
+
+// Cohort lock
+
+template <class Waiter>
+bool
+cohort_upgrade_mutex::lock_cohort(const Waiter& w)
+{
+    unsigned n = topo_.current_node();
+    cohort& c = cohorts_[n];
+    {
+        lock_type lk(c.mut);
+        if (c.locked)
+        {
+            ++c.waiting;
+            bool r = w(c.gate, lk, [&c] {return !c.locked;});
+            --c.waiting;
+            if (!r)
+                return false;
+        }
+        c.locked = true;
+        if (c.owns_global)
+        {
+            owner_node_ = n;
+            return true;
+        }
+    }
+    if (!lock_global(n, w))
+    {
+        release_local(c);
+        return false;
+    }
+    c.owns_global = true;
+    owner_node_ = n;
+    return true;
+}
+
+template <class Waiter>
+bool
+cohort_upgrade_mutex::lock_global(unsigned node, const Waiter& w)
+{
+    lock_type lk(gmut_);
+    if (gowner_ < 0)
+    {
+        gowner_ = static_cast<int>(node);
+        return true;
+    }
+    gwant_[node] = true;
+    ++gwanting_;
+    int me = static_cast<int>(node);
+    if (w(ggate_, lk, [this, me] {return gowner_ == me;}))
+        return true;
+    gwant_[node] = false;
+    --gwanting_;
+    return false;
+}
+
+// Readers
+
+template <class Waiter>
+bool
+cohort_upgrade_mutex::shared(const Waiter& w)
+{
+    for (;;)
+    {
+        add_reader();
+        if (!write_entered_.load())
+            return true;
+        remove_reader();
+        wake_writer();
+        lock_type lk(wmut_);
+        if (!w(reopened_, lk, [this] {return !write_entered_.load();}))
+            return false;
+    }
+}
+
+// Exclusive
+
+template <class Waiter>
+bool
+cohort_upgrade_mutex::exclusive(const Waiter& w)
+{
+    if (!lock_cohort(w))
+        return false;
+    if (upgrade_to_exclusive(w))
+        return true;
+    unlock_cohort();
+    return false;
+}
+
+// Holding the cohort lock, shut out new readers and wait for the current ones
+// to leave.  Giving up lets them in again.
+
+template <class Waiter>
+bool
+cohort_upgrade_mutex::upgrade_to_exclusive(const Waiter& w)
+{
+    write_entered_.store(true);
+    if (readers_drained())
+        return true;
+    {
+        lock_type lk(wmut_);
+        if (w(drained_, lk, [this] {return readers_drained();}))
+            return true;
+    }
+    reopen();
+    return false;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_COHORT
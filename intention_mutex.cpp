@@ -0,0 +1,103 @@
+//--------------------------- intention_mutex.cpp ------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "intention_mutex.h"
+
+namespace acme
+{
+
+void
+intention_mutex::check(intention_mode from, intention_mode to)
+{
+    if (!covers(from, to) && !covers(to, from))
+        throw std::system_error(std::error_code(EINVAL, std::system_category()),
+                                "intention_mutex: modes not comparable");
+}
+
+void
+intention_mutex::wake()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    gate_.notify_all();
+}
+
+// The word changes in one step, so no thread gets in between giving up from
+// and taking to.
+
+bool
+intention_mutex::weaken(intention_mode from, intention_mode to) noexcept
+{
+    state_type s = state_.fetch_add(one(to) - one(from),
+                                    std::memory_order_release);
+    return (s >> waiting_shift) != 0;
+}
+
+// Called holding mut_
+
+void
+intention_mutex::enter_waiting(intention_mode m) noexcept
+{
+    unsigned i = static_cast<unsigned>(m);
+    if (waiters_[i]++ == 0)
+        state_.fetch_or(state_type(1) << (waiting_shift + i),
+                        std::memory_order_relaxed);
+}
+
+// The last waiter for m to leave clears its bit.  If it gave up, threads
+// it kept out may now get in.
+
+void
+intention_mutex::leave_waiting(intention_mode m, bool acquired) noexcept
+{
+    unsigned i = static_cast<unsigned>(m);
+    if (--waiters_[i] != 0)
+        return;
+    state_.fetch_and(~(state_type(1) << (waiting_shift + i)),
+                     std::memory_order_relaxed);
+    if (!acquired)
+        gate_.notify_all();
+}
+
+// Conversions
+
+bool
+intention_mutex::try_convert(intention_mode from, intention_mode to)
+{
+    check(from, to);
+    if (covers(from, to))
+    {
+        if (from != to && weaken(from, to))
+            wake();
+        return true;
+    }
+    state_type s = state_.load(std::memory_order_relaxed);
+    while (!conflicting(s - one(from), to))
+        if (state_.compare_exchange_weak(s, s - one(from) + one(to),
+                                         std::memory_order_acquire,
+                                         std::memory_order_relaxed))
+            return true;
+    return false;
+}
+
+void
+intention_mutex::convert(intention_mode from, intention_mode to)
+{
+    check(from, to);
+    if (!covers(from, to) &&
+        !(from == intention_mode::six && to == intention_mode::x))
+        throw std::system_error(std::error_code(EDEADLK,
+                                                std::system_category()),
+                                "intention_mutex::convert: may deadlock");
+    if (!try_convert(from, to))
+        wait_convert(from, to, detail::untimed_wait());
+}
+
+}  // acme
@@ -0,0 +1,601 @@
+//----------------------------- intention_mutex.h ------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_INTENTION
+#define UPGRADE_MUTEX_INTENTION
+
+/*
+    <intention_mutex.h> synopsis
+
+namespace acme
+{
+
+// The modes of multi-granularity locking, weakest first.  A thread locks a
+// node of a hierarchy (table, page, row) in some mode after locking each of
+// its ancestors, root first, in at least parent_mode of it.
+//
+//          is   ix   s    six  x
+//     is   yes  yes  yes  yes  no
+//     ix   yes  yes  no   no   no
+//     s    yes  no   yes  no   no
+//     six  yes  no   no   no   no
+//     x    no   no   no   no   no
+
+enum class intention_mode : unsigned char
+{
+    is,      // intention shared:  will lock descendants s
+    ix,      // intention exclusive:  will lock descendants x
+    s,       // shared, and so every descendant
+    six,     // s and ix
+    x        // exclusive, and so every descendant
+};
+
+constexpr bool compatible(intention_mode a, intention_mode b) noexcept;
+constexpr bool covers(intention_mode a, intention_mode b) noexcept;  // a >= b
+constexpr intention_mode parent_mode(intention_mode m) noexcept;   // is or ix
+
+class intention_mutex
+{
+public:
+    intention_mutex() noexcept;
+    ~intention_mutex() = default;
+
+    intention_mutex(const intention_mutex&) = delete;
+    intention_mutex& operator=(const intention_mutex&) = delete;
+
+    void lock(intention_mode m);
+    bool try_lock(intention_mode m);
+    template <class Rep, class Period>
+        bool try_lock_for(intention_mode m,
+                          const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(intention_mode m,
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock(intention_mode m);
+
+    // Conversions, from one mode to another it covers or is covered by;
+    // otherwise system_error(EINVAL).  To a weaker mode they never wait.  To a
+    // stronger one they may, and as with upgrade_mutex, only a mode no other
+    // thread can hold (six, to x) may wait without a deadline:  convert
+    // throws system_error(EDEADLK) for any other.  On failure the thread
+    // still owns from.
+
+    void convert(intention_mode from, intention_mode to);
+    bool try_convert(intention_mode from, intention_mode to);
+    template <class Rep, class Period>
+        bool
+        try_convert_for(intention_mode from, intention_mode to,
+                        const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_convert_until(intention_mode from, intention_mode to,
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+};
+
+// Ownership of an intention_mutex in some mode.
+
+class intention_lock
+{
+public:
+    typedef intention_mutex mutex_type;
+
+    ~intention_lock();
+    intention_lock() noexcept;
+    intention_lock(intention_lock const&) = delete;
+    intention_lock& operator=(intention_lock const&) = delete;
+    intention_lock(intention_lock&& l) noexcept;
+    intention_lock& operator=(intention_lock&& l);
+
+    intention_lock(mutex_type& m, intention_mode mode);
+    intention_lock(mutex_type& m, intention_mode mode, std::defer_lock_t)
+                                                                      noexcept;
+    intention_lock(mutex_type& m, intention_mode mode, std::try_to_lock_t);
+    intention_lock(mutex_type& m, intention_mode mode, std::adopt_lock_t)
+                                                                      noexcept;
+    template <class Clock, class Duration>
+        intention_lock(mutex_type& m, intention_mode mode,
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        intention_lock(mutex_type& m, intention_mode mode,
+                       const std::chrono::duration<Rep, Period>& rel_time);
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    // As intention_mutex's, from mode() to to; on success mode() is to.  A
+    // lock that owns nothing only changes mode().
+    void convert(intention_mode to);
+    bool try_convert(intention_mode to);
+    template <class Rep, class Period>
+        bool
+        try_convert_for(intention_mode to,
+                        const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_convert_until(intention_mode to,
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+
+    void swap(intention_lock& l) noexcept;
+    mutex_type* release() noexcept;
+
+    bool owns_lock() const noexcept;
+    explicit operator bool () const noexcept;
+    mutex_type* mutex() const noexcept;
+    intention_mode mode() const noexcept;
+};
+
+void swap(intention_lock& x, intention_lock& y) noexcept;
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <cerrno>
+
+namespace acme
+{
+
+enum class intention_mode : unsigned char {is, ix, s, six, x};
+
+namespace detail
+{
+
+// Per mode, the modes it conflicts with, as a mask of 1 << mode.
+
+constexpr unsigned char intention_conflicts[] =
+{
+    0x10,           // is:   x
+    0x1C,           // ix:   s, six, x
+    0x1A,           // s:    ix, six, x
+    0x1E,           // six:  all but is
+    0x1F            // x:    all
+};
+
+// Per mode, the modes it covers.
+
+constexpr unsigned char intention_covers[] =
+{
+    0x01,           // is
+    0x03,           // ix:   is
+    0x05,           // s:    is
+    0x0F,           // six:  is, ix, s
+    0x1F            // x:    all
+};
+
+// Per mode, the conflicting modes a thread waiting for which keeps it out.
+// The modes are ranked is, ix, s, six, x, and only a higher one keeps out a
+// lower, so that waiters cannot keep each other out.  s ranks above ix:  a
+// scan of the whole node waits for the updates under it to drain, not for a
+// lull in their arrival.
+
+constexpr unsigned char intention_defers[] =
+{
+    0x10,           // is:   x
+    0x1C,           // ix:   s, six, x
+    0x18,           // s:    six, x
+    0x10,           // six:  x
+    0x00            // x
+};
+
+constexpr unsigned
+intention_bit(intention_mode m) noexcept
+{
+    return 1u << static_cast<unsigned>(m);
+}
+
+}  // detail
+
+constexpr
+bool
+compatible(intention_mode a, intention_mode b) noexcept
+{
+    return (detail::intention_conflicts[static_cast<unsigned>(a)] &
+            detail::intention_bit(b)) == 0;
+}
+
+constexpr
+bool
+covers(intention_mode a, intention_mode b) noexcept
+{
+    return (detail::intention_covers[static_cast<unsigned>(a)] &
+            detail::intention_bit(b)) != 0;
+}
+
+constexpr
+intention_mode
+parent_mode(intention_mode m) noexcept
+{
+    return m == intention_mode::is || m == intention_mode::s ?
+               intention_mode::is : intention_mode::ix;
+}
+
+// One 64-bit word holds the count of owners in each of is, ix and s, a bit
+// each for six and x, and a bit per mode for which some thread is waiting.
+// Locking, unlocking and converting is a compare-and-swap on it when the
+// compatibility matrix allows; the internal mutex and gate are for waiting.
+//
+// A thread takes the internal mutex to wait, sets its mode's waiting bit,
+// and retries the compare-and-swap each time it is woken.  Whoever changes
+// the word to release ownership, seeing a waiting bit in the value it
+// replaced, takes the internal mutex and wakes every waiter.  A waiting bit
+// keeps out the new owners the mode ranks above (intention_defers), as
+// upgrade_mutex's pending writer keeps out new readers; conversions by
+// owners are not kept out.  So a thread already owning one node may wait on
+// another for a thread that waits in turn; as with upgrade_mutex, lock in a
+// consistent order.
+//
+// At most 65535 threads may own the mutex in each of is, ix and s at once.
+
+class intention_mutex
+{
+    typedef std::uint64_t                state_type;
+    typedef std::mutex                   mutex_type;
+    typedef condvar_wait::gate_type      gate_type;
+    typedef std::unique_lock<mutex_type> lock_type;
+
+    static constexpr unsigned   waiting_shift = 56;
+    static constexpr state_type count_mask = 0xFFFF;
+
+    std::atomic<state_type> state_;
+    mutex_type              mut_;
+    gate_type               gate_;
+    unsigned                waiters_[5];
+
+public:
+    intention_mutex() noexcept : state_(0), waiters_() {}
+    ~intention_mutex() = default;
+
+    intention_mutex(const intention_mutex&) = delete;
+    intention_mutex& operator=(const intention_mutex&) = delete;
+
+    void
+    lock(intention_mode m)
+    {
+        if (!try_lock(m))
+            wait(m, detail::untimed_wait());
+    }
+
+    bool
+    try_lock(intention_mode m) noexcept
+    {
+        state_type s = state_.load(std::memory_order_relaxed);
+        while (!(conflicting(s, m) || kept_out(s, m)))
+            if (state_.compare_exchange_weak(s, s + one(m),
+                                             std::memory_order_acquire,
+                                             std::memory_order_relaxed))
+                return true;
+        return false;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_for(intention_mode m,
+                     const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(m,
+                                  std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(intention_mode m,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return try_lock(m) || wait(m, detail::wait_until(abs_time));
+        }
+
+    void
+    unlock(intention_mode m)
+    {
+        state_type s = state_.fetch_sub(one(m), std::memory_order_release);
+        if (s >> waiting_shift)
+            wake();
+    }
+
+    // Conversions
+
+    void convert(intention_mode from, intention_mode to);
+    bool try_convert(intention_mode from, intention_mode to);
+    template <class Rep, class Period>
+        bool
+        try_convert_for(intention_mode from, intention_mode to,
+                        const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_convert_until(from, to,
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_convert_until(intention_mode from, intention_mode to,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return try_convert(from, to) ||
+                   wait_convert(from, to, detail::wait_until(abs_time));
+        }
+
+private:
+    static
+    state_type
+    one(intention_mode m) noexcept
+    {
+        static constexpr unsigned char shift[] = {0, 16, 32, 48, 49};
+        return state_type(1) << shift[static_cast<unsigned>(m)];
+    }
+
+    // The modes owned, as a mask of 1 << mode
+    static
+    unsigned
+    held(state_type s) noexcept
+    {
+        return unsigned((s & count_mask) != 0) |
+               unsigned((s >> 16 & count_mask) != 0) << 1 |
+               unsigned((s >> 32 & count_mask) != 0) << 2 |
+               unsigned(s >> 45 & 0x18);
+    }
+
+    static
+    bool
+    conflicting(state_type s, intention_mode m) noexcept
+    {
+        return (held(s) &
+                detail::intention_conflicts[static_cast<unsigned>(m)]) != 0;
+    }
+
+    static
+    bool
+    kept_out(state_type s, intention_mode m) noexcept
+    {
+        return (unsigned(s >> waiting_shift) &
+                detail::intention_defers[static_cast<unsigned>(m)]) != 0;
+    }
+
+    static void check(intention_mode from, intention_mode to);
+    void wake();
+    bool weaken(intention_mode from, intention_mode to) noexcept;
+    void enter_waiting(intention_mode m) noexcept;
+    void leave_waiting(intention_mode m, bool acquired) noexcept;
+
+    template <class Waiter>
+        bool
+        wait(intention_mode m, const Waiter& w)
+        {
+            lock_type lk(mut_);
+            enter_waiting(m);
+            bool ok = w(gate_, lk, [&] {return try_lock(m);});
+            leave_waiting(m, ok);
+            return ok;
+        }
+
+    template <class Waiter>
+        bool
+        wait_convert(intention_mode from, intention_mode to, const Waiter& w)
+        {
+            lock_type lk(mut_);
+            enter_waiting(to);
+            bool ok = w(gate_, lk, [&] {return try_convert(from, to);});
+            leave_waiting(to, ok);
+            return ok;
+        }
+};
+
+// Locks
+
+class intention_lock
+{
+public:
+    typedef intention_mutex mutex_type;
+
+private:
+    mutex_type*    m_;
+    intention_mode mode_;
+    bool           owns_;
+
+public:
+    ~intention_lock()
+    {
+        if (owns_)
+            m_->unlock(mode_);
+    }
+
+    intention_lock() noexcept
+        : m_(nullptr), mode_(intention_mode::is), owns_(false) {}
+    intention_lock(intention_lock const&) = delete;
+    intention_lock& operator=(intention_lock const&) = delete;
+
+    intention_lock(intention_lock&& l) noexcept
+        : m_(l.m_), mode_(l.mode_), owns_(l.owns_)
+    {
+        l.m_ = nullptr;
+        l.owns_ = false;
+    }
+
+    intention_lock&
+    operator=(intention_lock&& l)
+    {
+        if (owns_)
+            m_->unlock(mode_);
+        m_ = l.m_;
+        mode_ = l.mode_;
+        owns_ = l.owns_;
+        l.m_ = nullptr;
+        l.owns_ = false;
+        return *this;
+    }
+
+    intention_lock(mutex_type& m, intention_mode mode)
+        : m_(&m), mode_(mode), owns_(true)
+    {
+        m_->lock(mode_);
+    }
+
+    intention_lock(mutex_type& m, intention_mode mode, std::defer_lock_t)
+                                                                       noexcept
+        : m_(&m), mode_(mode), owns_(false) {}
+
+    intention_lock(mutex_type& m, intention_mode mode, std::try_to_lock_t)
+        : m_(&m), mode_(mode), owns_(m.try_lock(mode)) {}
+
+    intention_lock(mutex_type& m, intention_mode mode, std::adopt_lock_t)
+                                                                       noexcept
+        : m_(&m), mode_(mode), owns_(true) {}
+
+    template <class Clock, class Duration>
+        intention_lock(mutex_type& m, intention_mode mode,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+            : m_(&m), mode_(mode), owns_(m.try_lock_until(mode, abs_time)) {}
+
+    template <class Rep, class Period>
+        intention_lock(mutex_type& m, intention_mode mode,
+                       const std::chrono::duration<Rep, Period>& rel_time)
+            : m_(&m), mode_(mode), owns_(m.try_lock_for(mode, rel_time)) {}
+
+    void
+    lock()
+    {
+        check_lockable();
+        m_->lock(mode_);
+        owns_ = true;
+    }
+
+    bool
+    try_lock()
+    {
+        check_lockable();
+        owns_ = m_->try_lock(mode_);
+        return owns_;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            check_lockable();
+            owns_ = m_->try_lock_for(mode_, rel_time);
+            return owns_;
+        }
+
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            check_lockable();
+            owns_ = m_->try_lock_until(mode_, abs_time);
+            return owns_;
+        }
+
+    void
+    unlock()
+    {
+        if (!owns_)
+            throw std::system_error(std::error_code(EPERM,
+                                                    std::system_category()),
+                                    "intention_lock::unlock: not locked");
+        m_->unlock(mode_);
+        owns_ = false;
+    }
+
+    // Conversions
+
+    void
+    convert(intention_mode to)
+    {
+        if (owns_)
+            m_->convert(mode_, to);
+        mode_ = to;
+    }
+
+    bool
+    try_convert(intention_mode to)
+    {
+        if (owns_ && !m_->try_convert(mode_, to))
+            return false;
+        mode_ = to;
+        return true;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_convert_for(intention_mode to,
+                        const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            if (owns_ && !m_->try_convert_for(mode_, to, rel_time))
+                return false;
+            mode_ = to;
+            return true;
+        }
+
+    template <class Clock, class Duration>
+        bool
+        try_convert_until(intention_mode to,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (owns_ && !m_->try_convert_until(mode_, to, abs_time))
+                return false;
+            mode_ = to;
+            return true;
+        }
+
+    void
+    swap(intention_lock& l) noexcept
+    {
+        std::swap(m_, l.m_);
+        std::swap(mode_, l.mode_);
+        std::swap(owns_, l.owns_);
+    }
+
+    mutex_type*
+    release() noexcept
+    {
+        mutex_type* m = m_;
+        m_ = nullptr;
+        owns_ = false;
+        return m;
+    }
+
+    bool owns_lock() const noexcept {return owns_;}
+    explicit operator bool () const noexcept {return owns_;}
+    mutex_type* mutex() const noexcept {return m_;}
+    intention_mode mode() const noexcept {return mode_;}
+
+private:
+    void
+    check_lockable() const
+    {
+        if (m_ == nullptr)
+            throw std::system_error(std::error_code(EPERM,
+                                                    std::system_category()),
+                                    "intention_lock::lock: references null "
+                                    "mutex");
+        if (owns_)
+            throw std::system_error(std::error_code(EDEADLK,
+                                                    std::system_category()),
+                                    "intention_lock::lock: already locked");
+    }
+};
+
+inline
+void
+swap(intention_lock& x, intention_lock& y) noexcept
+{
+    x.swap(y);
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_INTENTION
@@ -0,0 +1,325 @@
+//-------------------------------- lock_any.h ----------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_LOCK_ANY
+#define UPGRADE_MUTEX_LOCK_ANY
+
+/*
+    <lock_any.h> synopsis  (Linux only)
+
+namespace acme
+{
+
+// upgrade_mutex, but telling lock_any of its releases.
+typedef basic_upgrade_mutex<unsigned, condvar_wait, writer_priority, no_stats,
+                            any_release> any_upgrade_mutex;
+
+// Block until one of m[0] .. m[n-1] can be acquired in mode, acquire it and
+// return its index.  Mutex is a basic_upgrade_mutex whose ReleasePolicy is
+// any_release.
+
+template <class Mutex>
+    std::size_t lock_any(Mutex* const* m, std::size_t n, lock_mode mode);
+
+// As lock_any, but return n if none could be acquired in time.
+
+template <class Mutex, class Rep, class Period>
+    std::size_t
+    try_lock_any_for(Mutex* const* m, std::size_t n, lock_mode mode,
+                     const std::chrono::duration<Rep, Period>& rel_time);
+template <class Mutex, class Clock, class Duration>
+    std::size_t
+    try_lock_any_until(Mutex* const* m, std::size_t n, lock_mode mode,
+                       const std::chrono::time_point<Clock, Duration>& abs_time);
+
+// C++20:  the same taking a std::span of Mutex pointers in place of m, n.
+
+}  // acme
+*/
+
+#ifdef __linux__
+
+#include "upgrade_mutex.h"
+#include <cerrno>
+#include <vector>
+
+#if __has_include(<span>)
+#include <span>
+#endif
+
+namespace acme
+{
+
+namespace detail
+{
+
+struct any_access
+{
+    template <class Mutex>
+        static
+        release_gate&
+        gate(Mutex& m) noexcept
+        {
+            static_assert(std::is_same<typename Mutex::release_policy,
+                                       any_release>::value,
+                          "lock_any: Mutex must use the any_release policy");
+            return static_cast<any_release&>(m).gate_;
+        }
+};
+
+template <class Mutex>
+bool
+try_lock_mode(Mutex& m, lock_mode mode)
+{
+    switch (mode)
+    {
+    case lock_mode::shared:
+        return m.try_lock_shared();
+    case lock_mode::upgrade:
+        return m.try_lock_upgrade();
+    case lock_mode::exclusive:
+        break;
+    }
+    return m.try_lock();
+}
+
+#if defined(__NR_futex_waitv) && defined(FUTEX_32)
+
+const std::size_t max_waitv = FUTEX_WAITV_MAX;
+
+// Kernels before 5.16 answer ENOSYS; lock_any then waits on
+// any_release_seq, which every release bumps while someone waits there.
+
+inline
+bool
+have_futex_waitv() noexcept
+{
+    static const bool r = syscall(__NR_futex_waitv, nullptr, 0, 0, nullptr,
+                                  CLOCK_MONOTONIC) == 0 || errno != ENOSYS;
+    return r;
+}
+
+#else
+
+const std::size_t max_waitv = 0;
+
+inline bool have_futex_waitv() noexcept {return false;}
+
+#endif
+
+// Registers with each mutex's release gate for the lifetime of a lock_any.
+
+template <class Mutex>
+class any_waiter
+{
+    Mutex* const*     m_;
+    std::size_t       n_;
+    bool              vectored_;
+#if defined(__NR_futex_waitv) && defined(FUTEX_32)
+    std::vector<futex_waitv> w_;
+#endif
+    std::uint32_t     any_seq_;
+
+public:
+    any_waiter(Mutex* const* m, std::size_t n)
+        : m_(m),
+          n_(n),
+          vectored_(n <= max_waitv && have_futex_waitv()),
+          any_seq_(0)
+    {
+        if (!vectored_)
+            any_release_parked.fetch_add(1);
+        for (std::size_t i = 0; i < n_; ++i)
+            any_access::gate(*m_[i]).add_waiter();
+#if defined(__NR_futex_waitv) && defined(FUTEX_32)
+        if (vectored_)
+        {
+            w_.resize(n_);
+            for (std::size_t i = 0; i < n_; ++i)
+            {
+                w_[i].uaddr = reinterpret_cast<std::uintptr_t>(
+                                          &any_access::gate(*m_[i]).seq());
+                w_[i].flags = FUTEX_32 | FUTEX_PRIVATE_FLAG;
+                w_[i].__reserved = 0;
+            }
+        }
+#endif
+    }
+
+    ~any_waiter()
+    {
+        for (std::size_t i = 0; i < n_; ++i)
+            any_access::gate(*m_[i]).remove_waiter();
+        if (!vectored_)
+            any_release_parked.fetch_sub(1);
+    }
+
+    any_waiter(const any_waiter&) = delete;
+    any_waiter& operator=(const any_waiter&) = delete;
+
+    // Before each round of try_locks, so that a release after a failed try
+    // is seen by wait.
+    void
+    snapshot() noexcept
+    {
+#if defined(__NR_futex_waitv) && defined(FUTEX_32)
+        if (vectored_)
+        {
+            for (std::size_t i = 0; i < n_; ++i)
+                w_[i].val = any_access::gate(*m_[i]).seq().load();
+            return;
+        }
+#endif
+        any_seq_ = any_release_seq.load();
+    }
+
+    // Returns after a release since the snapshot, a signal, or abs_time (on
+    // CLOCK_MONOTONIC; nullptr: none), perhaps spuriously.
+    void
+    wait(const timespec* abs_time) noexcept
+    {
+#if defined(__NR_futex_waitv) && defined(FUTEX_32)
+        if (vectored_)
+        {
+            syscall(__NR_futex_waitv, w_.data(), static_cast<unsigned>(n_), 0,
+                    abs_time, CLOCK_MONOTONIC);
+            return;
+        }
+#endif
+        timespec rel;
+        if (abs_time != nullptr)
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            rel.tv_sec = abs_time->tv_sec - now.tv_sec;
+            rel.tv_nsec = abs_time->tv_nsec - now.tv_nsec;
+            if (rel.tv_nsec < 0)
+            {
+                rel.tv_nsec += 1000000000;
+                --rel.tv_sec;
+            }
+            if (rel.tv_sec < 0)
+                return;
+        }
+        futex(&any_release_seq, FUTEX_WAIT_PRIVATE, any_seq_,
+              abs_time != nullptr ? &rel : nullptr);
+    }
+};
+
+template <class Mutex>
+std::size_t
+lock_any(Mutex* const* m, std::size_t n, lock_mode mode,
+         const std::chrono::steady_clock::time_point* abs_time)
+{
+    if (n == 0)
+        throw std::system_error(std::error_code(EINVAL,
+                                                std::system_category()),
+                                "lock_any: no mutexes");
+    timespec ts;
+    if (abs_time != nullptr)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              abs_time->time_since_epoch());
+        ts.tv_sec = static_cast<std::time_t>(ns.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+    }
+    any_waiter<Mutex> w(m, n);
+    for (;;)
+    {
+        w.snapshot();
+        for (std::size_t i = 0; i < n; ++i)
+            if (try_lock_mode(*m[i], mode))
+                return i;
+        if (abs_time != nullptr &&
+            std::chrono::steady_clock::now() >= *abs_time)
+            return n;
+        w.wait(abs_time != nullptr ? &ts : nullptr);
+    }
+}
+
+}  // detail
+
+typedef basic_upgrade_mutex<unsigned, condvar_wait, writer_priority, no_stats,
+                            any_release> any_upgrade_mutex;
+
+// The mutexes are tried in order, so earlier ones win ties.  Each failed
+// round waits in a single futex_waitv on every mutex's release gate;
+// releases of a mutex make system calls only while someone waits on it.
+// With more than FUTEX_WAITV_MAX mutexes, or without futex_waitv, waiters
+// share one futex that every release of an any_release mutex bumps.
+
+template <class Mutex>
+inline
+std::size_t
+lock_any(Mutex* const* m, std::size_t n, lock_mode mode)
+{
+    return detail::lock_any(m, n, mode, nullptr);
+}
+
+// steady_clock is CLOCK_MONOTONIC; other clocks are converted once.
+
+template <class Mutex, class Clock, class Duration>
+std::size_t
+try_lock_any_until(Mutex* const* m, std::size_t n, lock_mode mode,
+                   const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    std::chrono::steady_clock::time_point t =
+        std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                       abs_time - Clock::now());
+    return detail::lock_any(m, n, mode, &t);
+}
+
+template <class Mutex, class Rep, class Period>
+inline
+std::size_t
+try_lock_any_for(Mutex* const* m, std::size_t n, lock_mode mode,
+                 const std::chrono::duration<Rep, Period>& rel_time)
+{
+    return try_lock_any_until(m, n, mode,
+                              std::chrono::steady_clock::now() + rel_time);
+}
+
+#ifdef __cpp_lib_span
+
+template <class T, std::size_t Extent>
+inline
+std::size_t
+lock_any(std::span<T, Extent> m, lock_mode mode)
+{
+    return lock_any(m.data(), m.size(), mode);
+}
+
+template <class T, std::size_t Extent, class Clock, class Duration>
+inline
+std::size_t
+try_lock_any_until(std::span<T, Extent> m, lock_mode mode,
+                   const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    return try_lock_any_until(m.data(), m.size(), mode, abs_time);
+}
+
+template <class T, std::size_t Extent, class Rep, class Period>
+inline
+std::size_t
+try_lock_any_for(std::span<T, Extent> m, lock_mode mode,
+                 const std::chrono::duration<Rep, Period>& rel_time)
+{
+    return try_lock_any_for(m.data(), m.size(), mode, rel_time);
+}
+
+#endif  // __cpp_lib_span
+
+}  // acme
+
+#endif  // __linux__
+
+#endif  // UPGRADE_MUTEX_LOCK_ANY
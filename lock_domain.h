@@ -0,0 +1,556 @@
+//------------------------------- lock_domain.h --------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_LOCK_DOMAIN
+#define UPGRADE_MUTEX_LOCK_DOMAIN
+
+/*
+    <lock_domain.h> synopsis
+
+namespace acme
+{
+
+// A group of mutexes that can be frozen together for a read-only phase.
+// While the domain is frozen no mutex in it can be owned exclusively, and
+// shared ownership of any of them is a load and a check that writes nothing
+// another thread reads, except the calling thread's own reader slot.
+
+template <class Mutex = upgrade_mutex>
+class basic_lock_domain
+{
+public:
+    typedef Mutex mutex_type;
+
+    static constexpr unsigned default_reader_slots = 128;
+
+    explicit basic_lock_domain(unsigned reader_slots = default_reader_slots);
+    ~basic_lock_domain();                       // unfreezes
+
+    basic_lock_domain(const basic_lock_domain&) = delete;
+    basic_lock_domain& operator=(const basic_lock_domain&) = delete;
+
+    // Waits for the exclusive owners of its mutexes to leave.  The caller
+    // must own none of them exclusively.
+    void freeze();
+    // Waits for every frozen shared ownership to be given up.  The caller
+    // must hold none.
+    void unfreeze();
+    bool frozen() const noexcept;
+
+    unsigned reader_slots() const noexcept;
+};
+
+// A Mutex in a domain, for the domain's lifetime.  The interface of
+// basic_upgrade_mutex, except there are no cancellable or helping overloads,
+// and shared ownership must be given up by the thread that took it.  Frozen
+// shared ownership converts to upgrade ownership but not to exclusive:  the
+// try conversions fail.
+
+template <class Mutex = upgrade_mutex>
+class basic_domain_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+    explicit basic_domain_mutex(basic_lock_domain<Mutex>& d);
+    ~basic_domain_mutex();
+
+    basic_domain_mutex(const basic_domain_mutex&) = delete;
+    basic_domain_mutex& operator=(const basic_domain_mutex&) = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions
+
+    basic_lock_domain<Mutex>& domain() const noexcept;
+};
+
+typedef basic_lock_domain<upgrade_mutex>  lock_domain;
+typedef basic_domain_mutex<upgrade_mutex> domain_upgrade_mutex;
+
+}  // acme
+*/
+
+#include "asymmetric_fence.h"
+#include "read_mostly_upgrade_mutex.h"
+#include "upgrade_mutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace acme
+{
+
+template <class Mutex = upgrade_mutex> class basic_lock_domain;
+template <class Mutex = upgrade_mutex> class basic_domain_mutex;
+
+namespace detail
+{
+
+// The mutexes the calling thread owns frozen shared, in every domain, so that
+// unlock_shared can tell a frozen ownership from one taken from the Mutex.
+// A thread owning more than capacity at once takes the rest from the Mutex.
+
+struct frozen_reads
+{
+    static constexpr unsigned capacity = 16;
+
+    const void* m[capacity];
+    unsigned    n = 0;
+
+    bool
+    add(const void* p) noexcept
+    {
+        if (n == capacity)
+            return false;
+        m[n++] = p;
+        return true;
+    }
+
+    bool
+    remove(const void* p) noexcept
+    {
+        for (unsigned i = n; i-- > 0;)
+            if (m[i] == p)
+            {
+                m[i] = m[--n];
+                return true;
+            }
+        return false;
+    }
+
+    bool
+    holds(const void* p) const noexcept
+    {
+        return std::find(m, m + n, p) != m + n;
+    }
+};
+
+inline thread_local frozen_reads this_thread_frozen_reads;
+
+}  // detail
+
+// Freezing takes shared ownership of every mutex in the domain on its
+// behalf, which keeps writers out for as long as it is frozen, and then sets
+// frozen_.  It waits for a mutex only owning no other:  a reader of the one
+// waited for may be queued behind a writer of another.  A mutex constructed
+// in a frozen domain is taken at once.
+//
+// A frozen reader announces itself as a read_mostly_upgrade_mutex reader
+// does:  with a plain store to a counter in its own cache line (one per
+// thread, per domain, numbered as read_mostly_upgrade_mutex numbers them),
+// then a light asymmetric fence and a load of frozen_.  It owns nothing of
+// the Mutex.  unfreeze clears frozen_ and issues the heavy fence, after which
+// every reader either saw frozen_ clear or has its count seen; it polls the
+// counters until all are zero, and only then gives back the domain's shared
+// ownership.  Readers never wake the unfreezing thread:  their release stays
+// a plain store.
+//
+// A thread already counted in the domain goes on taking frozen shared
+// ownership while the unfreeze waits for it, rather than queueing on a Mutex
+// behind a writer that waits for the unfreeze.  A thread owning frozen shared
+// ownership must not wait for exclusive ownership of a mutex in the domain.
+//
+// Shared ownership of the Mutex taken before the freeze, or while it is
+// being undone, is still given up to the Mutex.  The Mutex must permit shared
+// ownership to be given up by a thread other than the one that took it, as
+// basic_upgrade_mutex does.
+
+template <class Mutex>
+class basic_lock_domain
+{
+public:
+    typedef Mutex mutex_type;
+
+    static constexpr unsigned default_reader_slots = 128;
+
+private:
+    struct alignas(64) reader_slot
+    {
+        std::atomic<unsigned> n{0};
+    };
+
+    const unsigned                 n_slots_;
+    std::unique_ptr<reader_slot[]> slots_;
+
+    alignas(64) std::atomic<bool>  frozen_;
+    std::mutex                     mut_;       // members_, freeze, unfreeze
+    std::vector<Mutex*>            members_;
+
+public:
+    explicit basic_lock_domain(unsigned reader_slots = default_reader_slots)
+        : n_slots_(reader_slots),
+          slots_(new reader_slot[reader_slots]),
+          frozen_(false)
+    {
+        asymmetric_fence_expedited();
+    }
+
+    ~basic_lock_domain()
+    {
+        assert(members_.empty());
+        unfreeze();
+    }
+
+    basic_lock_domain(const basic_lock_domain&) = delete;
+    basic_lock_domain& operator=(const basic_lock_domain&) = delete;
+
+    void freeze();
+    void unfreeze();
+
+    bool frozen() const noexcept
+        {return frozen_.load(std::memory_order_relaxed);}
+    unsigned reader_slots() const noexcept {return n_slots_;}
+
+private:
+    friend class basic_domain_mutex<Mutex>;
+
+    void add(Mutex& m);
+    void remove(Mutex& m);
+
+    // Takes frozen shared ownership of p if the domain is frozen.  false:
+    // the caller must take it from the Mutex.
+    bool
+    enter_frozen(const void* p) noexcept
+    {
+        unsigned i = detail::this_reader_slot.get();
+        if (i >= n_slots_)
+            return false;
+        std::atomic<unsigned>& n = slots_[i].n;
+        unsigned c = n.load(std::memory_order_relaxed);
+        if (c != 0)
+        {
+            // Already counted:  the domain's ownership outlasts this one
+            if (!detail::this_thread_frozen_reads.add(p))
+                return false;
+            n.store(c + 1, std::memory_order_relaxed);
+            return true;
+        }
+        if (!frozen_.load(std::memory_order_relaxed))
+            return false;
+        n.store(1, std::memory_order_relaxed);
+        asymmetric_light_fence();
+        if (frozen_.load(std::memory_order_acquire) &&
+            detail::this_thread_frozen_reads.add(p))
+            return true;
+        n.store(0, std::memory_order_release);
+        return false;
+    }
+
+    // false:  the calling thread owns p from the Mutex.
+    bool
+    leave_frozen(const void* p) noexcept
+    {
+        if (!detail::this_thread_frozen_reads.remove(p))
+            return false;
+        std::atomic<unsigned>& n = slots_[detail::this_reader_slot.get()].n;
+        n.store(n.load(std::memory_order_relaxed) - 1,
+                std::memory_order_release);
+        return true;
+    }
+
+    bool
+    holds_frozen(const void* p) const noexcept
+    {
+        return detail::this_thread_frozen_reads.holds(p);
+    }
+
+    void wait_for_readers() const;
+};
+
+template <class Mutex>
+void
+basic_lock_domain<Mutex>::freeze()
+{
+    std::lock_guard<std::mutex> _(mut_);
+    if (frozen_.load(std::memory_order_relaxed))
+        return;
+    const std::size_t n = members_.size();
+    std::size_t waited = n;                    // owned, out of order
+    std::size_t i = 0;
+    while (i < n)
+    {
+        if (i == waited || members_[i]->try_lock_shared())
+        {
+            ++i;
+            continue;
+        }
+        for (std::size_t j = 0; j < i; ++j)
+            members_[j]->unlock_shared();
+        if (waited > i && waited != n)
+            members_[waited]->unlock_shared();
+        members_[i]->lock_shared();
+        waited = i;
+        i = 0;
+    }
+    frozen_.store(true, std::memory_order_release);
+}
+
+template <class Mutex>
+void
+basic_lock_domain<Mutex>::unfreeze()
+{
+    std::lock_guard<std::mutex> _(mut_);
+    if (!frozen_.load(std::memory_order_relaxed))
+        return;
+    frozen_.store(false, std::memory_order_relaxed);
+    asymmetric_heavy_fence();
+    wait_for_readers();
+    for (Mutex* m : members_)
+        m->unlock_shared();
+}
+
+// Frozen readers hold for as long as their read-only section runs, which is
+// short next to a frozen phase:  spin briefly, then back off to sleeping.
+
+template <class Mutex>
+void
+basic_lock_domain<Mutex>::wait_for_readers() const
+{
+    for (unsigned i = 0; i < n_slots_; ++i)
+    {
+        std::chrono::microseconds nap(1);
+        for (unsigned k = 0;
+             slots_[i].n.load(std::memory_order_acquire) != 0; ++k)
+        {
+            if (k < 64)
+                std::this_thread::yield();
+            else
+            {
+                std::this_thread::sleep_for(nap);
+                nap = std::min(nap * 2, std::chrono::microseconds(1000));
+            }
+        }
+    }
+}
+
+template <class Mutex>
+void
+basic_lock_domain<Mutex>::add(Mutex& m)
+{
+    std::lock_guard<std::mutex> _(mut_);
+    members_.push_back(&m);
+    if (frozen_.load(std::memory_order_relaxed))
+        m.lock_shared();
+}
+
+// Its users are gone:  no frozen reader holds m.
+
+template <class Mutex>
+void
+basic_lock_domain<Mutex>::remove(Mutex& m)
+{
+    std::lock_guard<std::mutex> _(mut_);
+    members_.erase(std::find(members_.begin(), members_.end(), &m));
+    if (frozen_.load(std::memory_order_relaxed))
+        m.unlock_shared();
+}
+
+template <class Mutex>
+class basic_domain_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    basic_lock_domain<Mutex>& d_;
+    Mutex                     m_;
+
+public:
+    explicit basic_domain_mutex(basic_lock_domain<Mutex>& d)
+        : d_(d)
+    {
+        d_.add(m_);
+    }
+
+    ~basic_domain_mutex() {d_.remove(m_);}
+
+    basic_domain_mutex(const basic_domain_mutex&) = delete;
+    basic_domain_mutex& operator=(const basic_domain_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void lock() {m_.lock();}
+    bool try_lock() {return m_.try_lock();}
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return m_.try_lock_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return m_.try_lock_until(abs_time);
+        }
+    void unlock() {m_.unlock();}
+
+    // Shared ownership
+
+    void
+    lock_shared()
+    {
+        if (!d_.enter_frozen(this))
+            m_.lock_shared();
+    }
+
+    bool
+    try_lock_shared()
+    {
+        return d_.enter_frozen(this) || m_.try_lock_shared();
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return d_.enter_frozen(this) || m_.try_lock_shared_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return d_.enter_frozen(this) ||
+                   m_.try_lock_shared_until(abs_time);
+        }
+
+    void
+    unlock_shared()
+    {
+        if (!d_.leave_frozen(this))
+            m_.unlock_shared();
+    }
+
+    // Upgrade ownership
+
+    void lock_upgrade() {m_.lock_upgrade();}
+    bool try_lock_upgrade() {return m_.try_lock_upgrade();}
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return m_.try_lock_upgrade_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return m_.try_lock_upgrade_until(abs_time);
+        }
+    void unlock_upgrade() {m_.unlock_upgrade();}
+
+    // Shared <-> Exclusive
+
+    // Frozen shared ownership cannot become exclusive until the unfreeze,
+    // which waits for it to be given up:  fail rather than wait.
+
+    bool
+    try_unlock_shared_and_lock()
+    {
+        return !d_.holds_frozen(this) && m_.try_unlock_shared_and_lock();
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return !d_.holds_frozen(this) &&
+                   m_.try_unlock_shared_and_lock_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return !d_.holds_frozen(this) &&
+                   m_.try_unlock_shared_and_lock_until(abs_time);
+        }
+    void unlock_and_lock_shared() {m_.unlock_and_lock_shared();}
+
+    // Shared <-> Upgrade
+
+    // Frozen shared ownership becomes upgrade ownership by taking it from the
+    // Mutex, the frozen ownership still held; no writer can intervene.
+
+    bool
+    try_unlock_shared_and_lock_upgrade()
+    {
+        if (!d_.holds_frozen(this))
+            return m_.try_unlock_shared_and_lock_upgrade();
+        if (!m_.try_lock_upgrade())
+            return false;
+        d_.leave_frozen(this);
+        return true;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            if (!d_.holds_frozen(this))
+                return m_.try_unlock_shared_and_lock_upgrade_until(abs_time);
+            if (!m_.try_lock_upgrade_until(abs_time))
+                return false;
+            d_.leave_frozen(this);
+            return true;
+        }
+    void unlock_upgrade_and_lock_shared() {m_.unlock_upgrade_and_lock_shared();}
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock() {m_.unlock_upgrade_and_lock();}
+    bool try_unlock_upgrade_and_lock()
+        {return m_.try_unlock_upgrade_and_lock();}
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return m_.try_unlock_upgrade_and_lock_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return m_.try_unlock_upgrade_and_lock_until(abs_time);
+        }
+    void unlock_and_lock_upgrade() {m_.unlock_and_lock_upgrade();}
+
+    // Observers
+
+    basic_lock_domain<Mutex>& domain() const noexcept {return d_;}
+};
+
+typedef basic_lock_domain<upgrade_mutex>  lock_domain;
+typedef basic_domain_mutex<upgrade_mutex> domain_upgrade_mutex;
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_LOCK_DOMAIN
@@ -0,0 +1,499 @@
+//------------------------------ lock_manager.h --------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_LOCK_MANAGER
+#define UPGRADE_MUTEX_LOCK_MANAGER
+
+/*
+    <lock_manager.h> synopsis
+
+namespace acme
+{
+
+// Upgrade locks on 64-bit IDs, created when an ID is first locked and
+// recycled when it is neither owned nor waited for.  Mutex is any mutex with
+// the upgrade_mutex interface.
+
+template <class Mutex>
+class basic_lock_manager
+{
+public:
+    typedef std::uint64_t key_type;
+    typedef Mutex         mutex_type;
+
+    static constexpr unsigned default_shards = 64;
+    static constexpr unsigned default_buckets = 64;    // per shard
+
+    explicit basic_lock_manager(unsigned shards = default_shards,
+                                unsigned buckets = default_buckets);
+    ~basic_lock_manager();
+
+    basic_lock_manager(const basic_lock_manager&) = delete;
+    basic_lock_manager& operator=(const basic_lock_manager&) = delete;
+
+    // Each member of the upgrade_mutex interface, taking the ID to lock or
+    // unlock first:  lock(id), try_lock_for(id, rel_time),
+    // unlock_upgrade_and_lock(id), ...  Releasing an ID the manager holds no
+    // lock for throws system_error(EPERM).
+
+    std::size_t entries() const;           // allocated, in use or pooled
+};
+
+typedef basic_lock_manager<upgrade_mutex> lock_manager;
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <cerrno>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace acme
+{
+
+// The IDs hash to shards, each with its own std::mutex, chained hash table
+// and pool of free entries.  An entry holds a Mutex and counts the threads
+// that own it or are waiting for it; the count pins it to its ID, and the
+// last thread out returns it to the pool.  A thread pins an entry holding
+// its shard's mutex, then waits for the entry's Mutex without it.  Releases
+// unlock the entry's Mutex holding the shard's mutex, which never waits.
+//
+// The pool grows a block of entries at a time and never shrinks, and a
+// shard's table doubles when its entries outnumber its buckets two to one;
+// after the set of IDs locked at once stops growing, locking and unlocking
+// allocate nothing.
+
+template <class Mutex>
+class basic_lock_manager
+{
+public:
+    typedef std::uint64_t key_type;
+    typedef Mutex         mutex_type;
+
+    static constexpr unsigned default_shards = 64;
+    static constexpr unsigned default_buckets = 64;
+
+private:
+    struct entry
+    {
+        Mutex     m;
+        key_type  key;
+        entry*    next;           // in a bucket or the free list
+        unsigned  pins;           // owners and waiters
+    };
+
+    static constexpr std::size_t block_size = 64;
+
+    struct block
+    {
+        entry e[block_size];
+    };
+
+    struct alignas(64) shard
+    {
+        std::mutex                          mut;
+        std::unique_ptr<entry*[]>           buckets;
+        std::size_t                         mask = 0;       // buckets - 1
+        std::size_t                         in_use = 0;
+        entry*                              free = nullptr;
+        std::vector<std::unique_ptr<block>> blocks;
+    };
+
+    typedef std::unique_lock<std::mutex> lock_type;
+
+    std::unique_ptr<shard[]> shards_;
+    std::size_t              shard_mask_;
+
+public:
+    explicit basic_lock_manager(unsigned shards = default_shards,
+                                unsigned buckets = default_buckets);
+    ~basic_lock_manager() = default;
+
+    basic_lock_manager(const basic_lock_manager&) = delete;
+    basic_lock_manager& operator=(const basic_lock_manager&) = delete;
+
+    // Exclusive ownership
+
+    void lock(key_type id) {acquire(id, [](Mutex& m) {m.lock(); return true;});}
+    bool try_lock(key_type id)
+        {return acquire(id, [](Mutex& m) {return m.try_lock();});}
+    template <class Rep, class Period>
+        bool
+        try_lock_for(key_type id,
+                     const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(id,
+                                  std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return acquire(id, [&](Mutex& m)
+                                   {return m.try_lock_until(abs_time);});
+        }
+    void unlock(key_type id) {release(id, [](Mutex& m) {m.unlock();});}
+
+    // Shared ownership
+
+    void lock_shared(key_type id)
+        {acquire(id, [](Mutex& m) {m.lock_shared(); return true;});}
+    bool try_lock_shared(key_type id)
+        {return acquire(id, [](Mutex& m) {return m.try_lock_shared();});}
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(key_type id,
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(id, std::chrono::steady_clock::now() +
+                                             rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return acquire(id, [&](Mutex& m)
+                                   {return m.try_lock_shared_until(abs_time);});
+        }
+    void unlock_shared(key_type id)
+        {release(id, [](Mutex& m) {m.unlock_shared();});}
+
+    // Upgrade ownership
+
+    void lock_upgrade(key_type id)
+        {acquire(id, [](Mutex& m) {m.lock_upgrade(); return true;});}
+    bool try_lock_upgrade(key_type id)
+        {return acquire(id, [](Mutex& m) {return m.try_lock_upgrade();});}
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(key_type id,
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(id,
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return acquire(id, [&](Mutex& m)
+                                  {return m.try_lock_upgrade_until(abs_time);});
+        }
+    void unlock_upgrade(key_type id)
+        {release(id, [](Mutex& m) {m.unlock_upgrade();});}
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock(key_type id)
+        {return held(id).try_unlock_shared_and_lock();}
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(key_type id,
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return held(id).try_unlock_shared_and_lock_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return held(id).try_unlock_shared_and_lock_until(abs_time);
+        }
+    void unlock_and_lock_shared(key_type id)
+        {held(id).unlock_and_lock_shared();}
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade(key_type id)
+        {return held(id).try_unlock_shared_and_lock_upgrade();}
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(key_type id,
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return held(id).try_unlock_shared_and_lock_upgrade_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return held(id).try_unlock_shared_and_lock_upgrade_until(abs_time);
+        }
+    void unlock_upgrade_and_lock_shared(key_type id)
+        {held(id).unlock_upgrade_and_lock_shared();}
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock(key_type id)
+        {held(id).unlock_upgrade_and_lock();}
+    bool try_unlock_upgrade_and_lock(key_type id)
+        {return held(id).try_unlock_upgrade_and_lock();}
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(key_type id,
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return held(id).try_unlock_upgrade_and_lock_for(rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(key_type id,
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return held(id).try_unlock_upgrade_and_lock_until(abs_time);
+        }
+    void unlock_and_lock_upgrade(key_type id)
+        {held(id).unlock_and_lock_upgrade();}
+
+    // Observers
+
+    std::size_t entries() const;
+
+private:
+    static std::uint64_t hash(key_type id) noexcept;
+    shard& shard_of(std::uint64_t h) const noexcept
+        {return shards_[(h >> 32) & shard_mask_];}
+
+    entry* find(const shard& s, std::uint64_t h, key_type id) const noexcept;
+    entry* pin(key_type id);
+    void unpin(shard& s, std::uint64_t h, entry* e) noexcept;
+    entry* take(shard& s);
+    void grow_table(shard& s);
+
+    template <class Acquire>
+        bool acquire(key_type id, Acquire f);
+    template <class Release>
+        void release(key_type id, Release f);
+    Mutex& held(key_type id);
+};
+
+typedef basic_lock_manager<upgrade_mutex> lock_manager;
+
+template <class Mutex>
+constexpr unsigned basic_lock_manager<Mutex>::default_shards;
+template <class Mutex>
+constexpr unsigned basic_lock_manager<Mutex>::default_buckets;
+
+// Both counts are rounded up to powers of two.
+
+template <class Mutex>
+basic_lock_manager<Mutex>::basic_lock_manager(unsigned shards,
+                                              unsigned buckets)
+{
+    std::size_t n = 1;
+    while (n < shards)
+        n <<= 1;
+    std::size_t b = 1;
+    while (b < buckets)
+        b <<= 1;
+    shards_.reset(new shard[n]);
+    shard_mask_ = n - 1;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        shards_[i].buckets.reset(new entry*[b]());
+        shards_[i].mask = b - 1;
+    }
+}
+
+template <class Mutex>
+std::size_t
+basic_lock_manager<Mutex>::entries() const
+{
+    std::size_t n = 0;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+    {
+        std::lock_guard<std::mutex> _(shards_[i].mut);
+        n += shards_[i].blocks.size() * block_size;
+    }
+    return n;
+}
+
+// The high half picks the shard, the low half the bucket.
+
+template <class Mutex>
+inline
+std::uint64_t
+basic_lock_manager<Mutex>::hash(key_type id) noexcept
+{
+    std::uint64_t h = id * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+// Called holding s.mut.
+
+template <class Mutex>
+typename basic_lock_manager<Mutex>::entry*
+basic_lock_manager<Mutex>::find(const shard& s, std::uint64_t h,
+                                key_type id) const noexcept
+{
+    entry* e = s.buckets[h & s.mask];
+    while (e != nullptr && e->key != id)
+        e = e->next;
+    return e;
+}
+
+// Called holding s.mut.  Takes an entry from the pool, first refilling it
+// and growing the table if it is empty.
+
+template <class Mutex>
+typename basic_lock_manager<Mutex>::entry*
+basic_lock_manager<Mutex>::take(shard& s)
+{
+    if (s.free == nullptr)
+    {
+        if (s.in_use >= 2 * (s.mask + 1))
+            grow_table(s);
+        s.blocks.reserve(s.blocks.size() + 1);
+        s.blocks.emplace_back(new block);
+        block& b = *s.blocks.back();
+        for (std::size_t i = block_size; i-- > 0;)
+        {
+            b.e[i].next = s.free;
+            s.free = &b.e[i];
+        }
+    }
+    entry* e = s.free;
+    s.free = e->next;
+    return e;
+}
+
+// Called holding s.mut.
+
+template <class Mutex>
+void
+basic_lock_manager<Mutex>::grow_table(shard& s)
+{
+    std::size_t n = 2 * (s.mask + 1);
+    std::unique_ptr<entry*[]> b(new entry*[n]());
+    for (std::size_t i = 0; i <= s.mask; ++i)
+        for (entry* e = s.buckets[i]; e != nullptr;)
+        {
+            entry* next = e->next;
+            entry*& head = b[hash(e->key) & (n - 1)];
+            e->next = head;
+            head = e;
+            e = next;
+        }
+    s.buckets = std::move(b);
+    s.mask = n - 1;
+}
+
+template <class Mutex>
+typename basic_lock_manager<Mutex>::entry*
+basic_lock_manager<Mutex>::pin(key_type id)
+{
+    std::uint64_t h = hash(id);
+    shard& s = shard_of(h);
+    std::lock_guard<std::mutex> _(s.mut);
+    entry* e = find(s, h, id);
+    if (e == nullptr)
+    {
+        e = take(s);
+        e->key = id;
+        e->pins = 0;
+        entry*& head = s.buckets[h & s.mask];
+        e->next = head;
+        head = e;
+        ++s.in_use;
+    }
+    ++e->pins;
+    return e;
+}
+
+// Called holding s.mut.
+
+template <class Mutex>
+void
+basic_lock_manager<Mutex>::unpin(shard& s, std::uint64_t h, entry* e) noexcept
+{
+    if (--e->pins != 0)
+        return;
+    entry** p = &s.buckets[h & s.mask];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    e->next = s.free;
+    s.free = e;
+    --s.in_use;
+}
+
+template <class Mutex>
+template <class Acquire>
+bool
+basic_lock_manager<Mutex>::acquire(key_type id, Acquire f)
+{
+    entry* e = pin(id);
+    bool r = false;
+    try
+    {
+        r = f(e->m);
+    }
+    catch (...)
+    {
+        std::uint64_t h = hash(id);
+        shard& s = shard_of(h);
+        std::lock_guard<std::mutex> _(s.mut);
+        unpin(s, h, e);
+        throw;
+    }
+    if (!r)
+    {
+        std::uint64_t h = hash(id);
+        shard& s = shard_of(h);
+        std::lock_guard<std::mutex> _(s.mut);
+        unpin(s, h, e);
+    }
+    return r;
+}
+
+template <class Mutex>
+template <class Release>
+void
+basic_lock_manager<Mutex>::release(key_type id, Release f)
+{
+    std::uint64_t h = hash(id);
+    shard& s = shard_of(h);
+    std::lock_guard<std::mutex> _(s.mut);
+    entry* e = find(s, h, id);
+    if (e == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "lock_manager: id not locked");
+    f(e->m);
+    unpin(s, h, e);
+}
+
+// The caller's own ownership pins the entry, so it may be used after the
+// shard's mutex is released.
+
+template <class Mutex>
+Mutex&
+basic_lock_manager<Mutex>::held(key_type id)
+{
+    std::uint64_t h = hash(id);
+    shard& s = shard_of(h);
+    std::lock_guard<std::mutex> _(s.mut);
+    entry* e = find(s, h, id);
+    if (e == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "lock_manager: id not locked");
+    return e->m;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_LOCK_MANAGER
@@ -0,0 +1,253 @@
+//---------------------------- lock_registry.cpp -------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "lock_registry.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace acme
+{
+
+namespace
+{
+
+void
+clear(lockstat_slot& s) noexcept
+{
+    s.readers.store(0, std::memory_order_relaxed);
+    s.upgrader.store(0, std::memory_order_relaxed);
+    s.writer.store(0, std::memory_order_relaxed);
+    s.waiting[0].store(0, std::memory_order_relaxed);
+    s.waiting[1].store(0, std::memory_order_relaxed);
+    s.writers_waiting.store(0, std::memory_order_relaxed);
+    s.address.store(0, std::memory_order_relaxed);
+    std::memset(s.name, 0, sizeof(s.name));
+    for (lockstat_mode_counters& c : s.modes)
+    {
+        c.acquisitions.store(0, std::memory_order_relaxed);
+        c.waits.store(0, std::memory_order_relaxed);
+        c.timeouts.store(0, std::memory_order_relaxed);
+        c.wait_ns.store(0, std::memory_order_relaxed);
+        c.max_wait_ns.store(0, std::memory_order_relaxed);
+    }
+}
+
+}  // unnamed
+
+// lock_registry
+
+std::string
+lock_registry::segment_name(int pid)
+{
+    return "/acme-lockstat." + std::to_string(pid);
+}
+
+// A segment left by an earlier process with our pid is replaced.
+
+lock_registry::lock_registry()
+    : name_(segment_name(getpid())),
+      header_(nullptr),
+      slots_(nullptr),
+      size_(sizeof(lockstat_header) + max_mutexes * sizeof(lockstat_slot))
+{
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                      0644);
+    if (fd < 0)
+        return;
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size_)) == 0)
+        p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        shm_unlink(name_.c_str());
+        return;
+    }
+    // The new object is zero filled:  every slot is free.
+    header_ = static_cast<lockstat_header*>(p);
+    slots_ = reinterpret_cast<lockstat_slot*>(header_ + 1);
+    header_->version = lockstat_version;
+    header_->slot_size = sizeof(lockstat_slot);
+    header_->slots = max_mutexes;
+    header_->pid = getpid();
+    header_->used.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header_->magic, lockstat_magic, sizeof(header_->magic));
+}
+
+// Never unmapped:  registry_stats that outlive the registry still write
+// their slots.
+
+lock_registry::~lock_registry()
+{
+    if (header_ != nullptr)
+        shm_unlink(name_.c_str());
+}
+
+lock_registry&
+lock_registry::get()
+{
+    static lock_registry registry;
+    return registry;
+}
+
+// Slots are taken lowest first, so that lockstat need look no further than
+// header_->used.
+
+lockstat_slot*
+lock_registry::claim(const void* mutex) noexcept
+{
+    if (header_ == nullptr)
+        return nullptr;
+    for (unsigned i = 0; i < max_mutexes; ++i)
+    {
+        lockstat_slot& s = slots_[i];
+        std::uint32_t expected = lockstat_slot::free_slot;
+        if (!s.state.compare_exchange_strong(expected, lockstat_slot::claimed))
+            continue;
+        clear(s);
+        s.address.store(reinterpret_cast<std::uintptr_t>(mutex),
+                        std::memory_order_relaxed);
+        s.state.store(lockstat_slot::live, std::memory_order_release);
+        std::uint32_t used = header_->used.load();
+        while (used < i + 1 &&
+               !header_->used.compare_exchange_weak(used, i + 1))
+            ;
+        return &s;
+    }
+    return nullptr;
+}
+
+void
+lock_registry::release(lockstat_slot* s) noexcept
+{
+    s->state.store(lockstat_slot::free_slot, std::memory_order_release);
+}
+
+// registry_stats
+
+// A slot of its own is private, zero filled and written by this mutex alone,
+// as a segment slot is.
+
+registry_stats::registry_stats()
+    : slot_(lock_registry::get().claim(this))
+{
+    if (slot_ == nullptr)
+    {
+        own_.reset(new lockstat_slot());
+        slot_ = own_.get();
+        slot_->address.store(reinterpret_cast<std::uintptr_t>(this),
+                             std::memory_order_relaxed);
+    }
+}
+
+registry_stats::~registry_stats()
+{
+    if (own_ == nullptr)
+        lock_registry::release(slot_);
+}
+
+// Called with the mutex's internal mutex held, as are acquired and released.
+
+void
+registry_stats::wait_end(wait_token t, lock_mode m, unsigned gate,
+                         bool acquired) noexcept
+{
+    std::uint64_t ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - t).count());
+    bump(slot_->waiting[gate - 1], -1);
+    if (m == lock_mode::exclusive)
+        bump(slot_->writers_waiting, -1);
+    lockstat_mode_counters& c = slot_->modes[static_cast<unsigned>(m)];
+    bump(c.waits, 1);
+    if (!acquired)
+        bump(c.timeouts, 1);
+    c.wait_ns.store(c.wait_ns.load(std::memory_order_relaxed) + ns,
+                    std::memory_order_relaxed);
+    if (ns > c.max_wait_ns.load(std::memory_order_relaxed))
+        c.max_wait_ns.store(ns, std::memory_order_relaxed);
+}
+
+void
+registry_stats::acquired(lock_mode m) noexcept
+{
+    bump(slot_->modes[static_cast<unsigned>(m)].acquisitions, 1);
+    switch (m)
+    {
+    case lock_mode::shared:
+        bump(slot_->readers, 1);
+        break;
+    case lock_mode::upgrade:
+        slot_->upgrader.store(1, std::memory_order_relaxed);
+        break;
+    case lock_mode::exclusive:
+        slot_->writer.store(1, std::memory_order_relaxed);
+        break;
+    }
+}
+
+void
+registry_stats::released(lock_mode m) noexcept
+{
+    switch (m)
+    {
+    case lock_mode::shared:
+        bump(slot_->readers, -1);
+        break;
+    case lock_mode::upgrade:
+        slot_->upgrader.store(0, std::memory_order_relaxed);
+        break;
+    case lock_mode::exclusive:
+        slot_->writer.store(0, std::memory_order_relaxed);
+        break;
+    }
+}
+
+// Names longer than the slot's are cut short.  Concurrent readers may see a
+// name half written.
+
+void
+registry_stats::set_name(const char* name) const noexcept
+{
+    std::size_t n = std::min(std::strlen(name), sizeof(slot_->name) - 1);
+    std::memcpy(slot_->name, name, n);
+    std::memset(slot_->name + n, 0, sizeof(slot_->name) - n);
+}
+
+basic_stats::counters
+registry_stats::snapshot(lock_mode m) const noexcept
+{
+    const lockstat_mode_counters& c = slot_->modes[static_cast<unsigned>(m)];
+    basic_stats::counters r;
+    r.acquisitions = c.acquisitions.load(std::memory_order_relaxed);
+    r.waits = c.waits.load(std::memory_order_relaxed);
+    r.timeouts = c.timeouts.load(std::memory_order_relaxed);
+    r.wait_ns = c.wait_ns.load(std::memory_order_relaxed);
+    r.max_wait_ns = c.max_wait_ns.load(std::memory_order_relaxed);
+    return r;
+}
+
+// registered_upgrade_mutex
+
+template class basic_upgrade_mutex<unsigned, condvar_wait, writer_priority,
+                                   registry_stats>;
+
+}  // acme
+
+#endif  // __linux__
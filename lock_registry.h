@@ -0,0 +1,210 @@
+//----------------------------- lock_registry.h --------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_REGISTRY
+#define UPGRADE_MUTEX_REGISTRY
+
+/*
+    <lock_registry.h> synopsis  (Linux only)
+
+namespace acme
+{
+
+// A stats policy publishing the mutex's ownership, waiters and counters in
+// the process's registry segment, where lockstat reads them.
+
+class registry_stats
+{
+public:
+    registry_stats();
+    ~registry_stats();
+
+    registry_stats(const registry_stats&) = delete;
+    registry_stats& operator=(const registry_stats&) = delete;
+
+    void set_name(const char* name) const noexcept;  // shown by lockstat
+    basic_stats::counters snapshot(lock_mode m) const noexcept;
+};
+
+typedef basic_upgrade_mutex<unsigned, condvar_wait, writer_priority,
+                            registry_stats> registered_upgrade_mutex;
+
+// The process's registry segment, created by the first registry_stats.
+
+class lock_registry
+{
+public:
+    static constexpr unsigned max_mutexes = 1024;
+
+    static lock_registry& get();
+    static std::string segment_name(int pid);
+
+    const char* name() const noexcept;
+    bool published() const noexcept;       // false: the segment is unavailable
+};
+
+}  // acme
+*/
+
+#ifdef __linux__
+
+#include "upgrade_mutex.h"
+#include <memory>
+#include <string>
+
+namespace acme
+{
+
+// Segment layout
+//
+// A registry segment is a POSIX shared memory object, /dev/shm/acme-lockstat.
+// <pid>, holding a lockstat_header and then max_mutexes lockstat_slots.  The
+// process writes the slots; readers map the segment read only.  Each slot has
+// one writer at a time, the mutex holding it, which updates it with its
+// internal mutex held; readers see each field individually up to date.
+
+struct lockstat_mode_counters
+{
+    std::atomic<std::uint64_t> acquisitions;   // includes conversions
+    std::atomic<std::uint64_t> waits;          // gate waits
+    std::atomic<std::uint64_t> timeouts;       // waits timed out or stopped
+    std::atomic<std::uint64_t> wait_ns;
+    std::atomic<std::uint64_t> max_wait_ns;
+};
+
+struct lockstat_slot
+{
+    enum : std::uint32_t {free_slot, claimed, live};
+
+    std::atomic<std::uint32_t> state;
+    std::atomic<std::uint32_t> readers;        // shared owners
+    std::atomic<std::uint32_t> upgrader;       // 1 if upgrade is owned
+    std::atomic<std::uint32_t> writer;         // 1 if exclusive is owned
+    std::atomic<std::uint32_t> waiting[2];     // blocked at gate1, gate2
+    std::atomic<std::uint32_t> writers_waiting;
+    std::uint32_t              reserved;
+    std::atomic<std::uint64_t> address;
+    char                       name[64];
+    lockstat_mode_counters     modes[3];       // by lock_mode
+};
+
+struct lockstat_header
+{
+    char                       magic[8];       // "acmeLKST"
+    std::uint32_t              version;
+    std::uint32_t              slot_size;
+    std::uint32_t              slots;
+    std::int32_t               pid;
+    std::atomic<std::uint32_t> used;           // slots ever claimed
+    std::uint32_t              reserved;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "lockstat segment: counters must be lock free");
+
+const char lockstat_magic[8] = {'a', 'c', 'm', 'e', 'L', 'K', 'S', 'T'};
+const std::uint32_t lockstat_version = 1;
+
+// lock_registry
+
+// Created by the first registry_stats, it lives until the process exits and
+// then removes the segment's name.  The mapping stays:  a registry_stats may
+// outlive the registry, made by a static constructed before it or used by a
+// thread still running at exit.  A mutex that finds the segment full, or
+// there is none, gets a slot of its own in the process's memory.
+
+class lock_registry
+{
+public:
+    static constexpr unsigned max_mutexes = 1024;
+
+private:
+    std::string      name_;
+    lockstat_header* header_;
+    lockstat_slot*   slots_;
+    std::size_t      size_;
+
+    lock_registry();
+
+public:
+    ~lock_registry();
+
+    lock_registry(const lock_registry&) = delete;
+    lock_registry& operator=(const lock_registry&) = delete;
+
+    static lock_registry& get();
+    static std::string segment_name(int pid);
+
+    const char* name() const noexcept {return name_.c_str();}
+    bool published() const noexcept {return header_ != nullptr;}
+
+    // nullptr:  no slot is free, or there is no segment
+    lockstat_slot* claim(const void* mutex) noexcept;
+    static void release(lockstat_slot* s) noexcept;
+};
+
+// registry_stats
+
+class registry_stats
+{
+    lockstat_slot*                 slot_;
+    std::unique_ptr<lockstat_slot> own_;    // when the segment has no room
+
+public:
+    typedef std::chrono::steady_clock::time_point wait_token;
+
+    registry_stats();
+    ~registry_stats();
+
+    registry_stats(const registry_stats&) = delete;
+    registry_stats& operator=(const registry_stats&) = delete;
+
+    wait_token
+    wait_begin(lock_mode m, unsigned gate) noexcept
+    {
+        bump(slot_->waiting[gate - 1], 1);
+        if (m == lock_mode::exclusive)
+            bump(slot_->writers_waiting, 1);
+        return std::chrono::steady_clock::now();
+    }
+
+    void wait_end(wait_token t, lock_mode m, unsigned gate,
+                  bool acquired) noexcept;
+    void acquired(lock_mode m) noexcept;
+    void released(lock_mode m) noexcept;
+
+    void set_name(const char* name) const noexcept;
+    basic_stats::counters snapshot(lock_mode m) const noexcept;
+
+private:
+    // Only the owner of the internal mutex writes the slot.
+
+    template <class T>
+        static
+        void
+        bump(std::atomic<T>& x, int d) noexcept
+        {
+            x.store(x.load(std::memory_order_relaxed) + static_cast<T>(d),
+                    std::memory_order_relaxed);
+        }
+};
+
+typedef basic_upgrade_mutex<unsigned, condvar_wait, writer_priority,
+                            registry_stats> registered_upgrade_mutex;
+
+extern template class basic_upgrade_mutex<unsigned, condvar_wait,
+                                          writer_priority, registry_stats>;
+
+}  // acme
+
+#endif  // __linux__
+
+#endif  // UPGRADE_MUTEX_REGISTRY
@@ -0,0 +1,358 @@
+//------------------------------- lockstat.cpp ---------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+//  lockstat [-d seconds] [-n count] [-t rows] [pid ...]
+//
+//  Shows the registered_upgrade_mutexes of the named processes (of every
+//  process publishing a registry segment when none are named), the most
+//  waited on first.  Every -d seconds (default 1) it prints, for each mutex,
+//  its owners and blocked threads at that moment; over the interval, the
+//  acquisitions, the time threads spent blocked and the waits that timed out;
+//  and the longest wait so far.  It stops after -n screens (default: never)
+//  and shows at most -t rows (default 20).
+//
+//  RD, UP, WR:  shared owners, upgrade owner, exclusive owner
+//  G1, G2, WW:  threads blocked at gate1, at gate2, and wanting exclusive
+//  WAIT%:       blocked thread time per second, in percent of one thread
+
+#include "lock_registry.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+// A mapped registry segment
+
+class segment
+{
+    const acme::lockstat_header* header_;
+    std::size_t                  size_;
+
+public:
+    explicit segment(int pid)
+        : header_(nullptr), size_(0)
+    {
+        std::string name = acme::lock_registry::segment_name(pid);
+        int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0)
+            return;
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >=
+                                   sizeof(acme::lockstat_header))
+        {
+            size_ = static_cast<std::size_t>(st.st_size);
+            p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (p == MAP_FAILED)
+            return;
+        header_ = static_cast<const acme::lockstat_header*>(p);
+        if (std::memcmp(header_->magic, acme::lockstat_magic,
+                        sizeof(header_->magic)) != 0 ||
+            header_->version != acme::lockstat_version ||
+            header_->slot_size != sizeof(acme::lockstat_slot) ||
+            sizeof(acme::lockstat_header) +
+                header_->slots * sizeof(acme::lockstat_slot) > size_)
+        {
+            munmap(const_cast<acme::lockstat_header*>(header_), size_);
+            header_ = nullptr;
+        }
+    }
+
+    ~segment()
+    {
+        if (header_ != nullptr)
+            munmap(const_cast<acme::lockstat_header*>(header_), size_);
+    }
+
+    segment(const segment&) = delete;
+    segment& operator=(const segment&) = delete;
+
+    bool valid() const {return header_ != nullptr;}
+
+    unsigned
+    used() const
+    {
+        return std::min(header_->used.load(), header_->slots);
+    }
+
+    const acme::lockstat_slot&
+    slot(unsigned i) const
+    {
+        return reinterpret_cast<const acme::lockstat_slot*>(header_ + 1)[i];
+    }
+};
+
+// One mutex, as read at one time
+
+struct sample
+{
+    int           pid;
+    unsigned      slot;
+    std::uint64_t address;
+    std::string   name;
+    unsigned      readers;
+    unsigned      upgrader;
+    unsigned      writer;
+    unsigned      waiting[2];
+    unsigned      writers_waiting;
+    std::uint64_t acquisitions;
+    std::uint64_t wait_ns;
+    std::uint64_t max_wait_ns;
+    std::uint64_t timeouts;
+};
+
+typedef std::tuple<int, unsigned, std::uint64_t> sample_key;
+
+sample_key
+key(const sample& s)
+{
+    return sample_key(s.pid, s.slot, s.address);
+}
+
+std::vector<int>
+publishing_pids()
+{
+    std::vector<int> v;
+    DIR* d = opendir("/dev/shm");
+    if (d == nullptr)
+        return v;
+    const char prefix[] = "acme-lockstat.";
+    while (dirent* e = readdir(d))
+    {
+        if (std::strncmp(e->d_name, prefix, sizeof(prefix) - 1) != 0)
+            continue;
+        char* end;
+        long pid = std::strtol(e->d_name + sizeof(prefix) - 1, &end, 10);
+        if (*end == '\0' && pid > 0)
+            v.push_back(static_cast<int>(pid));
+    }
+    closedir(d);
+    std::sort(v.begin(), v.end());
+    return v;
+}
+
+bool
+alive(int pid)
+{
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+void
+read_segment(int pid, std::vector<sample>& out)
+{
+    segment seg(pid);
+    if (!seg.valid())
+        return;
+    for (unsigned i = 0; i < seg.used(); ++i)
+    {
+        const acme::lockstat_slot& s = seg.slot(i);
+        if (s.state.load(std::memory_order_acquire) !=
+                                                     acme::lockstat_slot::live)
+            continue;
+        sample x;
+        x.pid = pid;
+        x.slot = i;
+        x.address = s.address.load(std::memory_order_relaxed);
+        char name[sizeof(s.name) + 1];
+        std::memcpy(name, s.name, sizeof(s.name));
+        name[sizeof(s.name)] = '\0';
+        x.name = name;
+        x.readers = s.readers.load(std::memory_order_relaxed);
+        x.upgrader = s.upgrader.load(std::memory_order_relaxed);
+        x.writer = s.writer.load(std::memory_order_relaxed);
+        x.waiting[0] = s.waiting[0].load(std::memory_order_relaxed);
+        x.waiting[1] = s.waiting[1].load(std::memory_order_relaxed);
+        x.writers_waiting = s.writers_waiting.load(std::memory_order_relaxed);
+        x.acquisitions = 0;
+        x.wait_ns = 0;
+        x.max_wait_ns = 0;
+        x.timeouts = 0;
+        for (const acme::lockstat_mode_counters& c : s.modes)
+        {
+            x.acquisitions += c.acquisitions.load(std::memory_order_relaxed);
+            x.wait_ns += c.wait_ns.load(std::memory_order_relaxed);
+            x.max_wait_ns = std::max(x.max_wait_ns, c.max_wait_ns.load(
+                                                    std::memory_order_relaxed));
+            x.timeouts += c.timeouts.load(std::memory_order_relaxed);
+        }
+        out.push_back(x);
+    }
+}
+
+std::vector<sample>
+read_all(const std::vector<int>& wanted)
+{
+    std::vector<sample> v;
+    for (int pid : wanted.empty() ? publishing_pids() : wanted)
+        if (alive(pid))
+            read_segment(pid, v);
+    return v;
+}
+
+// A row of the view:  the sample and what changed since the previous one.
+// The longest wait is the longest of the mutex's life.
+
+struct row
+{
+    const sample* s;
+    std::uint64_t acquisitions;
+    std::uint64_t wait_ns;
+    std::uint64_t timeouts;
+};
+
+void
+show(const std::vector<sample>& now, const std::map<sample_key, sample>& before,
+     double seconds, std::size_t max_rows)
+{
+    std::vector<row> rows;
+    for (const sample& s : now)
+    {
+        row r = {&s, s.acquisitions, s.wait_ns, s.timeouts};
+        auto i = before.find(key(s));
+        if (i != before.end())
+        {
+            const sample& b = i->second;
+            r.acquisitions -= b.acquisitions;
+            r.wait_ns -= b.wait_ns;
+            r.timeouts -= b.timeouts;
+        }
+        rows.push_back(r);
+    }
+    std::stable_sort(rows.begin(), rows.end(), [](const row& x, const row& y)
+    {
+        if (x.wait_ns != y.wait_ns)
+            return x.wait_ns > y.wait_ns;
+        return x.s->waiting[0] + x.s->waiting[1] >
+               y.s->waiting[0] + y.s->waiting[1];
+    });
+    std::cout << now.size() << " mutexes, interval " << std::fixed
+              << std::setprecision(1) << seconds << "s\n"
+              << std::right << std::setw(8) << "PID" << ' ' << std::left
+              << std::setw(24) << "MUTEX" << std::right << std::setw(5)
+              << "RD" << std::setw(4) << "UP" << std::setw(4) << "WR"
+              << std::setw(5) << "G1" << std::setw(5) << "G2" << std::setw(5)
+              << "WW" << std::setw(12) << "ACQ/s" << std::setw(10)
+              << "WAIT%" << std::setw(12) << "MAX us" << std::setw(9)
+              << "TIMEOUT" << '\n';
+    for (std::size_t i = 0; i < rows.size() && i < max_rows; ++i)
+    {
+        const row& r = rows[i];
+        const sample& s = *r.s;
+        std::string name = s.name;
+        if (name.empty())
+        {
+            std::ostringstream os;
+            os << "0x" << std::hex << s.address;
+            name = os.str();
+        }
+        if (name.size() > 23)
+            name.resize(23);
+        // Blocked thread-seconds per second, as a percentage of one thread.
+        double wait = seconds > 0 ? r.wait_ns / (seconds * 1e7) : 0;
+        std::cout << std::right << std::setw(8) << s.pid << ' ' << std::left
+                  << std::setw(24) << name << std::right << std::setw(5)
+                  << s.readers << std::setw(4) << s.upgrader << std::setw(4)
+                  << s.writer << std::setw(5) << s.waiting[0] << std::setw(5)
+                  << s.waiting[1] << std::setw(5) << s.writers_waiting
+                  << std::setprecision(0) << std::setw(12)
+                  << (seconds > 0 ? r.acquisitions / seconds : 0)
+                  << std::setprecision(1) << std::setw(10) << wait
+                  << std::setw(12) << s.max_wait_ns / 1e3 << std::setw(9)
+                  << r.timeouts << '\n';
+    }
+    std::cout.flush();
+}
+
+void
+usage(const char* prog)
+{
+    std::cerr << "usage: " << prog
+              << " [-d seconds] [-n count] [-t rows] [pid ...]\n";
+    std::exit(2);
+}
+
+}  // unnamed
+
+int main(int argc, char* argv[])
+{
+    double delay = 1;
+    long count = 0;
+    std::size_t max_rows = 20;
+    int c;
+    while ((c = getopt(argc, argv, "d:n:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            delay = std::atof(optarg);
+            if (delay <= 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            count = std::atol(optarg);
+            break;
+        case 't':
+            max_rows = static_cast<std::size_t>(std::atol(optarg));
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    std::vector<int> wanted;
+    for (int i = optind; i < argc; ++i)
+    {
+        char* end;
+        long pid = std::strtol(argv[i], &end, 10);
+        if (*end != '\0' || pid <= 0)
+            usage(argv[0]);
+        wanted.push_back(static_cast<int>(pid));
+    }
+    bool clear = count != 1 && isatty(STDOUT_FILENO);
+    std::map<sample_key, sample> before;
+    for (const sample& s : read_all(wanted))
+        before[key(s)] = s;
+    auto t0 = std::chrono::steady_clock::now();
+    for (long i = 0; count == 0 || i < count; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(delay));
+        std::vector<sample> now = read_all(wanted);
+        auto t1 = std::chrono::steady_clock::now();
+        if (clear)
+            std::cout << "\033[H\033[2J";
+        else if (i != 0)
+            std::cout << '\n';
+        show(now, before, std::chrono::duration<double>(t1 - t0).count(),
+             max_rows);
+        before.clear();
+        for (const sample& s : now)
+            before[key(s)] = s;
+        t0 = t1;
+    }
+}
@@ -0,0 +1,331 @@
+//-------------------------------- lru_cache.h ---------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_LRU_CACHE
+#define UPGRADE_MUTEX_LRU_CACHE
+
+/*
+    <lru_cache.h> synopsis
+
+namespace acme
+{
+
+// A map of at most capacity entries that evicts the least recently used.
+// Hits own the Mutex shared; recency is recorded approximately.  Mutex is
+// any mutex with the upgrade_mutex interface.
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Mutex = upgrade_mutex>
+class lru_cache
+{
+public:
+    typedef Key         key_type;
+    typedef T           mapped_type;
+    typedef Mutex       mutex_type;
+
+    static constexpr unsigned buffer_size = 32;    // hits per stripe
+
+    explicit lru_cache(std::size_t capacity);     // 0:  system_error(EINVAL)
+    ~lru_cache();
+
+    lru_cache(const lru_cache&) = delete;
+    lru_cache& operator=(const lru_cache&) = delete;
+
+    std::optional<T> get(const Key& k);
+    void put(const Key& k, const T& v);           // insert or assign
+    bool erase(const Key& k);
+
+    std::size_t size() const;
+    std::size_t capacity() const noexcept;
+    unsigned long drains() const;                 // batches of hits applied
+};
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+
+namespace acme
+{
+
+namespace detail
+{
+
+inline thread_local int lru_stripe_tag;
+
+}  // detail
+
+// The entries are on a doubly linked list, most recent first, and indexed
+// by an unordered_map.  A hit owns the mutex shared and so cannot move its
+// entry:  it marks the entry pending and appends it to a buffer of hits, one
+// of a power of two of them, at least one per core, which the calling thread
+// hashes to.  When a hit fills its buffer it tries to convert to upgrade
+// ownership; if no other thread has it, the hit converts on to exclusive and
+// drains every buffer, moving each pending entry to the front in the order
+// the buffers recorded them.  A hit finding its buffer full is dropped, and
+// a hit on an entry already pending is not recorded again; the order is
+// approximate, but a hit never waits for a writer that is not yet waiting.
+//
+// Every exclusive section drains the buffers before it unlinks an entry, so
+// a buffer never holds a pointer to a removed entry.  A put looks up its key
+// holding upgrade ownership, while hits go on, and only for a new key
+// allocates its entry, still beside the hits.  With the cache full it
+// evicts the back, chosen once the drain has moved every recorded hit to
+// the front.
+
+template <class Key, class T, class Hash = std::hash<Key>,
+          class Mutex = upgrade_mutex>
+class lru_cache
+{
+public:
+    typedef Key         key_type;
+    typedef T           mapped_type;
+    typedef Mutex       mutex_type;
+
+    static constexpr unsigned buffer_size = 32;
+
+private:
+    struct link
+    {
+        link* prev;
+        link* next;
+    };
+
+    struct node
+        : link
+    {
+        Key               key;
+        T                 value;
+        std::atomic<bool> pending;
+
+        node(const Key& k, const T& v) : key(k), value(v), pending(false) {}
+    };
+
+    struct alignas(64) stripe
+    {
+        std::atomic<unsigned> n{0};
+        node*                 hits[buffer_size];
+    };
+
+    mutable Mutex                        mut_;
+    link                                 head_;  // next:  most recent
+    std::unordered_map<Key, node*, Hash> index_;
+    const std::size_t                    capacity_;
+    std::unique_ptr<stripe[]>            stripes_;
+    unsigned                             stripe_mask_;
+    unsigned long                        drains_;
+
+public:
+    explicit lru_cache(std::size_t capacity);
+    ~lru_cache();
+
+    lru_cache(const lru_cache&) = delete;
+    lru_cache& operator=(const lru_cache&) = delete;
+
+    std::optional<T> get(const Key& k);
+    void put(const Key& k, const T& v);
+    bool erase(const Key& k);
+
+    std::size_t
+    size() const
+    {
+        shared_lock<Mutex> _(mut_);
+        return index_.size();
+    }
+
+    std::size_t capacity() const noexcept {return capacity_;}
+
+    unsigned long
+    drains() const
+    {
+        shared_lock<Mutex> _(mut_);
+        return drains_;
+    }
+
+private:
+    stripe& this_thread_stripe() noexcept;
+    void drain() noexcept;
+
+    static
+    void
+    unlink(link* n) noexcept
+    {
+        n->prev->next = n->next;
+        n->next->prev = n->prev;
+    }
+
+    void
+    push_front(link* n) noexcept
+    {
+        n->prev = &head_;
+        n->next = head_.next;
+        head_.next->prev = n;
+        head_.next = n;
+    }
+};
+
+template <class Key, class T, class Hash, class Mutex>
+lru_cache<Key, T, Hash, Mutex>::lru_cache(std::size_t capacity)
+    : capacity_(capacity),
+      drains_(0)
+{
+    if (capacity == 0)
+        throw std::system_error(std::error_code(EINVAL, std::system_category()),
+                                "lru_cache: capacity 0");
+    head_.prev = head_.next = &head_;
+    unsigned n = 1;
+    while (n < std::thread::hardware_concurrency())
+        n *= 2;
+    stripes_.reset(new stripe[n]);
+    stripe_mask_ = n - 1;
+    index_.reserve(capacity);
+}
+
+template <class Key, class T, class Hash, class Mutex>
+lru_cache<Key, T, Hash, Mutex>::~lru_cache()
+{
+    for (link* l = head_.next; l != &head_;)
+    {
+        link* next = l->next;
+        delete static_cast<node*>(l);
+        l = next;
+    }
+}
+
+template <class Key, class T, class Hash, class Mutex>
+typename lru_cache<Key, T, Hash, Mutex>::stripe&
+lru_cache<Key, T, Hash, Mutex>::this_thread_stripe() noexcept
+{
+    std::uint64_t h =
+        reinterpret_cast<std::uintptr_t>(&detail::lru_stripe_tag);
+    h *= 0x9E3779B97F4A7C15ull;
+    return stripes_[static_cast<unsigned>(h >> 40) & stripe_mask_];
+}
+
+template <class Key, class T, class Hash, class Mutex>
+std::optional<T>
+lru_cache<Key, T, Hash, Mutex>::get(const Key& k)
+{
+    shared_lock<Mutex> sl(mut_);
+    auto i = index_.find(k);
+    if (i == index_.end())
+        return std::nullopt;
+    node* n = i->second;
+    std::optional<T> r(n->value);
+    if (n->pending.exchange(true, std::memory_order_relaxed))
+        return r;
+    stripe& s = this_thread_stripe();
+    unsigned j = s.n.fetch_add(1, std::memory_order_relaxed);
+    if (j < buffer_size)
+        s.hits[j] = n;
+    else
+        n->pending.store(false, std::memory_order_relaxed);
+    if (j + 1 >= buffer_size)
+    {
+        upgrade_lock<Mutex> ul(std::move(sl), std::try_to_lock);
+        if (ul.owns_lock())
+        {
+            unique_lock<Mutex> _(std::move(ul));
+            drain();
+        }
+    }
+    return r;
+}
+
+// Requires exclusive ownership:  every hit has finished writing its buffer.
+
+template <class Key, class T, class Hash, class Mutex>
+void
+lru_cache<Key, T, Hash, Mutex>::drain() noexcept
+{
+    bool any = false;
+    for (unsigned i = 0; i <= stripe_mask_; ++i)
+    {
+        stripe& s = stripes_[i];
+        unsigned m = std::min(s.n.load(std::memory_order_relaxed),
+                              buffer_size);
+        for (unsigned j = 0; j < m; ++j)
+        {
+            node* n = s.hits[j];
+            n->pending.store(false, std::memory_order_relaxed);
+            unlink(n);
+            push_front(n);
+        }
+        if (m != 0)
+        {
+            s.n.store(0, std::memory_order_relaxed);
+            any = true;
+        }
+    }
+    drains_ += any;
+}
+
+template <class Key, class T, class Hash, class Mutex>
+void
+lru_cache<Key, T, Hash, Mutex>::put(const Key& k, const T& v)
+{
+    upgrade_lock<Mutex> ul(mut_);
+    auto i = index_.find(k);
+    if (i != index_.end())
+    {
+        unique_lock<Mutex> _(std::move(ul));
+        drain();
+        node* n = i->second;
+        n->value = v;
+        unlink(n);
+        push_front(n);
+        return;
+    }
+    std::unique_ptr<node> fresh(new node(k, v));
+    std::unique_ptr<node> evicted;
+    {
+        unique_lock<Mutex> _(std::move(ul));
+        drain();
+        if (index_.size() == capacity_)
+        {
+            evicted.reset(static_cast<node*>(head_.prev));
+            unlink(evicted.get());
+            index_.erase(evicted->key);
+        }
+        index_.emplace(k, fresh.get());
+        push_front(fresh.release());
+    }
+}
+
+template <class Key, class T, class Hash, class Mutex>
+bool
+lru_cache<Key, T, Hash, Mutex>::erase(const Key& k)
+{
+    std::unique_ptr<node> old;
+    unique_lock<Mutex> _(mut_);
+    auto i = index_.find(k);
+    if (i == index_.end())
+        return false;
+    drain();
+    old.reset(i->second);
+    index_.erase(i);
+    unlink(old.get());
+    return true;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_LRU_CACHE
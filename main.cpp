@@ -11,7 +11,11 @@
 
 #include "upgrade_mutex.h"
 #include <thread>
+#include <atomic>
 #include <cassert>
+#include <memory>
+#include <type_traits>
+#include <vector>
 
 #include <iostream>
 
@@ -535,6 +539,82 @@ void try_for_counter_clockwise()
     print("try_for_counter_clockwise = ", count, '\n');
 }
 
+#ifdef __cpp_lib_jthread
+
+void cancellable_upgradable(std::stop_token st)
+{
+    unsigned count = 0;
+    unsigned cancelled = 0;
+    while (!st.stop_requested() && mut.lock_upgrade(st))
+    {
+        assert(state == reading);
+        if (mut.unlock_upgrade_and_lock(st))
+        {
+            state = writing;
+            assert(state == writing);
+            state = reading;
+            mut.unlock();
+            ++count;
+        }
+        else
+        {
+            //  still upgrade
+            assert(state == reading);
+            mut.unlock_upgrade();
+            ++cancelled;
+        }
+    }
+    print("cancellable_upgradable = ", count, " cancelled = ", cancelled, '\n');
+}
+
+// The main thread owns mut shared, so the conversion waits on gate2, holding
+// new readers back, until the stop request.  The converter must then still
+// own upgrade, and readers be admitted again.
+
+void cancelled_conversion()
+{
+    std::atomic<int> phase{0};
+    mut.lock_shared();
+    std::jthread t([&](std::stop_token st)
+    {
+        bool got = mut.lock_upgrade(st);
+        assert(got);
+        phase = 1;
+        got = mut.unlock_upgrade_and_lock(st);
+        assert(!got);
+        phase = 2;
+        while (phase != 3)
+            std::this_thread::yield();
+        mut.unlock_upgrade();
+        (void)got;
+    });
+    while (phase != 1)
+        std::this_thread::yield();
+    // Waits until the converter has entered and shuts out new readers
+    while (mut.try_lock_shared())
+    {
+        mut.unlock_shared();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    t.request_stop();
+    while (phase != 2)
+        std::this_thread::yield();
+    bool restored = !mut.try_lock_upgrade() && !mut.try_lock();
+    assert(restored);
+    bool readers = mut.try_lock_shared();
+    assert(readers);
+    mut.unlock_shared();
+    mut.unlock_shared();
+    phase = 3;
+    t.join();
+    bool free = mut.try_lock();
+    assert(free);
+    mut.unlock();
+    print("cancelled_conversion = ", restored && readers && free, '\n');
+}
+
+#endif  // __cpp_lib_jthread
+
 void
 test_upgrade_mutex()
 {
@@ -611,99 +691,1883 @@ test_upgrade_mutex()
         t1.join();
         t2.join();
     }
+#ifdef __cpp_lib_jthread
+    {
+        std::thread t1(reader);
+        std::jthread t2(cancellable_upgradable);
+        std::thread t3(reader);
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        t2.request_stop();
+        t2.join();
+        t1.join();
+        t3.join();
+    }
+    cancelled_conversion();
+#endif
 }
 
 }
 
-#include <vector>
+#include "biased_upgrade_mutex.h"
+
+namespace B
+{
+
+acme::biased_upgrade_mutex mut;
+long owned = 0;     // written only holding mut exclusively
+
+// One thread, the bias owner, locks and unlocks as fast as it can; the
+// contenders each lock every 200 us.  The owner keeps earning the bias back
+// while the contenders revoke it, so rebiasing races revocations.
+
+void owner(std::atomic<bool>& stop, unsigned& count)
+{
+    while (!stop)
+    {
+        mut.lock();
+        long o = ++owned;
+        assert(owned == o);
+        mut.unlock();
+        ++count;
+    }
+}
+
+void contender(std::atomic<bool>& stop, unsigned& count)
+{
+    while (!stop)
+    {
+        mut.lock();
+        long o = ++owned;
+        std::this_thread::yield();
+        assert(owned == o);
+        mut.unlock();
+        ++count;
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+void
+test_biased_upgrade_mutex()
+{
+    std::atomic<bool> stop{false};
+    unsigned counts[4] = {};
+    std::thread t0(owner, std::ref(stop), std::ref(counts[0]));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::thread t1(contender, std::ref(stop), std::ref(counts[1]));
+    std::thread t2(contender, std::ref(stop), std::ref(counts[2]));
+    std::thread t3(contender, std::ref(stop), std::ref(counts[3]));
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+    stop = true;
+    t0.join();
+    t1.join();
+    t2.join();
+    t3.join();
+    assert(counts[1] != 0 && counts[2] != 0 && counts[3] != 0);
+    print("biased owner = ", counts[0], " contenders = ", counts[1], ' ',
+          counts[2], ' ', counts[3], " revocations = ", mut.revocations(),
+          '\n');
+}
 
-namespace Assignment
+}  // B
+
+#include "lock_manager.h"
+#include <cstdlib>
+#include <new>
+#include <system_error>
+
+// Counts the calling thread's allocations, for the lock_manager cases.
+
+thread_local std::size_t allocations = 0;
+
+void*
+operator new(std::size_t n)
 {
+    ++allocations;
+    if (void* p = std::malloc(n != 0 ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+// gcc, inlining these, takes the memory for operator new's, not malloc's.
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
 
-class A
+void operator delete(void* p) noexcept {std::free(p);}
+void operator delete(void* p, std::size_t) noexcept {std::free(p);}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+namespace M
 {
-    typedef acme::upgrade_mutex            mutex_type;
-    typedef std::shared_lock<mutex_type>   SharedLock;
-    typedef acme::upgrade_lock<mutex_type> UpgradeLock;
-    typedef std::unique_lock<mutex_type>   Lock;
 
-    mutable mutex_type  mut_;
-    std::vector<double> data_;
+// Holds count IDs from first at once, in every mode and through the
+// conversions, then gives them all back.
+
+void hold(acme::lock_manager& lm, std::uint64_t first, unsigned count)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        std::uint64_t id = first + i;
+        switch (i % 3)
+        {
+        case 0:
+            lm.lock_shared(id);
+            break;
+        case 1:
+            lm.lock_upgrade(id);
+            lm.unlock_upgrade_and_lock(id);
+            break;
+        case 2:
+            lm.lock(id);
+            lm.unlock_and_lock_upgrade(id);
+            break;
+        }
+    }
+    for (unsigned i = 0; i < count; ++i)
+    {
+        std::uint64_t id = first + i;
+        switch (i % 3)
+        {
+        case 0:
+            lm.unlock_shared(id);
+            break;
+        case 1:
+            lm.unlock(id);
+            break;
+        case 2:
+            lm.unlock_upgrade_and_lock_shared(id);
+            lm.unlock_shared(id);
+            break;
+        }
+    }
+}
 
-public:
+// Once as many IDs have been held at once as will be again, entries are
+// recycled rather than allocated:  fresh IDs take pooled entries, and the
+// pool does not grow.
 
-    A(const A& a)
+void recycled()
+{
+    acme::lock_manager lm(1, 4);
+    hold(lm, 0, 200);
+    const std::size_t warm = lm.entries();
+    assert(warm >= 200);
+    std::size_t before = allocations;
+    for (unsigned round = 1; round <= 100; ++round)
+        hold(lm, round * 1000, 200);
+    std::size_t allocated = allocations - before;
+    assert(allocated == 0);
+    assert(lm.entries() == warm);
+    bool refused = false;
+    try
+    {
+        lm.unlock(7);
+    }
+    catch (const std::system_error& e)
     {
-        SharedLock _(a.mut_);
-        data_ = a.data_;
+        refused = e.code().value() == EPERM;
     }
+    assert(refused);
+    print("lock_manager recycled = ", allocated == 0 && refused, " entries = ",
+          warm, '\n');
+}
+
+// Threads contend for a few IDs spread over the shards.  After each has
+// locked every ID once, none allocates.
+
+void steady()
+{
+    acme::lock_manager lm;
+    const unsigned ids = 16;
+    std::atomic<std::size_t> allocated{0};
+    std::atomic<unsigned> warmed{0};
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> t;
+    for (unsigned k = 0; k < 4; ++k)
+        t.emplace_back([&, k]
+        {
+            hold(lm, 0, ids + 2);
+            ++warmed;
+            while (warmed != 4)
+                std::this_thread::yield();
+            std::size_t before = allocations;
+            for (unsigned i = k; !stop; ++i)
+                hold(lm, i % ids, 1 + i % 3);
+            allocated += allocations - before;
+        });
+    while (warmed != 4)
+        std::this_thread::yield();
+    const std::size_t warm = lm.entries();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    stop = true;
+    for (auto& x : t)
+        x.join();
+    assert(allocated == 0);
+    assert(lm.entries() == warm);
+    print("lock_manager steady = ", allocated == 0, " entries = ", warm,
+          '\n');
+}
+
+void
+test_lock_manager()
+{
+    recycled();
+    steady();
+}
+
+}  // M
+
+#include "adaptive_upgrade_mutex.h"
+#include "ownership_token.h"
+#include "read_mostly_upgrade_mutex.h"
+#include "upgrade_mutex_profile.h"
+
+namespace O
+{
+
+// The main thread takes m in mode and detaches its ownership, which another
+// thread attaches and releases.  m must stay owned throughout:  writers are
+// shut out while the ownership is detached and while it is attached, and
+// let in once it is released.  With attach false the other thread drops the
+// token instead.  The main thread then uses m again, which catches
+// bookkeeping left behind by the detach.
 
-    A& operator=(const A& a)
+template <class Mutex>
+bool
+move_ownership(Mutex& m, acme::lock_mode mode, bool attach)
+{
+    switch (mode)
+    {
+    case acme::lock_mode::shared:
+        m.lock_shared();
+        break;
+    case acme::lock_mode::upgrade:
+        m.lock_upgrade();
+        break;
+    case acme::lock_mode::exclusive:
+        m.lock();
+        break;
+    }
+    acme::ownership_token<Mutex> t(m, mode, std::adopt_lock);
+    bool excluded = !m.try_lock();
+    std::atomic<int> phase{0};
+    std::thread th([&]
     {
-        if (this != &a)
+        acme::ownership_token<Mutex> mine(std::move(t));
+        if (!attach)
+            return;
+        acme::unique_lock<Mutex> ul;
+        std::shared_lock<Mutex> sl;
+        acme::upgrade_lock<Mutex> l;
+        switch (mode)
         {
-            Lock       this_lock(mut_, std::defer_lock);
-            SharedLock that_lock(a.mut_, std::defer_lock);
-            std::lock(this_lock, that_lock);
-            data_ = a.data_;
+        case acme::lock_mode::shared:
+            sl = mine.attach_shared();
+            break;
+        case acme::lock_mode::upgrade:
+            l = mine.attach_upgrade();
+            break;
+        case acme::lock_mode::exclusive:
+            ul = acme::unique_lock<Mutex>(*mine.attach(), std::adopt_lock);
+            break;
         }
-        return *this;
+        phase = 1;
+        while (phase != 2)
+            std::this_thread::yield();
+    });
+    if (attach)
+    {
+        while (phase != 1)
+            std::this_thread::yield();
+        excluded = excluded && !m.try_lock();
+        phase = 2;
     }
+    th.join();
+    assert(!t);
+    bool released = m.try_lock();
+    if (released)
+        m.unlock();
+    m.lock_shared();
+    m.unlock_shared();
+    m.lock_upgrade();
+    m.unlock_upgrade();
+    released = released && m.try_lock();
+    if (released)
+        m.unlock();
+    assert(excluded && released);
+    return excluded && released;
+}
 
-    void swap(A& a)
+template <class Mutex>
+bool
+move_all(Mutex& m)
+{
+    bool r = true;
+    for (bool attach : {true, false})
     {
-        Lock this_lock(mut_, std::defer_lock);
-        Lock that_lock(a.mut_, std::defer_lock);
-        std::lock(this_lock, that_lock);
-        data_.swap(a.data_);
+        r = move_ownership(m, acme::lock_mode::shared, attach) && r;
+        r = move_ownership(m, acme::lock_mode::upgrade, attach) && r;
+        r = move_ownership(m, acme::lock_mode::exclusive, attach) && r;
     }
+    return r;
+}
+
+// A bias owner's hold is detached onto the underlying mutex, which gives up
+// the bias; it cannot be while the owner has other biased holds.
 
-    void average(A& a)
+void biased()
+{
+    bool moved = true;
+    for (acme::lock_mode mode : {acme::lock_mode::shared,
+                                 acme::lock_mode::upgrade,
+                                 acme::lock_mode::exclusive})
+    {
+        acme::biased_upgrade_mutex m;
+        m.lock_shared();
+        m.unlock_shared();
+        assert(m.biased());
+        moved = move_ownership(m, mode, true) && moved;
+        assert(!m.biased());
+        moved = move_ownership(m, mode, false) && moved;
+    }
+    acme::biased_upgrade_mutex m;
+    m.lock_shared();
+    std::shared_lock<acme::biased_upgrade_mutex> sl(m);
+    assert(m.biased());
+    bool busy = false;
+    try
+    {
+        acme::ownership_token<acme::biased_upgrade_mutex> t(std::move(sl));
+    }
+    catch (const std::system_error& e)
     {
-        assert(data_.size() == a.data_.size());
-        assert(this != &a);
+        busy = e.code().value() == EBUSY;
+    }
+    assert(busy && sl.owns_lock() && m.biased());
+    sl.unlock();
+    m.unlock_shared();
+    bool free = m.try_lock();
+    assert(free);
+    m.unlock();
+    print("ownership_token biased = ", moved, " busy = ", busy, '\n');
+}
 
-        Lock        this_lock(mut_, std::defer_lock);
-        UpgradeLock share_that_lock(a.mut_, std::defer_lock);
-        std::lock(this_lock, share_that_lock);
+void read_mostly()
+{
+    acme::read_mostly_upgrade_mutex m;
+    bool moved = move_all(m);
+    print("ownership_token read_mostly = ", moved, '\n');
+}
 
-        for (unsigned i = 0; i < data_.size(); ++i)
-            data_[i] = (data_[i] + a.data_[i]) / 2;
+// Shared ownership is moved both after readers go distributed, when it
+// takes its visible reader slot along, and after a writer has centralized
+// them again.  Without an inhibit period one read redistributes them.
 
-#if 0
-        //  Not possible without committee help
-        SharedLock share_this_lock(std::move(this_lock));
-#else
-        //  Ugly workaraound
-        SharedLock share_this_lock(*this_lock.release(), std::adopt_lock);
-        share_this_lock.mutex()->unlock_and_lock_shared();
-#endif
-        Lock that_lock(std::move(share_that_lock));
-        a.data_ = data_;
+void adaptive()
+{
+    acme::adaptive_upgrade_mutex m(1, 0);
+    bool moved = true;
+    for (bool attach : {true, false})
+    {
+        m.lock_shared();
+        m.unlock_shared();
+        assert(m.distributed());
+        moved = move_ownership(m, acme::lock_mode::shared, attach) && moved;
+        assert(!m.distributed());
     }
-};
+    moved = move_all(m) && moved;
+    print("ownership_token adaptive = ", moved, '\n');
+}
 
-}  // Assignment
+// A sampled hold moves with the ownership and is recorded, for its whole
+// length, when the attaching thread releases it.
 
-void temp()
+void profiled()
 {
-    using namespace acme;
-    using namespace std;
-    static upgrade_mutex mut;
-    unique_lock<upgrade_mutex> ul(mut);
-    shared_lock<upgrade_mutex> sl;
-#if 0
-    //  Not possible without committee help
-    sl = shared_lock<upgrade_mutex>(std::move(ul));
-#else
-    //  Ugly workaraound
-    sl = shared_lock<upgrade_mutex>(*ul.release(), std::adopt_lock);
-    sl.mutex()->unlock_and_lock_shared();
-#endif
+    typedef acme::profiled_upgrade_mutex<> mutex_type;
+    acme::contention_profile prof(1);
+    mutex_type m(prof);
+    std::unique_lock<mutex_type> ul(m);
+    acme::ownership_token<mutex_type> t(std::move(ul));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::thread th([&]
+    {
+        std::unique_lock<mutex_type> l = t.attach_unique();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    });
+    th.join();
+    std::uint64_t holds = 0;
+    std::chrono::nanoseconds hold{};
+    for (const auto& s : prof.snapshot())
+    {
+        holds += s.holds;
+        hold += s.hold;
+    }
+    bool timed = holds == 1 && hold >= std::chrono::milliseconds(20);
+    assert(timed);
+    bool moved = move_all(m);
+    print("ownership_token profiled = ", moved, " timed = ", timed, '\n');
 }
 
-int main()
+void
+test_ownership_token()
 {
-    S::test_shared_mutex();
-    U::test_upgrade_mutex();
+    biased();
+    read_mostly();
+    adaptive();
+    profiled();
+}
+
+}  // O
+
+namespace H
+{
+
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::handoff_admission> handoff_mutex;
+
+struct help_failed {};
+
+// The waiting thread runs tasks; its third releases the mutex it waits for.
+
+void helped()
+{
+    handoff_mutex m;
+    m.lock();
+    std::atomic<unsigned> tasks{0};
+    std::thread t([&]
+    {
+        m.lock_shared([&]
+        {
+            if (++tasks == 3)
+                m.unlock();
+            return true;
+        });
+        m.unlock_shared();
+    });
+    t.join();
+    bool free = m.try_lock();
+    assert(tasks >= 3 && free);
+    m.unlock();
+    print("helped = ", tasks.load(), '\n');
+}
+
+// The helper throws after the mutex was handed off to its thread while it
+// ran:  the grant must be given back, not leaked, and with the conversion
+// the thread must be left owning upgrade.  With grant false the helper
+// throws while the mutex is still held, and nothing is granted.
+
+void throwing_helper(bool convert, bool grant)
+{
+    handoff_mutex m;
+    if (convert)
+        m.lock_shared();
+    else
+        m.lock();
+    std::atomic<int> phase{0};
+    bool thrown = false;
+    bool upgraded = true;
+    std::thread t([&]
+    {
+        auto help = [&]() -> bool
+        {
+            phase = 1;
+            if (grant)
+                while (phase != 2)
+                    std::this_thread::yield();
+            throw help_failed();
+        };
+        if (convert)
+            m.lock_upgrade();
+        try
+        {
+            if (convert)
+                m.unlock_upgrade_and_lock(help);
+            else
+                m.lock(help);
+        }
+        catch (const help_failed&)
+        {
+            thrown = true;
+        }
+        if (convert)
+        {
+            phase = 3;
+            while (phase != 4)
+                std::this_thread::yield();
+            m.unlock_upgrade();
+        }
+    });
+    while (phase < 1)
+        std::this_thread::yield();
+    if (grant)
+    {
+        if (convert)
+            m.unlock_shared();
+        else
+            m.unlock();
+        phase = 2;
+    }
+    if (convert)
+    {
+        while (phase < 3)
+            std::this_thread::yield();
+        upgraded = !m.try_lock_upgrade() && m.try_lock_shared();
+        if (upgraded)
+            m.unlock_shared();
+        if (!grant)
+            m.unlock_shared();
+        phase = 4;
+    }
+    t.join();
+    if (!grant && !convert)
+        m.unlock();
+    bool free = m.try_lock();
+    assert(thrown && upgraded && free);
+    m.unlock();
+    print("throwing helper", convert ? " converting" : "",
+          grant ? " granted" : "", " = ", thrown && upgraded && free, '\n');
+}
+
+void
+test_helping()
+{
+    helped();
+    for (bool convert : {false, true})
+        for (bool grant : {false, true})
+            throwing_helper(convert, grant);
+}
+
+}  // H
+
+namespace Q
+{
+
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::handoff_admission> handoff_mutex;
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::deadline_admission> deadline_mutex;
+
+// The main thread owns m exclusively while n threads queue for it, each
+// started once the one before has had time to block.  Thread i runs
+// body(i), which records i once it owns m.
+
+template <class Mutex, class Body>
+void
+queue_behind_owner(Mutex& m, unsigned n, Body body)
+{
+    std::vector<std::thread> threads;
+    m.lock();
+    for (unsigned i = 0; i < n; ++i)
+    {
+        threads.emplace_back(body, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    m.unlock();
+    for (auto& t : threads)
+        t.join();
+}
+
+// Writers and upgraders, alternately, get the mutex in the order they
+// queued for it, and a last thread polling try_lock only gets it after them.
+
+void arrival()
+{
+    handoff_mutex m;
+    std::vector<unsigned> order;    // written only owning m
+    queue_behind_owner(m, 7, [&](unsigned i)
+    {
+        if (i == 6)
+        {
+            while (!m.try_lock())
+                std::this_thread::yield();
+            order.push_back(i);
+            m.unlock();
+        }
+        else if (i % 2 == 0)
+        {
+            m.lock();
+            order.push_back(i);
+            m.unlock();
+        }
+        else
+        {
+            m.lock_upgrade();
+            order.push_back(i);
+            m.unlock_upgrade();
+        }
+    });
+    bool fifo = order == std::vector<unsigned>{0, 1, 2, 3, 4, 5, 6};
+    assert(fifo);
+    print("handoff arrival order = ", fifo, '\n');
+}
+
+// Writers get the mutex earliest deadline first, whatever the clock or the
+// order they queued in, and an untimed one last.
+
+void deadline()
+{
+    typedef std::chrono::steady_clock Clock;
+    using std::chrono::milliseconds;
+    deadline_mutex m;
+    std::vector<unsigned> order;    // written only owning m
+    const Clock::time_point t0 = Clock::now();
+    std::atomic<bool> timed_out{false};
+    queue_behind_owner(m, 6, [&](unsigned i)
+    {
+        bool got = true;
+        switch (i)
+        {
+        case 0:
+            m.lock();
+            break;
+        case 1:
+            got = m.try_lock_until(t0 + milliseconds(4000));
+            break;
+        case 2:
+            got = m.try_lock_until(t0 + milliseconds(1000));
+            break;
+        case 3:
+            got = m.try_lock_until(std::chrono::system_clock::now() +
+                                   (t0 + milliseconds(3000) - Clock::now()));
+            break;
+        case 4:
+            got = m.try_lock_until(t0 + milliseconds(2000));
+            break;
+        case 5:
+            got = m.try_lock_for(t0 + milliseconds(1500) - Clock::now());
+            break;
+        }
+        if (!got)
+        {
+            timed_out = true;
+            return;
+        }
+        order.push_back(i);
+        m.unlock();
+    });
+    bool edf = !timed_out &&
+               order == std::vector<unsigned>{2, 5, 4, 3, 1, 0};
+    assert(edf);
+    print("deadline order = ", edf, '\n');
+}
+
+void
+test_queued_admission()
+{
+    arrival();
+    deadline();
+}
+
+}  // Q
+
+#include "intention_mutex.h"
+
+namespace I
+{
+
+typedef acme::intention_mode mode;
+
+const mode modes[] = {mode::is, mode::ix, mode::s, mode::six, mode::x};
+
+// The matrix of intention_mutex.h's synopsis, observed with try_lock.
+
+void compatibility()
+{
+    static const bool table[5][5] =
+    {
+        {true,  true,  true,  true,  false},
+        {true,  true,  false, false, false},
+        {true,  false, true,  false, false},
+        {true,  false, false, false, false},
+        {false, false, false, false, false}
+    };
+    bool agrees = true;
+    for (unsigned i = 0; i < 5; ++i)
+    {
+        for (unsigned j = 0; j < 5; ++j)
+        {
+            acme::intention_mutex m;
+            m.lock(modes[i]);
+            bool got = m.try_lock(modes[j]);
+            if (got)
+                m.unlock(modes[j]);
+            m.unlock(modes[i]);
+            agrees = agrees && got == table[i][j] &&
+                     acme::compatible(modes[i], modes[j]) == table[i][j];
+        }
+    }
+    assert(agrees);
+    print("intention compatibility = ", agrees, '\n');
+}
+
+// A thread waiting for a mode keeps out new owners of the weaker modes it
+// conflicts with, though they are compatible with the present owner, and
+// only those; it does not keep out the owner's own conversions.
+
+void waiting_mark(mode holder, mode waiter, mode kept,
+                  std::initializer_list<mode> admitted)
+{
+    acme::intention_mutex m;
+    m.lock(holder);
+    std::atomic<bool> got{false};
+    std::thread t([&]
+    {
+        m.lock(waiter);
+        got = true;
+        m.unlock(waiter);
+    });
+    while (m.try_lock(kept))
+    {
+        m.unlock(kept);
+        std::this_thread::yield();
+    }
+    bool marked = !got;
+    for (mode a : admitted)
+    {
+        bool in = m.try_lock(a);
+        if (in)
+            m.unlock(a);
+        marked = marked && in;
+    }
+    mode stronger = holder == mode::is ? mode::s : mode::x;
+    bool converted = m.try_convert(holder, stronger);
+    assert(converted);
+    m.unlock(stronger);
+    t.join();
+    assert(marked && got);
+    print("intention waiting mark = ", marked, '\n');
+}
+
+// Strengthening conversions that no other thread's ownership allows time
+// out, still owning from, and succeed when it is released in time.
+
+void timed_convert(mode other, mode from, mode to)
+{
+    using namespace std::chrono;
+    acme::intention_mutex m;
+    m.lock(other);
+    m.lock(from);
+    auto t0 = steady_clock::now();
+    bool timed_out = !m.try_convert_for(from, to, milliseconds(20));
+    timed_out = timed_out && steady_clock::now() - t0 >= milliseconds(20);
+    std::thread t([&]
+    {
+        std::this_thread::sleep_for(milliseconds(20));
+        m.unlock(other);
+    });
+    bool converted = m.try_convert_for(from, to, seconds(10));
+    t.join();
+    m.unlock(to);
+    bool free = m.try_lock(mode::x);
+    m.unlock(mode::x);
+    assert(timed_out && converted && free);
+    print("intention timed convert = ", timed_out && converted, '\n');
+}
+
+// The untimed conversions that could deadlock, ix and s to six, are
+// refused; so are those between modes neither covers.
+
+int convert_error(mode from, mode to)
+{
+    acme::intention_mutex m;
+    m.lock(from);
+    int e = 0;
+    try
+    {
+        m.convert(from, to);
+        m.unlock(to);
+        return 0;
+    }
+    catch (const std::system_error& x)
+    {
+        e = x.code().value();
+    }
+    m.unlock(from);
+    bool free = m.try_lock(mode::x);
+    assert(free);
+    m.unlock(mode::x);
+    return e;
+}
+
+void
+test_intention_mutex()
+{
+    compatibility();
+    waiting_mark(mode::is, mode::x, mode::is, {});
+    waiting_mark(mode::ix, mode::s, mode::ix, {mode::is});
+    timed_convert(mode::is, mode::ix, mode::x);
+    timed_convert(mode::is, mode::six, mode::x);
+    timed_convert(mode::ix, mode::is, mode::s);
+    bool refused = convert_error(mode::ix, mode::six) == EDEADLK &&
+                   convert_error(mode::s, mode::six) == EDEADLK &&
+                   convert_error(mode::ix, mode::s) == EINVAL &&
+                   convert_error(mode::six, mode::x) == 0;
+    assert(refused);
+    print("intention convert refused = ", refused, '\n');
+}
+
+}  // I
+
+#include "lock_domain.h"
+
+namespace D
+{
+
+typedef std::vector<std::unique_ptr<acme::domain_upgrade_mutex>> mutexes;
+
+mutexes
+make_mutexes(acme::lock_domain& d, std::size_t n)
+{
+    mutexes m;
+    for (std::size_t i = 0; i < n; ++i)
+        m.emplace_back(new acme::domain_upgrade_mutex(d));
+    return m;
+}
+
+bool
+all_free(mutexes& m)
+{
+    bool r = true;
+    for (auto& p : m)
+    {
+        bool free = p->try_lock();
+        if (free)
+            p->unlock();
+        r = r && free;
+    }
+    return r;
+}
+
+// Readers on several threads share every mutex while the domain is frozen,
+// and writers are kept out until it is unfrozen.  A writer that arrives
+// while it is frozen gets in once unfreeze has waited for the readers.
+
+void frozen_readers()
+{
+    acme::lock_domain d;
+    mutexes m = make_mutexes(d, 4);
+    d.freeze();
+    assert(d.frozen());
+    std::atomic<bool> stop{false};
+    std::atomic<unsigned long> reads{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t)
+        readers.emplace_back([&]
+        {
+            while (!stop)
+            {
+                for (auto& p : m)
+                    p->lock_shared();
+                for (auto& p : m)
+                    p->unlock_shared();
+                ++reads;
+            }
+        });
+    bool kept_out = true;
+    for (auto& p : m)
+        kept_out = kept_out && !p->try_lock() &&
+                   !p->try_lock_for(std::chrono::milliseconds(5));
+    std::atomic<bool> wrote{false};
+    std::thread writer([&]
+    {
+        m[0]->lock();
+        wrote = true;
+        m[0]->unlock();
+    });
+    while (reads < 1000)
+        std::this_thread::yield();
+    kept_out = kept_out && !wrote;
+    stop = true;
+    for (auto& t : readers)
+        t.join();
+    d.unfreeze();
+    writer.join();
+    bool free = all_free(m);
+    assert(kept_out && wrote && free && !d.frozen());
+    print("lock_domain frozen readers = ", kept_out && free, '\n');
+}
+
+// unfreeze returns only once the frozen reader on another thread has given
+// up its ownership.
+
+void unfreeze_drains()
+{
+    acme::lock_domain d;
+    mutexes m = make_mutexes(d, 2);
+    d.freeze();
+    std::atomic<int> phase{0};
+    std::thread reader([&]
+    {
+        m[1]->lock_shared();
+        phase = 1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        phase = 2;
+        m[1]->unlock_shared();
+    });
+    while (phase < 1)
+        std::this_thread::yield();
+    d.unfreeze();
+    bool drained = phase == 2;
+    reader.join();
+    bool free = all_free(m);
+    assert(drained && free);
+    print("lock_domain unfreeze drains = ", drained, '\n');
+}
+
+// Frozen shared ownership cannot become exclusive:  the try conversions fail
+// at once, still owning shared.  It can become upgrade, which is then the
+// Mutex's, and no longer holds up unfreeze.
+
+void frozen_conversions()
+{
+    acme::lock_domain d;
+    mutexes m = make_mutexes(d, 1);
+    acme::domain_upgrade_mutex& mu = *m[0];
+    d.freeze();
+    mu.lock_shared();
+    bool refused = !mu.try_unlock_shared_and_lock() &&
+                   !mu.try_unlock_shared_and_lock_for(std::chrono::seconds(10));
+    bool upgraded = mu.try_unlock_shared_and_lock_upgrade();
+    bool sole = upgraded && !mu.try_lock_upgrade();
+    d.unfreeze();
+    mu.unlock_upgrade_and_lock();
+    mu.unlock();
+    d.freeze();
+    mu.lock_shared();
+    upgraded = upgraded && mu.try_unlock_shared_and_lock_upgrade_for(
+                                                 std::chrono::milliseconds(10));
+    mu.unlock_upgrade();
+    d.unfreeze();
+    bool free = all_free(m);
+    assert(refused && upgraded && sole && free);
+    print("lock_domain frozen conversions = ", refused && upgraded && sole,
+          '\n');
+}
+
+// A mutex constructed in a frozen domain is frozen with it.
+
+void built_frozen()
+{
+    acme::lock_domain d;
+    d.freeze();
+    mutexes m = make_mutexes(d, 1);
+    bool kept_out = !m[0]->try_lock();
+    m[0]->lock_shared();
+    m[0]->unlock_shared();
+    d.unfreeze();
+    bool free = all_free(m);
+    assert(kept_out && free);
+    print("lock_domain built frozen = ", kept_out && free, '\n');
+}
+
+// A thread can own at most frozen_reads::capacity mutexes frozen; it takes
+// the rest from the Mutex.  Those, unlike the others, it can keep across
+// the unfreeze.
+
+void past_capacity()
+{
+    const std::size_t cap = acme::detail::frozen_reads::capacity;
+    acme::lock_domain d;
+    mutexes m = make_mutexes(d, cap + 4);
+    d.freeze();
+    for (auto& p : m)
+        p->lock_shared();
+    for (std::size_t i = 0; i < cap; ++i)
+        m[i]->unlock_shared();
+    d.unfreeze();
+    bool fell_back = true;
+    for (std::size_t i = 0; i < m.size(); ++i)
+    {
+        bool free = m[i]->try_lock();
+        if (free)
+            m[i]->unlock();
+        fell_back = fell_back && free == (i < cap);
+    }
+    for (std::size_t i = cap; i < m.size(); ++i)
+        m[i]->unlock_shared();
+    bool free = all_free(m);
+    assert(fell_back && free);
+    print("lock_domain past capacity = ", fell_back && free, '\n');
+}
+
+void
+test_lock_domain()
+{
+    frozen_readers();
+    unfreeze_drains();
+    frozen_conversions();
+    built_frozen();
+    past_capacity();
+}
+
+}  // D
+
+#include "lru_cache.h"
+
+namespace C
+{
+
+typedef acme::lru_cache<int, int> cache;
+
+// Hits recorded in the buffers, more than the eviction used to look past,
+// must be applied before the victim is chosen:  the one entry not hit goes.
+
+void eviction_order()
+{
+    cache c(10);
+    for (int k = 0; k < 10; ++k)
+        c.put(k, k);
+    for (int k = 0; k < 9; ++k)
+        assert(c.get(k) == k);
+    c.put(10, 10);
+    bool ordered = !c.get(9) && c.size() == 10;
+    for (int k = 0; k <= 10; ++k)
+        ordered = ordered && (k == 9 || c.get(k) == k);
+    assert(ordered);
+    print("lru eviction order = ", ordered, '\n');
+}
+
+// A put of a present key assigns it, allocates nothing, and makes it the
+// most recent.
+
+void put_existing()
+{
+    cache c(2);
+    c.put(1, 1);
+    c.put(2, 2);
+    std::size_t before = allocations;
+    c.put(1, 11);
+    bool no_alloc = allocations == before;
+    c.put(3, 3);
+    bool assigned = c.get(1) == 11 && !c.get(2) && c.get(3) == 3 &&
+                    c.size() == 2;
+    assert(no_alloc && assigned);
+    print("lru put existing = ", no_alloc && assigned, '\n');
+}
+
+// Threads getting and putting more keys than fit:  the cache never grows
+// past its capacity, and every hit finds its key's value.
+
+void concurrent()
+{
+    const std::size_t capacity = 64;
+    cache c(capacity);
+    std::atomic<bool> wrong{false};
+    std::atomic<bool> over{false};
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]
+        {
+            unsigned x = t * 2654435761u + 1;
+            for (int i = 0; i < 50000; ++i)
+            {
+                x = x * 1664525 + 1013904223;
+                int k = static_cast<int>(x >> 24);
+                if (x & 0x30)
+                {
+                    std::optional<int> v = c.get(k);
+                    if (v && *v != k * 3)
+                        wrong = true;
+                }
+                else
+                    c.put(k, k * 3);
+                if (i % 1000 == 0 && c.size() > capacity)
+                    over = true;
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+    bool ok = !wrong && !over && c.size() == capacity;
+    assert(ok);
+    print("lru concurrent = ", ok, " drains = ", c.drains(), '\n');
+}
+
+void
+test_lru_cache()
+{
+    eviction_order();
+    put_existing();
+    concurrent();
+}
+
+}  // C
+
+#include "cohort_upgrade_mutex.h"
+
+namespace K
+{
+
+typedef std::chrono::steady_clock Clock;
+
+// Two nodes on any host:  each thread says which one it is on.
+
+thread_local unsigned node = 0;
+
+unsigned forced_node() noexcept {return node;}
+
+const acme::numa_topology two_nodes(2, forced_node);
+
+acme::cohort_upgrade_mutex mut(two_nodes, 4);
+
+void reader(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        mut.lock_shared();
+        assert(state == reading);
+        ++count;
+        mut.unlock_shared();
+    }
+    print("cohort reader ", n, " = ", count, '\n');
+}
+
+void writer(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        mut.lock();
+        state = writing;
+        assert(state == writing);
+        state = reading;
+        ++count;
+        mut.unlock();
+    }
+    print("cohort writer ", n, " = ", count, '\n');
+}
+
+void try_for_reader(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        if (mut.try_lock_shared_for(std::chrono::microseconds(5)))
+        {
+            assert(state == reading);
+            ++count;
+            mut.unlock_shared();
+        }
+    }
+    print("cohort try_for_reader ", n, " = ", count, '\n');
+}
+
+void try_for_writer(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        if (mut.try_lock_for(std::chrono::microseconds(5)))
+        {
+            state = writing;
+            assert(state == writing);
+            state = reading;
+            ++count;
+            mut.unlock();
+        }
+    }
+    print("cohort try_for_writer ", n, " = ", count, '\n');
+}
+
+void upgradable(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        mut.lock_upgrade();
+        assert(state == reading);
+        ++count;
+        mut.unlock_upgrade();
+    }
+    print("cohort upgradable ", n, " = ", count, '\n');
+}
+
+void clockwise(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        mut.lock_shared();
+        assert(state == reading);
+        if (mut.try_unlock_shared_and_lock())
+        {
+            state = writing;
+        }
+        else if (mut.try_unlock_shared_and_lock_upgrade())
+        {
+            assert(state == reading);
+            mut.unlock_upgrade_and_lock();
+            state = writing;
+        }
+        else
+        {
+            mut.unlock_shared();
+            continue;
+        }
+        assert(state == writing);
+        state = reading;
+        mut.unlock_and_lock_upgrade();
+        assert(state == reading);
+        mut.unlock_upgrade_and_lock_shared();
+        assert(state == reading);
+        mut.unlock_shared();
+        ++count;
+    }
+    print("cohort clockwise ", n, " = ", count, '\n');
+}
+
+void counter_clockwise(unsigned n)
+{
+    node = n;
+    unsigned count = 0;
+    Clock::time_point until = Clock::now() + std::chrono::seconds(1);
+    while (Clock::now() < until)
+    {
+        mut.lock_upgrade();
+        assert(state == reading);
+        mut.unlock_upgrade_and_lock();
+        assert(state == reading);
+        state = writing;
+        assert(state == writing);
+        state = reading;
+        mut.unlock_and_lock_shared();
+        assert(state == reading);
+        mut.unlock_shared();
+        ++count;
+    }
+    print("cohort counter_clockwise ", n, " = ", count, '\n');
+}
+
+// The main thread, on node 0, owns m while three more node 0 threads, then
+// one node 1 thread, queue up for it.  Returns the nodes of the queued
+// threads in the order they got m.
+
+std::vector<unsigned> handoff_order(unsigned max_batch)
+{
+    acme::cohort_upgrade_mutex m(two_nodes, max_batch);
+    std::vector<unsigned> order;    // written only holding m
+    std::vector<std::thread> threads;
+    node = 0;
+    m.lock();
+    for (unsigned n : {0u, 0u, 0u, 1u})
+    {
+        threads.emplace_back([&m, &order, n]
+        {
+            node = n;
+            m.lock();
+            order.push_back(n);
+            m.unlock();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    m.unlock();
+    for (auto& t : threads)
+        t.join();
+    return order;
+}
+
+// Node 0 hands the lock on locally, keeping the global lock, while it has
+// waiters, up to max_batch times in a row; then it releases the global lock,
+// to node 1 if it waits.  With max_batch 0 every release is global, so node
+// 1 goes first, and then hands the global lock back to node 0.
+
+void batch_handoff()
+{
+    typedef std::vector<unsigned> nodes;
+    bool unbounded = handoff_order(64) == nodes{0, 0, 0, 1};
+    bool batched = handoff_order(2) == nodes{0, 0, 1, 0};
+    bool global = handoff_order(0) == nodes{1, 0, 0, 0};
+    assert(unbounded && batched && global);
+    print("cohort batch handoff = ", unbounded && batched && global, '\n');
+}
+
+void
+test_cohort_upgrade_mutex()
+{
+    assert(mut.nodes() == 2 && mut.max_batch() == 4);
+    {
+        std::thread t1(reader, 0);
+        std::thread t2(writer, 1);
+        std::thread t3(reader, 1);
+        std::thread t4(writer, 0);
+        t1.join();
+        t2.join();
+        t3.join();
+        t4.join();
+    }
+    {
+        std::thread t1(try_for_reader, 1);
+        std::thread t2(try_for_writer, 0);
+        std::thread t3(try_for_writer, 1);
+        t1.join();
+        t2.join();
+        t3.join();
+    }
+    {
+        std::thread t1(reader, 0);
+        std::thread t2(writer, 1);
+        std::thread t3(upgradable, 0);
+        std::thread t4(upgradable, 1);
+        t1.join();
+        t2.join();
+        t3.join();
+        t4.join();
+    }
+    {
+        state = reading;
+        std::thread t1(clockwise, 0);
+        std::thread t2(counter_clockwise, 1);
+        std::thread t3(clockwise, 1);
+        std::thread t4(counter_clockwise, 0);
+        t1.join();
+        t2.join();
+        t3.join();
+        t4.join();
+    }
+    batch_handoff();
+}
+
+}  // K
+
+#include "upgrade_mutex_trace.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace T
+{
+
+typedef acme::traced_upgrade_mutex<> traced;
+
+const char trace_path[] = "main_trace.tmp";
+
+// Each thread's operations, with a hold long enough to see.
+
+void workload(traced& a, traced& b)
+{
+    a.lock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    a.unlock_and_lock_shared();
+    b.lock_shared();
+    a.unlock_shared();
+    b.unlock_shared();
+    a.lock_upgrade();
+    a.unlock_upgrade_and_lock();
+    bool got = a.try_lock_shared();     // refused to its own owner
+    assert(!got);
+    a.unlock_and_lock_upgrade();
+    a.unlock_upgrade();
+    (void)got;
+}
+
+// Re-drives one recorded operation.
+
+void apply(traced& m, const acme::trace_record& r)
+{
+    using acme::lock_op;
+    switch (r.op)
+    {
+    case lock_op::lock:
+        m.lock();
+        break;
+    case lock_op::unlock_and_lock_shared:
+        m.unlock_and_lock_shared();
+        break;
+    case lock_op::lock_shared:
+        m.lock_shared();
+        break;
+    case lock_op::unlock_shared:
+        m.unlock_shared();
+        break;
+    case lock_op::lock_upgrade:
+        m.lock_upgrade();
+        break;
+    case lock_op::unlock_upgrade_and_lock:
+        m.unlock_upgrade_and_lock();
+        break;
+    case lock_op::try_lock_shared:
+        if (m.try_lock_shared())
+            m.unlock_shared();
+        break;
+    case lock_op::unlock_and_lock_upgrade:
+        m.unlock_and_lock_upgrade();
+        break;
+    case lock_op::unlock_upgrade:
+        m.unlock_upgrade();
+        break;
+    default:
+        assert(!"not in the workload");
+    }
+}
+
+// Runs workload on two threads, one after the other, into a trace; the
+// second thread may well get the first's std::thread::id.
+
+std::vector<acme::trace_record> record()
+{
+    {
+        acme::trace_recorder rec(trace_path);
+        traced a(rec);
+        traced b(rec);
+        std::thread(workload, std::ref(a), std::ref(b)).join();
+        std::thread(workload, std::ref(a), std::ref(b)).join();
+    }
+    return acme::read_trace(trace_path);
+}
+
+// Replays each recorded thread, on a thread of its own, into a new trace.
+
+std::vector<acme::trace_record> replay(const std::vector<acme::trace_record>& v)
+{
+    {
+        acme::trace_recorder rec(trace_path);
+        traced m[2] = {traced(rec), traced(rec)};
+        for (std::uint32_t t = 0; t < 2; ++t)
+            std::thread([&, t]
+            {
+                for (const auto& r : v)
+                    if (r.thread == t)
+                        apply(m[r.mutex], r);
+            }).join();
+    }
+    return acme::read_trace(trace_path);
+}
+
+bool same_operations(const std::vector<acme::trace_record>& x,
+                     const std::vector<acme::trace_record>& y)
+{
+    typedef acme::trace_record record;
+    return std::equal(x.begin(), x.end(), y.begin(), y.end(),
+                      [](const record& r, const record& s)
+                      {
+                          return r.op == s.op && r.mutex == s.mutex &&
+                                 r.thread == s.thread &&
+                                 r.acquired == s.acquired;
+                      });
+}
+
+// Recording, replaying the recording, and recording the replay:  the two
+// traces hold the same operations, each thread's under its own number, and
+// the hold the workload sleeps through is timed.
+
+void round_trip()
+{
+    std::vector<acme::trace_record> recorded = record();
+    std::vector<acme::trace_record> replayed = replay(recorded);
+    std::remove(trace_path);
+    bool threads = recorded.size() == 20 &&
+                   std::count_if(recorded.begin(), recorded.end(),
+                                 [](const acme::trace_record& r)
+                                 {
+                                     return r.thread == 0;
+                                 }) == 10;
+    bool held = std::all_of(recorded.begin(), recorded.end(),
+                            [](const acme::trace_record& r)
+                            {
+                                return r.op != acme::lock_op::
+                                                    unlock_and_lock_shared ||
+                                       r.hold >= 2000000;
+                            });
+    bool same = same_operations(recorded, replayed);
+    assert(threads && held && same);
+    print("trace round trip = ", threads && held && same, '\n');
+}
+
+// Once the thread has its buffer, recording allocates nothing, even past
+// the holds it tracks.
+
+void no_allocation()
+{
+    std::size_t n = 0;
+    {
+        acme::trace_recorder rec(trace_path);
+        std::vector<std::unique_ptr<traced>> v;
+        for (int i = 0; i < 20; ++i)
+            v.emplace_back(new traced(rec));
+        v[0]->lock();
+        v[0]->unlock();
+        std::size_t before = allocations;
+        for (int k = 0; k < 100; ++k)
+        {
+            for (auto& m : v)
+                m->lock_shared();
+            for (auto& m : v)
+                m->unlock_shared();
+        }
+        n = allocations - before;
+    }
+    std::remove(trace_path);
+    assert(n == 0);
+    print("trace recording allocations = ", n, '\n');
+}
+
+void
+test_trace()
+{
+    round_trip();
+    no_allocation();
+}
+
+}  // T
+
+#ifdef __linux__
+
+#include "lock_any.h"
+
+namespace L
+{
+
+typedef std::chrono::steady_clock Clock;
+
+// The main thread owns every mutex exclusively; another thread waits in
+// lock_any for the first of them to be released, which must be the one the
+// main thread releases.  With more than FUTEX_WAITV_MAX mutexes lock_any
+// falls back to the futex shared by all releases.
+
+void wake_on_release(std::size_t n, acme::lock_mode mode)
+{
+    std::vector<std::unique_ptr<acme::any_upgrade_mutex>> owned(n);
+    std::vector<acme::any_upgrade_mutex*> m(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        owned[i].reset(new acme::any_upgrade_mutex);
+        m[i] = owned[i].get();
+        m[i]->lock();
+    }
+    std::size_t got = n + 1;
+    std::atomic<bool> done{false};
+    std::thread t([&]
+    {
+        got = acme::lock_any(m.data(), n, mode);
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!done);
+    const std::size_t k = n / 2;
+    m[k]->unlock();
+    t.join();
+    assert(got == k);
+    switch (mode)
+    {
+    case acme::lock_mode::shared:
+        m[k]->unlock_shared();
+        break;
+    case acme::lock_mode::upgrade:
+        m[k]->unlock_upgrade();
+        break;
+    case acme::lock_mode::exclusive:
+        m[k]->unlock();
+        break;
+    }
+    // Nothing is released now:  the timed form must give up, not too soon
+    m[k]->lock();
+    auto t0 = Clock::now();
+    std::size_t r = acme::try_lock_any_for(m.data(), n, mode,
+                                           std::chrono::milliseconds(20));
+    auto waited = Clock::now() - t0;
+    assert(r == n);
+    assert(waited >= std::chrono::milliseconds(20));
+    // A free mutex is taken at once
+    m[n - 1]->unlock();
+    r = acme::try_lock_any_for(m.data(), n, acme::lock_mode::exclusive,
+                               std::chrono::seconds(0));
+    assert(r == n - 1);
+    for (std::size_t i = 0; i < n; ++i)
+        m[i]->unlock();
+    print("lock_any(", n, ") = ", got == k && r == n - 1 && waited >=
+          std::chrono::milliseconds(20), '\n');
+}
+
+void
+test_lock_any()
+{
+    wake_on_release(3, acme::lock_mode::shared);
+    wake_on_release(4, acme::lock_mode::exclusive);
+    wake_on_release(acme::detail::max_waitv + 1, acme::lock_mode::upgrade);
+}
+
+}  // L
+
+#include "async_lock.h"
+
+namespace A
+{
+
+typedef acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                  acme::handoff_admission> handoff_mutex;
+typedef acme::async_lock_request<handoff_mutex> request;
+
+// Consumes the eventfd's count:  true if the request was signalled.
+bool signalled(const request& r)
+{
+    std::uint64_t n = 0;
+    return read(r.fd(), &n, sizeof(n)) == sizeof(n) && n == 1;
+}
+
+// Requests complete on the releasing thread:  a reader behind a writer when
+// the writer unlocks, a writer past gate1 when the last reader leaves.
+
+void completion()
+{
+    handoff_mutex m;
+    m.lock();
+    request r(m, acme::lock_mode::shared);
+    assert(!r.ready() && !signalled(r));
+    m.unlock();
+    assert(r.ready() && signalled(r));
+    bool wrong_mode = false;
+    try
+    {
+        r.take_upgrade();
+    }
+    catch (const std::system_error& e)
+    {
+        wrong_mode = e.code().value() == EPERM;
+    }
+    assert(wrong_mode);
+    std::shared_lock<handoff_mutex> sl = r.take_shared();
+    assert(!r.cancel() && !r.ready());
+    request w(m, acme::lock_mode::exclusive);
+    assert(!w.ready() && !m.try_lock_shared());
+    sl.unlock();
+    assert(w.ready() && signalled(w));
+    std::unique_lock<handoff_mutex> ul = w.take_unique();
+    ul.unlock();
+    assert(m.try_lock());
+    m.unlock();
+    print("async completion = ", wrong_mode, '\n');
+}
+
+// A queued request that is withdrawn is never granted, and no longer holds
+// back those queued behind it.
+
+void cancel_queued()
+{
+    handoff_mutex m;
+    m.lock();
+    request w(m, acme::lock_mode::exclusive);
+    request r(m, acme::lock_mode::shared);
+    bool cancelled = w.cancel();
+    assert(cancelled && !w.cancel());
+    m.unlock();
+    assert(!w.ready() && !signalled(w));
+    assert(r.ready() && signalled(r));
+    std::shared_lock<handoff_mutex> sl = r.take_shared();
+    assert(m.try_lock_shared());
+    m.unlock_shared();
+    sl.unlock();
+    assert(m.try_lock());
+    m.unlock();
+    print("async cancel queued = ", cancelled, '\n');
+}
+
+// A writer request past gate1 shuts out new readers while it waits for the
+// one inside.  Withdrawing it must let them in again, and the last reader out
+// must then not complete it.
+
+void cancel_draining()
+{
+    handoff_mutex m;
+    m.lock_shared();
+    request w(m, acme::lock_mode::exclusive);
+    assert(!w.ready() && !m.try_lock_shared());
+    request r(m, acme::lock_mode::shared);
+    assert(!r.ready());
+    bool cancelled = w.cancel();
+    assert(cancelled);
+    assert(r.ready() && signalled(r));
+    assert(m.try_lock_shared());
+    m.unlock_shared();
+    m.unlock_shared();
+    r.take_shared().unlock();
+    assert(!w.ready() && !signalled(w));
+    assert(m.try_lock());
+    m.unlock();
+    print("async cancel draining = ", cancelled, '\n');
+}
+
+// A request that owns the mutex but is never taken releases it when
+// destroyed.
+
+void untaken(acme::lock_mode mode)
+{
+    handoff_mutex m;
+    m.lock();
+    {
+        request r(m, mode);
+        m.unlock();
+        assert(r.ready());
+    }
+    bool released = m.try_lock();
+    assert(released);
+    m.unlock();
+    print("async untaken = ", released, '\n');
+}
+
+void
+test_async_lock()
+{
+    completion();
+    cancel_queued();
+    cancel_draining();
+    untaken(acme::lock_mode::shared);
+    untaken(acme::lock_mode::upgrade);
+    untaken(acme::lock_mode::exclusive);
+}
+
+}  // A
+
+#include "process_upgrade_mutex.h"
+#include <new>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace P
+{
+
+// A child process locks the mutex and exits owning it.  The parent does not
+// wait for it, so it lingers as a zombie, and its ownership must still be
+// reclaimed.
+
+void dead_owner(bool upgrade)
+{
+    void* p = mmap(nullptr, sizeof(acme::process_upgrade_mutex),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED);
+    auto* m = new (p) acme::process_upgrade_mutex;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (upgrade)
+            m->lock_upgrade();
+        else
+            m->lock();
+        _exit(0);
+    }
+    assert(pid > 0);
+    siginfo_t info;
+    waitid(P_PID, pid, &info, WEXITED | WNOWAIT);   // exited, not reaped
+    bool shared = m->try_lock_shared_for(std::chrono::seconds(2));
+    assert(shared);
+    m->unlock_shared();
+    bool upgraded = m->try_lock_upgrade_for(std::chrono::seconds(2));
+    assert(upgraded);
+    m->unlock_upgrade();
+    m->lock();
+    m->unlock();
+    waitpid(pid, nullptr, 0);
+    m->~process_upgrade_mutex();
+    munmap(p, sizeof(acme::process_upgrade_mutex));
+    print("dead_owner(", upgrade ? "upgrade" : "exclusive", ") = ",
+          shared && upgraded, '\n');
+}
+
+void
+test_process_upgrade_mutex()
+{
+    dead_owner(false);
+    dead_owner(true);
+}
+
+}  // P
+
+#endif  // __linux__
+
+#include "assignment.h"
+
+namespace V
+{
+
+// average_parallel must agree exactly with average, split across threads
+// and with a tail shorter than a vector lane, and again when it reuses the
+// buffers the first call left.
+
+void average_parallel()
+{
+    const std::size_t n = (std::size_t(1) << 18) + 5;
+    std::vector<double> x(n);
+    std::vector<double> y(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        x[i] = double(i) / 3;
+        y[i] = 1e6 - double(i) * 7;
+    }
+    Assignment::A a1(x), b1(y), a2(x), b2(y);
+    bool same = true;
+    for (int round = 0; round < 2; ++round)
+    {
+        a1.average(b1);
+        a2.average_parallel(b2, 4);
+        for (std::size_t i = 0; i < n; ++i)
+            same = same && a1.at(i) == a2.at(i) && b1.at(i) == b2.at(i);
+        b1 = Assignment::A(y);
+        b2 = Assignment::A(y);
+    }
+    assert(same && a2.size() == n);
+    print("average_parallel = ", same, '\n');
+}
+
+}  // V
+
+void temp()
+{
+    using namespace acme;
+    using namespace std;
+    static upgrade_mutex mut;
+    acme::unique_lock<upgrade_mutex> ul(mut);
+    acme::shared_lock<upgrade_mutex> sl;
+    sl = acme::shared_lock<upgrade_mutex>(std::move(ul));
+}
+
+// The conversions lock the mutex's internals, which can throw.
+
+static_assert(!std::is_nothrow_constructible<
+                  acme::shared_lock<acme::upgrade_mutex>,
+                  acme::unique_lock<acme::upgrade_mutex>&&>::value &&
+              !std::is_nothrow_constructible<
+                  acme::shared_lock<acme::upgrade_mutex>,
+                  acme::upgrade_lock<acme::upgrade_mutex>&&>::value &&
+              !std::is_nothrow_constructible<
+                  acme::upgrade_lock<acme::upgrade_mutex>,
+                  acme::unique_lock<acme::upgrade_mutex>&&>::value,
+              "lock conversions must not claim noexcept");
+
+int main()
+{
+    S::test_shared_mutex();
+    U::test_upgrade_mutex();
+    B::test_biased_upgrade_mutex();
+    M::test_lock_manager();
+    O::test_ownership_token();
+    H::test_helping();
+    Q::test_queued_admission();
+    I::test_intention_mutex();
+    D::test_lock_domain();
+    C::test_lru_cache();
+    K::test_cohort_upgrade_mutex();
+    T::test_trace();
+    V::average_parallel();
+#ifdef __linux__
+    L::test_lock_any();
+    A::test_async_lock();
+    P::test_process_upgrade_mutex();
+#endif
 }
@@ -0,0 +1,295 @@
+//----------------------------- ownership_token.h ------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_OWNERSHIP_TOKEN
+#define UPGRADE_MUTEX_OWNERSHIP_TOKEN
+
+/*
+    <ownership_token.h> synopsis
+
+namespace acme
+{
+
+// How ownership of a Mutex leaves one thread and joins another.  A mutex
+// that keeps per-thread bookkeeping declares
+//
+//     typedef ... detached_ownership;
+//     detached_ownership detach(lock_mode m);   // by the owning thread
+//     void attach(lock_mode m, const detached_ownership& d);  // the new one
+//     void unlock_detached(lock_mode m, const detached_ownership& d);
+//
+// and these forward to them; for any other mutex they do nothing, and
+// unlock_detached is the unlock for m.
+
+template <class Mutex>
+struct ownership_traits
+{
+    typedef ... detached_type;
+
+    static detached_type detach(Mutex& mut, lock_mode m);
+    static void attach(Mutex& mut, lock_mode m, const detached_type& d);
+    static void unlock_detached(Mutex& mut, lock_mode m,
+                                const detached_type& d);
+};
+
+// Ownership of a mutex in some mode, held by no thread.  Movable, so it can
+// be handed to another thread, which attaches it and owns the mutex with
+// no moment at which the mutex was free.
+
+template <class Mutex>
+class ownership_token
+{
+public:
+    typedef Mutex mutex_type;
+
+    ownership_token() noexcept;
+    ~ownership_token();                   // releases what it owns
+
+    ownership_token(ownership_token&& t) noexcept;
+    ownership_token& operator=(ownership_token&& t);
+
+    // Detach the lock's ownership from the calling thread.  If that
+    // throws, the lock still owns the mutex.
+    explicit ownership_token(std::unique_lock<mutex_type>&& l);
+    explicit ownership_token(std::shared_lock<mutex_type>&& l);
+    explicit ownership_token(unique_lock<mutex_type>&& l);
+    explicit ownership_token(shared_lock<mutex_type>&& l);
+    explicit ownership_token(upgrade_lock<mutex_type>&& l);
+    ownership_token(mutex_type& m, lock_mode mode, std::adopt_lock_t);
+
+    // Attach to the calling thread, which then owns the mutex.  If that
+    // throws, the token still owns it.  The modes must match; otherwise
+    // system_error(EPERM).
+    std::unique_lock<mutex_type> attach_unique();
+    std::shared_lock<mutex_type> attach_shared();
+    upgrade_lock<mutex_type> attach_upgrade();
+    mutex_type* attach();                 // any mode
+
+    mutex_type* mutex() const noexcept;
+    lock_mode mode() const noexcept;
+    explicit operator bool () const noexcept;   // owns a mutex
+};
+
+}  // acme
+*/
+
+#include "upgrade_mutex.h"
+#include <cerrno>
+#include <utility>
+
+namespace acme
+{
+
+namespace detail
+{
+
+template <class Mutex>
+void
+unlock_mode(Mutex& m, lock_mode mode)
+{
+    switch (mode)
+    {
+    case lock_mode::shared:
+        m.unlock_shared();
+        return;
+    case lock_mode::upgrade:
+        m.unlock_upgrade();
+        return;
+    case lock_mode::exclusive:
+        break;
+    }
+    m.unlock();
+}
+
+}  // detail
+
+// Ownership of a mutex without per-thread bookkeeping is already free to
+// move between threads.
+
+template <class Mutex, class = void>
+struct ownership_traits
+{
+    struct detached_type {};
+
+    static
+    detached_type
+    detach(Mutex&, lock_mode) noexcept
+    {
+        return detached_type();
+    }
+
+    static void attach(Mutex&, lock_mode, const detached_type&) noexcept {}
+
+    static
+    void
+    unlock_detached(Mutex& mut, lock_mode m, const detached_type&)
+    {
+        detail::unlock_mode(mut, m);
+    }
+};
+
+template <class Mutex>
+struct ownership_traits<Mutex,
+                        std::void_t<typename Mutex::detached_ownership>>
+{
+    typedef typename Mutex::detached_ownership detached_type;
+
+    static
+    detached_type
+    detach(Mutex& mut, lock_mode m)
+    {
+        return mut.detach(m);
+    }
+
+    static
+    void
+    attach(Mutex& mut, lock_mode m, const detached_type& d)
+    {
+        mut.attach(m, d);
+    }
+
+    static
+    void
+    unlock_detached(Mutex& mut, lock_mode m, const detached_type& d)
+    {
+        mut.unlock_detached(m, d);
+    }
+};
+
+template <class Mutex>
+class ownership_token
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    typedef ownership_traits<Mutex>         traits;
+    typedef typename traits::detached_type detached_type;
+
+    mutex_type*   m_;
+    lock_mode     mode_;
+    detached_type d_;
+
+    template <class Lock>
+        void
+        take(Lock& l, lock_mode mode)
+        {
+            if (!l.owns_lock())
+                return;
+            d_ = traits::detach(*l.mutex(), mode);
+            mode_ = mode;
+            m_ = l.release();
+        }
+
+    void check(lock_mode mode) const;
+
+public:
+    ownership_token() noexcept : m_(nullptr), mode_(lock_mode::shared), d_() {}
+    ~ownership_token();
+
+    ownership_token(ownership_token&& t) noexcept
+        : m_(t.m_), mode_(t.mode_), d_(std::move(t.d_))
+    {
+        t.m_ = nullptr;
+    }
+
+    ownership_token&
+    operator=(ownership_token&& t)
+    {
+        if (this != &t)
+        {
+            ownership_token old(std::move(*this));
+            m_ = t.m_;
+            mode_ = t.mode_;
+            d_ = std::move(t.d_);
+            t.m_ = nullptr;
+        }
+        return *this;
+    }
+
+    explicit ownership_token(std::unique_lock<mutex_type>&& l)
+        : ownership_token() {take(l, lock_mode::exclusive);}
+    explicit ownership_token(std::shared_lock<mutex_type>&& l)
+        : ownership_token() {take(l, lock_mode::shared);}
+    explicit ownership_token(unique_lock<mutex_type>&& l)
+        : ownership_token() {take(l, lock_mode::exclusive);}
+    explicit ownership_token(shared_lock<mutex_type>&& l)
+        : ownership_token() {take(l, lock_mode::shared);}
+    explicit ownership_token(upgrade_lock<mutex_type>&& l)
+        : ownership_token() {take(l, lock_mode::upgrade);}
+
+    ownership_token(mutex_type& m, lock_mode mode, std::adopt_lock_t)
+        : m_(&m), mode_(mode), d_(traits::detach(m, mode)) {}
+
+    // Attach
+
+    std::unique_lock<mutex_type>
+    attach_unique()
+    {
+        check(lock_mode::exclusive);
+        return std::unique_lock<mutex_type>(*attach(), std::adopt_lock);
+    }
+
+    std::shared_lock<mutex_type>
+    attach_shared()
+    {
+        check(lock_mode::shared);
+        return std::shared_lock<mutex_type>(*attach(), std::adopt_lock);
+    }
+
+    upgrade_lock<mutex_type>
+    attach_upgrade()
+    {
+        check(lock_mode::upgrade);
+        return upgrade_lock<mutex_type>(*attach(), std::adopt_lock);
+    }
+
+    mutex_type* attach();
+
+    // Observers
+
+    mutex_type* mutex() const noexcept {return m_;}
+    lock_mode mode() const noexcept {return mode_;}
+    explicit operator bool () const noexcept {return m_ != nullptr;}
+};
+
+template <class Mutex>
+ownership_token<Mutex>::~ownership_token()
+{
+    if (m_ != nullptr)
+        traits::unlock_detached(*m_, mode_, d_);
+}
+
+template <class Mutex>
+void
+ownership_token<Mutex>::check(lock_mode mode) const
+{
+    if (m_ == nullptr || mode != mode_)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "ownership_token: no ownership in this mode");
+}
+
+template <class Mutex>
+Mutex*
+ownership_token<Mutex>::attach()
+{
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "ownership_token: no ownership");
+    traits::attach(*m_, mode_, d_);
+    mutex_type* m = m_;
+    m_ = nullptr;
+    return m;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_OWNERSHIP_TOKEN
@@ -0,0 +1,294 @@
+//------------------------------ perf_counters.h -------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_PERF_COUNTERS
+#define UPGRADE_MUTEX_PERF_COUNTERS
+
+/*
+    <perf_counters.h> synopsis
+
+namespace acme
+{
+
+enum perf_event : unsigned
+{
+    perf_cycles,
+    perf_instructions,
+    perf_cache_misses,
+    perf_context_switches,
+    perf_involuntary_switches,      // preemptions
+    perf_events
+};
+
+struct perf_values
+{
+    std::uint64_t v[perf_events];
+};
+
+// The calling thread's event counts.  Counters the kernel, the host or the
+// platform does not permit are unavailable and read as 0:  without a PMU
+// (in most virtual machines) the hardware ones, and off Linux all of them.
+
+class perf_counters
+{
+public:
+    perf_counters() noexcept;                  // counts the calling thread
+    ~perf_counters();
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    bool available(perf_event e) const noexcept;
+    bool kernel() const noexcept;              // includes time in the kernel
+
+    perf_values read() const noexcept;         // totals since construction
+    const perf_values& overhead() const noexcept;   // counted by a read
+
+    static const char* name(perf_event e) noexcept;
+};
+
+}  // acme
+*/
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace acme
+{
+
+enum perf_event : unsigned
+{
+    perf_cycles,
+    perf_instructions,
+    perf_cache_misses,
+    perf_context_switches,
+    perf_involuntary_switches,
+    perf_events
+};
+
+struct perf_values
+{
+    std::uint64_t v[perf_events];
+};
+
+// The perf_event_open counters form one group, led by the first that opens,
+// so that a read is one system call and the counts are of the same
+// interval.  Counting in the kernel too is tried first, so that futex waits
+// and wakes are charged to the operations making them; where
+// perf_event_paranoid forbids it, user mode only.  Preemptions come from
+// getrusage, as do context switches if their counter does not open.
+//
+// The counts include the reads themselves; overhead() is the least a pair
+// of back-to-back reads counted, measured at construction, for callers to
+// subtract.
+
+class perf_counters
+{
+#ifdef __linux__
+    int         fd_[perf_events];
+    unsigned    index_[perf_events];    // in the group's read
+    unsigned    opened_;
+    int         leader_;
+    bool        kernel_;
+#endif
+    perf_values overhead_;
+
+public:
+    perf_counters() noexcept;
+    ~perf_counters();
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    bool
+    available(perf_event e) const noexcept
+    {
+#ifdef __linux__
+        return fd_[e] != -1 || e == perf_involuntary_switches ||
+               e == perf_context_switches;
+#else
+        (void)e;
+        return false;
+#endif
+    }
+
+    bool
+    kernel() const noexcept
+    {
+#ifdef __linux__
+        return kernel_;
+#else
+        return false;
+#endif
+    }
+
+    perf_values read() const noexcept;
+    const perf_values& overhead() const noexcept {return overhead_;}
+
+    static
+    const char*
+    name(perf_event e) noexcept
+    {
+        static const char* const names[] =
+            {"cycles", "instructions", "cache-misses", "cs", "invol-cs"};
+        return names[e];
+    }
+
+private:
+#ifdef __linux__
+    int open(perf_event e, std::uint32_t type, std::uint64_t config) noexcept;
+    void open_all(bool kernel) noexcept;
+    void close_all() noexcept;
+#endif
+};
+
+#ifdef __linux__
+
+inline
+perf_counters::perf_counters() noexcept
+{
+    open_all(true);
+    if (leader_ == -1)
+        open_all(false);
+    overhead_ = perf_values();
+    for (unsigned i = 0; i < perf_events; ++i)
+        overhead_.v[i] = ~std::uint64_t(0);
+    for (int k = 0; k < 16; ++k)
+    {
+        perf_values a = read();
+        perf_values b = read();
+        for (unsigned i = 0; i < perf_events; ++i)
+            if (b.v[i] - a.v[i] < overhead_.v[i])
+                overhead_.v[i] = b.v[i] - a.v[i];
+    }
+}
+
+inline
+perf_counters::~perf_counters()
+{
+    close_all();
+}
+
+inline
+int
+perf_counters::open(perf_event e, std::uint32_t type,
+                    std::uint64_t config) noexcept
+{
+    perf_event_attr a;
+    std::memset(&a, 0, sizeof(a));
+    a.size = sizeof(a);
+    a.type = type;
+    a.config = config;
+    a.exclude_kernel = !kernel_;
+    a.exclude_hv = 1;
+    a.read_format = PERF_FORMAT_GROUP;
+    long fd = syscall(SYS_perf_event_open, &a, 0, -1, leader_,
+                      PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    fd_[e] = static_cast<int>(fd);
+    index_[e] = opened_++;
+    if (leader_ == -1)
+        leader_ = fd_[e];
+    return fd_[e];
+}
+
+inline
+void
+perf_counters::open_all(bool kernel) noexcept
+{
+    for (unsigned i = 0; i < perf_events; ++i)
+        fd_[i] = -1;
+    opened_ = 0;
+    leader_ = -1;
+    kernel_ = kernel;
+    open(perf_cycles, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    open(perf_instructions, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    open(perf_cache_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    open(perf_context_switches, PERF_TYPE_SOFTWARE,
+         PERF_COUNT_SW_CONTEXT_SWITCHES);
+    if (leader_ == -1 || fd_[perf_cycles] != -1 || !kernel)
+        return;
+    // Only the software counter opened:  if the hardware ones were refused
+    // for counting the kernel rather than missing, user mode gets them.
+    perf_event_attr a;
+    std::memset(&a, 0, sizeof(a));
+    a.size = sizeof(a);
+    a.type = PERF_TYPE_HARDWARE;
+    a.config = PERF_COUNT_HW_CPU_CYCLES;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    long fd = syscall(SYS_perf_event_open, &a, 0, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1)
+        return;
+    ::close(static_cast<int>(fd));
+    close_all();
+    open_all(false);
+}
+
+inline
+void
+perf_counters::close_all() noexcept
+{
+    for (unsigned i = 0; i < perf_events; ++i)
+        if (fd_[i] != -1)
+        {
+            ::close(fd_[i]);
+            fd_[i] = -1;
+        }
+    leader_ = -1;
+}
+
+inline
+perf_values
+perf_counters::read() const noexcept
+{
+    perf_values r = perf_values();
+    if (leader_ != -1)
+    {
+        std::uint64_t buf[1 + perf_events];
+        ssize_t n = ::read(leader_, buf, sizeof(buf));
+        if (n >= static_cast<ssize_t>(sizeof(std::uint64_t)))
+            for (unsigned i = 0; i < perf_events; ++i)
+                if (fd_[i] != -1 && index_[i] < buf[0])
+                    r.v[i] = buf[1 + index_[i]];
+    }
+    rusage u;
+    if (getrusage(RUSAGE_THREAD, &u) == 0)
+    {
+        r.v[perf_involuntary_switches] =
+            static_cast<std::uint64_t>(u.ru_nivcsw);
+        if (fd_[perf_context_switches] == -1)
+            r.v[perf_context_switches] =
+                static_cast<std::uint64_t>(u.ru_nvcsw + u.ru_nivcsw);
+    }
+    return r;
+}
+
+#else  // __linux__
+
+inline perf_counters::perf_counters() noexcept : overhead_() {}
+inline perf_counters::~perf_counters() {}
+inline perf_values perf_counters::read() const noexcept {return perf_values();}
+
+#endif  // __linux__
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_PERF_COUNTERS
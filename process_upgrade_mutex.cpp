@@ -0,0 +1,614 @@
+//------------------------ process_upgrade_mutex.cpp ---------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "process_upgrade_mutex.h"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace acme
+{
+
+namespace
+{
+
+// How often a blocked thread looks for dead owners.
+const std::chrono::milliseconds probe_interval(100);
+
+// A process that has exited but not been waited for is a zombie, which kill
+// still finds:  its state in /proc/<pid>/stat is the word after the command
+// name, which is in parentheses and may itself hold any character.  Without
+// /proc the answer is kill's.
+
+bool
+alive(std::int32_t pid) noexcept
+{
+    if (kill(pid, 0) != 0 && errno == ESRCH)
+        return false;
+    char path[32];
+    std::snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return true;
+    char buf[512];
+    ssize_t n = ::read(fd, buf, sizeof(buf) - 1);
+    ::close(fd);
+    if (n <= 0)
+        return true;
+    buf[n] = '\0';
+    const char* p = std::strrchr(buf, ')');
+    if (p == nullptr || p[1] != ' ')
+        return true;
+    return p[2] != 'Z' && p[2] != 'X';
+}
+
+}  // unnamed
+
+// Locks the internal mutex, recovering the state if its last owner died
+// holding it.
+
+class process_upgrade_mutex::locker
+{
+    process_upgrade_mutex& m_;
+    bool                   owns_;
+
+public:
+    explicit locker(process_upgrade_mutex& m)
+        : m_(m), owns_(false)
+    {
+        lock();
+    }
+
+    ~locker()
+    {
+        if (owns_)
+            unlock();
+    }
+
+    locker(const locker&) = delete;
+    locker& operator=(const locker&) = delete;
+
+    void
+    lock()
+    {
+        int e = pthread_mutex_lock(&m_.mut_);
+        if (e == EOWNERDEAD)
+        {
+            m_.recover();
+            e = pthread_mutex_consistent(&m_.mut_);
+        }
+        if (e != 0)
+            throw std::system_error(std::error_code(e, std::system_category()),
+                          "process_upgrade_mutex: unable to lock internal mutex");
+        owns_ = true;
+    }
+
+    void
+    unlock() noexcept
+    {
+        owns_ = false;
+        pthread_mutex_unlock(&m_.mut_);
+    }
+};
+
+process_upgrade_mutex::process_upgrade_mutex()
+    : state_(0)
+{
+    pthread_mutexattr_t a;
+    pthread_mutexattr_init(&a);
+    pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+    int e = pthread_mutex_init(&mut_, &a);
+    pthread_mutexattr_destroy(&a);
+    if (e != 0)
+        throw std::system_error(std::error_code(e, std::system_category()),
+                                "process_upgrade_mutex: unable to create mutex");
+    for (gate* g : {&gate1_, &gate2_})
+    {
+        g->seq.store(0, std::memory_order_relaxed);
+        g->parked.store(0, std::memory_order_relaxed);
+    }
+    for (holder& h : holders_)
+        h = holder{0, 0, 0, 0, 0, 0};
+}
+
+process_upgrade_mutex::~process_upgrade_mutex()
+{
+    pthread_mutex_destroy(&mut_);
+}
+
+// Gates
+
+// Blocks, with the internal mutex unlocked, until pred() holds.  Wakes at
+// least every probe_interval to reclaim the ownership of dead processes,
+// which may be what pred() is waiting on.
+
+template <class Predicate>
+bool
+process_upgrade_mutex::wait(gate& g, locker& lk, Predicate pred,
+                            const clock_type::time_point* deadline)
+{
+    while (!pred())
+    {
+        clock_type::duration rel_time = probe_interval;
+        if (deadline != nullptr)
+        {
+            clock_type::duration left = *deadline - clock_type::now();
+            if (left <= left.zero())
+                return false;
+            if (left < rel_time)
+                rel_time = left;
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                                     rel_time);
+        timespec ts;
+        ts.tv_sec = static_cast<std::time_t>(ns.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+        std::uint32_t s = g.seq.load(std::memory_order_relaxed);
+        g.parked.fetch_add(1, std::memory_order_relaxed);
+        lk.unlock();
+        bool timed_out = detail::futex(&g.seq, FUTEX_WAIT, s, &ts) == -1 &&
+                         errno == ETIMEDOUT;
+        lk.lock();
+        g.parked.fetch_sub(1, std::memory_order_relaxed);
+        if (timed_out)
+            reclaim_dead();
+    }
+    return true;
+}
+
+// A parked count left behind by a process that died parked only costs later
+// notifies a system call.
+
+void
+process_upgrade_mutex::notify(gate& g, int n) noexcept
+{
+    g.seq.fetch_add(1, std::memory_order_relaxed);
+    if (g.parked.load(std::memory_order_relaxed) != 0)
+        detail::futex(&g.seq, FUTEX_WAKE, static_cast<std::uint32_t>(n));
+}
+
+// Holders
+
+// The calling process's slot, taken if it has none.  Look it up again after
+// any wait:  while this process owns nothing another of its threads may free
+// the slot.
+
+process_upgrade_mutex::holder&
+process_upgrade_mutex::self()
+{
+    std::int32_t pid = getpid();
+    holder* free = nullptr;
+    for (holder& h : holders_)
+    {
+        if (h.pid == pid)
+            return h;
+        if (h.pid == 0 && free == nullptr)
+            free = &h;
+    }
+    if (free == nullptr)
+    {
+        reclaim_dead();
+        for (holder& h : holders_)
+            if (h.pid == 0)
+                free = &h;
+        if (free == nullptr)
+            throw std::system_error(std::error_code(EAGAIN,
+                                                    std::system_category()),
+                       "process_upgrade_mutex: too many owning processes");
+    }
+    free->pid = pid;
+    return *free;
+}
+
+void
+process_upgrade_mutex::tidy(holder& h) noexcept
+{
+    if (h.shared == 0 && !h.upgrade && !h.exclusive && !h.entering)
+        h.pid = 0;
+}
+
+// Clears the counts before the pid, so that a process dying part way through
+// leaves a slot that is either still its own or free and clean.
+
+unsigned
+process_upgrade_mutex::reclaim_dead() noexcept
+{
+    unsigned n = 0;
+    for (holder& h : holders_)
+    {
+        if (h.pid != 0 && !alive(h.pid))
+        {
+            h.shared = 0;
+            h.upgrade = 0;
+            h.exclusive = 0;
+            h.entering = 0;
+            h.pid = 0;
+            ++n;
+        }
+    }
+    if (n != 0)
+    {
+        rebuild();
+        notify(gate1_, INT_MAX);
+        notify(gate2_, INT_MAX);
+    }
+    return n;
+}
+
+// The upgrade owner counts as a reader; a writer does not.
+
+void
+process_upgrade_mutex::rebuild() noexcept
+{
+    state_type readers = 0;
+    bool writer = false;
+    bool upgrader = false;
+    for (const holder& h : holders_)
+    {
+        if (h.pid == 0)
+            continue;
+        readers += h.shared + h.upgrade;
+        writer = writer || h.exclusive || h.entering;
+        upgrader = upgrader || h.upgrade;
+    }
+    state_ = (readers & n_readers_) | (writer ? write_entered_ : 0) |
+             (upgrader ? upgradable_entered_ : 0);
+}
+
+// The previous owner of the internal mutex died holding it, perhaps part way
+// through changing state_ or its slot.
+
+void
+process_upgrade_mutex::recover() noexcept
+{
+    reclaim_dead();
+    rebuild();
+    notify(gate1_, INT_MAX);
+    notify(gate2_, INT_MAX);
+}
+
+unsigned
+process_upgrade_mutex::reclaim()
+{
+    locker lk(*this);
+    return reclaim_dead();
+}
+
+// Acquisition
+
+bool
+process_upgrade_mutex::acquire_exclusive(const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    if (!wait(gate1_, lk, [this]
+              {
+                  return !(state_ & (write_entered_ | upgradable_entered_));
+              }, deadline))
+        return false;
+    holder& h = self();
+    state_ |= write_entered_;
+    h.entering = 1;
+    if (!wait(gate2_, lk, [this] {return readers() == 0;}, deadline))
+    {
+        state_ &= ~write_entered_;
+        h.entering = 0;
+        tidy(h);
+        notify(gate1_, INT_MAX);
+        return false;
+    }
+    h.entering = 0;
+    h.exclusive = 1;
+    return true;
+}
+
+bool
+process_upgrade_mutex::acquire_shared(const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    if (!wait(gate1_, lk, [this]
+              {
+                  return !(state_ & write_entered_) && readers() != n_readers_;
+              }, deadline))
+        return false;
+    holder& h = self();
+    add_reader();
+    ++h.shared;
+    return true;
+}
+
+bool
+process_upgrade_mutex::acquire_upgrade(const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    if (!wait(gate1_, lk, [this]
+              {
+                  return !(state_ & (write_entered_ | upgradable_entered_)) &&
+                         readers() != n_readers_;
+              }, deadline))
+        return false;
+    holder& h = self();
+    state_ |= upgradable_entered_;
+    add_reader();
+    h.upgrade = 1;
+    return true;
+}
+
+bool
+process_upgrade_mutex::shared_to_exclusive(
+                                        const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    if (!wait(gate1_, lk, [this]
+              {
+                  return !(state_ & (write_entered_ | upgradable_entered_));
+              }, deadline))
+        return false;
+    holder& h = self();
+    state_ |= write_entered_;
+    remove_reader();
+    --h.shared;
+    h.entering = 1;
+    if (!wait(gate2_, lk, [this] {return readers() == 0;}, deadline))
+    {
+        state_ &= ~write_entered_;
+        add_reader();
+        ++h.shared;
+        h.entering = 0;
+        notify(gate1_, INT_MAX);
+        return false;
+    }
+    h.entering = 0;
+    h.exclusive = 1;
+    return true;
+}
+
+bool
+process_upgrade_mutex::shared_to_upgrade(const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    if (!wait(gate1_, lk, [this]
+              {
+                  return !(state_ & (write_entered_ | upgradable_entered_));
+              }, deadline))
+        return false;
+    holder& h = self();
+    state_ |= upgradable_entered_;
+    --h.shared;
+    h.upgrade = 1;
+    return true;
+}
+
+// Readers are held at gate1 while waiting; giving up restores upgrade
+// ownership and lets them in again.
+
+bool
+process_upgrade_mutex::upgrade_to_exclusive(
+                                        const clock_type::time_point* deadline)
+{
+    locker lk(*this);
+    holder& h = self();
+    remove_reader();
+    state_ &= ~upgradable_entered_;
+    state_ |= write_entered_;
+    h.upgrade = 0;
+    h.entering = 1;
+    if (!wait(gate2_, lk, [this] {return readers() == 0;}, deadline))
+    {
+        add_reader();
+        state_ &= ~write_entered_;
+        state_ |= upgradable_entered_;
+        h.upgrade = 1;
+        h.entering = 0;
+        notify(gate1_, INT_MAX);
+        return false;
+    }
+    h.entering = 0;
+    h.exclusive = 1;
+    return true;
+}
+
+// Exclusive ownership
+
+void
+process_upgrade_mutex::lock()
+{
+    acquire_exclusive(nullptr);
+}
+
+bool
+process_upgrade_mutex::try_lock()
+{
+    locker lk(*this);
+    if (state_ != 0)
+        return false;
+    holder& h = self();
+    h.exclusive = 1;
+    state_ = write_entered_;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock()
+{
+    locker lk(*this);
+    holder& h = self();
+    h.exclusive = 0;
+    tidy(h);
+    state_ = 0;
+    notify(gate1_, INT_MAX);
+}
+
+// Shared ownership
+
+void
+process_upgrade_mutex::lock_shared()
+{
+    acquire_shared(nullptr);
+}
+
+bool
+process_upgrade_mutex::try_lock_shared()
+{
+    locker lk(*this);
+    if ((state_ & write_entered_) || readers() == n_readers_)
+        return false;
+    holder& h = self();
+    add_reader();
+    ++h.shared;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock_shared()
+{
+    locker lk(*this);
+    holder& h = self();
+    --h.shared;
+    tidy(h);
+    remove_reader();
+    state_type num_readers = readers();
+    if (state_ & write_entered_)
+    {
+        if (num_readers == 0)
+            notify(gate2_, 1);
+    }
+    else if (num_readers == n_readers_ - 1)
+        notify(gate1_, 1);
+}
+
+// Upgrade ownership
+
+void
+process_upgrade_mutex::lock_upgrade()
+{
+    acquire_upgrade(nullptr);
+}
+
+bool
+process_upgrade_mutex::try_lock_upgrade()
+{
+    locker lk(*this);
+    if ((state_ & (write_entered_ | upgradable_entered_)) ||
+        readers() == n_readers_)
+        return false;
+    holder& h = self();
+    state_ |= upgradable_entered_;
+    add_reader();
+    h.upgrade = 1;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock_upgrade()
+{
+    locker lk(*this);
+    holder& h = self();
+    h.upgrade = 0;
+    tidy(h);
+    state_ &= ~upgradable_entered_;
+    remove_reader();
+    notify(gate1_, INT_MAX);
+}
+
+// Shared <-> Exclusive
+
+bool
+process_upgrade_mutex::try_unlock_shared_and_lock()
+{
+    locker lk(*this);
+    if (state_ != 1)
+        return false;
+    holder& h = self();
+    --h.shared;
+    h.exclusive = 1;
+    state_ = write_entered_;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock_and_lock_shared()
+{
+    locker lk(*this);
+    holder& h = self();
+    h.exclusive = 0;
+    ++h.shared;
+    state_ = 1;
+    notify(gate1_, INT_MAX);
+}
+
+// Shared <-> Upgrade
+
+bool
+process_upgrade_mutex::try_unlock_shared_and_lock_upgrade()
+{
+    locker lk(*this);
+    if (state_ & (write_entered_ | upgradable_entered_))
+        return false;
+    holder& h = self();
+    --h.shared;
+    h.upgrade = 1;
+    state_ |= upgradable_entered_;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock_upgrade_and_lock_shared()
+{
+    locker lk(*this);
+    holder& h = self();
+    h.upgrade = 0;
+    ++h.shared;
+    state_ &= ~upgradable_entered_;
+    notify(gate1_, INT_MAX);
+}
+
+// Upgrade <-> Exclusive
+
+void
+process_upgrade_mutex::unlock_upgrade_and_lock()
+{
+    upgrade_to_exclusive(nullptr);
+}
+
+bool
+process_upgrade_mutex::try_unlock_upgrade_and_lock()
+{
+    locker lk(*this);
+    if (state_ != (upgradable_entered_ | 1))
+        return false;
+    holder& h = self();
+    h.upgrade = 0;
+    h.exclusive = 1;
+    state_ = write_entered_;
+    return true;
+}
+
+void
+process_upgrade_mutex::unlock_and_lock_upgrade()
+{
+    locker lk(*this);
+    holder& h = self();
+    h.exclusive = 0;
+    h.upgrade = 1;
+    state_ = upgradable_entered_ | 1;
+    notify(gate1_, INT_MAX);
+}
+
+}  // acme
+
+#endif  // __linux__
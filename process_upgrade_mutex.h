@@ -0,0 +1,292 @@
+//------------------------- process_upgrade_mutex.h ----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_PROCESS
+#define UPGRADE_MUTEX_PROCESS
+
+/*
+    <process_upgrade_mutex.h> synopsis  (Linux only)
+
+namespace acme
+{
+
+class process_upgrade_mutex
+{
+public:
+    static constexpr unsigned max_processes = 64;
+
+    process_upgrade_mutex();
+    ~process_upgrade_mutex();
+
+    process_upgrade_mutex(const process_upgrade_mutex&) = delete;
+    process_upgrade_mutex& operator=(const process_upgrade_mutex&) = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions:  as
+    // basic_upgrade_mutex, except there are no cancellable overloads.
+
+    // Gives back the ownership of every process that has died holding some.
+    // Returns the number of such processes.  Waiters do this by themselves.
+
+    unsigned reclaim();
+};
+
+}  // acme
+*/
+
+#ifdef __linux__
+
+#include "upgrade_mutex.h"
+#include <pthread.h>
+
+namespace acme
+{
+
+// An upgrade_mutex that can be placed in memory shared between processes,
+// e.g. with placement new into an mmap'd MAP_SHARED segment by the process
+// that creates the segment.  Other processes use it where it is mapped.  It
+// holds no pointers and the same object works at any address in each
+// process.
+//
+// The internal mutex is a robust, process-shared pthread mutex and the gates
+// are shared (not process-private) futex words.  Each process that owns the
+// mutex in any mode has a holder slot recording what it owns; the slots, not
+// the state word, are the record of ownership, and the state word can be
+// rebuilt from them.  When a process dies owning the mutex:
+//
+//  - if it died holding the internal mutex, the next process to lock it gets
+//    EOWNERDEAD and rebuilds the state without the dead process;
+//  - otherwise every blocked thread wakes at least every 100 ms, probes the
+//    slot owners with kill(pid, 0) and /proc/<pid>/stat, and reclaims the
+//    ownership of any that no longer exist or are zombies, dead but not yet
+//    waited for by their parents.
+//
+// A process id reused by a new process before its predecessor's slot is
+// reclaimed keeps that slot alive until the new process exits.  At most
+// max_processes processes can own the mutex at the same time; one more
+// gets std::system_error (EAGAIN).  Ownership is per process:  threads of one
+// process may unlock what another of its threads locked.
+
+class process_upgrade_mutex
+{
+public:
+    static constexpr unsigned max_processes = 64;
+
+private:
+    typedef std::uint32_t                         state_type;
+    typedef std::chrono::steady_clock             clock_type;
+
+    struct gate
+    {
+        std::atomic<std::uint32_t> seq;
+        std::atomic<std::uint32_t> parked;
+    };
+
+    struct holder
+    {
+        std::int32_t  pid;        // 0:  free, and all the counts are 0
+        std::uint32_t shared;     // shared ownerships
+        std::uint8_t  upgrade;    // owns upgrade
+        std::uint8_t  exclusive;  // owns exclusive
+        std::uint8_t  entering;   // past gate1 as a writer, waiting at gate2
+        std::uint8_t  reserved;
+    };
+
+    pthread_mutex_t mut_;
+    gate            gate1_;
+    gate            gate2_;
+    state_type      state_;
+    holder          holders_[max_processes];
+
+    static constexpr state_type write_entered_ = 1U << 31;
+    static constexpr state_type upgradable_entered_ = write_entered_ >> 1;
+    static constexpr state_type n_readers_ =
+                                        ~(write_entered_ | upgradable_entered_);
+
+    static_assert(std::atomic<std::uint32_t>::is_always_lock_free,
+                  "process_upgrade_mutex: futex words must be lock free");
+
+    class locker;
+
+public:
+    process_upgrade_mutex();
+    ~process_upgrade_mutex();
+
+    process_upgrade_mutex(const process_upgrade_mutex&) = delete;
+    process_upgrade_mutex& operator=(const process_upgrade_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(clock_type::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return acquire_exclusive(&t);
+        }
+    void unlock();
+
+    // Shared ownership
+
+    void lock_shared();
+    bool try_lock_shared();
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(clock_type::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return acquire_shared(&t);
+        }
+    void unlock_shared();
+
+    // Upgrade ownership
+
+    void lock_upgrade();
+    bool try_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(clock_type::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return acquire_upgrade(&t);
+        }
+    void unlock_upgrade();
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(clock_type::now() +
+                                                    rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return shared_to_exclusive(&t);
+        }
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(clock_type::now() +
+                                                            rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return shared_to_upgrade(&t);
+        }
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(clock_type::now() +
+                                                     rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            clock_type::time_point t = deadline(abs_time);
+            return upgrade_to_exclusive(&t);
+        }
+    void unlock_and_lock_upgrade();
+
+    // Recovery
+
+    unsigned reclaim();
+
+private:
+    template <class Clock, class Duration>
+        static
+        clock_type::time_point
+        deadline(const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return clock_type::now() + std::chrono::duration_cast<
+                       clock_type::duration>(abs_time - Clock::now());
+        }
+
+    // A null deadline waits for ever.
+
+    bool acquire_exclusive(const clock_type::time_point* deadline);
+    bool acquire_shared(const clock_type::time_point* deadline);
+    bool acquire_upgrade(const clock_type::time_point* deadline);
+    bool shared_to_exclusive(const clock_type::time_point* deadline);
+    bool shared_to_upgrade(const clock_type::time_point* deadline);
+    bool upgrade_to_exclusive(const clock_type::time_point* deadline);
+
+    template <class Predicate>
+        bool wait(gate& g, locker& lk, Predicate pred,
+                  const clock_type::time_point* deadline);
+    static void notify(gate& g, int n) noexcept;
+
+    holder& self();
+    void tidy(holder& h) noexcept;
+    unsigned reclaim_dead() noexcept;
+    void rebuild() noexcept;
+    void recover() noexcept;
+
+    void add_reader() noexcept {++state_;}
+    void remove_reader() noexcept {--state_;}
+    state_type readers() const noexcept {return state_ & n_readers_;}
+};
+
+}  // acme
+
+#endif  // __linux__
+
+#endif  // UPGRADE_MUTEX_PROCESS
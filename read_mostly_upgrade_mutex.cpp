@@ -0,0 +1,352 @@
+//---------------------- read_mostly_upgrade_mutex.cpp -------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "read_mostly_upgrade_mutex.h"
+#include <vector>
+
+namespace acme
+{
+
+namespace detail
+{
+
+namespace
+{
+
+// Slot numbers in use; a thread takes the lowest free one.  Never
+// destroyed, as threads may exit after static destruction.
+
+struct slot_numbers
+{
+    std::mutex        mut;
+    std::vector<bool> in_use;
+};
+
+slot_numbers&
+numbers()
+{
+    static slot_numbers* p = new slot_numbers;
+    return *p;
+}
+
+}  // unnamed
+
+unsigned
+reader_slot_number::take() noexcept
+{
+    slot_numbers& s = numbers();
+    std::lock_guard<std::mutex> _(s.mut);
+    std::vector<bool>& v = s.in_use;
+    unsigned n = 0;
+    while (n < v.size() && v[n])
+        ++n;
+    try
+    {
+        if (n == v.size())
+            v.push_back(true);
+        else
+            v[n] = true;
+    }
+    catch (const std::bad_alloc&)
+    {
+        // A number beyond every mutex's slots:  the thread reads the slow
+        // way, as it does when numbers run out.
+        return none - 1;
+    }
+    return n;
+}
+
+void
+reader_slot_number::give_back(unsigned n) noexcept
+{
+    slot_numbers& s = numbers();
+    std::lock_guard<std::mutex> _(s.mut);
+    std::vector<bool>& v = s.in_use;
+    if (n < v.size())
+        v[n] = false;
+}
+
+}  // detail
+
+read_mostly_upgrade_mutex::read_mostly_upgrade_mutex(unsigned reader_slots)
+    : n_slots_(reader_slots),
+      slots_(new reader_slot[reader_slots]),
+      write_entered_(false),
+      overflow_readers_(0),
+      upgradable_entered_(false)
+{
+    // Settle the choice of fences before any thread relies on it.
+    asymmetric_fence_expedited();
+}
+
+// Readers
+
+// Called holding mut_, by a thread converting its own shared ownership.
+
+void
+read_mostly_upgrade_mutex::add_reader() noexcept
+{
+    unsigned i = detail::this_reader_slot.get();
+    if (i >= n_slots_)
+    {
+        ++overflow_readers_;
+        return;
+    }
+    std::atomic<unsigned>& n = slots_[i].n;
+    n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void
+read_mostly_upgrade_mutex::remove_reader() noexcept
+{
+    unsigned i = detail::this_reader_slot.get();
+    if (i >= n_slots_)
+    {
+        --overflow_readers_;
+        return;
+    }
+    std::atomic<unsigned>& n = slots_[i].n;
+    n.store(n.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+}
+
+void
+read_mostly_upgrade_mutex::remove_overflow_reader()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    --overflow_readers_;
+    if (write_entered_.load(std::memory_order_relaxed) && readers_drained())
+        gate2_.notify_all();
+}
+
+// Called holding mut_, after the heavy fence.
+
+bool
+read_mostly_upgrade_mutex::readers_drained() const noexcept
+{
+    if (overflow_readers_ != 0)
+        return false;
+    for (unsigned i = 0; i < n_slots_; ++i)
+        if (slots_[i].n.load(std::memory_order_acquire) != 0)
+            return false;
+    return true;
+}
+
+// The writer checks the slots holding mut_, so notifying under it cannot be
+// missed.
+
+void
+read_mostly_upgrade_mutex::wake_writer()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    gate2_.notify_all();
+}
+
+// Called holding mut_.
+
+void
+read_mostly_upgrade_mutex::reopen() noexcept
+{
+    write_entered_.store(false, std::memory_order_release);
+    gate1_.notify_all();
+}
+
+bool
+read_mostly_upgrade_mutex::try_lock_shared()
+{
+    if (enter_fast())
+        return true;
+    if (detail::this_reader_slot.get() < n_slots_)
+        return false;
+    std::lock_guard<mutex_type> _(mut_);
+    if (write_entered_.load(std::memory_order_relaxed))
+        return false;
+    ++overflow_readers_;
+    return true;
+}
+
+// Exclusive ownership
+
+void
+read_mostly_upgrade_mutex::lock()
+{
+    exclusive(detail::untimed_wait());
+}
+
+bool
+read_mostly_upgrade_mutex::try_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    if (!gate1_open())
+        return false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    asymmetric_heavy_fence();
+    if (readers_drained())
+        return true;
+    reopen();
+    return false;
+}
+
+void
+read_mostly_upgrade_mutex::unlock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    reopen();
+}
+
+// Upgrade ownership
+
+void
+read_mostly_upgrade_mutex::lock_upgrade()
+{
+    upgrade(detail::untimed_wait());
+}
+
+bool
+read_mostly_upgrade_mutex::try_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    if (!gate1_open())
+        return false;
+    upgradable_entered_ = true;
+    return true;
+}
+
+void
+read_mostly_upgrade_mutex::unlock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    upgradable_entered_ = false;
+    gate1_.notify_all();
+}
+
+// Shared <-> Exclusive
+
+bool
+read_mostly_upgrade_mutex::try_unlock_shared_and_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    if (!gate1_open())
+        return false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    remove_reader();
+    asymmetric_heavy_fence();
+    if (readers_drained())
+        return true;
+    add_reader();
+    reopen();
+    return false;
+}
+
+void
+read_mostly_upgrade_mutex::unlock_and_lock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    add_reader();
+    reopen();
+}
+
+// Shared <-> Upgrade
+
+bool
+read_mostly_upgrade_mutex::try_unlock_shared_and_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    if (!gate1_open())
+        return false;
+    upgradable_entered_ = true;
+    remove_reader();
+    return true;
+}
+
+void
+read_mostly_upgrade_mutex::unlock_upgrade_and_lock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    add_reader();
+    upgradable_entered_ = false;
+    gate1_.notify_all();
+}
+
+// Upgrade <-> Exclusive
+
+void
+read_mostly_upgrade_mutex::unlock_upgrade_and_lock()
+{
+    lock_type lk(mut_);
+    upgrade_to_exclusive(lk, detail::untimed_wait());
+}
+
+bool
+read_mostly_upgrade_mutex::try_unlock_upgrade_and_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    upgradable_entered_ = false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    asymmetric_heavy_fence();
+    if (readers_drained())
+        return true;
+    upgradable_entered_ = true;
+    reopen();
+    return false;
+}
+
+void
+read_mostly_upgrade_mutex::unlock_and_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    upgradable_entered_ = true;
+    reopen();
+}
+
+// Ownership transfer
+
+read_mostly_upgrade_mutex::detached_ownership
+read_mostly_upgrade_mutex::detach(lock_mode m)
+{
+    if (m == lock_mode::shared)
+    {
+        std::lock_guard<mutex_type> _(mut_);
+        remove_reader();
+        ++overflow_readers_;
+    }
+    return detached_ownership();
+}
+
+void
+read_mostly_upgrade_mutex::attach(lock_mode m, const detached_ownership&)
+{
+    if (m == lock_mode::shared)
+    {
+        std::lock_guard<mutex_type> _(mut_);
+        --overflow_readers_;
+        add_reader();
+    }
+}
+
+void
+read_mostly_upgrade_mutex::unlock_detached(lock_mode m,
+                                           const detached_ownership&)
+{
+    switch (m)
+    {
+    case lock_mode::shared:
+        remove_overflow_reader();
+        break;
+    case lock_mode::upgrade:
+        unlock_upgrade();
+        break;
+    case lock_mode::exclusive:
+        unlock();
+        break;
+    }
+}
+
+}  // acme
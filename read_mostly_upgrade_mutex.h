@@ -0,0 +1,477 @@
+//----------------------- read_mostly_upgrade_mutex.h --------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_READ_MOSTLY
+#define UPGRADE_MUTEX_READ_MOSTLY
+
+/*
+    <read_mostly_upgrade_mutex.h> synopsis
+
+namespace acme
+{
+
+class read_mostly_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_reader_slots = 128;
+
+    explicit read_mostly_upgrade_mutex(unsigned reader_slots =
+                                                   default_reader_slots);
+    ~read_mostly_upgrade_mutex();
+
+    read_mostly_upgrade_mutex(const read_mostly_upgrade_mutex&) = delete;
+    read_mostly_upgrade_mutex& operator=(const read_mostly_upgrade_mutex&)
+                                                                     = delete;
+
+    // Exclusive, shared, upgrade ownership and conversions:  as
+    // basic_upgrade_mutex, except there are no cancellable overloads, and
+    // shared ownership must be given up by the thread that took it, unless
+    // moved with an ownership_token.
+
+    // Ownership transfer (see ownership_token.h)
+
+    struct detached_ownership {};
+
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode m, const detached_ownership&);
+    void unlock_detached(lock_mode m, const detached_ownership&);
+
+    unsigned reader_slots() const noexcept;
+};
+
+}  // acme
+*/
+
+#include "asymmetric_fence.h"
+#include "upgrade_mutex.h"
+#include <memory>
+
+namespace acme
+{
+
+namespace detail
+{
+
+// The calling thread's reader slot number, the same in every
+// read_mostly_upgrade_mutex.  Numbers are handed out lowest first and given
+// back when the thread exits.
+
+class reader_slot_number
+{
+    unsigned n_;
+
+    static unsigned take() noexcept;
+    static void give_back(unsigned n) noexcept;
+
+public:
+    static constexpr unsigned none = ~0u;
+
+    reader_slot_number() noexcept : n_(none) {}
+    ~reader_slot_number() {if (n_ != none) give_back(n_);}
+
+    reader_slot_number(const reader_slot_number&) = delete;
+    reader_slot_number& operator=(const reader_slot_number&) = delete;
+
+    unsigned
+    get() noexcept
+    {
+        if (n_ == none)
+            n_ = take();
+        return n_;
+    }
+};
+
+inline thread_local reader_slot_number this_reader_slot;
+
+}  // detail
+
+// An upgrade mutex for data read far more often than written.
+//
+// A reader announces itself by incrementing a counter in its own cache line,
+// one per thread, with a plain store; a light asymmetric fence (a compiler
+// barrier, where membarrier is available) orders that store before its load
+// of write_entered_.  A writer sets write_entered_, issues the heavy fence,
+// which makes every reader either see write_entered_ or have its increment
+// seen, and then waits for every counter to reach zero.  Readers that find
+// write_entered_ set give back their count and wait for it to clear.
+//
+// Shared ownership thus costs no locked instruction when there is no writer,
+// and exclusive ownership costs a system call and a scan of every slot.
+// Threads beyond the first reader_slots() to take shared ownership of any
+// read_mostly_upgrade_mutex share a counter guarded by the internal mutex.
+//
+// A reader's count is in its own thread's slot, so shared ownership must be
+// given up by the thread that took it.  Upgrade and exclusive ownership have
+// no such restriction.  The upgrade owner holds no reader count.
+
+class read_mostly_upgrade_mutex
+{
+public:
+    static constexpr unsigned default_reader_slots = 128;
+
+private:
+    typedef std::mutex                   mutex_type;
+    typedef condvar_wait::gate_type      gate_type;
+    typedef std::unique_lock<mutex_type> lock_type;
+
+    struct alignas(64) reader_slot
+    {
+        std::atomic<unsigned> n{0};
+    };
+
+    const unsigned                 n_slots_;
+    std::unique_ptr<reader_slot[]> slots_;
+
+    alignas(64) std::atomic<bool>  write_entered_;
+    mutex_type                     mut_;
+    gate_type                      gate1_;     // wait for the writer to leave
+    gate_type                      gate2_;     // a writer waits for readers
+    unsigned                       overflow_readers_;
+    bool                           upgradable_entered_;
+
+public:
+    explicit read_mostly_upgrade_mutex(unsigned reader_slots =
+                                                       default_reader_slots);
+    ~read_mostly_upgrade_mutex() = default;
+
+    read_mostly_upgrade_mutex(const read_mostly_upgrade_mutex&) = delete;
+    read_mostly_upgrade_mutex& operator=(const read_mostly_upgrade_mutex&)
+                                                                      = delete;
+
+    // Exclusive ownership
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return exclusive(detail::wait_until(abs_time));
+        }
+    void unlock();
+
+    // Shared ownership
+
+    void
+    lock_shared()
+    {
+        if (!enter_fast())
+            shared(detail::untimed_wait());
+    }
+
+    bool try_lock_shared();
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return enter_fast() || shared(detail::wait_until(abs_time));
+        }
+
+    void
+    unlock_shared()
+    {
+        unsigned i = detail::this_reader_slot.get();
+        if (i >= n_slots_)
+        {
+            remove_overflow_reader();
+            return;
+        }
+        std::atomic<unsigned>& n = slots_[i].n;
+        n.store(n.load(std::memory_order_relaxed) - 1,
+                std::memory_order_release);
+        asymmetric_light_fence();
+        if (write_entered_.load(std::memory_order_relaxed))
+            wake_writer();
+    }
+
+    // Upgrade ownership
+
+    void lock_upgrade();
+    bool try_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(std::chrono::steady_clock::now() +
+                                          rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return upgrade(detail::wait_until(abs_time));
+        }
+    void unlock_upgrade();
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return shared_to_exclusive(detail::wait_until(abs_time));
+        }
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            return shared_to_upgrade(detail::wait_until(abs_time));
+        }
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time)
+        {
+            lock_type lk(mut_);
+            return upgrade_to_exclusive(lk, detail::wait_until(abs_time));
+        }
+    void unlock_and_lock_upgrade();
+
+    // Ownership transfer
+
+    // A detached shared ownership is counted with the overflow readers, which
+    // belong to no thread.
+
+    struct detached_ownership {};
+
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode m, const detached_ownership&);
+    void unlock_detached(lock_mode m, const detached_ownership&);
+
+    // Observers
+
+    unsigned reader_slots() const noexcept {return n_slots_;}
+
+private:
+    // Readers
+
+    // Takes a count in the calling thread's slot unless a writer has
+    // entered.  false:  the caller must take the slow path.
+    bool
+    enter_fast() noexcept
+    {
+        unsigned i = detail::this_reader_slot.get();
+        if (i >= n_slots_)
+            return false;
+        std::atomic<unsigned>& n = slots_[i].n;
+        n.store(n.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        asymmetric_light_fence();
+        if (!write_entered_.load(std::memory_order_acquire))
+            return true;
+        n.store(n.load(std::memory_order_relaxed) - 1,
+                std::memory_order_release);
+        wake_writer();
+        return false;
+    }
+
+    template <class Waiter>
+        bool shared(const Waiter& w);
+    void add_reader() noexcept;
+    void remove_reader() noexcept;
+    void remove_overflow_reader();
+    bool readers_drained() const noexcept;
+    void wake_writer();
+
+    // Writers
+
+    bool
+    gate1_open() const noexcept
+    {
+        return !write_entered_.load(std::memory_order_relaxed) &&
+               !upgradable_entered_;
+    }
+
+    template <class Waiter>
+        bool exclusive(const Waiter& w);
+    template <class Waiter>
+        bool upgrade(const Waiter& w);
+    template <class Waiter>
+        bool drain(lock_type& lk, const Waiter& w);
+    template <class Waiter>
+        bool upgrade_to_exclusive(lock_type& lk, const Waiter& w);
+    template <class Waiter>
+        bool shared_to_exclusive(const Waiter& w);
+    template <class Waiter>
+        bool shared_to_upgrade(const Waiter& w);
+    void reopen() noexcept;
+};
+
+// Readers
+
+// With the slot count given back by enter_fast, or as an overflow reader,
+// wait for the writer to leave and try again.
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::shared(const Waiter& w)
+{
+    for (;;)
+    {
+        {
+            lock_type lk(mut_);
+            if (!w(gate1_, lk, [this]
+                   {
+                       return !write_entered_.load(std::memory_order_relaxed);
+                   }))
+                return false;
+            if (detail::this_reader_slot.get() >= n_slots_)
+            {
+                ++overflow_readers_;
+                return true;
+            }
+        }
+        if (enter_fast())
+            return true;
+    }
+}
+
+// Writers
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::exclusive(const Waiter& w)
+{
+    lock_type lk(mut_);
+    if (!w(gate1_, lk, [this] {return gate1_open();}))
+        return false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    return drain(lk, w);
+}
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::upgrade(const Waiter& w)
+{
+    lock_type lk(mut_);
+    if (!w(gate1_, lk, [this] {return gate1_open();}))
+        return false;
+    upgradable_entered_ = true;
+    return true;
+}
+
+// write_entered_ is set.  After the heavy fence every reader either sees it
+// or is seen in its slot; wait for those seen to leave.  Giving up lets
+// readers in again.
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::drain(lock_type& lk, const Waiter& w)
+{
+    asymmetric_heavy_fence();
+    if (w(gate2_, lk, [this] {return readers_drained();}))
+        return true;
+    reopen();
+    return false;
+}
+
+// On false the caller still owns upgrade.
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::upgrade_to_exclusive(lock_type& lk,
+                                                const Waiter& w)
+{
+    upgradable_entered_ = false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    if (drain(lk, w))
+        return true;
+    upgradable_entered_ = true;
+    return false;
+}
+
+// Enter as a writer, then give up our own count.  On false the caller still
+// owns shared.
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::shared_to_exclusive(const Waiter& w)
+{
+    lock_type lk(mut_);
+    if (!w(gate1_, lk, [this] {return gate1_open();}))
+        return false;
+    write_entered_.store(true, std::memory_order_relaxed);
+    remove_reader();
+    if (drain(lk, w))
+        return true;
+    add_reader();
+    return false;
+}
+
+template <class Waiter>
+bool
+read_mostly_upgrade_mutex::shared_to_upgrade(const Waiter& w)
+{
+    lock_type lk(mut_);
+    if (!w(gate1_, lk, [this] {return gate1_open();}))
+        return false;
+    upgradable_entered_ = true;
+    remove_reader();
+    return true;
+}
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_READ_MOSTLY
@@ -0,0 +1,472 @@
+//------------------------------- replay.cpp -----------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+//  replay trace-file [threads [mutex]]
+//
+//  Re-drives a schedule recorded by acme::trace_recorder against a mutex
+//  implementation and compares throughput and per-operation latency with the
+//  recording.  Each recorded thread keeps its own order of operations and the
+//  gaps between them (hold and think times).  When fewer replay threads than
+//  recorded threads are requested, recorded threads are dealt round robin and
+//  run back to back.
+//
+//  A try or timed acquisition whose outcome differs from the recording is
+//  corrected (by blocking for, or giving back, the ownership) so that every
+//  later operation in that thread finds the ownership it had when recorded.
+//  Throughput counts every recorded operation, applied or skipped, as the
+//  recording does.
+//
+//  mutex:  upgrade_mutex (the default), handoff, deadline, cohort, process,
+//  read_mostly, biased or adaptive.
+
+#include "adaptive_upgrade_mutex.h"
+#include "biased_upgrade_mutex.h"
+#include "cohort_upgrade_mutex.h"
+#include "process_upgrade_mutex.h"
+#include "read_mostly_upgrade_mutex.h"
+#include "upgrade_mutex_trace.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace
+{
+
+typedef std::chrono::steady_clock Clock;
+
+enum held_mode : unsigned char {none, shared, upgrade, exclusive};
+
+typedef std::vector<acme::trace_record> schedule;
+
+struct replay_result
+{
+    std::vector<std::uint32_t> wait[acme::n_lock_ops];     // applied only
+    Clock::duration            wall;
+    std::size_t                ops;        // applied or skipped
+};
+
+// Returns false if the record does not apply to the current ownership and
+// was skipped.
+
+template <class Mutex>
+bool
+apply(Mutex& m, const acme::trace_record& r, held_mode& held)
+{
+    using acme::lock_op;
+    auto deadline = [&r]
+                    {
+                        return Clock::now() + std::chrono::nanoseconds(r.timeout);
+                    };
+    bool got;
+    switch (r.op)
+    {
+    // Exclusive ownership
+    case lock_op::lock:
+        if (held != none)
+            return false;
+        m.lock();
+        held = exclusive;
+        return true;
+    case lock_op::try_lock:
+    case lock_op::try_lock_until:
+        if (held != none)
+            return false;
+        got = r.op == lock_op::try_lock ? m.try_lock()
+                                        : m.try_lock_until(deadline());
+        if (got && !r.acquired)
+            m.unlock();
+        else if (!got && r.acquired)
+            m.lock();
+        if (r.acquired)
+            held = exclusive;
+        return true;
+    case lock_op::unlock:
+        if (held != exclusive)
+            return false;
+        m.unlock();
+        held = none;
+        return true;
+    // Shared ownership
+    case lock_op::lock_shared:
+        if (held != none)
+            return false;
+        m.lock_shared();
+        held = shared;
+        return true;
+    case lock_op::try_lock_shared:
+    case lock_op::try_lock_shared_until:
+        if (held != none)
+            return false;
+        got = r.op == lock_op::try_lock_shared ?
+                  m.try_lock_shared() : m.try_lock_shared_until(deadline());
+        if (got && !r.acquired)
+            m.unlock_shared();
+        else if (!got && r.acquired)
+            m.lock_shared();
+        if (r.acquired)
+            held = shared;
+        return true;
+    case lock_op::unlock_shared:
+        if (held != shared)
+            return false;
+        m.unlock_shared();
+        held = none;
+        return true;
+    // Upgrade ownership
+    case lock_op::lock_upgrade:
+        if (held != none)
+            return false;
+        m.lock_upgrade();
+        held = upgrade;
+        return true;
+    case lock_op::try_lock_upgrade:
+    case lock_op::try_lock_upgrade_until:
+        if (held != none)
+            return false;
+        got = r.op == lock_op::try_lock_upgrade ?
+                  m.try_lock_upgrade() : m.try_lock_upgrade_until(deadline());
+        if (got && !r.acquired)
+            m.unlock_upgrade();
+        else if (!got && r.acquired)
+            m.lock_upgrade();
+        if (r.acquired)
+            held = upgrade;
+        return true;
+    case lock_op::unlock_upgrade:
+        if (held != upgrade)
+            return false;
+        m.unlock_upgrade();
+        held = none;
+        return true;
+    // Shared <-> Exclusive
+    case lock_op::try_unlock_shared_and_lock:
+    case lock_op::try_unlock_shared_and_lock_until:
+        if (held != shared)
+            return false;
+        got = r.op == lock_op::try_unlock_shared_and_lock ?
+                  m.try_unlock_shared_and_lock() :
+                  m.try_unlock_shared_and_lock_until(deadline());
+        if (got && !r.acquired)
+            m.unlock_and_lock_shared();
+        else if (!got && r.acquired)
+        {
+            m.unlock_shared();
+            m.lock();
+        }
+        if (r.acquired)
+            held = exclusive;
+        return true;
+    case lock_op::unlock_and_lock_shared:
+        if (held != exclusive)
+            return false;
+        m.unlock_and_lock_shared();
+        held = shared;
+        return true;
+    // Shared <-> Upgrade
+    case lock_op::try_unlock_shared_and_lock_upgrade:
+    case lock_op::try_unlock_shared_and_lock_upgrade_until:
+        if (held != shared)
+            return false;
+        got = r.op == lock_op::try_unlock_shared_and_lock_upgrade ?
+                  m.try_unlock_shared_and_lock_upgrade() :
+                  m.try_unlock_shared_and_lock_upgrade_until(deadline());
+        if (got && !r.acquired)
+            m.unlock_upgrade_and_lock_shared();
+        else if (!got && r.acquired)
+        {
+            m.unlock_shared();
+            m.lock_upgrade();
+        }
+        if (r.acquired)
+            held = upgrade;
+        return true;
+    case lock_op::unlock_upgrade_and_lock_shared:
+        if (held != upgrade)
+            return false;
+        m.unlock_upgrade_and_lock_shared();
+        held = shared;
+        return true;
+    // Upgrade <-> Exclusive
+    case lock_op::unlock_upgrade_and_lock:
+        if (held != upgrade)
+            return false;
+        m.unlock_upgrade_and_lock();
+        held = exclusive;
+        return true;
+    case lock_op::try_unlock_upgrade_and_lock:
+    case lock_op::try_unlock_upgrade_and_lock_until:
+        if (held != upgrade)
+            return false;
+        got = r.op == lock_op::try_unlock_upgrade_and_lock ?
+                  m.try_unlock_upgrade_and_lock() :
+                  m.try_unlock_upgrade_and_lock_until(deadline());
+        if (got && !r.acquired)
+            m.unlock_and_lock_upgrade();
+        else if (!got && r.acquired)
+            m.unlock_upgrade_and_lock();
+        if (r.acquired)
+            held = exclusive;
+        return true;
+    case lock_op::unlock_and_lock_upgrade:
+        if (held != exclusive)
+            return false;
+        m.unlock_and_lock_upgrade();
+        held = upgrade;
+        return true;
+    }
+    return false;
+}
+
+template <class Mutex>
+void
+release(Mutex& m, held_mode held)
+{
+    switch (held)
+    {
+    case none:
+        break;
+    case shared:
+        m.unlock_shared();
+        break;
+    case upgrade:
+        m.unlock_upgrade();
+        break;
+    case exclusive:
+        m.unlock();
+        break;
+    }
+}
+
+void
+pause_until(Clock::time_point t)
+{
+    auto now = Clock::now();
+    if (t - now > std::chrono::microseconds(100))
+        std::this_thread::sleep_for(t - now - std::chrono::microseconds(50));
+    while (Clock::now() < t)
+        ;
+}
+
+template <class Mutex>
+void
+run(Mutex* mutexes, std::size_t n_mutexes,
+    const std::vector<const schedule*>& work, replay_result& result)
+{
+    std::vector<held_mode> held(n_mutexes);
+    result.ops = 0;
+    for (const schedule* s : work)
+    {
+        std::fill(held.begin(), held.end(), none);
+        Clock::time_point last_end = Clock::now();
+        std::uint64_t recorded_end = s->front().start;
+        for (const acme::trace_record& r : *s)
+        {
+            if (r.mutex >= n_mutexes)
+                continue;
+            pause_until(last_end + std::chrono::nanoseconds(r.start -
+                                          std::min(r.start, recorded_end)));
+            auto t0 = Clock::now();
+            bool applied = apply(mutexes[r.mutex], r, held[r.mutex]);
+            last_end = Clock::now();
+            recorded_end = r.start + r.wait;
+            ++result.ops;
+            if (applied)
+            {
+                auto& w = result.wait[static_cast<unsigned>(r.op)];
+                w.push_back(static_cast<std::uint32_t>(std::min<long long>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                      last_end - t0).count(),
+                    0xFFFFFFFF)));
+            }
+        }
+        for (std::size_t i = 0; i < n_mutexes; ++i)
+            release(mutexes[i], held[i]);
+    }
+}
+
+template <class Mutex>
+replay_result
+replay(const std::vector<schedule>& schedules, std::size_t n_mutexes,
+       unsigned n_threads)
+{
+    std::unique_ptr<Mutex[]> mutexes(new Mutex[n_mutexes]);
+    std::vector<std::vector<const schedule*>> work(n_threads);
+    for (std::size_t i = 0; i < schedules.size(); ++i)
+        if (!schedules[i].empty())
+            work[i % n_threads].push_back(&schedules[i]);
+    std::vector<replay_result> results(n_threads);
+    std::vector<std::thread> threads;
+    auto t0 = Clock::now();
+    for (unsigned i = 0; i < n_threads; ++i)
+        threads.emplace_back(run<Mutex>, mutexes.get(), n_mutexes,
+                             std::cref(work[i]), std::ref(results[i]));
+    for (auto& t : threads)
+        t.join();
+    replay_result r;
+    r.wall = Clock::now() - t0;
+    r.ops = 0;
+    for (auto& x : results)
+    {
+        for (unsigned op = 0; op < acme::n_lock_ops; ++op)
+            r.wait[op].insert(r.wait[op].end(), x.wait[op].begin(),
+                              x.wait[op].end());
+        r.ops += x.ops;
+    }
+    return r;
+}
+
+struct summary
+{
+    double        mean;
+    std::uint32_t p50;
+    std::uint32_t p99;
+    std::uint32_t max;
+};
+
+summary
+summarize(std::vector<std::uint32_t> v)
+{
+    summary s = {0, 0, 0, 0};
+    if (v.empty())
+        return s;
+    std::sort(v.begin(), v.end());
+    double sum = 0;
+    for (auto x : v)
+        sum += x;
+    s.mean = sum / v.size();
+    s.p50 = v[v.size() / 2];
+    s.p99 = v[std::min(v.size() - 1, v.size() * 99 / 100)];
+    s.max = v.back();
+    return s;
+}
+
+void
+report(const std::vector<acme::trace_record>& trace, const replay_result& r)
+{
+    std::vector<std::uint32_t> recorded[acme::n_lock_ops];
+    std::uint64_t first = trace.front().start;
+    std::uint64_t last = first;
+    for (auto& x : trace)
+    {
+        recorded[static_cast<unsigned>(x.op)].push_back(x.wait);
+        last = std::max(last, x.start + x.wait);
+    }
+    double recorded_s = (last - first) / 1e9;
+    double replay_s = std::chrono::duration<double>(r.wall).count();
+    double recorded_tp = recorded_s > 0 ? trace.size() / recorded_s : 0;
+    double replay_tp = replay_s > 0 ? r.ops / replay_s : 0;
+    std::cout << std::fixed << std::setprecision(0)
+              << "throughput (ops/s): recorded " << recorded_tp
+              << ", replay " << replay_tp;
+    if (recorded_tp > 0)
+        std::cout << " (" << std::showpos
+                  << (replay_tp / recorded_tp - 1) * 100 << std::noshowpos
+                  << "%)";
+    std::cout << "\n\n" << std::left << std::setw(42) << "latency (ns)"
+              << std::right
+              << std::setw(9) << "count"
+              << std::setw(10) << "mean" << std::setw(10) << "p50"
+              << std::setw(10) << "p99" << std::setw(11) << "max" << '\n';
+    for (unsigned op = 0; op < acme::n_lock_ops; ++op)
+    {
+        if (recorded[op].empty() && r.wait[op].empty())
+            continue;
+        const char* name = acme::to_string(static_cast<acme::lock_op>(op));
+        summary a = summarize(recorded[op]);
+        summary b = summarize(r.wait[op]);
+        std::cout << std::left << std::setw(42) << name << std::right
+                  << std::setw(9) << recorded[op].size()
+                  << std::setw(10) << a.mean << std::setw(10) << a.p50
+                  << std::setw(10) << a.p99 << std::setw(11) << a.max
+                  << "  recorded\n"
+                  << std::setw(42) << "" << std::setw(9) << r.wait[op].size()
+                  << std::setw(10) << b.mean << std::setw(10) << b.p50
+                  << std::setw(10) << b.p99 << std::setw(11) << b.max
+                  << "  replay\n";
+    }
+}
+
+}  // unnamed
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " trace-file [threads [mutex]]\n"
+                  << "mutex: upgrade_mutex handoff deadline cohort process "
+                     "read_mostly biased adaptive\n";
+        return 2;
+    }
+    try
+    {
+        auto trace = acme::read_trace(argv[1]);
+        if (trace.empty())
+        {
+            std::cerr << argv[1] << ": empty trace\n";
+            return 1;
+        }
+        std::vector<schedule> schedules;
+        std::size_t n_mutexes = 0;
+        for (auto& r : trace)
+        {
+            if (r.thread >= schedules.size())
+                schedules.resize(r.thread + 1);
+            schedules[r.thread].push_back(r);
+            n_mutexes = std::max<std::size_t>(n_mutexes, r.mutex + 1);
+        }
+        unsigned n_threads = argc > 2 ? std::stoul(argv[2])
+                                      : static_cast<unsigned>(schedules.size());
+        if (n_threads == 0)
+            n_threads = 1;
+        std::string impl = argc > 3 ? argv[3] : "upgrade_mutex";
+        std::cout << trace.size() << " operations, " << schedules.size()
+                  << " threads, " << n_mutexes << " mutexes; replaying with "
+                  << n_threads << " threads on " << impl << "\n\n";
+        replay_result r;
+        if (impl == "upgrade_mutex")
+            r = replay<acme::upgrade_mutex>(schedules, n_mutexes, n_threads);
+        else if (impl == "handoff")
+            r = replay<acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                                 acme::handoff_admission>>(
+                                           schedules, n_mutexes, n_threads);
+        else if (impl == "deadline")
+            r = replay<acme::basic_upgrade_mutex<unsigned, acme::condvar_wait,
+                                                 acme::deadline_admission>>(
+                                           schedules, n_mutexes, n_threads);
+        else if (impl == "cohort")
+            r = replay<acme::cohort_upgrade_mutex>(schedules, n_mutexes,
+                                                   n_threads);
+        else if (impl == "process")
+            r = replay<acme::process_upgrade_mutex>(schedules, n_mutexes,
+                                                    n_threads);
+        else if (impl == "read_mostly")
+            r = replay<acme::read_mostly_upgrade_mutex>(schedules, n_mutexes,
+                                                        n_threads);
+        else if (impl == "biased")
+            r = replay<acme::biased_upgrade_mutex>(schedules, n_mutexes,
+                                                   n_threads);
+        else if (impl == "adaptive")
+            r = replay<acme::adaptive_upgrade_mutex>(schedules, n_mutexes,
+                                                     n_threads);
+        else
+        {
+            std::cerr << "unknown mutex: " << impl << '\n';
+            return 2;
+        }
+        report(trace, r);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
@@ -14,216 +14,40 @@
 namespace acme
 {
 
-upgrade_mutex::upgrade_mutex()
-    : state_(0)
-{
-}
+// basic_stats
 
-upgrade_mutex::~upgrade_mutex() = default;
-
-// Exclusive ownership
+// Called with the mutex's internal mutex held, so max_wait_ns needs no CAS.
 
 void
-upgrade_mutex::lock()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    while (state_ & (write_entered_ | upgradable_entered_))
-        gate1_.wait(lk);
-    state_ |= write_entered_;
-    while (state_ & n_readers_)
-        gate2_.wait(lk);
-}
-
-bool
-upgrade_mutex::try_lock()
+basic_stats::wait_end(wait_token t, lock_mode m, unsigned, bool acquired) noexcept
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if (state_ == 0)
-    {
-        state_ = write_entered_;
-        return true;
-    }
-    return false;
+    std::uint64_t ns = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - t).count());
+    atomic_counters& c = c_[static_cast<unsigned>(m)];
+    c.waits.fetch_add(1, std::memory_order_relaxed);
+    if (!acquired)
+        c.timeouts.fetch_add(1, std::memory_order_relaxed);
+    c.wait_ns.fetch_add(ns, std::memory_order_relaxed);
+    if (ns > c.max_wait_ns.load(std::memory_order_relaxed))
+        c.max_wait_ns.store(ns, std::memory_order_relaxed);
 }
 
-void
-upgrade_mutex::unlock()
+basic_stats::counters
+basic_stats::snapshot(lock_mode m) const noexcept
 {
-    std::lock_guard<std::mutex> _(mut_);
-    state_ = 0;
-    gate1_.notify_all();
+    const atomic_counters& c = c_[static_cast<unsigned>(m)];
+    counters r;
+    r.acquisitions = c.acquisitions.load(std::memory_order_relaxed);
+    r.waits = c.waits.load(std::memory_order_relaxed);
+    r.timeouts = c.timeouts.load(std::memory_order_relaxed);
+    r.wait_ns = c.wait_ns.load(std::memory_order_relaxed);
+    r.max_wait_ns = c.max_wait_ns.load(std::memory_order_relaxed);
+    return r;
 }
 
-// Shared ownership
+// upgrade_mutex
 
-void
-upgrade_mutex::lock_shared()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    while ((state_ & write_entered_) || (state_ & n_readers_) == n_readers_)
-        gate1_.wait(lk);
-    unsigned num_readers = (state_ & n_readers_) + 1;
-    state_ &= ~n_readers_;
-    state_ |= num_readers;
-}
-
-bool
-upgrade_mutex::try_lock_shared()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    unsigned num_readers = state_ & n_readers_;
-    if (!(state_ & write_entered_) && num_readers != n_readers_)
-    {
-        ++num_readers;
-        state_ &= ~n_readers_;
-        state_ |= num_readers;
-        return true;
-    }
-    return false;
-}
-
-void
-upgrade_mutex::unlock_shared()
-{
-    std::lock_guard<std::mutex> _(mut_);
-    unsigned num_readers = (state_ & n_readers_) - 1;
-    state_ &= ~n_readers_;
-    state_ |= num_readers;
-    if (state_ & write_entered_)
-    {
-        if (num_readers == 0)
-            gate2_.notify_one();
-    }
-    else
-    {
-        if (num_readers == n_readers_ - 1)
-            gate1_.notify_one();
-    }
-}
-
-// Upgrade ownership
-
-void
-upgrade_mutex::lock_upgrade()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    while ((state_ & (write_entered_ | upgradable_entered_)) || 
-           (state_ & n_readers_) == n_readers_)
-        gate1_.wait(lk);
-    unsigned num_readers = (state_ & n_readers_) + 1;
-    state_ &= ~n_readers_;
-    state_ |= upgradable_entered_ | num_readers;
-}
-
-bool
-upgrade_mutex::try_lock_upgrade()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    unsigned num_readers = state_ & n_readers_;
-    if (!(state_ & (write_entered_ | upgradable_entered_))
-        && num_readers != n_readers_)
-    {
-        ++num_readers;
-        state_ &= ~n_readers_;
-        state_ |= upgradable_entered_ | num_readers;
-        return true;
-    }
-    return false;
-}
-
-void
-upgrade_mutex::unlock_upgrade()
-{
-    {
-        std::lock_guard<std::mutex> _(mut_);
-        unsigned num_readers = (state_ & n_readers_) - 1;
-        state_ &= ~(upgradable_entered_ | n_readers_);
-        state_ |= num_readers;
-    }
-    gate1_.notify_all();
-}
-
-// Shared <-> Exclusive
-
-bool
-upgrade_mutex::try_unlock_shared_and_lock()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    if (state_ == 1)
-    {
-        state_ = write_entered_;
-        return true;
-    }
-    return false;
-}
-
-void
-upgrade_mutex::unlock_and_lock_shared()
-{
-    {
-        std::lock_guard<std::mutex> _(mut_);
-        state_ = 1;
-    }
-    gate1_.notify_all();
-}
-
-// Shared <-> Upgrade
-
-bool
-upgrade_mutex::try_unlock_shared_and_lock_upgrade()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    if (!(state_ & (write_entered_ | upgradable_entered_)))
-    {
-        state_ |= upgradable_entered_;
-        return true;
-    }
-    return false;
-}
-
-void
-upgrade_mutex::unlock_upgrade_and_lock_shared()
-{
-    {
-        std::lock_guard<std::mutex> _(mut_);
-        state_ &= ~upgradable_entered_;
-    }
-    gate1_.notify_all();
-}
-
-// Upgrade <-> Exclusive
-
-void
-upgrade_mutex::unlock_upgrade_and_lock()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    unsigned num_readers = (state_ & n_readers_) - 1;
-    state_ &= ~(upgradable_entered_ | n_readers_);
-    state_ |= write_entered_ | num_readers;
-    while (state_ & n_readers_)
-        gate2_.wait(lk);
-}
-
-bool
-upgrade_mutex::try_unlock_upgrade_and_lock()
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    if (state_ == (upgradable_entered_ | 1))
-    {
-        state_ = write_entered_;
-        return true;
-    }
-    return false;
-}
-
-void
-upgrade_mutex::unlock_and_lock_upgrade()
-{
-    {
-        std::lock_guard<std::mutex> _(mut_);
-        state_ = upgradable_entered_ | 1;
-    }
-    gate1_.notify_all();
-}
+template class basic_upgrade_mutex<>;
 
 }  // acme
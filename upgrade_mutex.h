@@ -18,14 +18,99 @@
 namespace acme
 {
 
-class upgrade_mutex
+enum class lock_mode : unsigned char {shared, upgrade, exclusive};
+
+// The operations of the upgrade_mutex interface, numbered as they are in
+// traces and in the arguments of the USDT probes.
+
+enum class lock_op : std::uint8_t
+{
+    lock, try_lock, try_lock_until, unlock,
+    lock_shared, try_lock_shared, try_lock_shared_until, unlock_shared,
+    lock_upgrade, try_lock_upgrade, try_lock_upgrade_until, unlock_upgrade,
+    try_unlock_shared_and_lock, try_unlock_shared_and_lock_until,
+    unlock_and_lock_shared,
+    try_unlock_shared_and_lock_upgrade, try_unlock_shared_and_lock_upgrade_until,
+    unlock_upgrade_and_lock_shared,
+    unlock_upgrade_and_lock, try_unlock_upgrade_and_lock,
+    try_unlock_upgrade_and_lock_until, unlock_and_lock_upgrade
+};
+
+// USDT probes (Linux, when <sys/sdt.h> is available and ACME_NO_USDT is not
+// defined), provider acme.  Each is a nop until a tracer attaches to it.
+//
+//   acquire_begin(void* mutex, lock_op op, state_type state)
+//   acquire_end(void* mutex, lock_op op, state_type state, bool acquired)
+//   release(void* mutex, lock_op op, state_type state)
+//
+// acquire_begin and acquire_end bracket every acquisition and every
+// conversion that may have to wait (to upgrade or exclusive);  release
+// follows every unlock and every conversion that gives up ownership without
+// waiting (exclusive to upgrade or shared, upgrade to shared).  state is the
+// state word at that point, as seen holding the internal mutex.
+
+// Wait strategies:  how a thread blocked at a gate waits
+
+struct condvar_wait;                          // std::condition_variable
+template <unsigned Spins = 1000>
+    struct spin_then_park;                    // spin, then condition_variable
+struct futex_wait;                            // Linux futex (Linux only)
+
+// Admission policies:  who may pass gate1
+
+template <bool ReadersPassPendingWriter>
+    struct barging_admission;
+typedef barging_admission<false> writer_priority;  // pending writer stops readers
+typedef barging_admission<true>  reader_priority;  // readers pass pending writer
+template <class Order>
+    class queued_admission;               // unlock hands gate1 to the queue head
+struct arrival_order;                     // first come, first served
+struct deadline_order;                    // earliest deadline, untimed last
+typedef queued_admission<arrival_order>  handoff_admission;
+typedef queued_admission<deadline_order> deadline_admission;
+
+// Stats policies
+
+struct no_stats;
+class basic_stats
+{
+public:
+    struct counters
+    {
+        std::uint64_t acquisitions;           // includes conversions
+        std::uint64_t waits;                  // gate waits
+        std::uint64_t timeouts;               // waits timed out or stopped
+        std::uint64_t wait_ns;
+        std::uint64_t max_wait_ns;
+    };
+
+    counters snapshot(lock_mode m) const noexcept;
+};
+
+// Release policies:  who hears of releases
+
+struct silent_release;                        // no one
+class any_release;                            // lock_any (Linux only)
+
+template <class StateWord = unsigned,
+          class WaitStrategy = condvar_wait,
+          class AdmissionPolicy = writer_priority,
+          class StatsPolicy = no_stats,
+          class ReleasePolicy = silent_release>
+class basic_upgrade_mutex
 {
 public:
-    upgrade_mutex();
-    ~upgrade_mutex();
+    typedef StateWord       state_type;
+    typedef WaitStrategy    wait_strategy;
+    typedef AdmissionPolicy admission_policy;
+    typedef StatsPolicy     stats_type;
+    typedef ReleasePolicy   release_policy;
 
-    upgrade_mutex(const upgrade_mutex&) = delete;
-    upgrade_mutex& operator=(const upgrade_mutex&) = delete;
+    basic_upgrade_mutex();
+    ~basic_upgrade_mutex();
+
+    basic_upgrade_mutex(const basic_upgrade_mutex&) = delete;
+    basic_upgrade_mutex& operator=(const basic_upgrade_mutex&) = delete;
 
     // Exclusive ownership
 
@@ -66,6 +151,21 @@ public:
                       const std::chrono::time_point<Clock, Duration>& abs_time);
     void unlock_upgrade();
 
+    // Cancellable -- false if stop was requested first (C++20)
+
+    bool lock(std::stop_token st);
+    bool lock_shared(std::stop_token st);
+    bool lock_upgrade(std::stop_token st);
+    bool unlock_upgrade_and_lock(std::stop_token st);  // false: still upgrade
+
+    // Helping -- while waiting, run the caller's tasks:  help() runs one and
+    // returns false if there was none
+
+    template <class Helper> void lock(Helper&& help);
+    template <class Helper> void lock_shared(Helper&& help);
+    template <class Helper> void lock_upgrade(Helper&& help);
+    template <class Helper> void unlock_upgrade_and_lock(Helper&& help);
+
     // Shared <-> Exclusive -- unused by Locks without std::lib cooperation
 
     bool try_unlock_shared_and_lock();
@@ -108,6 +208,131 @@ public:
         bool
         try_unlock_upgrade_and_lock_until(
                       const std::chrono::time_point<Clock, Duration>& abs_time);
+
+    // Statistics
+
+    const stats_type& stats() const noexcept;
+};
+
+typedef basic_upgrade_mutex<> upgrade_mutex;
+
+// Locks.  Conversions between them are by move construction and change the
+// ownership of the mutex atomically.  Even those that cannot fail may block
+// or throw, as the mutex's conversion does; one that throws leaves the
+// source lock its ownership.
+
+template <class Mutex>
+class shared_lock
+{
+public:
+    typedef Mutex mutex_type;
+
+    ~shared_lock();
+    shared_lock() noexcept;
+    shared_lock(shared_lock const&) = delete;
+    shared_lock& operator=(shared_lock const&) = delete;
+    shared_lock(shared_lock&& sl) noexcept;
+    shared_lock& operator=(shared_lock&& sl);
+
+    explicit shared_lock(mutex_type& m);
+    shared_lock(mutex_type& m, std::defer_lock_t) noexcept;
+    shared_lock(mutex_type& m, std::try_to_lock_t);
+    shared_lock(mutex_type& m, std::adopt_lock_t) noexcept;
+    template <class Clock, class Duration>
+        shared_lock(mutex_type& m,
+                    const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        shared_lock(mutex_type& m,
+                    const std::chrono::duration<Rep, Period>& rel_time);
+
+    // Exclusive -> Shared, Upgrade -> Shared
+
+    explicit shared_lock(unique_lock<mutex_type>&& ul);
+    explicit shared_lock(upgrade_lock<mutex_type>&& ul);
+
+    // Shared
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    void swap(shared_lock& u) noexcept;
+    mutex_type* release() noexcept;
+
+    bool owns_lock() const noexcept;
+    explicit operator bool () const noexcept;
+    mutex_type* mutex() const noexcept;
+};
+
+template <class Mutex>
+class unique_lock
+{
+public:
+    typedef Mutex mutex_type;
+
+    ~unique_lock();
+    unique_lock() noexcept;
+    unique_lock(unique_lock const&) = delete;
+    unique_lock& operator=(unique_lock const&) = delete;
+    unique_lock(unique_lock&& ul) noexcept;
+    unique_lock& operator=(unique_lock&& ul);
+
+    explicit unique_lock(mutex_type& m);
+    unique_lock(mutex_type& m, std::defer_lock_t) noexcept;
+    unique_lock(mutex_type& m, std::try_to_lock_t);
+    unique_lock(mutex_type& m, std::adopt_lock_t) noexcept;
+    template <class Clock, class Duration>
+        unique_lock(mutex_type& m,
+                    const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        unique_lock(mutex_type& m,
+                    const std::chrono::duration<Rep, Period>& rel_time);
+
+    // Shared -> Exclusive
+
+    unique_lock(shared_lock<mutex_type>&& sl, std::try_to_lock_t);
+    template <class Clock, class Duration>
+        unique_lock(shared_lock<mutex_type>&& sl,
+                    const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        unique_lock(shared_lock<mutex_type>&& sl,
+                    const std::chrono::duration<Rep, Period>& rel_time);
+
+    // Upgrade -> Exclusive
+
+    explicit unique_lock(upgrade_lock<mutex_type>&& ul);
+    unique_lock(upgrade_lock<mutex_type>&& ul, std::try_to_lock_t);
+    template <class Clock, class Duration>
+        unique_lock(upgrade_lock<mutex_type>&& ul,
+                    const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        unique_lock(upgrade_lock<mutex_type>&& ul,
+                    const std::chrono::duration<Rep, Period>& rel_time);
+
+    // Exclusive
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time);
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    void swap(unique_lock& u) noexcept;
+    mutex_type* release() noexcept;
+
+    bool owns_lock() const noexcept;
+    explicit operator bool () const noexcept;
+    mutex_type* mutex() const noexcept;
 };
 
 template <class Mutex>
@@ -136,8 +361,15 @@ public:
 
     // Shared <-> Upgrade
 
-    upgrade_lock(std::shared_lock<mutex_type>&& sl, std::try_to_lock_t);
+    upgrade_lock(shared_lock<mutex_type>&& sl, std::try_to_lock_t);
+    template <class Clock, class Duration>
+        upgrade_lock(shared_lock<mutex_type>&& sl,
+                     const std::chrono::time_point<Clock, Duration>& abs_time);
+    template <class Rep, class Period>
+        upgrade_lock(shared_lock<mutex_type>&& sl,
+                     const std::chrono::duration<Rep, Period>& rel_time);
 
+    upgrade_lock(std::shared_lock<mutex_type>&& sl, std::try_to_lock_t);
     template <class Clock, class Duration>
         upgrade_lock(std::shared_lock<mutex_type>&& sl,
                      const std::chrono::time_point<Clock, Duration>& abs_time);
@@ -148,6 +380,8 @@ public:
 
     // Exclusive <-> Upgrade
 
+    explicit upgrade_lock(unique_lock<mutex_type>&& ul);
+
     explicit upgrade_lock(std::unique_lock<mutex_type>&& ul);
     explicit operator std::unique_lock<mutex_type> () &&;
 
@@ -171,6 +405,12 @@ public:
     mutex_type* mutex() const;
 };
 
+template <class Mutex>
+void
+swap(shared_lock<Mutex>&  x, shared_lock<Mutex>&  y) noexcept;
+template <class Mutex>
+void
+swap(unique_lock<Mutex>&  x, unique_lock<Mutex>&  y) noexcept;
 template <class Mutex>
 void
 swap(upgrade_lock<Mutex>&  x, upgrade_lock<Mutex>&  y);
@@ -178,283 +418,2238 @@ swap(upgrade_lock<Mutex>&  x, upgrade_lock<Mutex>&  y);
 }  // acme
 */
 
+#include <atomic>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <mutex>
 #include <shared_mutex>
 #include <system_error>
+#include <type_traits>
+
+#if __has_include(<stop_token>)
+#include <stop_token>
+#endif
+
+#ifdef __linux__
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(ACME_NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ACME_USDT3(name, a1, a2, a3) STAP_PROBE3(acme, name, a1, a2, a3)
+#define ACME_USDT4(name, a1, a2, a3, a4) \
+    STAP_PROBE4(acme, name, a1, a2, a3, a4)
+#else
+#define ACME_USDT3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#define ACME_USDT4(name, a1, a2, a3, a4) \
+    ((void)(a1), (void)(a2), (void)(a3), (void)(a4))
+#endif
 
 namespace acme
 {
 
-// upgrade_mutex
+enum class lock_mode : unsigned char {shared, upgrade, exclusive};
 
-class upgrade_mutex
+enum class lock_op : std::uint8_t
 {
-    std::mutex              mut_;
-    std::condition_variable gate1_;
-    std::condition_variable gate2_;
-    unsigned                state_;
+    lock,
+    try_lock,
+    try_lock_until,
+    unlock,
+    lock_shared,
+    try_lock_shared,
+    try_lock_shared_until,
+    unlock_shared,
+    lock_upgrade,
+    try_lock_upgrade,
+    try_lock_upgrade_until,
+    unlock_upgrade,
+    try_unlock_shared_and_lock,
+    try_unlock_shared_and_lock_until,
+    unlock_and_lock_shared,
+    try_unlock_shared_and_lock_upgrade,
+    try_unlock_shared_and_lock_upgrade_until,
+    unlock_upgrade_and_lock_shared,
+    unlock_upgrade_and_lock,
+    try_unlock_upgrade_and_lock,
+    try_unlock_upgrade_and_lock_until,
+    unlock_and_lock_upgrade
+};
 
-    static const unsigned write_entered_ = 1U << (sizeof(unsigned)*CHAR_BIT - 1);
-    static const unsigned upgradable_entered_ = write_entered_ >> 1;
-    static const unsigned n_readers_ = ~(write_entered_ | upgradable_entered_);
+const unsigned n_lock_ops =
+                       static_cast<unsigned>(lock_op::unlock_and_lock_upgrade) + 1;
 
-public:
-    upgrade_mutex();
-    ~upgrade_mutex();
+namespace detail
+{
 
-    upgrade_mutex(const upgrade_mutex&) = delete;
-    upgrade_mutex& operator=(const upgrade_mutex&) = delete;
+inline
+void
+cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
 
-    // Exclusive ownership
+// A Waiter blocks a thread on a gate until the predicate holds, and returns
+// false if it gave up first.
 
-    void lock();
-    bool try_lock();
-    template <class Rep, class Period>
-        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+struct untimed_wait
+{
+    template <class Gate, class Lock, class Predicate>
+        bool operator()(Gate& g, Lock& lk, Predicate pred) const
         {
-            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+            g.wait(lk, pred);
+            return true;
         }
-    template <class Clock, class Duration>
-        bool
-        try_lock_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock();
+};
 
-    // Shared ownership
+template <class Clock, class Duration>
+struct timed_wait
+{
+    const std::chrono::time_point<Clock, Duration>& abs_time;
 
-    void lock_shared();
-    bool try_lock_shared();
-    template <class Rep, class Period>
-        bool
-        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+    template <class Gate, class Lock, class Predicate>
+        bool operator()(Gate& g, Lock& lk, Predicate pred) const
         {
-            return try_lock_shared_until(std::chrono::steady_clock::now() +
-                                         rel_time);
+            return g.wait_until(lk, abs_time, pred);
         }
-    template <class Clock, class Duration>
-        bool
-        try_lock_shared_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock_shared();
+};
 
-    // Upgrade ownership
+template <class Clock, class Duration>
+inline
+timed_wait<Clock, Duration>
+wait_until(const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    return timed_wait<Clock, Duration>{abs_time};
+}
 
-    void lock_upgrade();
-    bool try_lock_upgrade();
-    template <class Rep, class Period>
-        bool
-        try_lock_upgrade_for(
-                            const std::chrono::duration<Rep, Period>& rel_time)
+// Checks the predicate once; for try_ operations.
+
+struct no_wait
+{
+    template <class Gate, class Lock, class Predicate>
+        bool operator()(Gate&, Lock&, Predicate pred) const
         {
-            return try_lock_upgrade_until(std::chrono::steady_clock::now() +
-                                         rel_time);
+            return pred();
         }
-    template <class Clock, class Duration>
-        bool
-        try_lock_upgrade_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock_upgrade();
+};
 
-    // Shared <-> Exclusive
+// Between checks of the predicate, calls help() with the internal mutex
+// unlocked, as a condition variable wait would have it.  When help has
+// nothing to run, waits at the gate for up to help_interval before calling
+// it again.  If help throws, gives up, keeping the exception for the caller
+// to rethrow once the mutex's state is restored.  The grant may have been
+// made while help ran, so the result is still the predicate's; the caller
+// then owns the mutex and must release it before rethrowing.  Later waits
+// of the same acquisition only check the predicate.
 
-    bool try_unlock_shared_and_lock();
-    template <class Rep, class Period>
-        bool
-        try_unlock_shared_and_lock_for(
-                            const std::chrono::duration<Rep, Period>& rel_time)
+constexpr std::chrono::microseconds help_interval(200);
+
+template <class Helper>
+struct helping_wait
+{
+    Helper&                    help;
+    mutable std::exception_ptr error;
+
+    template <class Gate, class Lock, class Predicate>
+        bool operator()(Gate& g, Lock& lk, Predicate pred) const
         {
-            return try_unlock_shared_and_lock_until(
-                                   std::chrono::steady_clock::now() + rel_time);
+            if (error)
+                return pred();
+            while (!pred())
+            {
+                bool ran;
+                lk.unlock();
+                try
+                {
+                    ran = help();
+                }
+                catch (...)
+                {
+                    lk.lock();
+                    error = std::current_exception();
+                    return pred();
+                }
+                lk.lock();
+                if (!ran &&
+                    g.wait_until(lk, std::chrono::steady_clock::now() +
+                                     help_interval, pred))
+                    break;
+            }
+            return true;
         }
-    template <class Clock, class Duration>
-        bool
-        try_unlock_shared_and_lock_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock_and_lock_shared();
+};
 
-    // Shared <-> Upgrade
+template <class Helper>
+using enable_if_helper =
+    std::enable_if_t<std::is_invocable_r_v<bool, Helper&>>;
 
-    bool try_unlock_shared_and_lock_upgrade();
-    template <class Rep, class Period>
-        bool
-        try_unlock_shared_and_lock_upgrade_for(
-                            const std::chrono::duration<Rep, Period>& rel_time)
+#ifdef __cpp_lib_jthread
+
+// Gives up when stop is requested.  The stop callback takes the internal
+// mutex and notifies whichever gate the thread is blocked on, so there is no
+// lost wakeup and no polling.  Must be constructed before, and destroyed
+// after, the internal mutex is locked by this thread:  the callback may run
+// inline from either.
+
+template <class Mutex, class Gate>
+class stoppable_wait
+{
+    struct wake
+    {
+        stoppable_wait* self;
+
+        void
+        operator()() noexcept
         {
-            return try_unlock_shared_and_lock_upgrade_until(
-                                   std::chrono::steady_clock::now() + rel_time);
+            std::lock_guard<Mutex> _(self->mut_);
+            if (self->gate_ != nullptr)
+                self->gate_->notify_all();
         }
-    template <class Clock, class Duration>
-        bool
-        try_unlock_shared_and_lock_upgrade_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock_upgrade_and_lock_shared();
+    };
 
-    // Upgrade <-> Exclusive
+    Mutex&                   mut_;
+    std::stop_token          st_;
+    mutable Gate*            gate_ = nullptr;  // guarded by mut_
+    std::stop_callback<wake> cb_;
 
-    void unlock_upgrade_and_lock();
-    bool try_unlock_upgrade_and_lock();
-    template <class Rep, class Period>
+public:
+    stoppable_wait(Mutex& mut, std::stop_token st)
+        : mut_(mut), st_(st), cb_(std::move(st), wake{this}) {}
+
+    stoppable_wait(const stoppable_wait&) = delete;
+    stoppable_wait& operator=(const stoppable_wait&) = delete;
+
+    template <class Lock, class Predicate>
         bool
-        try_unlock_upgrade_and_lock_for(
-                            const std::chrono::duration<Rep, Period>& rel_time)
+        operator()(Gate& g, Lock& lk, Predicate pred) const
         {
-            return try_unlock_upgrade_and_lock_until(
-                                   std::chrono::steady_clock::now() + rel_time);
+            gate_ = &g;
+            g.wait(lk, [this, &pred] {return pred() || st_.stop_requested();});
+            gate_ = nullptr;
+            return pred();
         }
-    template <class Clock, class Duration>
-        bool
-        try_unlock_upgrade_and_lock_until(
-                      const std::chrono::time_point<Clock, Duration>& abs_time);
-    void unlock_and_lock_upgrade();
 };
 
-template <class Clock, class Duration>
-bool
-upgrade_mutex::try_lock_until(
-                       const std::chrono::time_point<Clock, Duration>& abs_time)
+#endif  // __cpp_lib_jthread
+
+#ifdef __linux__
+
+inline
+long
+futex(std::atomic<std::uint32_t>* addr, int op, std::uint32_t val,
+      const timespec* timeout = nullptr) noexcept
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if (state_ & (write_entered_ | upgradable_entered_))
-    {
-        while (true)
-        {
-            std::cv_status status = gate1_.wait_until(lk, abs_time);
-            if ((state_ & (write_entered_ | upgradable_entered_)) == 0)
-                break;
-            if (status == std::cv_status::timeout)
-                return false;
-        }
-    }
-    state_ |= write_entered_;
-    if (state_ & n_readers_)
-    {
-        while (true)
-        {
-            std::cv_status status = gate2_.wait_until(lk, abs_time);
-            if ((state_ & n_readers_) == 0)
-                break;
-            if (status == std::cv_status::timeout)
-            {
-                state_ &= ~write_entered_;
-                return false;
-            }
-        }
-    }
-    return true;
+    return syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(addr), op, val,
+                   timeout, nullptr, 0);
 }
 
-template <class Clock, class Duration>
-bool
-upgrade_mutex::try_lock_shared_until(
-                       const std::chrono::time_point<Clock, Duration>& abs_time)
+// Bumped and woken for every release of an any_release mutex while lock_any
+// waits without futex_waitv.
+
+inline std::atomic<std::uint32_t> any_release_seq{0};
+inline std::atomic<std::uint32_t> any_release_parked{0};
+
+// Counts a mutex's releases, for lock_any.  A release makes a system call
+// only while some lock_any waits on the mutex.
+
+class release_gate
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if ((state_ & write_entered_) || (state_ & n_readers_) == n_readers_)
+    std::atomic<std::uint32_t> seq_{0};
+    std::atomic<std::uint32_t> waiters_{0};
+
+public:
+    // Called with the mutex's internal mutex held, which orders it after any
+    // lock_any that registered and then failed to lock.
+    void
+    notify() noexcept
     {
-        while (true)
-        {
-            std::cv_status status = gate1_.wait_until(lk, abs_time);
-            if ((state_ & write_entered_) == 0 &&
-                                             (state_ & n_readers_) < n_readers_)
-                break;
-            if (status == std::cv_status::timeout)
-                return false;
-        }
+        if (waiters_.load(std::memory_order_relaxed) != 0)
+            wake();
     }
-    unsigned num_readers = (state_ & n_readers_) + 1;
-    state_ &= ~n_readers_;
-    state_ |= num_readers;
-    return true;
-}
 
-template <class Clock, class Duration>
-bool
-upgrade_mutex::try_lock_upgrade_until(
-                       const std::chrono::time_point<Clock, Duration>& abs_time)
-{
-    std::unique_lock<std::mutex> lk(mut_);
-    if ((state_ & (write_entered_ | upgradable_entered_)) ||
-        (state_ & n_readers_) == n_readers_)
+    void
+    wake() noexcept
     {
-        while (true)
+        seq_.fetch_add(1, std::memory_order_relaxed);
+        futex(&seq_, FUTEX_WAKE_PRIVATE, INT_MAX);
+        if (any_release_parked.load(std::memory_order_relaxed) != 0)
         {
-            std::cv_status status = gate1_.wait_until(lk, abs_time);
-            if ((state_ & (write_entered_ | upgradable_entered_)) == 0 &&
-                                             (state_ & n_readers_) < n_readers_)
-                break;
-            if (status == std::cv_status::timeout)
-                return false;
+            any_release_seq.fetch_add(1, std::memory_order_relaxed);
+            futex(&any_release_seq, FUTEX_WAKE_PRIVATE, INT_MAX);
         }
     }
-    unsigned num_readers = (state_ & n_readers_) + 1;
-    state_ &= ~n_readers_;
-    state_ |= upgradable_entered_ | num_readers;
-    return true;
-}
 
-template <class Clock, class Duration>
-bool
-upgrade_mutex::try_unlock_shared_and_lock_until(
-                       const std::chrono::time_point<Clock, Duration>& abs_time)
+    std::atomic<std::uint32_t>& seq() noexcept {return seq_;}
+    void add_waiter() noexcept {waiters_.fetch_add(1);}
+    void remove_waiter() noexcept {waiters_.fetch_sub(1);}
+};
+
+#endif  // __linux__
+
+struct any_access;
+struct async_access;
+
+}  // detail
+
+// Wait strategies
+
+// Gates are condition variables.
+
+struct condvar_wait
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if (state_ != 1)
+    typedef std::mutex mutex_type;
+
+    class gate_type
     {
-        while (true)
-        {
-            std::cv_status status = gate2_.wait_until(lk, abs_time);
-            if (state_ == 1)
-                break;
-            if (status == std::cv_status::timeout)
+        std::condition_variable cv_;
+
+    public:
+        template <class Lock, class Predicate>
+            void wait(Lock& lk, Predicate pred) {cv_.wait(lk, pred);}
+
+        template <class Lock, class Clock, class Duration, class Predicate>
+            bool
+            wait_until(Lock& lk,
+                       const std::chrono::time_point<Clock, Duration>& abs_time,
+                       Predicate pred)
+            {
+                return cv_.wait_until(lk, abs_time, pred);
+            }
+
+        void notify_one() noexcept {cv_.notify_one();}
+        void notify_all() noexcept {cv_.notify_all();}
+    };
+};
+
+// A blocked thread first releases the internal mutex and polls the gate's
+// notification count up to Spins times, then parks on a condition variable.
+// Suits ownership that is typically held for less than a context switch.
+
+template <unsigned Spins = 1000>
+struct spin_then_park
+{
+    typedef std::mutex mutex_type;
+
+    class gate_type
+    {
+        std::condition_variable cv_;
+        std::atomic<unsigned>   notified_{0};
+
+        template <class Lock>
+            void
+            spin(Lock& lk)
+            {
+                unsigned n = notified_.load(std::memory_order_relaxed);
+                lk.unlock();
+                for (unsigned i = 0; i < Spins &&
+                         notified_.load(std::memory_order_relaxed) == n; ++i)
+                    detail::cpu_relax();
+                lk.lock();
+            }
+
+    public:
+        template <class Lock, class Predicate>
+            void
+            wait(Lock& lk, Predicate pred)
+            {
+                if (!pred())
+                {
+                    spin(lk);
+                    cv_.wait(lk, pred);
+                }
+            }
+
+        template <class Lock, class Clock, class Duration, class Predicate>
+            bool
+            wait_until(Lock& lk,
+                       const std::chrono::time_point<Clock, Duration>& abs_time,
+                       Predicate pred)
+            {
+                if (pred())
+                    return true;
+                spin(lk);
+                return cv_.wait_until(lk, abs_time, pred);
+            }
+
+        void notify_one() noexcept
+        {
+            notified_.fetch_add(1, std::memory_order_relaxed);
+            cv_.notify_one();
+        }
+
+        void notify_all() noexcept
+        {
+            notified_.fetch_add(1, std::memory_order_relaxed);
+            cv_.notify_all();
+        }
+    };
+};
+
+#ifdef __linux__
+
+// Gates are futex words counting notifications.  Notifying makes a system
+// call only when some thread is parked on the gate.
+
+struct futex_wait
+{
+    typedef std::mutex mutex_type;
+
+    class gate_type
+    {
+        std::atomic<std::uint32_t> seq_{0};
+        std::atomic<std::uint32_t> parked_{0};
+
+        template <class Lock>
+            void
+            park(Lock& lk, const timespec* rel_time)
+            {
+                std::uint32_t s = seq_.load(std::memory_order_relaxed);
+                parked_.fetch_add(1, std::memory_order_relaxed);
+                lk.unlock();
+                detail::futex(&seq_, FUTEX_WAIT_PRIVATE, s, rel_time);
+                lk.lock();
+                parked_.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+    public:
+        template <class Lock, class Predicate>
+            void
+            wait(Lock& lk, Predicate pred)
+            {
+                while (!pred())
+                    park(lk, nullptr);
+            }
+
+        template <class Lock, class Clock, class Duration, class Predicate>
+            bool
+            wait_until(Lock& lk,
+                       const std::chrono::time_point<Clock, Duration>& abs_time,
+                       Predicate pred)
+            {
+                while (!pred())
+                {
+                    auto rel_time = abs_time - Clock::now();
+                    if (rel_time <= rel_time.zero())
+                        return false;
+                    std::chrono::nanoseconds ns = std::chrono::hours(1);
+                    if (rel_time < std::chrono::hours(1))
+                        ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                                      rel_time);
+                    timespec ts;
+                    ts.tv_sec = static_cast<std::time_t>(ns.count() / 1000000000);
+                    ts.tv_nsec = static_cast<long>(ns.count() % 1000000000);
+                    park(lk, &ts);
+                }
+                return true;
+            }
+
+        void notify_one() noexcept
+        {
+            seq_.fetch_add(1, std::memory_order_relaxed);
+            if (parked_.load(std::memory_order_relaxed) != 0)
+                detail::futex(&seq_, FUTEX_WAKE_PRIVATE, 1);
+        }
+
+        void notify_all() noexcept
+        {
+            seq_.fetch_add(1, std::memory_order_relaxed);
+            if (parked_.load(std::memory_order_relaxed) != 0)
+                detail::futex(&seq_, FUTEX_WAKE_PRIVATE, INT_MAX);
+        }
+    };
+};
+
+#endif  // __linux__
+
+// Admission policies
+//
+// An admission policy decides how threads pass gate1.  It sees the mutex's
+// internals and is called with the internal mutex held:
+//
+//     bool admit(m, lk, mode, waiter)  block until mode may pass gate1, pass
+//     bool try_admit(m, mode)          pass gate1 now or return false
+//     void reopen(m)                   gate1 may admit more than before
+//     void drained(m)                  the last reader left a writer at gate2
+
+// Every waiter at gate1 is woken whenever gate1 may have opened, and all race
+// (with any newly arriving thread) to pass it.
+
+template <bool ReadersPassPendingWriter>
+struct barging_admission
+{
+    static constexpr bool readers_pass_pending_writer = ReadersPassPendingWriter;
+
+    template <class Mutex, class Lock, class Waiter>
+        static
+        bool
+        admit(Mutex& m, Lock& lk, lock_mode mode, const Waiter& w)
+        {
+            if (!m.wait(m.gate1_, lk, mode, 1, w,
+                        [&m, mode] {return m.gate1_admits(mode);}))
+                return false;
+            m.pass_gate1(mode);
+            return true;
+        }
+
+    template <class Mutex>
+        static
+        bool
+        try_admit(Mutex& m, lock_mode mode) noexcept
+        {
+            if (!m.gate1_admits(mode))
+                return false;
+            m.pass_gate1(mode);
+            return true;
+        }
+
+    template <class Mutex>
+        static
+        void
+        reopen(Mutex& m) noexcept
+        {
+            m.gate1_.notify_all();
+        }
+
+    template <class Mutex>
+        static
+        void
+        drained(Mutex&) noexcept
+        {
+        }
+};
+
+// Once a writer has passed gate1 no new reader enters until it has come and
+// gone.
+
+typedef barging_admission<false> writer_priority;
+
+// Readers are held back only by a writer that owns the mutex, not by one
+// still waiting at gate2 for readers to drain.  Writers can starve.
+
+typedef barging_admission<true> reader_priority;
+
+// Waiters queue at gate1 in the order Order gives them.  Whenever gate1 may
+// have opened the releasing thread passes it on behalf of the waiters at the
+// head of the queue -- a writer, an upgrader, or a run of readers -- and wakes
+// only them.  They wake already past gate1, and an arriving thread, including
+// one using try_lock*, never overtakes a queued one.  This trades some
+// throughput for bounded waits and no convoys of repeatedly losing waiters.
+//
+// Order::rank(waiter) maps a thread's Waiter to a steady_clock time point;
+// the queue is kept sorted by rank, equal ranks in arrival order.
+//
+// Requests that no thread waits for (async_lock_request) queue alongside
+// threads and rank as untimed.  Granting one past gate1 completes it, or for
+// a writer, the last reader to leave does.
+
+// All waiters rank alike:  the queue is first come, first served.
+
+struct arrival_order
+{
+    template <class Waiter>
+        static
+        std::chrono::steady_clock::time_point
+        rank(const Waiter&) noexcept
+        {
+            return std::chrono::steady_clock::time_point::max();
+        }
+};
+
+// Earliest deadline first.  Timed waiters rank by their deadline, untimed and
+// cancellable ones last.  Serving the most urgent first maximizes the
+// acquisitions that meet their deadlines when the mutex is the bottleneck.
+
+struct deadline_order
+{
+    template <class Waiter>
+        static
+        std::chrono::steady_clock::time_point
+        rank(const Waiter&) noexcept
+        {
+            return std::chrono::steady_clock::time_point::max();
+        }
+
+    template <class Duration>
+        static
+        std::chrono::steady_clock::time_point
+        rank(const detail::timed_wait<std::chrono::steady_clock, Duration>& w)
+                                                                       noexcept
+        {
+            return std::chrono::time_point_cast<
+                            std::chrono::steady_clock::duration>(w.abs_time);
+        }
+
+    template <class Clock, class Duration>
+        static
+        std::chrono::steady_clock::time_point
+        rank(const detail::timed_wait<Clock, Duration>& w) noexcept
+        {
+            return std::chrono::steady_clock::now() +
+                   std::chrono::duration_cast<
+                       std::chrono::steady_clock::duration>(
+                                                    w.abs_time - Clock::now());
+        }
+};
+
+template <class Order>
+class queued_admission
+{
+    struct waiter
+    {
+        lock_mode                             mode;
+        bool                                  admitted;
+        bool                                  async;
+        std::chrono::steady_clock::time_point rank;
+        waiter*                               prev;
+        waiter*                               next;
+    };
+
+    template <class Gate>
+    struct gated_waiter
+        : waiter
+    {
+        Gate gate;
+    };
+
+public:
+    // done is called with the internal mutex held once the request owns the
+    // mutex.
+
+    struct async_waiter
+        : waiter
+    {
+        void (*done)(async_waiter&) noexcept;
+    };
+
+private:
+    waiter*       head_ = nullptr;
+    waiter*       tail_ = nullptr;
+    async_waiter* draining_ = nullptr;       // past gate1, readers remain
+
+    // Nodes live on the waiting thread's stack; queued guarantees they are
+    // unlinked before admit returns, which gcc cannot see.
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+
+    // Searches from the tail, so arrival order costs nothing.
+    void
+    insert(waiter* w) noexcept
+    {
+        waiter* p = tail_;
+        while (p != nullptr && w->rank < p->rank)
+            p = p->prev;
+        w->prev = p;
+        w->next = p != nullptr ? p->next : head_;
+        if (w->next != nullptr)
+            w->next->prev = w;
+        else
+            tail_ = w;
+        if (p != nullptr)
+            p->next = w;
+        else
+            head_ = w;
+    }
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+
+    void
+    unlink(waiter* w) noexcept
+    {
+        if (w->prev != nullptr)
+            w->prev->next = w->next;
+        else
+            head_ = w->next;
+        if (w->next != nullptr)
+            w->next->prev = w->prev;
+        else
+            tail_ = w->prev;
+    }
+
+    template <class Mutex>
+        void
+        grant(Mutex& m) noexcept
+        {
+            typedef gated_waiter<typename Mutex::gate_type> node;
+            while (head_ != nullptr && m.gate1_admits(head_->mode))
+            {
+                waiter* w = head_;
+                unlink(w);
+                m.pass_gate1(w->mode);
+                w->admitted = true;
+                if (w->async)
+                    passed(m, static_cast<async_waiter&>(*w));
+                else
+                    static_cast<node*>(w)->gate.notify_one();
+            }
+        }
+
+    template <class Mutex>
+        void
+        passed(Mutex& m, async_waiter& a) noexcept
+        {
+            if (a.mode == lock_mode::exclusive && !m.no_readers())
+                draining_ = &a;
+            else
+                complete(m, a);
+        }
+
+    template <class Mutex>
+        static
+        void
+        complete(Mutex& m, async_waiter& a) noexcept
+        {
+            static_cast<typename Mutex::stats_type&>(m).acquired(a.mode);
+            a.done(a);
+        }
+
+    // Keeps a waiter queued for its lifetime unless admitted.  One that gives
+    // up may have been holding back those queued behind it.
+
+    template <class Mutex>
+    class queued
+    {
+        queued_admission& a_;
+        Mutex&            m_;
+        waiter&           w_;
+
+    public:
+        queued(queued_admission& a, Mutex& m, waiter& w) noexcept
+            : a_(a), m_(m), w_(w)
+        {
+            a_.insert(&w_);
+        }
+
+        ~queued()
+        {
+            if (!w_.admitted)
+            {
+                a_.unlink(&w_);
+                a_.grant(m_);
+            }
+        }
+
+        queued(const queued&) = delete;
+        queued& operator=(const queued&) = delete;
+    };
+
+public:
+    static constexpr bool readers_pass_pending_writer = false;
+
+    template <class Mutex, class Lock, class Waiter>
+        bool
+        admit(Mutex& m, Lock& lk, lock_mode mode, const Waiter& w)
+        {
+            if (head_ == nullptr && m.gate1_admits(mode))
+            {
+                m.pass_gate1(mode);
+                return true;
+            }
+            gated_waiter<typename Mutex::gate_type> self;
+            self.mode = mode;
+            self.admitted = false;
+            self.async = false;
+            self.rank = Order::rank(w);
+            queued<Mutex> q(*this, m, self);
+            if (head_ == &self)
+                grant(m);       // ahead of a head that gate1 refuses
+            return m.wait(self.gate, lk, mode, 1, w,
+                          [&self] {return self.admitted;});
+        }
+
+    template <class Mutex>
+        bool
+        try_admit(Mutex& m, lock_mode mode) noexcept
+        {
+            if (head_ != nullptr || !m.gate1_admits(mode))
+                return false;
+            m.pass_gate1(mode);
+            return true;
+        }
+
+    // gate1_ itself is waited on only by try_unlock_shared_and_lock_upgrade_*.
+
+    template <class Mutex>
+        void
+        reopen(Mutex& m) noexcept
+        {
+            grant(m);
+            m.gate1_.notify_all();
+        }
+
+    template <class Mutex>
+        void
+        drained(Mutex& m) noexcept
+        {
+            if (draining_ == nullptr)
+                return;
+            async_waiter& a = *draining_;
+            draining_ = nullptr;
+            complete(m, a);
+        }
+
+    // Asynchronous requests, with the internal mutex held.  Either may call
+    // a.done before returning.
+
+    template <class Mutex>
+        void
+        admit_async(Mutex& m, async_waiter& a, lock_mode mode) noexcept
+        {
+            a.mode = mode;
+            a.admitted = false;
+            a.async = true;
+            a.rank = Order::rank(detail::untimed_wait());
+            if (head_ == nullptr && m.gate1_admits(mode))
+            {
+                m.pass_gate1(mode);
+                a.admitted = true;
+                passed(m, a);
+                return;
+            }
+            insert(&a);
+            if (head_ == &a)
+                grant(m);
+        }
+
+    // Returns false if a already owns the mutex.
+    template <class Mutex>
+        bool
+        cancel_async(Mutex& m, async_waiter& a) noexcept
+        {
+            if (!a.admitted)
+            {
+                unlink(&a);
+                grant(m);
+                return true;
+            }
+            if (draining_ != &a)
                 return false;
+            draining_ = nullptr;
+            m.state_ &= ~Mutex::write_entered_;
+            m.reopen();
+            return true;
+        }
+};
+
+typedef queued_admission<arrival_order>  handoff_admission;
+typedef queued_admission<deadline_order> deadline_admission;
+
+// Stats policies
+//
+// Hooks, called with the internal mutex held:
+//
+//     wait_token wait_begin(mode, gate)         a thread blocks at gate 1 or 2
+//     void wait_end(token, mode, gate, bool)    ... and stops, acquired or not
+//     void acquired(mode)                       any acquisition or conversion
+//     void released(mode)                       into / out of mode
+
+struct no_stats
+{
+    struct wait_token {};
+
+    wait_token wait_begin(lock_mode, unsigned) noexcept {return wait_token();}
+    void wait_end(wait_token, lock_mode, unsigned, bool) noexcept {}
+    void acquired(lock_mode) noexcept {}
+    void released(lock_mode) noexcept {}
+};
+
+// Per mode counters, readable at any time with snapshot().
+
+class basic_stats
+{
+public:
+    struct counters
+    {
+        std::uint64_t acquisitions;
+        std::uint64_t waits;
+        std::uint64_t timeouts;
+        std::uint64_t wait_ns;
+        std::uint64_t max_wait_ns;
+    };
+
+private:
+    struct atomic_counters
+    {
+        std::atomic<std::uint64_t> acquisitions{0};
+        std::atomic<std::uint64_t> waits{0};
+        std::atomic<std::uint64_t> timeouts{0};
+        std::atomic<std::uint64_t> wait_ns{0};
+        std::atomic<std::uint64_t> max_wait_ns{0};
+    };
+
+    atomic_counters c_[3];
+
+public:
+    typedef std::chrono::steady_clock::time_point wait_token;
+
+    wait_token
+    wait_begin(lock_mode, unsigned) noexcept
+    {
+        return std::chrono::steady_clock::now();
+    }
+
+    void wait_end(wait_token t, lock_mode m, unsigned gate,
+                  bool acquired) noexcept;
+
+    void
+    acquired(lock_mode m) noexcept
+    {
+        c_[static_cast<unsigned>(m)].acquisitions.fetch_add(1,
+                                                   std::memory_order_relaxed);
+    }
+
+    void released(lock_mode) noexcept {}
+
+    counters snapshot(lock_mode m) const noexcept;
+};
+
+// Release policies
+//
+// A release policy is told, with the internal mutex held, of every release
+// or reopening of gate1 after which a thread may acquire the mutex that
+// could not before:
+//
+//     void notify()
+//
+// Only lock_any needs to hear of them, and it requires any_release.  Other
+// mutexes pay nothing.
+
+struct silent_release
+{
+    void notify() noexcept {}
+};
+
+#ifdef __linux__
+
+class any_release
+{
+    detail::release_gate gate_;
+
+    friend detail::any_access;
+
+public:
+    void notify() noexcept {gate_.notify();}
+};
+
+#endif  // __linux__
+
+// basic_upgrade_mutex
+
+template <class StateWord = unsigned,
+          class WaitStrategy = condvar_wait,
+          class AdmissionPolicy = writer_priority,
+          class StatsPolicy = no_stats,
+          class ReleasePolicy = silent_release>
+class basic_upgrade_mutex
+    : private AdmissionPolicy,
+      private StatsPolicy,
+      private ReleasePolicy
+{
+    static_assert(std::is_unsigned<StateWord>::value,
+                  "basic_upgrade_mutex: StateWord must be an unsigned integer");
+
+public:
+    typedef StateWord       state_type;
+    typedef WaitStrategy    wait_strategy;
+    typedef AdmissionPolicy admission_policy;
+    typedef StatsPolicy     stats_type;
+    typedef ReleasePolicy   release_policy;
+
+private:
+    typedef typename WaitStrategy::mutex_type mutex_type;
+    typedef typename WaitStrategy::gate_type  gate_type;
+    typedef std::unique_lock<mutex_type>      lock_type;
+#ifdef __cpp_lib_jthread
+    typedef detail::stoppable_wait<mutex_type, gate_type> stop_waiter;
+#endif
+
+    mutex_type mut_;
+    gate_type  gate1_;
+    gate_type  gate2_;
+    StateWord  state_;
+
+    static constexpr StateWord write_entered_ =
+                   StateWord(StateWord(1) << (sizeof(StateWord)*CHAR_BIT - 1));
+    static constexpr StateWord upgradable_entered_ = write_entered_ >> 1;
+    static constexpr StateWord n_readers_ =
+                              StateWord(~(write_entered_ | upgradable_entered_));
+
+    friend AdmissionPolicy;
+    friend detail::any_access;
+    friend detail::async_access;
+
+public:
+    basic_upgrade_mutex() : state_(0) {}
+    ~basic_upgrade_mutex() = default;
+
+    basic_upgrade_mutex(const basic_upgrade_mutex&) = delete;
+    basic_upgrade_mutex& operator=(const basic_upgrade_mutex&) = delete;
+
+    // Exclusive ownership
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    // Shared ownership
+
+    void lock_shared();
+    bool try_lock_shared();
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_shared_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock_shared();
+
+    // Upgrade ownership
+
+    void lock_upgrade();
+    bool try_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(std::chrono::steady_clock::now() +
+                                         rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock_upgrade();
+
+#ifdef __cpp_lib_jthread
+    // Cancellable.  These return false, owning nothing new, if stop is
+    // requested before the ownership is obtained.
+
+    bool lock(std::stop_token st);
+    bool lock_shared(std::stop_token st);
+    bool lock_upgrade(std::stop_token st);
+    bool unlock_upgrade_and_lock(std::stop_token st);
+#endif
+
+    // Helping.  A thread that must wait calls help(), with no lock held, to
+    // run one of its own tasks, which must not need this mutex; help returns
+    // false if it had none.  The thread stops helping as soon as it is
+    // granted ownership, but a grant made while a task runs holds the mutex
+    // for it until the task returns:  tasks should be short.  If help throws,
+    // the thread gives up waiting, owning nothing new (upgrade, for
+    // unlock_upgrade_and_lock), and the exception propagates.
+
+    template <class Helper, class = detail::enable_if_helper<Helper>>
+        void
+        lock(Helper&& help)
+        {
+            acquire_helping(lock_op::lock, lock_mode::exclusive, help);
+        }
+    template <class Helper, class = detail::enable_if_helper<Helper>>
+        void
+        lock_shared(Helper&& help)
+        {
+            acquire_helping(lock_op::lock_shared, lock_mode::shared, help);
+        }
+    template <class Helper, class = detail::enable_if_helper<Helper>>
+        void
+        lock_upgrade(Helper&& help)
+        {
+            acquire_helping(lock_op::lock_upgrade, lock_mode::upgrade, help);
+        }
+    template <class Helper, class = detail::enable_if_helper<Helper>>
+        void unlock_upgrade_and_lock(Helper&& help);
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock_and_lock_shared();
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade();
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock_upgrade_and_lock_shared();
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock();
+    bool try_unlock_upgrade_and_lock();
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(
+                                   std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock_and_lock_upgrade();
+
+    // Statistics
+
+    const stats_type& stats() const noexcept {return *this;}
+
+private:
+    bool
+    gate1_admits(lock_mode m) const noexcept
+    {
+        switch (m)
+        {
+        case lock_mode::shared:
+            if ((state_ & n_readers_) == n_readers_)
+                return false;
+            if (AdmissionPolicy::readers_pass_pending_writer)
+                return !(state_ & write_entered_) || (state_ & n_readers_) != 0;
+            return !(state_ & write_entered_);
+        case lock_mode::upgrade:
+            return !(state_ & (write_entered_ | upgradable_entered_)) &&
+                   (state_ & n_readers_) != n_readers_;
+        case lock_mode::exclusive:
+            break;
+        }
+        return !(state_ & (write_entered_ | upgradable_entered_));
+    }
+
+    void
+    pass_gate1(lock_mode m) noexcept
+    {
+        if (m == lock_mode::exclusive)
+            state_ |= write_entered_;
+        else
+        {
+            add_reader();
+            if (m == lock_mode::upgrade)
+                state_ |= upgradable_entered_;
+        }
+    }
+
+    void
+    add_reader() noexcept
+    {
+        StateWord num_readers = (state_ & n_readers_) + 1;
+        state_ &= ~n_readers_;
+        state_ |= num_readers;
+    }
+
+    void
+    remove_reader() noexcept
+    {
+        StateWord num_readers = (state_ & n_readers_) - 1;
+        state_ &= ~n_readers_;
+        state_ |= num_readers;
+    }
+
+    bool no_readers() const noexcept {return (state_ & n_readers_) == 0;}
+
+    // gate1 may admit more than before.
+    void
+    reopen() noexcept
+    {
+        AdmissionPolicy::reopen(*this);
+        ReleasePolicy::notify();
+    }
+
+    template <class Waiter, class Predicate>
+        bool
+        wait(gate_type& g, lock_type& lk, lock_mode m, unsigned gate,
+             const Waiter& w, Predicate pred)
+        {
+            if (pred())
+                return true;
+            auto t = StatsPolicy::wait_begin(m, gate);
+            bool r = w(g, lk, pred);
+            StatsPolicy::wait_end(t, m, gate, r);
+            return r;
+        }
+
+    // USDT probes, with the internal mutex held
+
+    void
+    probe_acquire_begin(lock_op op) const noexcept
+    {
+        ACME_USDT3(acquire_begin, this, static_cast<unsigned>(op), state_);
+    }
+
+    void
+    probe_acquire_end(lock_op op, bool acquired) const noexcept
+    {
+        ACME_USDT4(acquire_end, this, static_cast<unsigned>(op), state_,
+                   static_cast<int>(acquired));
+    }
+
+    void
+    probe_release(lock_op op) const noexcept
+    {
+        ACME_USDT3(release, this, static_cast<unsigned>(op), state_);
+    }
+
+    template <class Waiter>
+        bool acquire(lock_type& lk, lock_op op, lock_mode m, const Waiter& w);
+    template <class Waiter>
+        bool shared_to_exclusive(lock_type& lk, lock_op op, const Waiter& w);
+    template <class Waiter>
+        bool shared_to_upgrade(lock_type& lk, lock_op op, const Waiter& w);
+    template <class Waiter>
+        bool upgrade_to_exclusive(lock_type& lk, lock_op op, const Waiter& w);
+    template <class Helper>
+        void acquire_helping(lock_op op, lock_mode m, Helper& help);
+};
+
+typedef basic_upgrade_mutex<> upgrade_mutex;
+
+// Pass gate1, then if exclusive wait at gate2 for the readers to drain.
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Waiter>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::acquire(lock_type& lk, lock_op op,
+                                            lock_mode m, const Waiter& w)
+{
+    probe_acquire_begin(op);
+    if (!AdmissionPolicy::admit(*this, lk, m, w))
+    {
+        probe_acquire_end(op, false);
+        return false;
+    }
+    if (m == lock_mode::exclusive &&
+        !wait(gate2_, lk, m, 2, w, [this] {return no_readers();}))
+    {
+        state_ &= ~write_entered_;
+        reopen();
+        probe_acquire_end(op, false);
+        return false;
+    }
+    StatsPolicy::acquired(m);
+    probe_acquire_end(op, true);
+    return true;
+}
+
+// Pass gate1 as a writer, then give up our read count and wait at gate2 for
+// the other readers, as unlock_upgrade_and_lock does.
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Waiter>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::shared_to_exclusive(lock_type& lk,
+                                                        lock_op op,
+                                                        const Waiter& w)
+{
+    probe_acquire_begin(op);
+    if (!AdmissionPolicy::admit(*this, lk, lock_mode::exclusive, w))
+    {
+        probe_acquire_end(op, false);
+        return false;
+    }
+    remove_reader();
+    if (!wait(gate2_, lk, lock_mode::exclusive, 2, w,
+              [this] {return no_readers();}))
+    {
+        add_reader();
+        state_ &= ~write_entered_;
+        reopen();
+        probe_acquire_end(op, false);
+        return false;
+    }
+    StatsPolicy::released(lock_mode::shared);
+    StatsPolicy::acquired(lock_mode::exclusive);
+    probe_acquire_end(op, true);
+    return true;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Waiter>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::shared_to_upgrade(lock_type& lk,
+                                                      lock_op op,
+                                                      const Waiter& w)
+{
+    probe_acquire_begin(op);
+    if (!wait(gate1_, lk, lock_mode::upgrade, 1, w, [this]
+              {
+                  return !(state_ & (write_entered_ | upgradable_entered_));
+              }))
+    {
+        probe_acquire_end(op, false);
+        return false;
+    }
+    state_ |= upgradable_entered_;
+    StatsPolicy::released(lock_mode::shared);
+    StatsPolicy::acquired(lock_mode::upgrade);
+    probe_acquire_end(op, true);
+    return true;
+}
+
+// Readers are held at gate1 while waiting; giving up restores upgrade
+// ownership and lets them in again.
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Waiter>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::upgrade_to_exclusive(lock_type& lk,
+                                                         lock_op op,
+                                                         const Waiter& w)
+{
+    probe_acquire_begin(op);
+    remove_reader();
+    state_ &= ~upgradable_entered_;
+    state_ |= write_entered_;
+    if (!wait(gate2_, lk, lock_mode::exclusive, 2, w,
+              [this] {return no_readers();}))
+    {
+        add_reader();
+        state_ &= ~write_entered_;
+        state_ |= upgradable_entered_;
+        reopen();
+        probe_acquire_end(op, false);
+        return false;
+    }
+    StatsPolicy::released(lock_mode::upgrade);
+    StatsPolicy::acquired(lock_mode::exclusive);
+    probe_acquire_end(op, true);
+    return true;
+}
+
+// Exclusive ownership
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock()
+{
+    lock_type lk(mut_);
+    acquire(lk, lock_op::lock, lock_mode::exclusive, detail::untimed_wait());
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_lock);
+    bool r = no_readers() &&
+             AdmissionPolicy::try_admit(*this, lock_mode::exclusive);
+    if (r)
+        StatsPolicy::acquired(lock_mode::exclusive);
+    probe_acquire_end(lock_op::try_lock, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::try_lock_until, lock_mode::exclusive,
+                   detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    state_ = 0;
+    StatsPolicy::released(lock_mode::exclusive);
+    probe_release(lock_op::unlock);
+    reopen();
+}
+
+// Shared ownership
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock_shared()
+{
+    lock_type lk(mut_);
+    acquire(lk, lock_op::lock_shared, lock_mode::shared,
+            detail::untimed_wait());
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_lock_shared);
+    bool r = AdmissionPolicy::try_admit(*this, lock_mode::shared);
+    if (r)
+        StatsPolicy::acquired(lock_mode::shared);
+    probe_acquire_end(lock_op::try_lock_shared, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock_shared_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::try_lock_shared_until, lock_mode::shared,
+                   detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    remove_reader();
+    StatsPolicy::released(lock_mode::shared);
+    probe_release(lock_op::unlock_shared);
+    StateWord num_readers = state_ & n_readers_;
+    if (state_ & write_entered_)
+    {
+        if (num_readers == 0)
+        {
+            gate2_.notify_one();
+            AdmissionPolicy::drained(*this);
+        }
+    }
+    else if (num_readers == n_readers_ - 1)
+        reopen();
+    else if (num_readers == 0)
+        ReleasePolicy::notify();
+}
+
+// Upgrade ownership
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock_upgrade()
+{
+    lock_type lk(mut_);
+    acquire(lk, lock_op::lock_upgrade, lock_mode::upgrade,
+            detail::untimed_wait());
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_lock_upgrade);
+    bool r = AdmissionPolicy::try_admit(*this, lock_mode::upgrade);
+    if (r)
+        StatsPolicy::acquired(lock_mode::upgrade);
+    probe_acquire_end(lock_op::try_lock_upgrade, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_lock_upgrade_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::try_lock_upgrade_until, lock_mode::upgrade,
+                   detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    remove_reader();
+    state_ &= ~upgradable_entered_;
+    StatsPolicy::released(lock_mode::upgrade);
+    probe_release(lock_op::unlock_upgrade);
+    reopen();
+}
+
+// Shared <-> Exclusive
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_shared_and_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_unlock_shared_and_lock);
+    bool r = state_ == 1;
+    if (r)
+    {
+        state_ = write_entered_;
+        StatsPolicy::released(lock_mode::shared);
+        StatsPolicy::acquired(lock_mode::exclusive);
+    }
+    probe_acquire_end(lock_op::try_unlock_shared_and_lock, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_shared_and_lock_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return shared_to_exclusive(lk, lock_op::try_unlock_shared_and_lock_until,
+                               detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_and_lock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    state_ = 1;
+    StatsPolicy::released(lock_mode::exclusive);
+    StatsPolicy::acquired(lock_mode::shared);
+    probe_release(lock_op::unlock_and_lock_shared);
+    reopen();
+}
+
+// Shared <-> Upgrade
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_shared_and_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_unlock_shared_and_lock_upgrade);
+    bool r = !(state_ & (write_entered_ | upgradable_entered_));
+    if (r)
+    {
+        state_ |= upgradable_entered_;
+        StatsPolicy::released(lock_mode::shared);
+        StatsPolicy::acquired(lock_mode::upgrade);
+    }
+    probe_acquire_end(lock_op::try_unlock_shared_and_lock_upgrade, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_shared_and_lock_upgrade_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return shared_to_upgrade(lk,
+                             lock_op::try_unlock_shared_and_lock_upgrade_until,
+                             detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_upgrade_and_lock_shared()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    state_ &= ~upgradable_entered_;
+    StatsPolicy::released(lock_mode::upgrade);
+    StatsPolicy::acquired(lock_mode::shared);
+    probe_release(lock_op::unlock_upgrade_and_lock_shared);
+    reopen();
+}
+
+// Upgrade <-> Exclusive
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_upgrade_and_lock()
+{
+    lock_type lk(mut_);
+    upgrade_to_exclusive(lk, lock_op::unlock_upgrade_and_lock,
+                         detail::untimed_wait());
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_upgrade_and_lock()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    probe_acquire_begin(lock_op::try_unlock_upgrade_and_lock);
+    bool r = state_ == (upgradable_entered_ | 1);
+    if (r)
+    {
+        state_ = write_entered_;
+        StatsPolicy::released(lock_mode::upgrade);
+        StatsPolicy::acquired(lock_mode::exclusive);
+    }
+    probe_acquire_end(lock_op::try_unlock_upgrade_and_lock, r);
+    return r;
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Clock, class Duration>
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::try_unlock_upgrade_and_lock_until(
+                       const std::chrono::time_point<Clock, Duration>& abs_time)
+{
+    lock_type lk(mut_);
+    return upgrade_to_exclusive(lk, lock_op::try_unlock_upgrade_and_lock_until,
+                                detail::wait_until(abs_time));
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_and_lock_upgrade()
+{
+    std::lock_guard<mutex_type> _(mut_);
+    state_ = upgradable_entered_ | 1;
+    StatsPolicy::released(lock_mode::exclusive);
+    StatsPolicy::acquired(lock_mode::upgrade);
+    probe_release(lock_op::unlock_and_lock_upgrade);
+    reopen();
+}
+
+#ifdef __cpp_lib_jthread
+
+// Cancellable
+//
+// inline, so that callers built as C++20 do not depend on upgrade_mutex.cpp
+// having been built as C++20 too:  extern template does not cover them.
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+inline
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock(std::stop_token st)
+{
+    stop_waiter w(mut_, std::move(st));
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::lock, lock_mode::exclusive, w);
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+inline
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock_shared(std::stop_token st)
+{
+    stop_waiter w(mut_, std::move(st));
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::lock_shared, lock_mode::shared, w);
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+inline
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::lock_upgrade(std::stop_token st)
+{
+    stop_waiter w(mut_, std::move(st));
+    lock_type lk(mut_);
+    return acquire(lk, lock_op::lock_upgrade, lock_mode::upgrade, w);
+}
+
+// On false the caller still owns upgrade; upgrade_to_exclusive has cleared
+// write_entered_ and let the readers it was holding back in again.
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+inline
+bool
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_upgrade_and_lock(std::stop_token st)
+{
+    stop_waiter w(mut_, std::move(st));
+    lock_type lk(mut_);
+    return upgrade_to_exclusive(lk, lock_op::unlock_upgrade_and_lock, w);
+}
+
+#endif  // __cpp_lib_jthread
+
+// Helping
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Helper>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::acquire_helping(lock_op op, lock_mode m,
+                                                    Helper& help)
+{
+    detail::helping_wait<Helper> w{help, nullptr};
+    lock_type lk(mut_);
+    const bool owns = acquire(lk, op, m, w);
+    lk.unlock();
+    if (!w.error)
+        return;
+    if (owns)
+    {
+        switch (m)
+        {
+        case lock_mode::shared:
+            unlock_shared();
+            break;
+        case lock_mode::upgrade:
+            unlock_upgrade();
+            break;
+        case lock_mode::exclusive:
+            unlock();
+            break;
+        }
+    }
+    std::rethrow_exception(w.error);
+}
+
+template <class StateWord, class WaitStrategy, class AdmissionPolicy,
+          class StatsPolicy, class ReleasePolicy>
+template <class Helper, class>
+void
+basic_upgrade_mutex<StateWord, WaitStrategy, AdmissionPolicy, StatsPolicy,
+                    ReleasePolicy>::unlock_upgrade_and_lock(Helper&& help)
+{
+    detail::helping_wait<Helper> w{help, nullptr};
+    lock_type lk(mut_);
+    const bool owns = upgrade_to_exclusive(lk, lock_op::unlock_upgrade_and_lock,
+                                           w);
+    lk.unlock();
+    if (!w.error)
+        return;
+    if (owns)
+        unlock_and_lock_upgrade();
+    std::rethrow_exception(w.error);
+}
+
+extern template class basic_upgrade_mutex<>;
+
+template <class Mutex> class shared_lock;
+template <class Mutex> class unique_lock;
+template <class Mutex> class upgrade_lock;
+
+// shared_lock
+
+template <class Mutex>
+class shared_lock
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    mutex_type* m_;
+    bool        owns_;
+
+    // Takes over l's mutex and ownership, which it has already converted.
+    template <class Lock>
+        void
+        take(Lock& l) noexcept
+        {
+            owns_ = l.owns_lock();
+            m_ = l.release();
+        }
+
+public:
+    ~shared_lock()
+    {
+        if (owns_)
+            m_->unlock_shared();
+    }
+
+    shared_lock() noexcept
+        : m_(nullptr), owns_(false) {}
+
+    shared_lock(shared_lock const&) = delete;
+    shared_lock& operator=(shared_lock const&) = delete;
+
+    shared_lock(shared_lock&& sl) noexcept
+        : m_(sl.m_), owns_(sl.owns_)
+        {
+            sl.m_ = nullptr;
+            sl.owns_ = false;
+        }
+
+    shared_lock& operator=(shared_lock&& sl)
+    {
+        if (owns_)
+            m_->unlock_shared();
+        m_ = sl.m_;
+        owns_ = sl.owns_;
+        sl.m_ = nullptr;
+        sl.owns_ = false;
+        return *this;
+    }
+
+    explicit shared_lock(mutex_type& m)
+        : m_(&m), owns_(true)
+        {m_->lock_shared();}
+
+    shared_lock(mutex_type& m, std::defer_lock_t) noexcept
+        : m_(&m), owns_(false) {}
+
+    shared_lock(mutex_type& m, std::try_to_lock_t)
+        : m_(&m), owns_(m.try_lock_shared()) {}
+
+    shared_lock(mutex_type& m, std::adopt_lock_t) noexcept
+        : m_(&m), owns_(true) {}
+
+    template <class Clock, class Duration>
+        shared_lock(mutex_type& m,
+                    const std::chrono::time_point<Clock, Duration>& abs_time)
+        : m_(&m), owns_(m.try_lock_shared_until(abs_time)) {}
+    template <class Rep, class Period>
+        shared_lock(mutex_type& m,
+                    const std::chrono::duration<Rep, Period>& rel_time)
+        : m_(&m), owns_(m.try_lock_shared_for(rel_time)) {}
+
+    // Exclusive -> Shared
+
+    explicit shared_lock(unique_lock<mutex_type>&& ul)
+        : m_(nullptr), owns_(false)
+    {
+        if (ul.owns_lock())
+            ul.mutex()->unlock_and_lock_shared();
+        take(ul);
+    }
+
+    // Upgrade -> Shared
+
+    explicit shared_lock(upgrade_lock<mutex_type>&& ul)
+        : m_(nullptr), owns_(false)
+    {
+        if (ul.owns_lock())
+            ul.mutex()->unlock_upgrade_and_lock_shared();
+        take(ul);
+    }
+
+    // Shared
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
         }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    void swap(shared_lock& u) noexcept
+    {
+        std::swap(m_, u.m_);
+        std::swap(owns_, u.owns_);
     }
-    state_ = write_entered_;
-    return true;
+
+    mutex_type* release() noexcept
+    {
+        mutex_type* r = m_;
+        m_ = nullptr;
+        owns_ = false;
+        return r;
+    }
+
+    bool owns_lock() const noexcept {return owns_;}
+    explicit operator bool () const noexcept {return owns_;}
+    mutex_type* mutex() const noexcept {return m_;}
+};
+
+template <class Mutex>
+void
+shared_lock<Mutex>::lock()
+{
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                    "shared_lock::lock: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                           "shared_lock::lock: already locked");
+    m_->lock_shared();
+    owns_ = true;
+}
+
+template <class Mutex>
+bool
+shared_lock<Mutex>::try_lock()
+{
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "shared_lock::try_lock: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                       "shared_lock::try_lock: already locked");
+    owns_ = m_->try_lock_shared();
+    return owns_;
 }
 
+template <class Mutex>
 template <class Clock, class Duration>
 bool
-upgrade_mutex::try_unlock_shared_and_lock_upgrade_until(
+shared_lock<Mutex>::try_lock_until(
                        const std::chrono::time_point<Clock, Duration>& abs_time)
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if ((state_ & (write_entered_ | upgradable_entered_)) != 0)
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                          "shared_lock::try_lock_until: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                 "shared_lock::try_lock_until: already locked");
+    owns_ = m_->try_lock_shared_until(abs_time);
+    return owns_;
+}
+
+template <class Mutex>
+void
+shared_lock<Mutex>::unlock()
+{
+    if (!owns_)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "shared_lock::unlock: not locked");
+    m_->unlock_shared();
+    owns_ = false;
+}
+
+template <class Mutex>
+inline
+void
+swap(shared_lock<Mutex>&  x, shared_lock<Mutex>&  y) noexcept
+{
+    x.swap(y);
+}
+
+// unique_lock
+
+template <class Mutex>
+class unique_lock
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    mutex_type* m_;
+    bool        owns_;
+
+    // Takes over l's mutex and ownership, which it has already converted.
+    template <class Lock>
+        void
+        take(Lock& l) noexcept
+        {
+            owns_ = l.owns_lock();
+            m_ = l.release();
+        }
+
+public:
+    ~unique_lock()
     {
-        while (true)
+        if (owns_)
+            m_->unlock();
+    }
+
+    unique_lock() noexcept
+        : m_(nullptr), owns_(false) {}
+
+    unique_lock(unique_lock const&) = delete;
+    unique_lock& operator=(unique_lock const&) = delete;
+
+    unique_lock(unique_lock&& ul) noexcept
+        : m_(ul.m_), owns_(ul.owns_)
         {
-            std::cv_status status = gate2_.wait_until(lk, abs_time);
-            if ((state_ & (write_entered_ | upgradable_entered_)) == 0)
-                break;
-            if (status == std::cv_status::timeout)
-                return false;
+            ul.m_ = nullptr;
+            ul.owns_ = false;
         }
+
+    unique_lock& operator=(unique_lock&& ul)
+    {
+        if (owns_)
+            m_->unlock();
+        m_ = ul.m_;
+        owns_ = ul.owns_;
+        ul.m_ = nullptr;
+        ul.owns_ = false;
+        return *this;
     }
-    state_ |= upgradable_entered_;
-    return true;
+
+    explicit unique_lock(mutex_type& m)
+        : m_(&m), owns_(true)
+        {m_->lock();}
+
+    unique_lock(mutex_type& m, std::defer_lock_t) noexcept
+        : m_(&m), owns_(false) {}
+
+    unique_lock(mutex_type& m, std::try_to_lock_t)
+        : m_(&m), owns_(m.try_lock()) {}
+
+    unique_lock(mutex_type& m, std::adopt_lock_t) noexcept
+        : m_(&m), owns_(true) {}
+
+    template <class Clock, class Duration>
+        unique_lock(mutex_type& m,
+                    const std::chrono::time_point<Clock, Duration>& abs_time)
+        : m_(&m), owns_(m.try_lock_until(abs_time)) {}
+    template <class Rep, class Period>
+        unique_lock(mutex_type& m,
+                    const std::chrono::duration<Rep, Period>& rel_time)
+        : m_(&m), owns_(m.try_lock_for(rel_time)) {}
+
+    // Shared -> Exclusive.  On failure sl keeps its ownership and *this is
+    // empty.
+
+    unique_lock(shared_lock<mutex_type>&& sl, std::try_to_lock_t)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() || sl.mutex()->try_unlock_shared_and_lock())
+            take(sl);
+    }
+
+    template <class Clock, class Duration>
+        unique_lock(shared_lock<mutex_type>&& sl,
+                    const std::chrono::time_point<Clock, Duration>& abs_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() ||
+            sl.mutex()->try_unlock_shared_and_lock_until(abs_time))
+            take(sl);
+    }
+
+    template <class Rep, class Period>
+        unique_lock(shared_lock<mutex_type>&& sl,
+                    const std::chrono::duration<Rep, Period>& rel_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() ||
+            sl.mutex()->try_unlock_shared_and_lock_for(rel_time))
+            take(sl);
+    }
+
+    // Upgrade -> Exclusive.  On failure ul keeps its ownership and *this is
+    // empty.
+
+    explicit unique_lock(upgrade_lock<mutex_type>&& ul)
+        : m_(nullptr), owns_(false)
+    {
+        if (ul.owns_lock())
+            ul.mutex()->unlock_upgrade_and_lock();
+        take(ul);
+    }
+
+    unique_lock(upgrade_lock<mutex_type>&& ul, std::try_to_lock_t)
+        : m_(nullptr), owns_(false)
+    {
+        if (!ul.owns_lock() || ul.mutex()->try_unlock_upgrade_and_lock())
+            take(ul);
+    }
+
+    template <class Clock, class Duration>
+        unique_lock(upgrade_lock<mutex_type>&& ul,
+                    const std::chrono::time_point<Clock, Duration>& abs_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!ul.owns_lock() ||
+            ul.mutex()->try_unlock_upgrade_and_lock_until(abs_time))
+            take(ul);
+    }
+
+    template <class Rep, class Period>
+        unique_lock(upgrade_lock<mutex_type>&& ul,
+                    const std::chrono::duration<Rep, Period>& rel_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!ul.owns_lock() ||
+            ul.mutex()->try_unlock_upgrade_and_lock_for(rel_time))
+            take(ul);
+    }
+
+    // Exclusive
+
+    void lock();
+    bool try_lock();
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(std::chrono::steady_clock::now() + rel_time);
+        }
+    template <class Clock, class Duration>
+        bool
+        try_lock_until(
+                      const std::chrono::time_point<Clock, Duration>& abs_time);
+    void unlock();
+
+    void swap(unique_lock& u) noexcept
+    {
+        std::swap(m_, u.m_);
+        std::swap(owns_, u.owns_);
+    }
+
+    mutex_type* release() noexcept
+    {
+        mutex_type* r = m_;
+        m_ = nullptr;
+        owns_ = false;
+        return r;
+    }
+
+    bool owns_lock() const noexcept {return owns_;}
+    explicit operator bool () const noexcept {return owns_;}
+    mutex_type* mutex() const noexcept {return m_;}
+};
+
+template <class Mutex>
+void
+unique_lock<Mutex>::lock()
+{
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                    "unique_lock::lock: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                           "unique_lock::lock: already locked");
+    m_->lock();
+    owns_ = true;
+}
+
+template <class Mutex>
+bool
+unique_lock<Mutex>::try_lock()
+{
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "unique_lock::try_lock: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                       "unique_lock::try_lock: already locked");
+    owns_ = m_->try_lock();
+    return owns_;
 }
 
+template <class Mutex>
 template <class Clock, class Duration>
 bool
-upgrade_mutex::try_unlock_upgrade_and_lock_until(
+unique_lock<Mutex>::try_lock_until(
                        const std::chrono::time_point<Clock, Duration>& abs_time)
 {
-    std::unique_lock<std::mutex> lk(mut_);
-    if ((state_ & n_readers_) != 1)
-    {
-        while (true)
-        {
-            std::cv_status status = gate2_.wait_until(lk, abs_time);
-            if ((state_ & n_readers_) == 1)
-                break;
-            if (status == std::cv_status::timeout)
-                return false;
-        }
-    }
-    state_ = write_entered_;
-    return true;
+    if (m_ == nullptr)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                          "unique_lock::try_lock_until: references null mutex");
+    if (owns_)
+        throw std::system_error(std::error_code(EDEADLK, std::system_category()),
+                                 "unique_lock::try_lock_until: already locked");
+    owns_ = m_->try_lock_until(abs_time);
+    return owns_;
+}
+
+template <class Mutex>
+void
+unique_lock<Mutex>::unlock()
+{
+    if (!owns_)
+        throw std::system_error(std::error_code(EPERM, std::system_category()),
+                                "unique_lock::unlock: not locked");
+    m_->unlock();
+    owns_ = false;
+}
+
+template <class Mutex>
+inline
+void
+swap(unique_lock<Mutex>&  x, unique_lock<Mutex>&  y) noexcept
+{
+    x.swap(y);
 }
 
 // upgrade_lock
@@ -471,6 +2666,15 @@ private:
 
     struct __nat {int _;};
 
+    // Takes over l's mutex and ownership, which it has already converted.
+    template <class Lock>
+        void
+        take(Lock& l) noexcept
+        {
+            owns_ = l.owns_lock();
+            m_ = l.release();
+        }
+
 public:
     ~upgrade_lock()
     {
@@ -524,7 +2728,36 @@ public:
                     const std::chrono::duration<Rep, Period>& rel_time)
         : m_(&m), owns_(m.try_lock_upgrade_for(rel_time)) {}
 
-    // Shared <-> Upgrade
+    // Shared <-> Upgrade.  On failure sl keeps its ownership and *this is
+    // empty.
+
+    upgrade_lock(shared_lock<mutex_type>&& sl, std::try_to_lock_t)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() ||
+            sl.mutex()->try_unlock_shared_and_lock_upgrade())
+            take(sl);
+    }
+
+    template <class Clock, class Duration>
+        upgrade_lock(shared_lock<mutex_type>&& sl,
+                     const std::chrono::time_point<Clock, Duration>& abs_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() ||
+            sl.mutex()->try_unlock_shared_and_lock_upgrade_until(abs_time))
+            take(sl);
+    }
+
+    template <class Rep, class Period>
+        upgrade_lock(shared_lock<mutex_type>&& sl,
+                     const std::chrono::duration<Rep, Period>& rel_time)
+        : m_(nullptr), owns_(false)
+    {
+        if (!sl.owns_lock() ||
+            sl.mutex()->try_unlock_shared_and_lock_upgrade_for(rel_time))
+            take(sl);
+    }
 
     upgrade_lock(std::shared_lock<mutex_type>&& sl, std::try_to_lock_t)
         : m_(nullptr), owns_(false)
@@ -589,6 +2822,14 @@ public:
 
     // Exclusive <-> Upgrade
 
+    explicit upgrade_lock(unique_lock<mutex_type>&& ul)
+        : m_(nullptr), owns_(false)
+    {
+        if (ul.owns_lock())
+            ul.mutex()->unlock_and_lock_upgrade();
+        take(ul);
+    }
+
     explicit upgrade_lock(std::unique_lock<mutex_type>&& ul)
         : m_(ul.mutex()), owns_(ul.owns_lock())
     {
@@ -0,0 +1,277 @@
+//----------------------- upgrade_mutex_profile.cpp ----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "upgrade_mutex_profile.h"
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+
+namespace acme
+{
+
+namespace
+{
+
+// The ownership an operation starts from and ends with, as "shared",
+// "upgrade->exclusive", ...
+
+const char*
+transition(lock_op op)
+{
+    switch (op)
+    {
+    case lock_op::lock:
+    case lock_op::try_lock:
+    case lock_op::try_lock_until:
+        return "exclusive";
+    case lock_op::lock_shared:
+    case lock_op::try_lock_shared:
+    case lock_op::try_lock_shared_until:
+        return "shared";
+    case lock_op::lock_upgrade:
+    case lock_op::try_lock_upgrade:
+    case lock_op::try_lock_upgrade_until:
+        return "upgrade";
+    case lock_op::try_unlock_shared_and_lock:
+    case lock_op::try_unlock_shared_and_lock_until:
+        return "shared->exclusive";
+    case lock_op::unlock_and_lock_shared:
+        return "exclusive->shared";
+    case lock_op::try_unlock_shared_and_lock_upgrade:
+    case lock_op::try_unlock_shared_and_lock_upgrade_until:
+        return "shared->upgrade";
+    case lock_op::unlock_upgrade_and_lock_shared:
+        return "upgrade->shared";
+    case lock_op::unlock_upgrade_and_lock:
+    case lock_op::try_unlock_upgrade_and_lock:
+    case lock_op::try_unlock_upgrade_and_lock_until:
+        return "upgrade->exclusive";
+    case lock_op::unlock_and_lock_upgrade:
+        return "exclusive->upgrade";
+    default:
+        return to_string(op);
+    }
+}
+
+double
+to_ms(std::chrono::nanoseconds d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+double
+to_us(std::chrono::nanoseconds d)
+{
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+}  // unnamed
+
+// contention_profile
+
+// The same file may be named by different pointers from different
+// translation units.
+
+bool
+contention_profile::key::operator<(const key& y) const
+{
+    if (line != y.line)
+        return line < y.line;
+    if (op != y.op)
+        return op < y.op;
+    return std::strcmp(file, y.file) < 0;
+}
+
+contention_profile::contention_profile(unsigned period)
+    : period_(std::max(period, 1u))
+{
+}
+
+void
+contention_profile::set_period(unsigned period) noexcept
+{
+    period_.store(std::max(period, 1u), std::memory_order_relaxed);
+}
+
+contention_profile::site_stats&
+contention_profile::entry(const call_site& site, lock_op op)
+{
+    auto i = sites_.find(key{site.file, site.line, op});
+    if (i == sites_.end())
+    {
+        site_stats s{};
+        s.site = site;
+        s.op = op;
+        i = sites_.emplace(key{site.file, site.line, op}, s).first;
+    }
+    return i->second;
+}
+
+void
+contention_profile::record_wait(const call_site& site, lock_op op,
+                                std::chrono::steady_clock::duration wait,
+                                bool acquired)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait);
+    std::lock_guard<std::mutex> _(mut_);
+    site_stats& s = entry(site, op);
+    ++s.samples;
+    if (!acquired)
+        ++s.failures;
+    s.wait += ns;
+    s.max_wait = std::max(s.max_wait, ns);
+}
+
+// The site has an entry unless the profile was reset while the ownership
+// was held; that holding is dropped.
+
+void
+contention_profile::record_hold(const call_site& site, lock_op op,
+                                std::chrono::steady_clock::duration hold)
+                                noexcept
+{
+    std::lock_guard<std::mutex> _(mut_);
+    auto i = sites_.find(key{site.file, site.line, op});
+    if (i == sites_.end())
+        return;
+    ++i->second.holds;
+    i->second.hold += std::chrono::duration_cast<std::chrono::nanoseconds>(hold);
+}
+
+std::vector<contention_profile::site_stats>
+contention_profile::snapshot() const
+{
+    std::vector<site_stats> v;
+    {
+        std::lock_guard<std::mutex> _(mut_);
+        v.reserve(sites_.size());
+        for (const auto& x : sites_)
+            v.push_back(x.second);
+    }
+    std::stable_sort(v.begin(), v.end(),
+                     [](const site_stats& x, const site_stats& y)
+                     {
+                         return x.wait > y.wait;
+                     });
+    return v;
+}
+
+// Totals are of the sampled calls only; multiplied by the period they
+// estimate the whole.
+
+void
+contention_profile::dump(std::ostream& os, std::size_t max_sites) const
+{
+    std::vector<site_stats> v = snapshot();
+    std::ios::fmtflags flags = os.flags();
+    std::streamsize precision = os.precision();
+    os << "contention by call site, 1 call in " << period()
+       << " sampled per thread\n"
+       << std::right << std::setw(12) << "blocked ms" << std::setw(10)
+       << "samples" << std::setw(10) << "failed" << std::setw(12)
+       << "mean us" << std::setw(12) << "max us" << std::setw(12)
+       << "hold us" << "  " << std::left << std::setw(20) << "mode"
+       << "site\n";
+    os << std::fixed;
+    std::size_t n = std::min(v.size(), max_sites);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        const site_stats& s = v[i];
+        double mean = s.samples ? to_us(s.wait) / s.samples : 0;
+        double hold = s.holds ? to_us(s.hold) / s.holds : 0;
+        os << std::right << std::setprecision(3) << std::setw(12)
+           << to_ms(s.wait) << std::setw(10) << s.samples << std::setw(10)
+           << s.failures << std::setprecision(1) << std::setw(12) << mean
+           << std::setw(12) << to_us(s.max_wait) << std::setw(12) << hold
+           << "  " << std::left << std::setw(20) << transition(s.op)
+           << s.site.file << ':' << s.site.line << " (" << to_string(s.op)
+           << " in " << s.site.function << ")\n";
+    }
+    if (v.size() > n)
+        os << "... " << v.size() - n << " more sites\n";
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void
+contention_profile::reset()
+{
+    std::lock_guard<std::mutex> _(mut_);
+    sites_.clear();
+}
+
+namespace detail
+{
+
+// A thread holding max_holds sampled ownerships forgets its oldest to make
+// room, as it does one released by another thread.
+
+void
+begin_profiled_hold(const void* mutex, lock_mode m, const call_site& site,
+                    lock_op op, std::chrono::steady_clock::time_point now)
+                    noexcept
+{
+    attach_profiled_hold(profiled_hold{mutex, site, op, m, now});
+}
+
+// Ends the most recent sampled ownership of mutex in mode m, if any.
+
+void
+end_profiled_hold(contention_profile& prof, const void* mutex, lock_mode m,
+                  std::chrono::steady_clock::time_point now) noexcept
+{
+    profile_thread& t = this_profile_thread;
+    for (unsigned i = t.held; i-- > 0;)
+    {
+        profiled_hold& h = t.holds[i];
+        if (h.mutex == mutex && h.mode == m)
+        {
+            prof.record_hold(h.site, h.op, now - h.since);
+            std::copy(t.holds + i + 1, t.holds + t.held, t.holds + i);
+            --t.held;
+            return;
+        }
+    }
+}
+
+bool
+detach_profiled_hold(const void* mutex, lock_mode m, profiled_hold& h) noexcept
+{
+    profile_thread& t = this_profile_thread;
+    for (unsigned i = t.held; i-- > 0;)
+    {
+        if (t.holds[i].mutex == mutex && t.holds[i].mode == m)
+        {
+            h = t.holds[i];
+            std::copy(t.holds + i + 1, t.holds + t.held, t.holds + i);
+            --t.held;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+attach_profiled_hold(const profiled_hold& h) noexcept
+{
+    profile_thread& t = this_profile_thread;
+    if (t.held == profile_thread::max_holds)
+    {
+        std::copy(t.holds + 1, t.holds + t.held, t.holds);
+        --t.held;
+    }
+    t.holds[t.held++] = h;
+}
+
+}  // detail
+
+}  // acme
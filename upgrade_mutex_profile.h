@@ -0,0 +1,665 @@
+//------------------------ upgrade_mutex_profile.h -----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_PROFILE
+#define UPGRADE_MUTEX_PROFILE
+
+/*
+    <upgrade_mutex_profile.h> synopsis
+
+namespace acme
+{
+
+// std::source_location where the library has it, else an equivalent built
+// on the compiler's __builtin_FILE, __builtin_LINE and __builtin_FUNCTION.
+
+typedef ... source_location;
+
+struct call_site
+{
+    const char* file;
+    const char* function;
+    unsigned    line;
+};
+
+class contention_profile
+{
+public:
+    static constexpr unsigned default_period = 64;
+
+    struct site_stats
+    {
+        call_site                site;
+        lock_op                  op;
+        std::uint64_t            samples;    // sampled calls
+        std::uint64_t            failures;   // of which did not acquire
+        std::chrono::nanoseconds wait;       // total time spent in the calls
+        std::chrono::nanoseconds max_wait;
+        std::uint64_t            holds;      // ownerships timed to release
+        std::chrono::nanoseconds hold;       // total time they were held
+    };
+
+    explicit contention_profile(unsigned period = default_period);
+
+    contention_profile(const contention_profile&) = delete;
+    contention_profile& operator=(const contention_profile&) = delete;
+
+    unsigned period() const noexcept;
+    void set_period(unsigned period) noexcept;
+
+    std::vector<site_stats> snapshot() const;  // by total wait, longest first
+    void dump(std::ostream& os, std::size_t max_sites = 20) const;
+    void reset();
+};
+
+template <class Mutex = upgrade_mutex>
+class profiled_upgrade_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+    explicit profiled_upgrade_mutex(contention_profile& prof);
+
+    profiled_upgrade_mutex(const profiled_upgrade_mutex&) = delete;
+    profiled_upgrade_mutex& operator=(const profiled_upgrade_mutex&) = delete;
+
+    // The full upgrade_mutex interface.  Every call but the three unlocks
+    // takes a last, defaulted, const source_location& naming its caller.
+
+    // Ownership transfer (see ownership_token.h):  a sampled hold moves to
+    // the attaching thread, and is recorded when the mutex is released.
+    struct detached_ownership;
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    mutex_type& underlying();
+};
+
+}  // acme
+*/
+
+#include "upgrade_mutex_trace.h"
+#include <iosfwd>
+#include <map>
+
+#if __has_include(<source_location>)
+#include <source_location>
+#endif
+
+namespace acme
+{
+
+#ifdef __cpp_lib_source_location
+
+typedef std::source_location source_location;
+
+#else  // __cpp_lib_source_location
+
+class source_location
+{
+    const char*   file_;
+    const char*   function_;
+    std::uint32_t line_;
+
+public:
+    constexpr source_location() noexcept
+        : file_(""), function_(""), line_(0) {}
+
+    static
+    constexpr
+    source_location
+    current(const char* file = __builtin_FILE(),
+            const char* function = __builtin_FUNCTION(),
+            std::uint32_t line = __builtin_LINE()) noexcept
+    {
+        source_location r;
+        r.file_ = file;
+        r.function_ = function;
+        r.line_ = line;
+        return r;
+    }
+
+    constexpr std::uint32_t line() const noexcept {return line_;}
+    constexpr std::uint32_t column() const noexcept {return 0;}
+    constexpr const char* file_name() const noexcept {return file_;}
+    constexpr const char* function_name() const noexcept {return function_;}
+};
+
+#endif  // __cpp_lib_source_location
+
+// What the profile keeps of a source_location.  The compiled part of the
+// profiler deals only in call_site, so it does not matter which
+// source_location the code using it was built with.
+
+struct call_site
+{
+    const char* file;
+    const char* function;
+    unsigned    line;
+};
+
+inline
+call_site
+to_call_site(const source_location& loc) noexcept
+{
+    return call_site{loc.file_name(), loc.function_name(),
+                     static_cast<unsigned>(loc.line())};
+}
+
+// contention_profile
+
+// Collects, for the profiled_upgrade_mutexes using it, the time spent
+// acquiring and holding ownership, per call site and per operation, from
+// one call in period() made by each thread.  A conversion is its own
+// operation:  a shared to upgrade conversion at x.cpp:42 is reported apart
+// from a lock_upgrade at the same line.  Holding time is measured from a
+// sampled acquisition or conversion to the release or conversion that ends
+// it, when that is made by the same thread, and charged to the call site
+// that acquired.
+
+class contention_profile
+{
+public:
+    static constexpr unsigned default_period = 64;
+
+    struct site_stats
+    {
+        call_site                site;
+        lock_op                  op;
+        std::uint64_t            samples;
+        std::uint64_t            failures;
+        std::chrono::nanoseconds wait;
+        std::chrono::nanoseconds max_wait;
+        std::uint64_t            holds;
+        std::chrono::nanoseconds hold;
+    };
+
+private:
+    struct key
+    {
+        const char* file;
+        unsigned    line;
+        lock_op     op;
+
+        bool operator<(const key& y) const;
+    };
+
+    std::atomic<unsigned>      period_;
+    mutable std::mutex         mut_;
+    std::map<key, site_stats>  sites_;
+
+    site_stats& entry(const call_site& site, lock_op op);
+
+public:
+    explicit contention_profile(unsigned period = default_period);
+
+    contention_profile(const contention_profile&) = delete;
+    contention_profile& operator=(const contention_profile&) = delete;
+
+    // A period of 1 samples every call; 0 is taken as 1.
+    unsigned
+    period() const noexcept
+    {
+        return period_.load(std::memory_order_relaxed);
+    }
+
+    void set_period(unsigned period) noexcept;
+
+    std::vector<site_stats> snapshot() const;
+    void dump(std::ostream& os, std::size_t max_sites = 20) const;
+    void reset();
+
+    // Used by profiled_upgrade_mutex
+
+    void record_wait(const call_site& site, lock_op op,
+                     std::chrono::steady_clock::duration wait, bool acquired);
+    void record_hold(const call_site& site, lock_op op,
+                     std::chrono::steady_clock::duration hold) noexcept;
+};
+
+namespace detail
+{
+
+// The calling thread's sampling countdown, and the sampled ownerships it
+// holds.  The countdown is shared by every profiled_upgrade_mutex:  a thread
+// samples its calls to any of them at the period of the one sampled last.
+
+struct profiled_hold
+{
+    const void*                           mutex;
+    call_site                             site;
+    lock_op                               op;
+    lock_mode                             mode;
+    std::chrono::steady_clock::time_point since;
+};
+
+struct profile_thread
+{
+    static const unsigned max_holds = 8;
+
+    unsigned      countdown;
+    unsigned      held;
+    profiled_hold holds[max_holds];
+};
+
+inline thread_local profile_thread this_profile_thread = {1, 0, {}};
+
+void begin_profiled_hold(const void* mutex, lock_mode m, const call_site& site,
+                         lock_op op,
+                         std::chrono::steady_clock::time_point now) noexcept;
+void end_profiled_hold(contention_profile& prof, const void* mutex,
+                       lock_mode m,
+                       std::chrono::steady_clock::time_point now) noexcept;
+
+// Ownership transfer:  take the calling thread's most recent sampled hold of
+// mutex in mode m, if any, or give it one.
+bool detach_profiled_hold(const void* mutex, lock_mode m,
+                          profiled_hold& h) noexcept;
+void attach_profiled_hold(const profiled_hold& h) noexcept;
+
+}  // detail
+
+// profiled_upgrade_mutex
+
+// An unsampled acquisition or conversion costs a decrement and a branch on
+// the thread's countdown; a release, one branch on whether the thread holds
+// any sampled ownership.
+
+template <class Mutex = upgrade_mutex>
+class profiled_upgrade_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    mutex_type          mut_;
+    contention_profile& prof_;
+
+    static
+    bool
+    sample() noexcept
+    {
+        return __builtin_expect(--detail::this_profile_thread.countdown == 0,
+                                0);
+    }
+
+    void
+    released(lock_mode m, Clock::time_point now) noexcept
+    {
+        if (detail::this_profile_thread.held != 0)
+            detail::end_profiled_hold(prof_, this, m, now);
+    }
+
+    void
+    released(lock_mode m) noexcept
+    {
+        if (detail::this_profile_thread.held != 0)
+            detail::end_profiled_hold(prof_, this, m, Clock::now());
+    }
+
+    template <class F>
+        bool
+        sampled(lock_op op, const source_location& loc, const lock_mode* from,
+                lock_mode to, F f)
+        {
+            detail::this_profile_thread.countdown = prof_.period();
+            call_site site = to_call_site(loc);
+            auto t0 = Clock::now();
+            bool r = f();
+            auto t1 = Clock::now();
+            prof_.record_wait(site, op, t1 - t0, r);
+            if (r)
+            {
+                if (from != nullptr)
+                    released(*from, t1);
+                detail::begin_profiled_hold(this, to, site, op, t1);
+            }
+            return r;
+        }
+
+    template <class F>
+        bool
+        acquire(lock_op op, const source_location& loc, lock_mode to, F f)
+        {
+            if (!sample())
+                return f();
+            return sampled(op, loc, nullptr, to, f);
+        }
+
+    template <class F>
+        bool
+        convert(lock_op op, const source_location& loc, lock_mode from,
+                lock_mode to, F f)
+        {
+            if (!sample())
+            {
+                if (!f())
+                    return false;
+                released(from);
+                return true;
+            }
+            return sampled(op, loc, &from, to, f);
+        }
+
+public:
+    explicit profiled_upgrade_mutex(contention_profile& prof)
+        : prof_(prof) {}
+
+    profiled_upgrade_mutex(const profiled_upgrade_mutex&) = delete;
+    profiled_upgrade_mutex& operator=(const profiled_upgrade_mutex&) = delete;
+
+    mutex_type& underlying() {return mut_;}
+
+    // Exclusive ownership
+
+    void lock(const source_location& loc = source_location::current())
+    {
+        acquire(lock_op::lock, loc, lock_mode::exclusive,
+                [this] {mut_.lock(); return true;});
+    }
+
+    bool try_lock(const source_location& loc = source_location::current())
+    {
+        return acquire(lock_op::try_lock, loc, lock_mode::exclusive,
+                       [this] {return mut_.try_lock();});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_for(const std::chrono::duration<Rep, Period>& rel_time,
+                     const source_location& loc = source_location::current())
+        {
+            return try_lock_until(Clock::now() + rel_time, loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return acquire(lock_op::try_lock_until, loc, lock_mode::exclusive,
+                           [&] {return mut_.try_lock_until(abs_time);});
+        }
+
+    void unlock()
+    {
+        mut_.unlock();
+        released(lock_mode::exclusive);
+    }
+
+    // Shared ownership
+
+    void lock_shared(const source_location& loc = source_location::current())
+    {
+        acquire(lock_op::lock_shared, loc, lock_mode::shared,
+                [this] {mut_.lock_shared(); return true;});
+    }
+
+    bool
+    try_lock_shared(const source_location& loc = source_location::current())
+    {
+        return acquire(lock_op::try_lock_shared, loc, lock_mode::shared,
+                       [this] {return mut_.try_lock_shared();});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time,
+                        const source_location& loc = source_location::current())
+        {
+            return try_lock_shared_until(Clock::now() + rel_time, loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_shared_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return acquire(lock_op::try_lock_shared_until, loc,
+                           lock_mode::shared,
+                           [&] {return mut_.try_lock_shared_until(abs_time);});
+        }
+
+    void unlock_shared()
+    {
+        mut_.unlock_shared();
+        released(lock_mode::shared);
+    }
+
+    // Upgrade ownership
+
+    void lock_upgrade(const source_location& loc = source_location::current())
+    {
+        acquire(lock_op::lock_upgrade, loc, lock_mode::upgrade,
+                [this] {mut_.lock_upgrade(); return true;});
+    }
+
+    bool
+    try_lock_upgrade(const source_location& loc = source_location::current())
+    {
+        return acquire(lock_op::try_lock_upgrade, loc, lock_mode::upgrade,
+                       [this] {return mut_.try_lock_upgrade();});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(const std::chrono::duration<Rep, Period>& rel_time,
+                        const source_location& loc = source_location::current())
+        {
+            return try_lock_upgrade_until(Clock::now() + rel_time, loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_upgrade_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return acquire(lock_op::try_lock_upgrade_until, loc,
+                           lock_mode::upgrade,
+                           [&] {return mut_.try_lock_upgrade_until(abs_time);});
+        }
+
+    void unlock_upgrade()
+    {
+        mut_.unlock_upgrade();
+        released(lock_mode::upgrade);
+    }
+
+    // Shared <-> Exclusive
+
+    bool
+    try_unlock_shared_and_lock(
+                        const source_location& loc = source_location::current())
+    {
+        return convert(lock_op::try_unlock_shared_and_lock, loc,
+                       lock_mode::shared, lock_mode::exclusive,
+                       [this] {return mut_.try_unlock_shared_and_lock();});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                        const std::chrono::duration<Rep, Period>& rel_time,
+                        const source_location& loc = source_location::current())
+        {
+            return try_unlock_shared_and_lock_until(Clock::now() + rel_time,
+                                                    loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return convert(lock_op::try_unlock_shared_and_lock_until, loc,
+                           lock_mode::shared, lock_mode::exclusive, [&]
+                           {
+                               return mut_.try_unlock_shared_and_lock_until(
+                                                                    abs_time);
+                           });
+        }
+
+    void
+    unlock_and_lock_shared(
+                        const source_location& loc = source_location::current())
+    {
+        convert(lock_op::unlock_and_lock_shared, loc, lock_mode::exclusive,
+                lock_mode::shared,
+                [this] {mut_.unlock_and_lock_shared(); return true;});
+    }
+
+    // Shared <-> Upgrade
+
+    bool
+    try_unlock_shared_and_lock_upgrade(
+                        const source_location& loc = source_location::current())
+    {
+        return convert(lock_op::try_unlock_shared_and_lock_upgrade, loc,
+                       lock_mode::shared, lock_mode::upgrade, [this]
+                       {
+                           return mut_.try_unlock_shared_and_lock_upgrade();
+                       });
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                        const std::chrono::duration<Rep, Period>& rel_time,
+                        const source_location& loc = source_location::current())
+        {
+            return try_unlock_shared_and_lock_upgrade_until(Clock::now() +
+                                                            rel_time, loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return convert(lock_op::try_unlock_shared_and_lock_upgrade_until,
+                           loc, lock_mode::shared, lock_mode::upgrade, [&]
+                           {
+                               return mut_.
+                                   try_unlock_shared_and_lock_upgrade_until(
+                                                                    abs_time);
+                           });
+        }
+
+    void
+    unlock_upgrade_and_lock_shared(
+                        const source_location& loc = source_location::current())
+    {
+        convert(lock_op::unlock_upgrade_and_lock_shared, loc,
+                lock_mode::upgrade, lock_mode::shared,
+                [this] {mut_.unlock_upgrade_and_lock_shared(); return true;});
+    }
+
+    // Upgrade <-> Exclusive
+
+    void
+    unlock_upgrade_and_lock(
+                        const source_location& loc = source_location::current())
+    {
+        convert(lock_op::unlock_upgrade_and_lock, loc, lock_mode::upgrade,
+                lock_mode::exclusive,
+                [this] {mut_.unlock_upgrade_and_lock(); return true;});
+    }
+
+    bool
+    try_unlock_upgrade_and_lock(
+                        const source_location& loc = source_location::current())
+    {
+        return convert(lock_op::try_unlock_upgrade_and_lock, loc,
+                       lock_mode::upgrade, lock_mode::exclusive,
+                       [this] {return mut_.try_unlock_upgrade_and_lock();});
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                        const std::chrono::duration<Rep, Period>& rel_time,
+                        const source_location& loc = source_location::current())
+        {
+            return try_unlock_upgrade_and_lock_until(Clock::now() + rel_time,
+                                                     loc);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time,
+                     const source_location& loc = source_location::current())
+        {
+            return convert(lock_op::try_unlock_upgrade_and_lock_until, loc,
+                           lock_mode::upgrade, lock_mode::exclusive, [&]
+                           {
+                               return mut_.try_unlock_upgrade_and_lock_until(
+                                                                    abs_time);
+                           });
+        }
+
+    void
+    unlock_and_lock_upgrade(
+                        const source_location& loc = source_location::current())
+    {
+        convert(lock_op::unlock_and_lock_upgrade, loc, lock_mode::exclusive,
+                lock_mode::upgrade,
+                [this] {mut_.unlock_and_lock_upgrade(); return true;});
+    }
+
+    // Ownership transfer
+
+    struct detached_ownership
+    {
+        typename ownership_traits<mutex_type>::detached_type inner;
+        bool                                                 sampled;
+        detail::profiled_hold                                hold;
+    };
+
+    detached_ownership
+    detach(lock_mode m)
+    {
+        detached_ownership d = {ownership_traits<mutex_type>::detach(mut_, m),
+                                false, {}};
+        d.sampled = detail::this_profile_thread.held != 0 &&
+                    detail::detach_profiled_hold(this, m, d.hold);
+        return d;
+    }
+
+    void
+    attach(lock_mode m, const detached_ownership& d)
+    {
+        ownership_traits<mutex_type>::attach(mut_, m, d.inner);
+        if (d.sampled)
+            detail::attach_profiled_hold(d.hold);
+    }
+
+    void
+    unlock_detached(lock_mode m, const detached_ownership& d)
+    {
+        ownership_traits<mutex_type>::unlock_detached(mut_, m, d.inner);
+        if (d.sampled)
+            prof_.record_hold(d.hold.site, d.hold.op,
+                              Clock::now() - d.hold.since);
+    }
+};
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_PROFILE
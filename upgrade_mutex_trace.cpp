@@ -0,0 +1,332 @@
+//------------------------ upgrade_mutex_trace.cpp -----------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#include "upgrade_mutex_trace.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+namespace acme
+{
+
+namespace
+{
+
+// File layout:  header, then trace_records in flush order.
+
+const char          trace_magic[8] = {'a', 'c', 'm', 'e', 'L', 'K', 'T', 'R'};
+const std::uint32_t trace_version = 1;
+
+struct trace_header
+{
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t record_size;
+};
+
+enum op_kind {acquisition, release, conversion};
+
+op_kind
+kind(lock_op op)
+{
+    switch (op)
+    {
+    case lock_op::unlock:
+    case lock_op::unlock_shared:
+    case lock_op::unlock_upgrade:
+        return release;
+    case lock_op::lock:
+    case lock_op::try_lock:
+    case lock_op::try_lock_until:
+    case lock_op::lock_shared:
+    case lock_op::try_lock_shared:
+    case lock_op::try_lock_shared_until:
+    case lock_op::lock_upgrade:
+    case lock_op::try_lock_upgrade:
+    case lock_op::try_lock_upgrade_until:
+        return acquisition;
+    default:
+        return conversion;
+    }
+}
+
+std::uint32_t
+saturate(std::chrono::steady_clock::duration d)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    if (ns <= 0)
+        return 0;
+    if (ns > std::numeric_limits<std::uint32_t>::max())
+        return std::numeric_limits<std::uint32_t>::max();
+    return static_cast<std::uint32_t>(ns);
+}
+
+std::atomic<std::uint64_t> next_recorder_id{1};
+
+struct local_cache
+{
+    std::uint64_t id;
+    void*         buf;
+};
+
+thread_local local_cache tls_cache = {0, nullptr};
+
+// Buffers are found by this, not std::thread::id, which a thread started
+// after another has exited may be given again.
+
+std::atomic<std::uint64_t> next_thread_serial{1};
+
+thread_local const std::uint64_t this_thread_serial = next_thread_serial++;
+
+}  // unnamed
+
+const char*
+to_string(lock_op op)
+{
+    static const char* const names[n_lock_ops] =
+    {
+        "lock",
+        "try_lock",
+        "try_lock_until",
+        "unlock",
+        "lock_shared",
+        "try_lock_shared",
+        "try_lock_shared_until",
+        "unlock_shared",
+        "lock_upgrade",
+        "try_lock_upgrade",
+        "try_lock_upgrade_until",
+        "unlock_upgrade",
+        "try_unlock_shared_and_lock",
+        "try_unlock_shared_and_lock_until",
+        "unlock_and_lock_shared",
+        "try_unlock_shared_and_lock_upgrade",
+        "try_unlock_shared_and_lock_upgrade_until",
+        "unlock_upgrade_and_lock_shared",
+        "unlock_upgrade_and_lock",
+        "try_unlock_upgrade_and_lock",
+        "try_unlock_upgrade_and_lock_until",
+        "unlock_and_lock_upgrade"
+    };
+    unsigned i = static_cast<unsigned>(op);
+    return i < n_lock_ops ? names[i] : "unknown";
+}
+
+// trace_recorder
+
+trace_recorder::trace_recorder(const char* path)
+    : file_(std::fopen(path, "wb")),
+      id_(next_recorder_id++),
+      epoch_(std::chrono::steady_clock::now()),
+      mutexes_(0)
+{
+    if (file_ == nullptr)
+        throw std::system_error(std::error_code(errno, std::system_category()),
+                                "trace_recorder: unable to open trace file");
+    trace_header h;
+    std::memcpy(h.magic, trace_magic, sizeof(h.magic));
+    h.version = trace_version;
+    h.record_size = sizeof(trace_record);
+    if (std::fwrite(&h, sizeof(h), 1, file_) != 1)
+    {
+        int e = errno;
+        std::fclose(file_);
+        throw std::system_error(std::error_code(e, std::system_category()),
+                                "trace_recorder: unable to write trace file");
+    }
+}
+
+trace_recorder::~trace_recorder()
+{
+    for (auto& b : buffers_)
+        write(*b);
+    std::fclose(file_);
+}
+
+std::uint32_t
+trace_recorder::register_mutex()
+{
+    std::lock_guard<std::mutex> _(mut_);
+    return mutexes_++;
+}
+
+trace_recorder::buffer&
+trace_recorder::local_buffer()
+{
+    if (tls_cache.id == id_)
+        return *static_cast<buffer*>(tls_cache.buf);
+    std::lock_guard<std::mutex> _(mut_);
+    const std::uint64_t self = this_thread_serial;
+    auto i = std::find_if(buffers_.begin(), buffers_.end(),
+                          [self](const std::unique_ptr<buffer>& b)
+                          {
+                              return b->owner == self;
+                          });
+    buffer* b;
+    if (i != buffers_.end())
+        b = i->get();
+    else
+    {
+        buffers_.emplace_back(new buffer);
+        b = buffers_.back().get();
+        b->owner = self;
+        b->thread = static_cast<std::uint32_t>(buffers_.size() - 1);
+        b->size = 0;
+        b->n_held = 0;
+    }
+    tls_cache.id = id_;
+    tls_cache.buf = b;
+    return *b;
+}
+
+void
+trace_recorder::record(lock_op op, std::uint32_t mutex,
+                       std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end,
+                       bool acquired,
+                       std::chrono::steady_clock::duration timeout)
+{
+    buffer& b = local_buffer();
+    std::uint64_t s = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                     start - epoch_).count();
+    std::uint64_t e = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                       end - epoch_).count();
+    trace_record& r = b.records[b.size];
+    r.start = s;
+    r.wait = saturate(end - start);
+    r.hold = 0;
+    r.timeout = saturate(timeout);
+    r.thread = b.thread;
+    r.mutex = mutex;
+    r.op = op;
+    r.acquired = acquired;
+    r.reserved = 0;
+    if (acquired)
+    {
+        hold* h = b.find_hold(mutex);
+        switch (kind(op))
+        {
+        case acquisition:
+            b.open_hold(mutex, e);
+            break;
+        case release:
+            if (h != nullptr)
+            {
+                r.hold = saturate(std::chrono::nanoseconds(s - h->since));
+                b.close_hold(h);
+            }
+            break;
+        case conversion:
+            if (h != nullptr)
+                r.hold = saturate(std::chrono::nanoseconds(s - h->since));
+            b.open_hold(mutex, e);
+            break;
+        }
+    }
+    if (++b.size == buffer::capacity)
+        write(b);
+}
+
+void
+trace_recorder::write(buffer& b)
+{
+    std::lock_guard<std::mutex> _(mut_);
+    std::fwrite(b.records, sizeof(trace_record), b.size, file_);
+    b.size = 0;
+}
+
+std::uint64_t
+trace_recorder::detach_hold(std::uint32_t mutex)
+{
+    buffer& b = local_buffer();
+    hold* h = b.find_hold(mutex);
+    if (h == nullptr)
+        return ~std::uint64_t(0);
+    std::uint64_t since = h->since;
+    b.close_hold(h);
+    return since;
+}
+
+void
+trace_recorder::attach_hold(std::uint32_t mutex, std::uint64_t since)
+{
+    local_buffer().open_hold(mutex, since);
+}
+
+// A thread's open holds
+
+trace_recorder::hold*
+trace_recorder::buffer::find_hold(std::uint32_t mutex) noexcept
+{
+    for (std::size_t i = 0; i < n_held; ++i)
+        if (held[i].mutex == mutex)
+            return &held[i];
+    return nullptr;
+}
+
+// Restarts mutex's hold if open; past max_held a new one goes untracked.
+
+void
+trace_recorder::buffer::open_hold(std::uint32_t mutex,
+                                  std::uint64_t since) noexcept
+{
+    if (hold* h = find_hold(mutex))
+        h->since = since;
+    else if (n_held != max_held)
+        held[n_held++] = hold{mutex, since};
+}
+
+void
+trace_recorder::buffer::close_hold(hold* h) noexcept
+{
+    *h = held[--n_held];
+}
+
+void
+trace_recorder::flush()
+{
+    for (auto& b : buffers_)
+        write(*b);
+    std::lock_guard<std::mutex> _(mut_);
+    if (std::fflush(file_) != 0 || std::ferror(file_))
+        throw std::system_error(std::error_code(errno, std::system_category()),
+                                "trace_recorder::flush: write failed");
+}
+
+std::vector<trace_record>
+read_trace(const char* path)
+{
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> f(std::fopen(path, "rb"),
+                                                     &std::fclose);
+    if (f == nullptr)
+        throw std::system_error(std::error_code(errno, std::system_category()),
+                                "read_trace: unable to open trace file");
+    trace_header h;
+    if (std::fread(&h, sizeof(h), 1, f.get()) != 1 ||
+        std::memcmp(h.magic, trace_magic, sizeof(h.magic)) != 0 ||
+        h.version != trace_version || h.record_size != sizeof(trace_record))
+        throw std::system_error(std::error_code(EINVAL, std::system_category()),
+                                "read_trace: not an upgrade_mutex trace");
+    std::vector<trace_record> v;
+    trace_record r;
+    while (std::fread(&r, sizeof(r), 1, f.get()) == 1)
+        v.push_back(r);
+    std::stable_sort(v.begin(), v.end(),
+                     [](const trace_record& x, const trace_record& y)
+                     {
+                         return x.start < y.start;
+                     });
+    return v;
+}
+
+}  // acme
@@ -0,0 +1,520 @@
+//------------------------- upgrade_mutex_trace.h ------------------------------
+//
+// This software is in the public domain.  The only restriction on its use is
+// that no one can remove it from the public domain by claiming ownership of it,
+// including the original authors.
+//
+// There is no warranty of correctness on the software contained herein.  Use
+// at your own risk.
+//
+//------------------------------------------------------------------------------
+
+#ifndef UPGRADE_MUTEX_TRACE
+#define UPGRADE_MUTEX_TRACE
+
+/*
+    <upgrade_mutex_trace.h> synopsis
+
+namespace acme
+{
+
+const char* to_string(lock_op op);    // lock_op is in <upgrade_mutex.h>
+
+// One fixed size record per upgrade_mutex operation.  All times are in
+// nanoseconds.  wait, hold and timeout saturate at 2^32-1 (about 4.3s).
+
+struct trace_record
+{
+    std::uint64_t start;     // call entry, relative to the recorder's epoch
+    std::uint32_t wait;      // time spent inside the call
+    std::uint32_t hold;      // how long the relinquished ownership was held
+    std::uint32_t timeout;   // time allowed to a timed call
+    std::uint32_t thread;    // recorder assigned thread number
+    std::uint32_t mutex;     // recorder assigned mutex number
+    lock_op       op;
+    std::uint8_t  acquired;  // 1 if the call obtained the requested ownership
+    std::uint16_t reserved;
+};
+
+class trace_recorder
+{
+public:
+    explicit trace_recorder(const char* path);
+    ~trace_recorder();
+
+    trace_recorder(const trace_recorder&) = delete;
+    trace_recorder& operator=(const trace_recorder&) = delete;
+
+    std::uint32_t register_mutex();
+    void record(lock_op op, std::uint32_t mutex,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end,
+                bool acquired,
+                std::chrono::steady_clock::duration timeout = {});
+    void flush();
+
+    // Moves the calling thread's open hold of mutex out of its bookkeeping,
+    // returning when it began (~0:  none), or into it.
+    std::uint64_t detach_hold(std::uint32_t mutex);
+    void attach_hold(std::uint32_t mutex, std::uint64_t since);
+};
+
+std::vector<trace_record> read_trace(const char* path);
+
+template <class Mutex = upgrade_mutex>
+class traced_upgrade_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+    explicit traced_upgrade_mutex(trace_recorder& rec);
+
+    traced_upgrade_mutex(const traced_upgrade_mutex&) = delete;
+    traced_upgrade_mutex& operator=(const traced_upgrade_mutex&) = delete;
+
+    // The full upgrade_mutex interface, each call recorded
+
+    // Ownership transfer (see ownership_token.h):  the hold moves to the
+    // attaching thread, and its release records the whole hold.
+    struct detached_ownership;
+    detached_ownership detach(lock_mode m);
+    void attach(lock_mode m, const detached_ownership& d);
+    void unlock_detached(lock_mode m, const detached_ownership& d);
+
+    mutex_type& underlying();
+    std::uint32_t id() const;
+};
+
+}  // acme
+*/
+
+#include "ownership_token.h"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace acme
+{
+
+const char* to_string(lock_op op);
+
+struct trace_record
+{
+    std::uint64_t start;
+    std::uint32_t wait;
+    std::uint32_t hold;
+    std::uint32_t timeout;
+    std::uint32_t thread;
+    std::uint32_t mutex;
+    lock_op       op;
+    std::uint8_t  acquired;
+    std::uint16_t reserved;
+};
+
+static_assert(sizeof(trace_record) == 32, "trace_record must stay 32 bytes");
+
+// trace_recorder
+
+// Each recording thread appends to its own buffer, which is written to the
+// file only when it fills, on flush(), and when the recorder is destroyed.
+// Only a thread's first record allocates, for its buffer; the buffer also
+// tracks the thread's open holds, up to max_held of them, and the release of
+// any beyond those records no hold time.  The recorder must outlive every
+// traced_upgrade_mutex referring to it, and no thread may be recording while
+// flush() or the destructor runs.
+
+class trace_recorder
+{
+    struct hold
+    {
+        std::uint32_t mutex;
+        std::uint64_t since;
+    };
+
+    struct buffer
+    {
+        static const std::size_t capacity = 1024;
+        static const std::size_t max_held = 16;
+
+        std::uint64_t owner;        // unlike a std::thread::id, never reused
+        std::uint32_t thread;
+        std::size_t   size;
+        std::size_t   n_held;
+        hold          held[max_held];
+        trace_record  records[capacity];
+
+        hold* find_hold(std::uint32_t mutex) noexcept;
+        void  open_hold(std::uint32_t mutex, std::uint64_t since) noexcept;
+        void  close_hold(hold* h) noexcept;
+    };
+
+    std::mutex                            mut_;
+    std::FILE*                            file_;
+    std::uint64_t                         id_;
+    std::chrono::steady_clock::time_point epoch_;
+    std::uint32_t                         mutexes_;
+    std::vector<std::unique_ptr<buffer>>  buffers_;
+
+public:
+    explicit trace_recorder(const char* path);
+    ~trace_recorder();
+
+    trace_recorder(const trace_recorder&) = delete;
+    trace_recorder& operator=(const trace_recorder&) = delete;
+
+    std::uint32_t register_mutex();
+    void record(lock_op op, std::uint32_t mutex,
+                std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end,
+                bool acquired,
+                std::chrono::steady_clock::duration timeout = {});
+    void flush();
+
+    std::uint64_t detach_hold(std::uint32_t mutex);
+    void attach_hold(std::uint32_t mutex, std::uint64_t since);
+
+private:
+    buffer& local_buffer();
+    void write(buffer& b);
+};
+
+std::vector<trace_record> read_trace(const char* path);
+
+// traced_upgrade_mutex
+
+template <class Mutex = upgrade_mutex>
+class traced_upgrade_mutex
+{
+public:
+    typedef Mutex mutex_type;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    mutex_type      mut_;
+    trace_recorder& rec_;
+    std::uint32_t   id_;
+
+    template <class Duration>
+        static
+        Clock::duration
+        remaining(const std::chrono::time_point<Clock, Duration>& abs_time,
+                  Clock::time_point now)
+        {
+            return std::chrono::duration_cast<Clock::duration>(abs_time - now);
+        }
+    template <class Clock2, class Duration>
+        static
+        Clock::duration
+        remaining(const std::chrono::time_point<Clock2, Duration>& abs_time,
+                  Clock::time_point)
+        {
+            return std::chrono::duration_cast<Clock::duration>(abs_time -
+                                                               Clock2::now());
+        }
+
+    void trace(lock_op op, Clock::time_point start, bool acquired = true,
+               Clock::duration timeout = {})
+    {
+        rec_.record(op, id_, start, Clock::now(), acquired, timeout);
+    }
+
+public:
+    explicit traced_upgrade_mutex(trace_recorder& rec)
+        : rec_(rec), id_(rec.register_mutex()) {}
+
+    traced_upgrade_mutex(const traced_upgrade_mutex&) = delete;
+    traced_upgrade_mutex& operator=(const traced_upgrade_mutex&) = delete;
+
+    mutex_type& underlying() {return mut_;}
+    std::uint32_t id() const {return id_;}
+
+    // Exclusive ownership
+
+    void lock()
+    {
+        auto t = Clock::now();
+        mut_.lock();
+        trace(lock_op::lock, t);
+    }
+
+    bool try_lock()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_lock();
+        trace(lock_op::try_lock, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool try_lock_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_until(Clock::now() + rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_until(const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_lock_until(abs_time);
+            trace(lock_op::try_lock_until, t, r, remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock()
+    {
+        auto t = Clock::now();
+        mut_.unlock();
+        trace(lock_op::unlock, t);
+    }
+
+    // Shared ownership
+
+    void lock_shared()
+    {
+        auto t = Clock::now();
+        mut_.lock_shared();
+        trace(lock_op::lock_shared, t);
+    }
+
+    bool try_lock_shared()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_lock_shared();
+        trace(lock_op::try_lock_shared, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_shared_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_shared_until(Clock::now() + rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_shared_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_lock_shared_until(abs_time);
+            trace(lock_op::try_lock_shared_until, t, r, remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock_shared()
+    {
+        auto t = Clock::now();
+        mut_.unlock_shared();
+        trace(lock_op::unlock_shared, t);
+    }
+
+    // Upgrade ownership
+
+    void lock_upgrade()
+    {
+        auto t = Clock::now();
+        mut_.lock_upgrade();
+        trace(lock_op::lock_upgrade, t);
+    }
+
+    bool try_lock_upgrade()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_lock_upgrade();
+        trace(lock_op::try_lock_upgrade, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_lock_upgrade_for(const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_lock_upgrade_until(Clock::now() + rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_lock_upgrade_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_lock_upgrade_until(abs_time);
+            trace(lock_op::try_lock_upgrade_until, t, r, remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock_upgrade()
+    {
+        auto t = Clock::now();
+        mut_.unlock_upgrade();
+        trace(lock_op::unlock_upgrade, t);
+    }
+
+    // Shared <-> Exclusive
+
+    bool try_unlock_shared_and_lock()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_unlock_shared_and_lock();
+        trace(lock_op::try_unlock_shared_and_lock, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_until(Clock::now() + rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_shared_and_lock_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_unlock_shared_and_lock_until(abs_time);
+            trace(lock_op::try_unlock_shared_and_lock_until, t, r,
+                  remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock_and_lock_shared()
+    {
+        auto t = Clock::now();
+        mut_.unlock_and_lock_shared();
+        trace(lock_op::unlock_and_lock_shared, t);
+    }
+
+    // Shared <-> Upgrade
+
+    bool try_unlock_shared_and_lock_upgrade()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_unlock_shared_and_lock_upgrade();
+        trace(lock_op::try_unlock_shared_and_lock_upgrade, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_shared_and_lock_upgrade_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_shared_and_lock_upgrade_until(Clock::now() +
+                                                            rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_shared_and_lock_upgrade_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_unlock_shared_and_lock_upgrade_until(abs_time);
+            trace(lock_op::try_unlock_shared_and_lock_upgrade_until, t, r,
+                  remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock_upgrade_and_lock_shared()
+    {
+        auto t = Clock::now();
+        mut_.unlock_upgrade_and_lock_shared();
+        trace(lock_op::unlock_upgrade_and_lock_shared, t);
+    }
+
+    // Upgrade <-> Exclusive
+
+    void unlock_upgrade_and_lock()
+    {
+        auto t = Clock::now();
+        mut_.unlock_upgrade_and_lock();
+        trace(lock_op::unlock_upgrade_and_lock, t);
+    }
+
+    bool try_unlock_upgrade_and_lock()
+    {
+        auto t = Clock::now();
+        bool r = mut_.try_unlock_upgrade_and_lock();
+        trace(lock_op::try_unlock_upgrade_and_lock, t, r);
+        return r;
+    }
+
+    template <class Rep, class Period>
+        bool
+        try_unlock_upgrade_and_lock_for(
+                            const std::chrono::duration<Rep, Period>& rel_time)
+        {
+            return try_unlock_upgrade_and_lock_until(Clock::now() + rel_time);
+        }
+
+    template <class Clock2, class Duration>
+        bool
+        try_unlock_upgrade_and_lock_until(
+                     const std::chrono::time_point<Clock2, Duration>& abs_time)
+        {
+            auto t = Clock::now();
+            bool r = mut_.try_unlock_upgrade_and_lock_until(abs_time);
+            trace(lock_op::try_unlock_upgrade_and_lock_until, t, r,
+                  remaining(abs_time, t));
+            return r;
+        }
+
+    void unlock_and_lock_upgrade()
+    {
+        auto t = Clock::now();
+        mut_.unlock_and_lock_upgrade();
+        trace(lock_op::unlock_and_lock_upgrade, t);
+    }
+
+    // Ownership transfer
+
+    struct detached_ownership
+    {
+        typename ownership_traits<mutex_type>::detached_type inner;
+        std::uint64_t                                        since;
+    };
+
+    detached_ownership
+    detach(lock_mode m)
+    {
+        detached_ownership d = {ownership_traits<mutex_type>::detach(mut_, m),
+                                0};
+        d.since = rec_.detach_hold(id_);
+        return d;
+    }
+
+    void
+    attach(lock_mode m, const detached_ownership& d)
+    {
+        ownership_traits<mutex_type>::attach(mut_, m, d.inner);
+        if (d.since != ~std::uint64_t(0))
+            rec_.attach_hold(id_, d.since);
+    }
+
+    void
+    unlock_detached(lock_mode m, const detached_ownership& d)
+    {
+        lock_op op = lock_op::unlock;
+        if (m == lock_mode::shared)
+            op = lock_op::unlock_shared;
+        else if (m == lock_mode::upgrade)
+            op = lock_op::unlock_upgrade;
+        auto t = Clock::now();
+        if (d.since != ~std::uint64_t(0))
+            rec_.attach_hold(id_, d.since);
+        ownership_traits<mutex_type>::unlock_detached(mut_, m, d.inner);
+        trace(op, t);
+    }
+};
+
+}  // acme
+
+#endif  // UPGRADE_MUTEX_TRACE